@@ -17,9 +17,12 @@
 #include <memory>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cmath>
 #include <algorithm>
 #include <vector>
 #include <set>
+#include <functional>
 #include <omp.h>
 
 #include <boost/program_options.hpp>
@@ -31,14 +34,24 @@
 #include <nn/log.hpp>
 #include <nn/pgibbs.hpp>
 #include <nn/timing.hpp>
+#include <nn/profile.hpp>
+#include <nn/metrics.hpp>
 #include <nn/utils.hpp>
 #include <nn/reader.hpp>
+#include <nn/corpus_cache.hpp>
 #include <nn/data.hpp>
+#include <nn/prediction_writer.hpp>
+#include <nn/pipeline.hpp>
+#include <nn/state_snapshots.hpp>
+#include <nn/pgibbs_checkpoint.hpp>
 #include <nn/evaluation.hpp>
+#include <nn/experiment.hpp>
+#include <nn/live_model.hpp>
 #include <nn/generic_filter.hpp>
 #include <nn/adapted_seq_model.hpp>
 #include <nn/hidden_sequence_memoizer.hpp>
 #include <nn/segmental_sequence_memoizer.hpp>
+#include <nn/semi_markov.hpp>
 
 #include <cereal/types/memory.hpp>
 #include <cereal/archives/binary.hpp>
@@ -49,9 +62,11 @@ DEFINE_string(unlabeled, "", "path to unlabeled data for training");
 DEFINE_string(train, "data/conll/eng/train.utf8", "path to training data");
 DEFINE_string(test,  "data/conll/eng/valid.utf8", "path to test data");
 DEFINE_string(gazetteer, "", "path to gazetteer");
-DEFINE_string(mixed, "", "path to partially annotated data for inference");
+DEFINE_string(mixed, "", "path to partially annotated data for training");
 DEFINE_string(out_path, "pred.txt", "output path for predictions");
+DEFINE_string(output_format, "conll", "conll | tsv");
 DEFINE_string(model_path, "model.ser", "path to save/load model");
+DEFINE_string(corpus_cache, "", "directory for binary caches of parsed inputs");
 DEFINE_uint64(max_gazetteer_train, 50000, "maximum number of gazetteer items");
 DEFINE_string(bos, "<bos>", "beginning-of-string symbol");
 DEFINE_string(eos, "<eos>", "end-of-string symbol");
@@ -65,12 +80,31 @@ DEFINE_bool(classify, false, "assume the segmentation is given");
 DEFINE_bool(train_only, false, "only do training");
 DEFINE_bool(test_only, false, "only run test");
 DEFINE_bool(stdin_decoder, false, "read tokens from stdin and output tagging");
+DEFINE_string(merge, "", "comma-separated models to merge and save to model_path");
+DEFINE_bool(prune, false, "prune the context trees of model_path");
+DEFINE_double(prune_threshold, 0.1, "max weighted KL (nats) of a pruned context");
+DEFINE_uint64(prune_interval, 0, "particle Gibbs sweeps between compactions (0 = never)");
+DEFINE_string(sweep_prefix, "", "write particle Gibbs states to <prefix>_<sweep>.<part>.conll");
+DEFINE_uint64(sweep_interval, 1, "particle Gibbs sweeps between written states");
+DEFINE_uint64(sweep_keep, 0, "written particle Gibbs states kept on disk (0 = all)");
+DEFINE_bool(sweep_gzip, false, "gzip written particle Gibbs states");
+DEFINE_bool(sweep_train, false, "also write the train and unlabeled states");
+DEFINE_string(checkpoint_path, "", "particle Gibbs checkpoint, written after sweeps");
+DEFINE_uint64(checkpoint_interval, 1, "particle Gibbs sweeps between checkpoints");
+DEFINE_bool(resume, false, "continue particle Gibbs from --checkpoint_path, if there is one");
+DEFINE_bool(online_updates, false, "stdin decoder also accepts annotations");
+DEFINE_uint64(snapshot_interval, 60, "seconds between model snapshots (0 = at exit)");
 DEFINE_bool(print_errors, false, "display errors");
 DEFINE_bool(fine_grained_context, false, "predict fine-grained context tags");
 DEFINE_uint64(status_interval, 500, "status interval (instances)");
 DEFINE_uint64(sec_status_interval, 5, "status interval (seconds)");
+DEFINE_uint64(pipeline_window, 256, "most test sentences between reading and writing");
+DEFINE_string(metrics_path, "", "write live metrics in the Prometheus text format to this path");
+DEFINE_uint64(metrics_interval, 15, "seconds between writes of --metrics_path");
+DEFINE_string(profile_json, "", "also write the profile of an NN_PROFILE build to this path at exit");
 DEFINE_bool(crossval, false, "cross validate train");
 DEFINE_uint64(nfolds, 10, "number of cross val folds");
+DEFINE_uint64(fold_threads, 0, "cross val folds run at once (0 = as many as threads)");
 DEFINE_string(model, "seg", "hsm | seg | hseg");
 DEFINE_string(parameters, "", "parameters for each named-entity model");
 DEFINE_double(emission_adaptor_discount, 0.75, "Emission discount hyper");
@@ -80,24 +114,176 @@ DEFINE_string(emission_model, "simple_adapted", "type of phrasal model");
 DEFINE_string(other_model, "all_other", "what to do with dictionary");
 DEFINE_bool(observe_dictionary, true, "if the dictionary is observed");
 DEFINE_bool(train_gazetteer_model, false, "if an entity model is trained");
-DEFINE_string(resampling, "none", "which resampling method to use");
+DEFINE_string(resampling, "none", "none | multinomial | residual | stratified | systematic");
+DEFINE_bool(collapse_particles, true, "move the particles that are in the same state together");
+DEFINE_double(resample_threshold, 0.5, "resample when the ESS falls below this fraction of the particles (or number, if >= 1)");
+DEFINE_bool(ancestor_sampling, false, "particle Gibbs: resample the ancestor of the reference particle whenever the filter resamples (see --resampling, --resample_threshold)");
+DEFINE_string(proposal, "hybrid", "segmental filter proposal: hybrid | gazetteer | lookahead");
+DEFINE_uint64(lookahead, 1, "words past a segment end scored by the lookahead proposal");
+DEFINE_bool(benchmark_proposals, false, "compare the ESS per ms of the segmental proposals on test");
+DEFINE_bool(benchmark_exact, false, "compare the exact segmental decoder with the filter on test");
+DEFINE_uint64(exact_order, 2, "context elements seen by the transitions of the exact decoder");
+DEFINE_uint64(exact_max_len, 8, "longest segment of the exact decoder (words)");
 DEFINE_uint64(nparticles, 16, "number of particles used for gazetteer filter");
 DEFINE_uint64(nmcmc_iter, 10, "number of MCMC iterations");
 DEFINE_string(mode, "smc", "smc | pgibbs");
+DEFINE_bool(experiment, false, "run the replication experiment grid on train/test");
+DEFINE_uint64(expt_replications, 5, "number of experiment replications");
+DEFINE_uint64(expt_ntrain, 100, "largest experiment training set");
+DEFINE_uint64(expt_ntrain_folds, 10, "number of experiment training set sizes");
+DEFINE_string(expt_gazetteer_sizes, "0", "comma-separated gazetteer sizes (instances)");
+DEFINE_uint64(expt_nvalid, 250, "number of validation instances per replication");
+DEFINE_uint64(expt_seed, 42, "seed for experiment splits");
+DEFINE_string(expt_report, "experiment.json", "output path for experiment results");
+
+// Read a CoNLL file, through the binary corpus cache if one is
+// configured
+template<typename Corpus>
+instances read_corpus(Corpus& corpus, std::string path) {
+    if (FLAGS_corpus_cache == "") return corpus.read(path);
+    corpus_cache cache(path, FLAGS_corpus_cache, corpus.get_other_val(),
+                       corpus.unk_tag);
+    return cache.read(corpus);
+}
+
+template<typename Model, typename Corpus>
+void run_experiment(const experiment_settings& settings, const Corpus& corpus) {
+    experiment_runner<Model, Corpus> runner(settings, corpus,
+                                            FLAGS_corpus_cache);
+    tic();
+    auto results = runner.run();
+    LOG(INFO) << results.size() << " results in " << prettyprint(toc());
+    write_experiment_report(FLAGS_expt_report, settings, results);
+    LOG(INFO) << "Experiment report written to: " << FLAGS_expt_report;
+}
+
+rmethod resampling_from_string(std::string name) {
+    if (name == "none")        return rmethod::SMC_RESAMPLE_NONE;
+    if (name == "multinomial") return rmethod::SMC_RESAMPLE_MULTINOMIAL;
+    if (name == "residual")    return rmethod::SMC_RESAMPLE_RESIDUAL;
+    if (name == "stratified")  return rmethod::SMC_RESAMPLE_STRATIFIED;
+    if (name == "systematic")  return rmethod::SMC_RESAMPLE_SYSTEMATIC;
+    CHECK(false) << "unrecognized resampling method: " << name;
+    return rmethod::SMC_RESAMPLE_NONE;
+}
+
+FilterProposal proposal_from_string(std::string name) {
+    if (name == "hybrid")    return FilterProposal::HYBRID;
+    if (name == "gazetteer") return FilterProposal::GAZETTEER;
+    if (name == "lookahead") return FilterProposal::LOOKAHEAD;
+    CHECK(false) << "unrecognized proposal: " << name;
+    return FilterProposal::HYBRID;
+}
+
+// The segmental filter is configured by --proposal; its gazetteer
+// proposal looks for the entity spans of the gazetteer (indexed as it
+// is observed) and of the fully annotated training data, which are
+// indexed whichever proposal is used so a saved model can switch
+template<typename Model>
+void set_filter_proposal(Model&) {}
+
+void set_filter_proposal(segmental_sequence_memoizer<>& m) {
+    m.set_proposal(proposal_from_string(FLAGS_proposal));
+    m.set_lookahead(FLAGS_lookahead);
+}
+
+template<typename Model>
+void index_spans(Model&, const instance&) {}
+
+void index_spans(segmental_sequence_memoizer<>& m, const instance& ex) {
+    m.index_spans(ex.tags, ex.lens, ex.words);
+}
 
 template<typename Model>
-std::unique_ptr<Model> load_model() {
-    std::string fn = FLAGS_model_path;
+std::unique_ptr<Model> load_model(std::string fn = FLAGS_model_path) {
     std::unique_ptr<Model> model;
     {
         std::ifstream is(fn, std::ios::binary);
+        CHECK(is.is_open()) << "problem opening: " << fn;
         cereal::BinaryInputArchive iarchive(is);
         iarchive(model);
     }
+    set_filter_proposal(*model);
     return model;
 }
 
-bool check_output(nn::instances test, std::string path) {
+template<typename Model>
+void save_model(const std::unique_ptr<Model>& model,
+                std::string fn = FLAGS_model_path) {
+    LOG(INFO) << "Serializing model to: " << fn;
+    std::ofstream os(fn, std::ios::binary);
+    cereal::BinaryOutputArchive oarchive(os);
+    oarchive(model);
+}
+
+// Per-word perplexity of the fully labeled instances
+template<typename Model>
+double perplexity(const Model& model, const instances& data) {
+    double ll = 0.0;
+    size_t n = 0;
+    for (const auto& ex : data) {
+        if (ex.obs != Annotation::FULL) continue;
+        ll += model.log_prob(ex.tags, ex.lens, ex.words);
+        n  += ex.words.size();
+    }
+    CHECK(n > 0) << "no labeled instances";
+    return exp(-ll / static_cast<double>(n));
+}
+
+template<typename Model>
+size_t serialized_size(const std::unique_ptr<Model>& model) {
+    std::ostringstream os(std::ios::binary);
+    {
+        cereal::BinaryOutputArchive oarchive(os);
+        oarchive(model);
+    }
+    return os.str().size();
+}
+
+// Prunes a trained model, reporting its size and the perplexity of
+// the test data before and after
+template<typename Model>
+void prune_model() {
+    auto model = load_model<Model>();
+    auto corpus = model->get_corpus();
+    LOG(INFO) << "Reading test data: " << FLAGS_test;
+    auto test = read_corpus(corpus, FLAGS_test);
+    auto size_before = serialized_size(model);
+    auto ppl_before  = perplexity(*model, test);
+    tic();
+    auto stats = model->prune(FLAGS_prune_threshold);
+    LOG(INFO) << "Pruned with threshold " << FLAGS_prune_threshold
+              << " in " << prettyprint(toc());
+    LOG(INFO) << "Nodes: " << stats.nodes_before << " -> "
+              << stats.nodes_after << " (" << stats.customers_folded
+              << " customers folded)";
+    LOG(INFO) << "Serialized bytes: " << size_before << " -> "
+              << serialized_size(model);
+    LOG(INFO) << "Test perplexity: " << ppl_before << " -> "
+              << perplexity(*model, test);
+    save_model(model);
+}
+
+// Merges models trained on disjoint shards of the data into the
+// first one
+template<typename Model>
+void merge_models(const std::vector<std::string>& paths) {
+    CHECK(paths.size() > 1) << "need at least two models to merge";
+    tic();
+    LOG(INFO) << "Loading: " << paths.front();
+    auto model = load_model<Model>(paths.front());
+    for (auto it = std::next(paths.begin()); it != paths.end(); ++it) {
+        LOG(INFO) << "Merging: " << *it;
+        auto other = load_model<Model>(*it);
+        model->merge(*other);
+    }
+    model->log_stats();
+    LOG(INFO) << "Merged " << paths.size() << " models in "
+              << prettyprint(toc());
+    save_model(model);
+}
+
+bool check_output(const nn::instances& test, std::string path) {
     std::string line;
     std::ifstream infile;
     infile.open(path);
@@ -110,7 +296,7 @@ bool check_output(nn::instances test, std::string path) {
     }
     infile.close();
     size_t num_test_tags {0};
-    for(auto instance : test) {
+    for(const auto& instance : test) {
         for (auto i = 0; i<instance.tags.size(); ++i) {
             auto len = instance.lens.at(i);
             num_test_tags += len;
@@ -123,41 +309,187 @@ bool check_output(nn::instances test, std::string path) {
     return true;
 }
 
+// Customers and tables of the restaurants of a model, in the live
+// metrics
+template<typename Model>
+void record_model_metrics(Model& model) {
+    auto& m = metrics::global();
+    auto T = model.get_transition_model();
+    m.set("nname_transition_customers", T->totalCustomers(),
+          "observations of the transition model");
+    m.set("nname_transition_tables", T->totalTables(),
+          "tables of the transition model, over all levels");
+    const auto& corpus = model.get_corpus();
+    double customers {0};
+    double tables {0};
+    for (auto tag : corpus.tagtab.get_key_set()) {
+        if (corpus.is_unk_tag(tag)) continue;
+        customers += model.get_emission_model(tag)->get_num_customers();
+        tables    += model.get_emission_model(tag)->get_num_tables();
+    }
+    m.set("nname_emission_customers", customers,
+          "customers of the emission adaptors");
+    m.set("nname_emission_tables", tables, "tables of the emission adaptors");
+}
+
+// Compares the segmental filter proposals on the test data, with
+// the model at model_path: mean ESS of the final particle systems
+// and ESS per ms of filtering
+template<typename Model>
+void benchmark_proposals() {
+    auto model  = load_model<Model>();
+    auto corpus = model->get_corpus();
+    auto test   = read_corpus(corpus, FLAGS_test);
+    LOG(INFO) << "Benchmarking proposals on " << test.size()
+              << " instances, " << FLAGS_nparticles << " particles";
+    typedef typename Model::particle Particle;
+    typedef generic_filter<Model, Particle> Filter;
+    typename Filter::settings filter_config;
+    filter_config.num_particles = FLAGS_nparticles;
+    filter_config.resample = resampling_from_string(FLAGS_resampling);
+    filter_config.resample_threshold = FLAGS_resample_threshold;
+    filter_config.collapse = FLAGS_collapse_particles;
+    for (std::string name : { "hybrid", "gazetteer", "lookahead" }) {
+        model->set_proposal(proposal_from_string(name));
+        Filter filter(filter_config, *model);
+        double ess {0};
+        double log_z {0};
+        auto start = now();
+        for (const auto& ex : test) {
+            log_z += filter.estimate_log_partition(ex.words);
+            ess   += filter.get_ess();
+        }
+        auto ms = std::max<double>(elapsed_ms(start, now()), 1.0);
+        LOG(INFO) << name
+                  << ": mean ESS = "   << ess / test.size()
+                  << "; ms = "         << ms
+                  << "; ESS/ms = "     << ess / ms
+                  << "; mean log Z = " << log_z / test.size();
+    }
+}
+
+// Compares the exact decoder (see nn/semi_markov.hpp) with the
+// segmental filter on the test data, with the model at model_path:
+// segment F1 and sentences per second of filter samples, exact
+// posterior samples and Viterbi segmentations
+template<typename Model>
+void benchmark_exact() {
+    auto model  = load_model<Model>();
+    auto corpus = model->get_corpus();
+    auto test   = read_corpus(corpus, FLAGS_test);
+    LOG(INFO) << "Benchmarking the exact decoder on " << test.size()
+              << " instances: order " << FLAGS_exact_order
+              << ", segments of up to " << FLAGS_exact_max_len << " words";
+    typedef typename Model::particle Particle;
+    typedef generic_filter<Model, Particle> Filter;
+    typedef semi_markov_decoder<Model> Decoder;
+    typename Filter::settings filter_config;
+    filter_config.num_particles = FLAGS_nparticles;
+    filter_config.resample = resampling_from_string(FLAGS_resampling);
+    filter_config.resample_threshold = FLAGS_resample_threshold;
+    filter_config.collapse = FLAGS_collapse_particles;
+    Filter filter(filter_config, *model);
+    typename Decoder::settings exact_config;
+    exact_config.order   = FLAGS_exact_order;
+    exact_config.max_len = FLAGS_exact_max_len;
+    Decoder decoder(exact_config, *model);
+    SegmentF1Evaluator<Model> eval(*model, test);
+    std::vector<Particle> pred(test.size());
+    auto run = [&](std::string name, std::function<Particle(const phrase&)> decode) {
+        auto start = now();
+        for (size_t i = 0; i < test.size(); ++i) pred[i] = decode(test[i].words);
+        auto ms = std::max<double>(elapsed_ms(start, now()), 1.0);
+        LOG(INFO) << name
+                  << ": F1 = "            << eval.evaluate(pred.begin(), pred.end()).f1()
+                  << "; sentences/s = "   << 1000.0 * test.size() / ms;
+    };
+    run("filter (" + std::to_string(FLAGS_nparticles) + " particles)",
+        [&](const phrase& words) { return filter.sample(words); });
+    double log_z {0};
+    size_t nstates {0};
+    run("exact sample", [&](const phrase& words) {
+            log_z += decoder.forward(words);
+            nstates += decoder.num_states();
+            return decoder.sample();
+        });
+    run("exact Viterbi", [&](const phrase& words) { return decoder.viterbi(words); });
+    LOG(INFO) << "Exact mean log Z = " << log_z / test.size()
+              << "; mean states = " << double(nstates) / test.size();
+}
+
 template<typename Model,
          typename Corpus = CoNLLCorpus<>
          >
 std::unique_ptr<Model> train_model(const Corpus& corpus,
                                    const instances& train,
                                    const instances& gaz,
-                                   const instances& unlabeled) {
+                                   const instances&, // unlabeled
+                                   std::string model_path = FLAGS_model_path) {
     LOG(INFO) << "Observing training data: " << FLAGS_train;
     tic();
     auto m = std::make_unique<Model>(corpus);
     if (gaz.size() > 0) {
         LOG(INFO) << "Observing gazetteer...";
         histogram<sym> gaz_type_counts;
+        // Identical events of the entries are counted first, and
+        // each is then observed once, with its count
+        typename Model::observations gaz_obs;
         for(const auto& g : gaz) {
-            m->observe_gazetteer(g.tags, g.lens, g.words);
+            m->count_gazetteer(g.tags, g.lens, g.words, gaz_obs);
+            index_spans(*m, g);
             for(auto i = 0; i < g.tags.size(); ++i) {
                 auto tag  = g.tags.at(i);
                 gaz_type_counts.observe(tag);
             }
         }
+        m->observe(gaz_obs);
         LOG(INFO) << "Gazetteer type stats:";
         LOG(INFO) << gaz_type_counts.str();
     }
     histogram<size_t> tag_hist;
     size_t ntag = 0;
     double alen = 0;
-    for (const auto& ex : train) {
-        m->observe(ex.tags, ex.lens, ex.words);
-        for(auto i=0; i<ex.tags.size(); ++i) {
-            auto tag = ex.tags.at(i);
-            auto len = ex.lens.at(i);
+    auto count_tags = [&](const syms& tags, const syms& lens) {
+        for(size_t i=0; i<tags.size(); ++i) {
+            auto tag = tags.at(i);
+            auto len = lens.at(i);
             alen += static_cast<double>(len);
             ntag += 1;
             tag_hist.observe(tag);
         }
+    };
+    std::vector<const instance*> latent;
+    typename Model::observations train_obs;
+    for (const auto& ex : train) {
+        if (ex.obs != Annotation::FULL) {
+            latent.push_back(&ex);
+            continue;
+        }
+        m->count(ex.tags, ex.lens, ex.words, train_obs);
+        index_spans(*m, ex);
+        count_tags(ex.tags, ex.lens);
+    }
+    LOG(INFO) << train_obs.transitions.get_total() << " transitions, "
+              << train_obs.transitions.size() << " distinct";
+    m->observe(train_obs);
+    set_filter_proposal(*m);
+    if (latent.size() > 0) {
+        // The missing labels are sampled given the fully annotated data
+        LOG(INFO) << "Imputing " << latent.size()
+                  << " partially annotated instances...";
+        typedef typename Model::particle Particle;
+        typedef generic_filter<Model, Particle> Filter;
+        typename Filter::settings filter_config;
+        filter_config.num_particles = FLAGS_nparticles;
+        filter_config.resample = resampling_from_string(FLAGS_resampling);
+        filter_config.resample_threshold = FLAGS_resample_threshold;
+        filter_config.collapse = FLAGS_collapse_particles;
+        Filter filter(filter_config, *m);
+        for (auto ex : latent) {
+            auto p = filter.sample(ex->tags, ex->lens, ex->words, ex->obs);
+            m->observe(p, ex->words);
+            count_tags(m->get_tags(p), m->get_lens(p));
+        }
     }
     m->log_stats();
     LOG(INFO) << "TRAIN tag histogram:";
@@ -165,43 +497,60 @@ std::unique_ptr<Model> train_model(const Corpus& corpus,
     alen /= static_cast<double>(ntag);
     LOG(INFO) << "TRAIN mean tag len: "   << alen;
     LOG(INFO) << "...done in: "           << prettyprint(toc());
-    LOG(INFO) << "Serializing model to: " << FLAGS_model_path;
-    {
-        std::string fn = FLAGS_model_path;
-        std::ofstream os(fn, std::ios::binary);
-        cereal::BinaryOutputArchive oarchive(os);
-        oarchive(m);
-    }
+    save_model(m, model_path);
     LOG(INFO) << "Done.";
     return m;
 }
 
-template<typename Model>
-void test_model(Model* model,
-                const instances& test,
-                std::string out_path) {
+// Tags the sentences given by read(sentence), which returns false
+// after the last one, and writes the predictions to out_path in
+// order. Reading, decoding and writing overlap (see
+// nn::ordered_pipeline), so the input never needs to be in memory.
+template<typename Model, typename Read>
+void tag_sentences(Model* model, Read read, size_t total,
+                   std::string out_path) {
     typedef typename Model::particle Particle;
     typedef generic_filter<Model, Particle> Filter;
     typename Filter::settings filter_config;
     filter_config.num_particles = FLAGS_nparticles;
+    filter_config.resample = resampling_from_string(FLAGS_resampling);
+    filter_config.resample_threshold = FLAGS_resample_threshold;
+    filter_config.collapse = FLAGS_collapse_particles;
     Filter filter(filter_config, *model);
     LOG(INFO) << "Writing predictions on test data: " << FLAGS_test;
-    std::ofstream of(out_path);
+    output_vocab vocab(model->get_corpus());
+    prediction_writer out(out_path, vocab,
+                          output_format_from_string(FLAGS_output_format));
     size_t idx  = 0;
     size_t ntag = 0;
     double alen = 0;
     double azf  = 0;
     double aess = 0;
-    CHECK(of.is_open()) << "problem opening: " << out_path;
     histogram<size_t> tag_hist;
-    progress_bar prog(test.size(), FLAGS_sec_status_interval);
+    progress_bar prog(total, FLAGS_sec_status_interval);
     tic();
-    for (const auto& i : test) {
-        auto p  = filter.sample(i.words);
-        azf    += filter.get_zero_frac();
-        aess   += filter.sys.ess;
-        auto tags = model->get_tags(p);
-        auto lens = model->get_lens(p);
+
+    struct prediction {
+        Particle p;
+        double zero_frac;
+        double ess;
+        size_t resamples;
+    };
+    auto decode = [](Filter& f, const instance& i, prediction& pred) {
+        auto resamples = f.num_resamples;
+        pred.p         = f.sample(i.words);
+        pred.zero_frac = f.get_zero_frac();
+        pred.ess       = f.sys.ess;
+        pred.resamples = f.num_resamples - resamples;
+    };
+    auto write = [&](const instance& i, const prediction& pred) {
+        azf    += pred.zero_frac;
+        aess   += pred.ess;
+        record_filtered_sentence(metrics::global(), i.words.size() - 1,
+                                 pred.resamples);
+        record_filter_ess(metrics::global(), pred.ess / FLAGS_nparticles);
+        auto tags = model->get_tags(pred.p);
+        auto lens = model->get_lens(pred.p);
 
         for(auto len : lens) {
             alen += static_cast<double>(len);
@@ -212,12 +561,7 @@ void test_model(Model* model,
             tag_hist.observe(tag);
         }
 
-        write_tagging_conll(of, i.words,
-                            tags, lens,
-                            i.tags, i.lens,
-                            model->get_corpus().get_other_key(),
-                            model->get_corpus().symtab.get_map(),
-                            model->get_corpus().tagtab.get_map());
+        out.write(i.words, tags, lens, i.tags, i.lens);
 
         if(idx % FLAGS_status_interval == 0) {
             azf /= static_cast<double>(FLAGS_status_interval);
@@ -228,32 +572,162 @@ void test_model(Model* model,
             azf = 0;
             aess = 0;
         }
-        prog++;
         idx++;
+        prog++;
+    };
+
+    // The first sentences calibrate the cost model, which then picks
+    // a team of threads per sentence or a thread per sentence
+    const size_t ncalibrate = 8;
+    std::vector<size_t> lengths;
+    instance i;
+    bool more = true;
+    while (lengths.size() < ncalibrate && (more = read(i))) {
+        prediction pred;
+        decode(filter, i, pred);
+        write(i, pred);
+        lengths.push_back(i.words.size());
+    }
+    if (!more) lengths.clear();
+
+    size_t ndecoders = 1;
+    if (filter.cost.prefer_sentences(FLAGS_nparticles, lengths)) {
+        ndecoders = filter.cost.get_threads();
+        LOG(INFO) << "Filtering sentences on " << ndecoders
+                  << " threads of their own ("
+                  << filter.cost.get_step_ns() << " ns per particle step)";
+    }
+    // A single decoder goes on with the calibrated filter, on teams
+    // of its own; more have a filter each, on one thread
+    auto decoder_config = filter_config;
+    decoder_config.parallel = false;
+    if (more) {
+        nn::ordered_pipeline<instance, prediction>(
+            ndecoders, FLAGS_pipeline_window, read,
+            [&] {
+                std::unique_ptr<Filter> own;
+                if (ndecoders > 1) own.reset(new Filter(decoder_config, *model));
+                Filter* f = own ? own.get() : &filter;
+                return [&decode, f, own = std::move(own)](const instance& i,
+                                                          prediction& pred) {
+                    decode(*f, i, pred);
+                };
+            },
+            write);
     }
+
     LOG(INFO) << "TEST tag histogram:";
     LOG(INFO) << tag_hist.count_str();
     LOG(INFO) << "...done in: " << prettyprint(toc());
-    of.close();
+    if (!out.close()) {
+        LOG(FATAL) << "Error writing predictions to: `" << out_path << "'";
+        throw std::system_error(EIO, std::generic_category());
+    }
     LOG(INFO) << "Predictions written to: " << out_path;
 }
 
 template<typename Model>
-void stdin_decoder(Model* model) {
+void test_model(Model* model,
+                const instances& test,
+                std::string out_path) {
+    size_t j = 0;
+    auto read = [&](instance& i) {
+        if (j == test.size()) return false;
+        i = test[j++];
+        return true;
+    };
+    tag_sentences(model, read, test.size(), out_path);
+}
+
+// Tags the sentences of the file at path as they are read, unless
+// they come from --corpus_cache
+template<typename Model>
+void test_model(Model* model,
+                std::string path,
+                std::string out_path) {
+    auto corpus = model->get_corpus();
+    LOG(INFO) << "Reading test data: " << path;
+    if (FLAGS_corpus_cache != "") {
+        auto test = read_corpus(corpus, path);
+        LOG(INFO) << "Read " << test.size() << " test instances.";
+        test_model(model, test, out_path);
+        return;
+    }
+    std::ifstream infile(path);
+    if(!infile) {
+        LOG(FATAL) << "Error reading path: `" << path << "'";
+        throw std::system_error(EIO, std::generic_category());
+    }
+    typename decltype(corpus)::read_state st;
+    auto read = [&](instance& i) { return corpus.read_next(infile, st, i); };
+    tag_sentences(model, read, decltype(corpus)::num_instances(path), out_path);
+    LOG(INFO) << "Read " << st.n_full + st.n_semi + st.n_none
+              << " test instances.";
+}
+
+// Tags sentences read from stdin, one per line. With
+// --online_updates, a line may instead add an annotation to the
+// model, and is answered with "ok" or an error:
+//
+//   observe<TAB>words<TAB>labels     labeled sentence
+//   gazetteer<TAB>words<TAB>labels   gazetteer entries
+//
+// where labels are as output by the decoder. The updated model is
+// written to --model_path every --snapshot_interval seconds.
+template<typename Model>
+void stdin_decoder(std::unique_ptr<Model> model) {
     typedef typename Model::particle Particle;
     typedef generic_filter<Model, Particle> Filter;
     typename Filter::settings filter_config;
     filter_config.num_particles = FLAGS_nparticles;
-    Filter filter(filter_config, *model);
+    filter_config.resample = resampling_from_string(FLAGS_resampling);
+    filter_config.resample_threshold = FLAGS_resample_threshold;
+    filter_config.collapse = FLAGS_collapse_particles;
     auto corpus = model->get_corpus();
+    live_model<Model> live(std::move(model));
+    if (FLAGS_online_updates && FLAGS_snapshot_interval > 0) {
+        live.start_snapshots(FLAGS_model_path,
+                             std::chrono::seconds(FLAGS_snapshot_interval));
+    }
     std::string line;
-    std::vector<std::string> toks;
+    std::vector<std::string> fields;
+    instance annotated;
     while (std::getline(std::cin, line)) {
+        if (FLAGS_online_updates) {
+            boost::split(fields, line, boost::is_any_of("\t"));
+            if (fields.size() == 3 &&
+                (fields[0] == "observe" || fields[0] == "gazetteer")) {
+                if (!corpus.line_to_instance(fields[1], fields[2], annotated)) {
+                    std::cout << "error: bad annotation" << std::endl;
+                    continue;
+                }
+                if (fields[0] == "observe") {
+                    live.observe(annotated.tags, annotated.lens,
+                                 annotated.words);
+                } else {
+                    live.observe_gazetteer(annotated.tags, annotated.lens,
+                                           annotated.words);
+                }
+                std::cout << "ok" << std::endl;
+                continue;
+            }
+        }
         auto i = corpus.line_to_instance(line);
-        auto p  = filter.sample(i.words);
-        auto tags = model->get_tags(p);
-        auto lens = model->get_lens(p);
-        std::cout << corpus.get_tagging_string(tags, lens) << std::endl;
+        auto tagging = live.read([&](const Model& m) {
+            Filter filter(filter_config, m);
+            auto p = filter.sample(i.words);
+            record_filtered_sentence(metrics::global(), i.words.size() - 1,
+                                     filter.num_resamples);
+            record_filter_ess(metrics::global(),
+                              filter.get_ess() / FLAGS_nparticles);
+            return corpus.get_tagging_string(m.get_tags(p), m.get_lens(p));
+        });
+        std::cout << tagging << std::endl;
+    }
+    live.stop_snapshots();
+    if (FLAGS_online_updates && FLAGS_snapshot_interval == 0 &&
+        live.get_generation() > 0) {
+        live.snapshot(FLAGS_model_path);
     }
 }
 
@@ -265,7 +739,8 @@ void run_inference(const instances& train,
                    const instances& unlabeled,
                    const instances& test,
                    std::string out_path,
-                   const Corpus& corpus) {
+                   const Corpus& corpus,
+                   std::string model_path = FLAGS_model_path) {
     LOG(INFO) << "mode: " << FLAGS_mode;
 
     if (FLAGS_mode == "smc") {
@@ -273,19 +748,32 @@ void run_inference(const instances& train,
         std::unique_ptr<Model> model = train_model<Model, Corpus>(corpus,
                                                                   train,
                                                                   gaz,
-                                                                  unlabeled);
+                                                                  unlabeled,
+                                                                  model_path);
         CHECK(model->consistent()) << "inconsistent model state";
+        record_model_metrics(*model);
         test_model<Model>(model.get(), test, out_path);
     } else if (FLAGS_mode == "pgibbs") {
         LOG(INFO) << "Inference: particle Gibbs";
         Model model(corpus);
+        for (const auto& ex : train) {
+            if (ex.obs == Annotation::FULL) index_spans(model, ex);
+        }
+        set_filter_proposal(model);
         typedef typename Model::particle Particle;
         typedef generic_filter<Model, Particle> Filter;
         typename Filter::settings filter_config;
+        filter_config.resample = resampling_from_string(FLAGS_resampling);
+        filter_config.resample_threshold = FLAGS_resample_threshold;
+        filter_config.collapse = FLAGS_collapse_particles;
+        filter_config.ancestor_sampling = FLAGS_ancestor_sampling;
+        CHECK(!FLAGS_ancestor_sampling || FLAGS_resampling != "none")
+            << "ancestor sampling happens when the filter resamples";
         typedef particle_gibbs<Particle, Filter, Model, instances> PG;
         typename PG::settings pg_config;
         auto gold_particles = model.make_particles(test);
         pg_config.num_iter = FLAGS_nmcmc_iter;
+        pg_config.prune_interval = FLAGS_prune_interval;
         Filter filter(filter_config, model);
         auto sampler = std::make_unique<PG>(pg_config,
                                             train,
@@ -293,23 +781,88 @@ void run_inference(const instances& train,
                                             test,
                                             &model,
                                             &filter);
-        std::string path {"tmp"};
-        typename Model::writer w(path,
-                                 test,
-                                 corpus.get_other_key(),
-                                 corpus.symtab.get_map(),
-                                 corpus.tagtab.get_map());
-        sampler->add_writer_callback(w);
+        sampler->add_evaluation_callback(SegmentF1Evaluator<Model>(model, test));
+        std::unique_ptr<state_snapshot_writer> snapshots;
+        if (FLAGS_sweep_prefix != "") {
+            state_snapshot_writer::settings snapshot_config;
+            snapshot_config.prefix   = FLAGS_sweep_prefix;
+            snapshot_config.interval = FLAGS_sweep_interval;
+            snapshot_config.keep     = FLAGS_sweep_keep;
+            snapshot_config.compress = FLAGS_sweep_gzip;
+            snapshot_config.train    = FLAGS_sweep_train;
+            snapshots.reset(new state_snapshot_writer(snapshot_config,
+                                                      output_vocab(corpus),
+                                                      train, unlabeled, test));
+            sampler->add_snapshot_callback(
+                [&](size_t sweep,
+                    const std::vector<Particle>& train_state,
+                    const std::vector<Particle>& unlabeled_state,
+                    const std::vector<Particle>& test_state) {
+                    snapshots->capture(sweep, model, train_state,
+                                       unlabeled_state, test_state);
+                });
+        }
+        sampler->add_snapshot_callback(
+            [&](size_t,
+                const std::vector<Particle>&,
+                const std::vector<Particle>&,
+                const std::vector<Particle>&) {
+                record_model_metrics(model);
+            });
+        pgibbs_checkpoint checkpoint;
+        if (FLAGS_resume) {
+            CHECK(FLAGS_checkpoint_path != "") << "--resume needs --checkpoint_path";
+            if (checkpoint.load(FLAGS_checkpoint_path)) {
+                CHECK(checkpoint.matches(train, unlabeled, test))
+                    << "checkpoint is of other data: " << FLAGS_checkpoint_path;
+                sampler->resume(checkpoint.sweep,
+                                checkpoint.particles(model, checkpoint.train),
+                                checkpoint.particles(model, checkpoint.unlabeled),
+                                checkpoint.particles(model, checkpoint.test));
+                checkpoint.restore_engines();
+            } else {
+                LOG(INFO) << "No usable checkpoint at "
+                          << FLAGS_checkpoint_path << "; starting afresh";
+            }
+        }
+        if (FLAGS_checkpoint_path != "") {
+            CHECK(FLAGS_checkpoint_interval > 0) << "bad checkpoint interval";
+            sampler->add_snapshot_callback(
+                [&](size_t sweep,
+                    const std::vector<Particle>& train_state,
+                    const std::vector<Particle>& unlabeled_state,
+                    const std::vector<Particle>& test_state) {
+                    if (sweep % FLAGS_checkpoint_interval != 0) return;
+                    checkpoint.capture(sweep, model, train_state,
+                                       unlabeled_state, test_state);
+                    if (checkpoint.save(FLAGS_checkpoint_path)) {
+                        LOG(INFO) << "Checkpoint of sweep " << sweep
+                                  << " written to: " << FLAGS_checkpoint_path;
+                    } else {
+                        LOG(WARNING) << "Checkpoint of sweep " << sweep
+                                     << " couldn't be written to: "
+                                     << FLAGS_checkpoint_path
+                                     << "; keeping the last one";
+                    }
+                });
+        }
         sampler->run(FLAGS_sec_status_interval);
+        if (snapshots) snapshots->close();
         auto particles = sampler->get_test_state();
         CHECK(particles.size() > 0)            << "no particles";
         CHECK(particles.size() == test.size()) << "size mismatch";
         LOG(INFO) << "writing state to: " << out_path;
-        write_state(particles, test, corpus, model, out_path);
+        if (!write_state(particles, test, corpus, model, out_path,
+                         output_format_from_string(FLAGS_output_format))) {
+            LOG(FATAL) << "Error writing state to: `" << out_path << "'";
+            throw std::system_error(EIO, std::generic_category());
+        }
     } else {
         CHECK(false) << "unrecognized mode: " << FLAGS_mode;
     }
-    check_output(test, out_path);
+    if (FLAGS_output_format == "conll") {
+        check_output(test, out_path);
+    }
 }
 
 int main(int argc, char **argv) {
@@ -325,6 +878,8 @@ int main(int argc, char **argv) {
     LOG(INFO) << "Gazetteer path: "              << FLAGS_gazetteer;
     LOG(INFO) << "Number of particles: "         << FLAGS_nparticles;
     LOG(INFO) << "Resampling: "                  << FLAGS_resampling;
+    LOG(INFO) << "Resample threshold: "          << FLAGS_resample_threshold;
+    LOG(INFO) << "Collapse particles: "          << FLAGS_collapse_particles;
     LOG(INFO) << "Inference mode: "              << FLAGS_mode;
 
     CHECK(FLAGS_out_path != "") << "must supply output path for predictions!";
@@ -340,6 +895,20 @@ int main(int argc, char **argv) {
     // Timer
     boost::timer::auto_cpu_timer t;
 
+    // Hot path profile, if built with NN_PROFILE (see nn/profile.hpp)
+    struct profile_at_exit {
+        ~profile_at_exit() { profile::report(FLAGS_profile_json); }
+    } profile_report;
+
+    // Live metrics, written until exit
+    std::unique_ptr<metrics_writer> live_metrics;
+    if (FLAGS_metrics_path != "") {
+        live_metrics.reset(new metrics_writer(
+            FLAGS_metrics_path, std::chrono::seconds(FLAGS_metrics_interval)));
+        LOG(INFO) << "Writing metrics every " << FLAGS_metrics_interval
+                  << "s to: " << FLAGS_metrics_path;
+    }
+
     // Initialize the random number generator(s)
     LOG(INFO) << "Initializing random number generator...";
     rng::init();
@@ -351,29 +920,98 @@ int main(int argc, char **argv) {
 
     typedef CoNLLCorpus<> Corpus;
 
+    if (FLAGS_experiment) {
+        experiment_settings settings;
+        settings.train_path   = FLAGS_train;
+        settings.valid_path   = FLAGS_test;
+        settings.model        = FLAGS_model;
+        settings.replications = FLAGS_expt_replications;
+        settings.nvalid       = FLAGS_expt_nvalid;
+        settings.nparticles   = FLAGS_nparticles;
+        settings.seed         = FLAGS_expt_seed;
+        auto incr = FLAGS_expt_ntrain / FLAGS_expt_ntrain_folds;
+        CHECK(incr > 0) << "fewer training instances than folds";
+        for (auto n = incr; n <= FLAGS_expt_ntrain; n += incr) {
+            settings.train_sizes.push_back(n);
+        }
+        std::vector<std::string> toks;
+        boost::split(toks, FLAGS_expt_gazetteer_sizes, boost::is_any_of(","));
+        for (const auto& tok : toks) {
+            settings.gazetteer_sizes.push_back(std::stoul(tok));
+        }
+        std::sort(settings.gazetteer_sizes.begin(),
+                  settings.gazetteer_sizes.end());
+
+        Corpus corpus(FLAGS_bos,
+                      FLAGS_eos,
+                      FLAGS_space,
+                      FLAGS_unk,
+                      FLAGS_context_tag);
+        if (FLAGS_model == "hsm") {
+            run_experiment<HSM>(settings, corpus);
+        } else if (FLAGS_model == "seg") {
+            run_experiment<SSM>(settings, corpus);
+        } else {
+            CHECK(false) << "unrecognized model: " << FLAGS_model;
+        }
+        LOG(INFO) << "Done. Exiting...";
+        return 0;
+    }
+
+    if (FLAGS_merge != "") {
+        std::vector<std::string> paths;
+        boost::split(paths, FLAGS_merge, boost::is_any_of(","));
+        if (FLAGS_model == "seg") {
+            merge_models<SSM>(paths);
+        } else {
+            CHECK(false) << "merging is only supported for seg models";
+        }
+        LOG(INFO) << "Done. Exiting...";
+        return 0;
+    }
+
+    if (FLAGS_prune) {
+        if (FLAGS_model == "seg") {
+            prune_model<SSM>();
+        } else {
+            CHECK(false) << "pruning is only supported for seg models";
+        }
+        LOG(INFO) << "Done. Exiting...";
+        return 0;
+    }
+
+    if (FLAGS_benchmark_proposals) {
+        if (FLAGS_model == "seg") {
+            benchmark_proposals<SSM>();
+        } else {
+            CHECK(false) << "proposals are only benchmarked for seg models";
+        }
+        LOG(INFO) << "Done. Exiting...";
+        return 0;
+    }
+
+    if (FLAGS_benchmark_exact) {
+        if (FLAGS_model == "seg") {
+            benchmark_exact<SSM>();
+        } else {
+            CHECK(false) << "the exact decoder is only benchmarked for seg models";
+        }
+        LOG(INFO) << "Done. Exiting...";
+        return 0;
+    }
+
     if (FLAGS_test_only) {
       if (FLAGS_model == "hsm") {
         LOG(INFO) << "Model: hidden sequence memoizer";
         // Load serialized model
         auto model = load_model<HSM>();
-        auto corpus = model->get_corpus();
-        // Read test data
-        LOG(INFO) << "Reading test data: " << FLAGS_test;
-        auto test = corpus.read(FLAGS_test);
-        LOG(INFO) << "Read " << test.size() << " test instances.";
-        test_model<HSM>(model.get(), test, FLAGS_out_path);
+        test_model<HSM>(model.get(), FLAGS_test, FLAGS_out_path);
       }
       else if (FLAGS_model == "seg") {
         LOG(INFO) << "Model: segmental sequence memoizer";
         // Load serialized model
         auto model = load_model<SSM>();
-        auto corpus = model->get_corpus();
-
-        // Read test data
-        LOG(INFO) << "Reading test data: " << FLAGS_test;
-        auto test = corpus.read(FLAGS_test);
-        LOG(INFO) << "Read " << test.size() << " test instances.";
-        test_model<SSM>(model.get(), test, FLAGS_out_path);
+        test_model<SSM>(model.get(), FLAGS_test, FLAGS_out_path);
       }
       LOG(INFO) << "Done. Exiting...";
       return 0;
@@ -383,14 +1021,12 @@ int main(int argc, char **argv) {
       if (FLAGS_model == "hsm") {
         LOG(INFO) << "Model: hidden sequence memoizer";
         // Load serialized model
-        auto model = load_model<HSM>();
-        stdin_decoder<HSM>(model.get());
+        stdin_decoder<HSM>(load_model<HSM>());
       }
       else if (FLAGS_model == "seg") {
         LOG(INFO) << "Model: segmental sequence memoizer";
         // Load serialized model
-        auto model = load_model<SSM>();
-        stdin_decoder<SSM>(model.get());
+        stdin_decoder<SSM>(load_model<SSM>());
       }
       LOG(INFO) << "Done. Exiting...";
       return 0;
@@ -405,7 +1041,7 @@ int main(int argc, char **argv) {
 
         // Read training data
         LOG(INFO) << "Reading training data: " << FLAGS_train;
-        auto train = corpus.read(FLAGS_train);
+        auto train = read_corpus(corpus, FLAGS_train);
         LOG(INFO) << "Read " << train.size() << " training instances.";
 
         // Print some examples:
@@ -419,17 +1055,26 @@ int main(int argc, char **argv) {
         instances gaz;
         if (FLAGS_gazetteer != "") {
             LOG(INFO) << "Reading gazetteer: " << FLAGS_gazetteer;
-            gaz = corpus.read(FLAGS_gazetteer);
+            gaz = read_corpus(corpus, FLAGS_gazetteer);
         }
 
         // Optionally: read unlabeled data
         instances unlabeled;
         if (FLAGS_unlabeled != "") {
             LOG(INFO) << "Reading unlabeled data: " << FLAGS_unlabeled;
-            unlabeled = corpus.read(FLAGS_unlabeled);
+            unlabeled = read_corpus(corpus, FLAGS_unlabeled);
             CHECK(unlabeled.size() > 0);
         }
 
+        // Optionally: read partially annotated data, which is trained
+        // on with its missing labels imputed
+        if (FLAGS_mixed != "") {
+            LOG(INFO) << "Reading partially annotated data: " << FLAGS_mixed;
+            auto mixed = read_corpus(corpus, FLAGS_mixed);
+            CHECK(mixed.size() > 0);
+            train.insert(train.end(), mixed.begin(), mixed.end());
+        }
+
         // Freeze the symbol table
         corpus.symtab.freeze();
         corpus.frozen = true;
@@ -462,7 +1107,7 @@ int main(int argc, char **argv) {
 
         // Read test data
         LOG(INFO) << "Reading test data: " << FLAGS_test;
-        auto test = corpus.read(FLAGS_test);
+        auto test = read_corpus(corpus, FLAGS_test);
         LOG(INFO) << "Read " << test.size() << " test instances.";
 
         if (FLAGS_model == "hsm") {
@@ -479,23 +1124,36 @@ int main(int argc, char **argv) {
             CHECK(false) << "unrecognized model: " << FLAGS_model;
         }
     } else { // CROSS VALIDATION
-        auto N = Corpus::num_instances(FLAGS_train);
+        // Inputs are parsed once, into the cache or memory, and each
+        // fold reads its instances from there
+        CHECK(FLAGS_checkpoint_path == "" && FLAGS_sweep_prefix == "")
+            << "checkpoints and sweep states are per run, not per fold";
+        corpus_cache train_cache(FLAGS_train, FLAGS_corpus_cache,
+                                 FLAGS_context_tag);
+        std::unique_ptr<corpus_cache> gaz_cache;
+        std::unique_ptr<corpus_cache> unlabeled_cache;
+        if (FLAGS_gazetteer != "") {
+            gaz_cache = std::make_unique<corpus_cache>(
+                FLAGS_gazetteer, FLAGS_corpus_cache, FLAGS_context_tag);
+        }
+        if (FLAGS_unlabeled != "") {
+            unlabeled_cache = std::make_unique<corpus_cache>(
+                FLAGS_unlabeled, FLAGS_corpus_cache, FLAGS_context_tag);
+        }
+
+        auto N = train_cache.size();
         CHECK(N > 0);
         LOG(INFO) << "N = " << N;
 
         auto N_test_per_fold = N/FLAGS_nfolds;
         LOG(INFO) << "N test per fold = " << N_test_per_fold;
 
+        // Splits are drawn up front, as they were fold by fold
         std::set<size_t> indices;
         for (auto i = 0; i < N; ++i) indices.insert(i);
-
-        std::vector<std::string> output_paths;
-
+        std::vector<std::set<size_t>> fold_test(FLAGS_nfolds);
         for(auto fold = 0; fold < FLAGS_nfolds; ++fold) {
-            LOG(INFO) << "Fold " << fold << " of " << FLAGS_nfolds;
-
-            // Create test corpus
-            std::set<size_t> test_indices;
+            auto& test_indices = fold_test[fold];
             auto n = 0;
             while(indices.size() > 0 && n < N_test_per_fold) {
                 auto i = pop(rng::get(), indices);
@@ -504,8 +1162,31 @@ int main(int argc, char **argv) {
             }
             CHECK(test_indices.size() > 0);
             CHECK(test_indices.size() < (N/2)) << test_indices.size();
+        }
+
+        // The threads are split between folds, which run concurrently,
+        // and the particle filters of each fold
+        size_t nthreads = omp_get_max_threads();
+        size_t fold_threads = FLAGS_fold_threads > 0 ? FLAGS_fold_threads
+                                                     : nthreads;
+        fold_threads = std::min<size_t>(fold_threads, nthreads);
+        fold_threads = std::max<size_t>(1, std::min<size_t>(fold_threads,
+                                                            FLAGS_nfolds));
+        size_t particle_threads = std::max<size_t>(1, nthreads / fold_threads);
+        LOG(INFO) << FLAGS_nfolds << " folds on " << fold_threads
+                  << " threads, with " << particle_threads
+                  << " threads each for particles";
+        if (particle_threads > 1) omp_set_max_active_levels(2);
+
+        std::vector<std::string> output_paths(FLAGS_nfolds);
+
+        #pragma omp parallel for schedule(dynamic) num_threads(fold_threads)
+        for(size_t fold = 0; fold < FLAGS_nfolds; ++fold) {
+            omp_set_num_threads(particle_threads);
+            LOG(INFO) << "Fold " << fold << " of " << FLAGS_nfolds;
 
             // Create training corpus
+            const auto& test_indices = fold_test[fold];
             std::set<size_t> train_indices;
             for (size_t i=0; i < N; ++i) {
                 auto in_test = (test_indices.count(i) > 0);
@@ -524,20 +1205,16 @@ int main(int argc, char **argv) {
 
             // Read gazetteer
             instances gaz;
-            if (FLAGS_gazetteer != "") {
-                LOG(INFO) << "Reading gazetteer: " << FLAGS_gazetteer;
-                gaz = corpus.read(FLAGS_gazetteer);
-            }
+            if (gaz_cache) gaz = gaz_cache->read(corpus);
 
             // Optionally: read unlabeled data
             instances unlabeled;
-            if(FLAGS_unlabeled != "") {
-                LOG(INFO) << "Reading unlabeled data: " << FLAGS_unlabeled;
-                unlabeled = corpus.read(FLAGS_unlabeled);
+            if (unlabeled_cache) {
+                unlabeled = unlabeled_cache->read(corpus);
                 CHECK(unlabeled.size() > 0);
             }
 
-            auto ret = corpus.read(FLAGS_train, train_indices, test_indices);
+            auto ret = train_cache.read(corpus, train_indices, test_indices);
 
             auto train = std::get<0>(ret);
             auto test = std::get<1>(ret);
@@ -556,17 +1233,20 @@ int main(int argc, char **argv) {
             LOG(INFO) << nsym << " symbols in the alphabet";
 
             std::string output_path {FLAGS_out_path+"."+std::to_string(fold)};
+            std::string model_path {FLAGS_model_path+"."+std::to_string(fold)};
             LOG(INFO) << "Writing predictions: " << output_path;
 
-            output_paths.push_back(output_path);
+            output_paths[fold] = output_path;
 
             if (FLAGS_model == "hsm") {
                 LOG(INFO) << "Model: hidden sequence memoizer";
-                run_inference<HSM>(train, gaz, unlabeled, test, output_path, corpus);
+                run_inference<HSM>(train, gaz, unlabeled, test, output_path,
+                                   corpus, model_path);
             }
             else if (FLAGS_model == "seg") {
                 LOG(INFO) << "Model: segmental sequence memoizer";
-                run_inference<SSM>(train, gaz, unlabeled, test, output_path, corpus);
+                run_inference<SSM>(train, gaz, unlabeled, test, output_path,
+                                   corpus, model_path);
             }
             else {
                 CHECK(false) << "unrecognized model: " << FLAGS_model;
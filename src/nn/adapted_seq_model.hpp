@@ -52,6 +52,8 @@ namespace nn {
         T SPACE;
 
     public:
+        typedef H base_model;
+
         struct param {
             size_t nsyms;
             T BOS;
@@ -77,6 +79,10 @@ namespace nn {
 
         H* get_base() const { return base.get(); }
 
+        // The adaptor's tables only hold whole sequences; the context
+        // tree is in the base
+        prune_stats prune(double threshold) { return base->prune(threshold); }
+
         double log_prob(const seq_t& seq) const {
             auto log_p0 = base->log_prob(seq);
             return crp->log_prob(seq, log_p0, p.first, p.second);
@@ -126,6 +132,19 @@ namespace nn {
             }
         }
 
+        // See adapted_seq_model_prefix::observe(seq, count)
+        void observe(const seq_t& seq, size_t count) {
+            CHECK(seq.front() == BOS) << "bad first symbol: " << seq.front();
+            CHECK(seq.back() == EOS)  << "bad last symbol: "  << seq.back();
+            auto log_p0 = base->log_prob(seq);
+            for (size_t n = 0; n < count; ++n) {
+                if (crp->add(seq, log_p0, p.first, p.second)) {
+                    base->observe(seq);
+                    if (n + 1 < count) log_p0 = base->log_prob(seq);
+                }
+            }
+        }
+
         void observe(typename seq_t::const_iterator, size_t len) {
             CHECK(false) << "unsupported";
         }
@@ -25,9 +25,9 @@
 #include <vector>
 #include <utility>
 
-#include <nn/prefix_matcher.hpp>
 #include <nn/adapted_seq_model.hpp>
 #include <nn/data.hpp>
+#include <nn/profile.hpp>
 
 #include <cereal/types/memory.hpp>
 
@@ -42,8 +42,6 @@ namespace nn {
         typedef std::pair<double, double> prm;
         typedef std::vector<T> seq_t;
 
-        PrefixMap<T,int> matcher;
-
         H base; // base distribution
         prm p;  // parameters
         A crp;  // adaptor
@@ -52,7 +50,26 @@ namespace nn {
         T EOS;
         T SPACE;
 
+        // Tally the cached probability of existing strings which
+        // continue past the given key. Every string ever added to the
+        // adaptor is interned, so its string table doubles as the
+        // prefix index.
+        double log_cached_prefix_prob(const seq_t& key) const {
+            auto cache_log_prob = NEG_INF;
+            const auto key_len = key.size();
+            const auto result  = crp.get_strings().match_prefix(key);
+            for(auto it = result.first; it != result.second; ++it) {
+                if (it->first.size() == key_len) continue;
+                if (it->first[key_len] == EOS) continue;
+                auto lcp = crp.log_cache_prob(it->second, p.first, p.second);
+                nn::log_plus_equals(cache_log_prob, lcp);
+            }
+            return cache_log_prob;
+        }
+
     public:
+        typedef H base_model;
+
         struct param {
             size_t nsyms;
             T BOS;
@@ -69,7 +86,7 @@ namespace nn {
 
         template<class Archive>
         void serialize(Archive & archive) {
-            archive( matcher, base, p, crp, BOS, EOS, SPACE );
+            archive( base, p, crp, BOS, EOS, SPACE );
         }
 
         adapted_seq_model_prefix() {}
@@ -90,6 +107,7 @@ namespace nn {
         }
 
         double log_prob(const seq_t& seq) const {
+            NN_PROFILE_SCOPE("emission.log_prob");
             CHECK(seq.front() == BOS) << "unexpected 1st symbol: "
                                       << seq.front();
             CHECK(seq.back()  == EOS) << "unexpected last symbol: "
@@ -107,17 +125,7 @@ namespace nn {
         // Calculates the total probability of *future* expansions of
         // the given key
         double log_prefix_prob(const seq_t& key) const {
-            auto cache_log_prob = NEG_INF;
-
-            const auto key_len = key.size();
-            const auto result  = matcher.match_prefix(key);
-
-            // Tally the probability of existing strings
-            for(auto it = result.first; it != result.second; ++it) {
-                if (it->first.at(key_len) == EOS) continue;
-                auto lcp = log_cached_prob(it->first);
-                nn::log_plus_equals(cache_log_prob, lcp);
-            }
+            auto cache_log_prob = log_cached_prefix_prob(key);
 
             // Tally the probability of generating the given key from
             // the base, and then NOT generating the STOP symbol.
@@ -127,6 +135,71 @@ namespace nn {
 
         H* get_base() { return &base; }
 
+        // The adaptor's tables only hold whole sequences; the context
+        // tree is in the base
+        prune_stats prune(double threshold) { return base.prune(threshold); }
+
+        // Incremental scorer for a phrase that grows one word at a
+        // time. The joined key and the base model's running log
+        // probability are extended in place, so scoring every prefix
+        // of an L-word phrase is linear rather than quadratic in L.
+        //
+        // log_prob() and log_prefix_prob() agree with
+        // log_prob(prefix, last) and log_prefix_prob(prefix, last).
+        class scorer {
+            const adapted_seq_model_prefix* model {nullptr};
+            typename H::scorer base_scorer;
+            seq_t key; // BOS w1 SPACE w2 ... (no EOS)
+            size_t nwords {0};
+
+        public:
+            scorer() {}
+            scorer(const adapted_seq_model_prefix* _model)
+                : model(_model),
+                  base_scorer(_model->base.get_scorer()),
+                  key {_model->BOS} {}
+
+            // append a BOS/EOS-wrapped word to the phrase
+            void extend(const seq_t& word) {
+                if (nwords > 0) {
+                    key.push_back(model->SPACE);
+                    base_scorer.extend(model->SPACE);
+                }
+                for (auto it = word.begin()+1; it != word.end()-1; ++it) {
+                    key.push_back(*it);
+                    base_scorer.extend(*it);
+                }
+                nwords ++;
+            }
+
+            // the phrase stops after the last word
+            double log_prob() {
+                NN_PROFILE_SCOPE("emission.log_prob");
+                auto log_p0 = base_scorer.log_prob() +
+                    base_scorer.log_prob(model->EOS);
+                key.push_back(model->EOS);
+                auto ret = model->crp.log_prob(key, log_p0,
+                                               model->p.first,
+                                               model->p.second);
+                key.pop_back();
+                return ret;
+            }
+
+            // the phrase continues past the last word
+            double log_prefix_prob() const {
+                auto cache_log_prob = model->log_cached_prefix_prob(key);
+                auto new_log_prob = model->crp.log_new_prob(
+                    base_scorer.log_prob(), model->p.first, model->p.second)
+                    + base_scorer.log_prob(model->SPACE);
+                return nn::log_add(cache_log_prob, new_log_prob);
+            }
+
+            size_t size() const { return nwords;      }
+            bool empty()  const { return nwords == 0; }
+        };
+
+        scorer get_scorer() const { return scorer(this); }
+
         double log_prefix_prob(const std::vector<seq_t>& prefix,
                                const seq_t& last)
             const {
@@ -161,13 +234,36 @@ namespace nn {
         }
 
         void observe(const seq_t& seq) {
+            NN_PROFILE_SCOPE("emission.observe");
             CHECK(seq.front() == BOS) << "unexpected first symbol: " << seq.front();
             CHECK(seq.back()  == EOS) << "unexpected last symbol: "  << seq.back();
-            matcher.add(seq, 0);
             auto log_p0 = base.log_prob(seq);
             auto new_table = crp.add(seq, log_p0, p.first, p.second);
             if(new_table) {
+                NN_PROFILE_COUNT("emission.new_tables", 1);
                 base.observe(seq);
+            } else {
+                NN_PROFILE_COUNT("emission.cache_hits", 1);
+            }
+        }
+
+        // Seats count customers for seq, as count calls to observe
+        // would; the base probability only changes when the base
+        // observes a new table, so it is only recomputed then
+        void observe(const seq_t& seq, size_t count) {
+            CHECK(seq.front() == BOS) << "unexpected first symbol: " << seq.front();
+            CHECK(seq.back()  == EOS) << "unexpected last symbol: "  << seq.back();
+            NN_PROFILE_SCOPE("emission.observe_bulk");
+            NN_PROFILE_COUNT("customers", count);
+            auto log_p0 = base.log_prob(seq);
+            for (size_t n = 0; n < count; ++n) {
+                if (crp.add(seq, log_p0, p.first, p.second)) {
+                    NN_PROFILE_COUNT("emission.new_tables", 1);
+                    base.observe(seq);
+                    if (n + 1 < count) log_p0 = base.log_prob(seq);
+                } else {
+                    NN_PROFILE_COUNT("emission.cache_hits", 1);
+                }
             }
         }
 
@@ -181,11 +277,18 @@ namespace nn {
             observe(nn::join(start, stop, BOS, SPACE, EOS));
         }
 
+        void observe(typename std::vector<seq_t>::const_iterator start,
+                     typename std::vector<seq_t>::const_iterator stop,
+                     size_t count) {
+            observe(nn::join(start, stop, BOS, SPACE, EOS), count);
+        }
+
         void observe(const std::vector<seq_t>& seqs) {
             observe(seqs.begin(), seqs.end());
         }
 
         void remove(const seq_t& seq) {
+            NN_PROFILE_SCOPE("emission.remove");
             CHECK(seq.front() == BOS) << "unexpected first symbol: "
                                       << seq.front();
             CHECK(seq.back() == EOS) << "unexpected last symbol: "
@@ -207,6 +310,16 @@ namespace nn {
             p.second = a;
         }
 
+        // Each table of the adaptor is one draw from the base, so the
+        // two are merged alike and stay in step
+        template<typename SymMap>
+        void merge(const adapted_seq_model_prefix& other,
+                   const SymMap& sym_map) {
+            CHECK(sym_map(other.SPACE) == SPACE) << "SPACE mismatch";
+            base.merge(other.base, sym_map);
+            crp.merge(other.crp, sym_map);
+        }
+
         template<typename RNG>
         void resample_hyperparameters(RNG& rng) {}
     };
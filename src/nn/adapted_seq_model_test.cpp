@@ -5,6 +5,7 @@
 #include <nn/fixed_depth_hpyp.hpp>
 #include <nn/simple_seq_model.hpp>
 #include <nn/adapted_seq_model.hpp>
+#include <nn/adapted_seq_model_prefix.hpp>
 
 #include <cereal/archives/binary.hpp>
 
@@ -39,3 +40,29 @@ TEST(AdaptedSequenceModel, CerealWorks) {
         ASSERT_EQ(lp, lp2);
     }
 }
+
+TEST(AdaptedSequenceModelPrefix, ScorerMatchesJoinedKey) {
+    using namespace nn;
+    rng::init();
+    adapted_seq_model_prefix<>::param p;
+    p.nsyms = 6;
+    p.BOS = 0;
+    p.EOS = 4;
+    p.SPACE = 1;
+    adapted_seq_model_prefix<> model(p);
+    syms w1 { 0, 2, 3, 4 };
+    syms w2 { 0, 3, 5, 2, 4 };
+    syms w3 { 0, 5, 4 };
+    phrase seen { w1, w2 };
+    model.observe(seen);
+    model.observe(seen);
+    phrase words { w1, w2, w3, w1 };
+    auto scorer = model.get_scorer();
+    phrase prefix;
+    for(const auto& w : words) {
+        scorer.extend(w);
+        ASSERT_EQ(model.log_prob(prefix, w), scorer.log_prob());
+        ASSERT_EQ(model.log_prefix_prob(prefix, w), scorer.log_prefix_prob());
+        prefix.push_back(w);
+    }
+}
@@ -0,0 +1,552 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_CORPUS_CACHE_HPP__
+#define __NN_CORPUS_CACHE_HPP__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <system_error>
+#include <unordered_map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include <nn/log.hpp>
+#include <nn/data.hpp>
+#include <nn/reader.hpp>
+
+namespace nn {
+
+    // Binary cache of a parsed CoNLL file. The first time a file is
+    // seen it is parsed once into a compact image, which later runs
+    // (and cross-validation folds) memory-map instead of re-parsing
+    // the text.
+    //
+    // Symbols and tags are stored with ids local to the file, in
+    // first-seen order. Reading from the cache replays them into a
+    // CoNLLCorpus in that order, so the corpus ends up with the same
+    // symbol and tag ids, and the same unknown symbols, as
+    // CoNLLCorpus::read on the text.
+    //
+    // The image depends on the tag conventions as well as the file,
+    // so the other and unknown tags are stored too; a cache built with
+    // different ones is stale.
+    //
+    // Layout (native byte order; arrays are 8-byte aligned):
+    //   header
+    //   other tag, unknown tag       (u32 length + bytes each)
+    //   symbol strings, tag strings  (u32 length + bytes each)
+    //   u64 inst_words[n_inst+1]     first word of each instance
+    //   u64 inst_tags[n_inst+1]      first tag of each instance
+    //   u64 word_chars[n_words+1]    first char of each word
+    //   u32 chars[n_chars]           local symbol ids
+    //   u32 tags[n_tags]             local tag ids
+    //   u32 lens[n_tags]             words spanned by each tag
+    //   u8  obs[n_inst]              Annotation of each instance
+    class corpus_cache {
+        static constexpr uint64_t MAGIC   {0x45484341434e4e4eULL}; // NNNCACHE
+        static constexpr uint32_t VERSION {2};
+
+        struct header {
+            uint64_t magic;
+            uint32_t version;
+            uint32_t reserved;
+            uint64_t src_size;
+            int64_t  src_mtime;
+            uint64_t n_syms;
+            uint64_t n_tag_strs;
+            uint64_t n_inst;
+            uint64_t n_words;
+            uint64_t n_chars;
+            uint64_t n_tags;
+        };
+
+        // Parsed file, with local ids
+        struct image {
+            std::vector<std::string> sym_strs;
+            std::vector<std::string> tag_strs;
+            std::vector<uint64_t> inst_words {0};
+            std::vector<uint64_t> inst_tags {0};
+            std::vector<uint64_t> word_chars {0};
+            std::vector<uint32_t> chars;
+            std::vector<uint32_t> tags;
+            std::vector<uint32_t> lens;
+            std::vector<uint8_t>  obs;
+        };
+
+        boost::iostreams::mapped_file_source file;
+        image mem; // backs the arrays when there is no cache file
+        header h;
+        std::vector<std::string> sym_strs;
+        std::vector<std::string> tag_strs;
+        const uint64_t* inst_words;
+        const uint64_t* inst_tags;
+        const uint64_t* word_chars;
+        const uint32_t* chars;
+        const uint32_t* tags;
+        const uint32_t* lens;
+        const uint8_t*  obs;
+
+        static void pad(std::ofstream& os) {
+            static const char zeros[8] {0};
+            auto pos = static_cast<size_t>(os.tellp());
+            if (pos % 8) os.write(zeros, 8 - pos % 8);
+        }
+
+        template<typename V>
+        static void write_array(std::ofstream& os, const std::vector<V>& v) {
+            pad(os);
+            os.write(reinterpret_cast<const char*>(v.data()),
+                     v.size() * sizeof(V));
+        }
+
+        static void write_strings(std::ofstream& os,
+                                  const std::vector<std::string>& strs) {
+            for (const auto& s : strs) {
+                uint32_t len = s.size();
+                os.write(reinterpret_cast<const char*>(&len), sizeof(len));
+                os.write(s.data(), len);
+            }
+        }
+
+        // Mirrors CoNLLCorpus::read
+        static image parse(const std::string& path,
+                           const std::string& other_tag,
+                           const std::string& unk_tag) {
+            std::ifstream infile(path);
+            if (!infile) {
+                LOG(FATAL) << "Error reading path: `" << path << "'";
+                throw std::system_error(EIO, std::generic_category());
+            }
+
+            image img;
+            codepoint_index<uint32_t> cpindex;
+            std::unordered_map<std::string, uint32_t> tag_ids;
+
+            std::string line;
+            std::vector<boost::string_ref> toks;
+            size_t nwords {0};
+            size_t ntags  {0};
+            size_t ntok   {0}; // tokens in the current sentence
+            int line_idx  {-1};
+
+            while (std::getline(infile, line)) {
+                ++line_idx;
+                split_fields(line, " \n\t", toks);
+                if (toks.size() != 2) { // end of sentence
+                    if (img.tags.size() == img.inst_tags.back()) {
+                        throw std::runtime_error("pushing empty sentence");
+                    }
+                    size_t tot_len = 0;
+                    for (auto i = img.inst_tags.back(); i < img.lens.size(); ++i) {
+                        tot_len += img.lens[i];
+                    }
+                    CHECK(tot_len == nwords) << nwords << " != " << tot_len
+                                             << "; line = " << line_idx;
+                    if (nwords == ntags) {
+                        img.obs.push_back(static_cast<uint8_t>(Annotation::FULL));
+                    } else if (ntags > 0) {
+                        img.obs.push_back(static_cast<uint8_t>(Annotation::SEMI));
+                    } else {
+                        img.obs.push_back(static_cast<uint8_t>(Annotation::NONE));
+                    }
+                    img.inst_words.push_back(img.word_chars.size() - 1);
+                    img.inst_tags.push_back(img.tags.size());
+                    nwords = 0;
+                    ntags  = 0;
+                    ntok   = 0;
+                    continue;
+                }
+
+                ++ nwords;
+                boost::string_ref obs(toks[0]);
+                std::string raw_tag(toks[1]);
+                if (!(raw_tag == unk_tag)) {
+                    ++ ntags;
+                }
+                CHECK(!obs.empty()) << "empty observation for line: " << line;
+
+                auto parts = raw_tag == unk_tag
+                    ? std::vector<std::string> { "B", unk_tag }
+                    : split_tag(raw_tag, other_tag);
+                if (parts[0] == "B") {
+                    auto it = tag_ids.find(parts[1]);
+                    uint32_t t;
+                    if (it == tag_ids.end()) {
+                        t = img.tag_strs.size();
+                        tag_ids.emplace(parts[1], t);
+                        img.tag_strs.push_back(parts[1]);
+                    } else {
+                        t = it->second;
+                    }
+                    img.tags.push_back(t);
+                    img.lens.push_back(1);
+                } else if (parts[0] == "I") {
+                    CHECK(ntok > 0) << "I- tag starts a sentence; line = "
+                                    << line_idx;
+                    img.lens.back() ++;
+                }
+                ++ ntok;
+
+                const char* it  = obs.data();
+                const char* end = it + obs.size();
+                while (it < end) {
+                    uint32_t cp = utf8::next(it, end);
+                    if (cp == 0) continue;
+                    uint32_t s;
+                    if (!cpindex.find(cp, s)) {
+                        s = img.sym_strs.size();
+                        std::string c;
+                        utf8::append(cp, std::back_inserter(c));
+                        img.sym_strs.push_back(c);
+                        cpindex.put(cp, s);
+                    }
+                    img.chars.push_back(s);
+                }
+                img.word_chars.push_back(img.chars.size());
+            }
+
+            // an unterminated last sentence is dropped
+            img.word_chars.resize(img.inst_words.back() + 1);
+            img.chars.resize(img.word_chars.back());
+            img.tags.resize(img.inst_tags.back());
+            img.lens.resize(img.inst_tags.back());
+            return img;
+        }
+
+        // Returns false if the cache couldn't be written
+        static bool write(const std::string& cache_file,
+                          const image& img,
+                          uint64_t src_size,
+                          int64_t src_mtime,
+                          const std::string& other_tag,
+                          const std::string& unk_tag) {
+            // write to a temporary file and rename it into place, so
+            // concurrent runs never see a partial cache
+            std::string tmp = cache_file + ".tmp" + std::to_string(::getpid());
+            bool written;
+            {
+                std::ofstream os(tmp, std::ios::binary);
+                CHECK(os.is_open()) << "problem opening: " << tmp;
+                header hdr;
+                std::memset(&hdr, 0, sizeof(hdr));
+                hdr.magic      = MAGIC;
+                hdr.version    = VERSION;
+                hdr.src_size   = src_size;
+                hdr.src_mtime  = src_mtime;
+                hdr.n_syms     = img.sym_strs.size();
+                hdr.n_tag_strs = img.tag_strs.size();
+                hdr.n_inst     = img.obs.size();
+                hdr.n_words    = img.word_chars.size() - 1;
+                hdr.n_chars    = img.chars.size();
+                hdr.n_tags     = img.tags.size();
+                os.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+                write_strings(os, { other_tag, unk_tag });
+                write_strings(os, img.sym_strs);
+                write_strings(os, img.tag_strs);
+                write_array(os, img.inst_words);
+                write_array(os, img.inst_tags);
+                write_array(os, img.word_chars);
+                write_array(os, img.chars);
+                write_array(os, img.tags);
+                write_array(os, img.lens);
+                write_array(os, img.obs);
+                os.close();
+                written = !os.fail();
+            }
+            // a partial cache (e.g. on a full disk) is never renamed
+            // into place
+            if (!written) {
+                LOG(INFO) << "problem writing: " << tmp;
+                std::remove(tmp.c_str());
+                return false;
+            }
+            boost::filesystem::rename(tmp, cache_file);
+            return true;
+        }
+
+        // Points arr at the n values from the next 8-byte boundary;
+        // false if the file ends before them
+        template<typename V>
+        bool map_array(const char*& cur, size_t n, const V*& arr) const {
+            auto off = static_cast<size_t>(cur - file.data());
+            if (off % 8) off += 8 - off % 8;
+            if (off > file.size() || n > (file.size() - off) / sizeof(V)) {
+                return false;
+            }
+            arr = reinterpret_cast<const V*>(file.data() + off);
+            cur = file.data() + off + n * sizeof(V);
+            return true;
+        }
+
+        // False if the file ends before the n strings
+        bool map_strings(const char*& cur, size_t n,
+                         std::vector<std::string>& strs) const {
+            const char* end = file.data() + file.size();
+            strs.clear();
+            for (size_t i = 0; i < n; ++i) {
+                uint32_t len;
+                if (static_cast<size_t>(end - cur) < sizeof(len)) return false;
+                std::memcpy(&len, cur, sizeof(len));
+                cur += sizeof(len);
+                if (static_cast<size_t>(end - cur) < len) return false;
+                strs.emplace_back(cur, len);
+                cur += len;
+            }
+            return true;
+        }
+
+        // Returns false if the file isn't a current cache of the
+        // source, or is cut short
+        bool open(const std::string& cache_file,
+                  uint64_t src_size, int64_t src_mtime,
+                  const std::string& other_tag,
+                  const std::string& unk_tag) {
+            if (!boost::filesystem::exists(cache_file)) return false;
+            if (boost::filesystem::file_size(cache_file) < sizeof(header)) {
+                return false;
+            }
+            file.open(cache_file);
+            std::memcpy(&h, file.data(), sizeof(h));
+            if (h.magic != MAGIC || h.version != VERSION ||
+                h.src_size != src_size || h.src_mtime != src_mtime) {
+                file.close();
+                return false;
+            }
+            const char* cur = file.data() + sizeof(h);
+            std::vector<std::string> conf;
+            bool ok = map_strings(cur, 2, conf)
+                && conf[0] == other_tag && conf[1] == unk_tag
+                && map_strings(cur, h.n_syms, sym_strs)
+                && map_strings(cur, h.n_tag_strs, tag_strs)
+                && map_array(cur, h.n_inst + 1, inst_words)
+                && map_array(cur, h.n_inst + 1, inst_tags)
+                && map_array(cur, h.n_words + 1, word_chars)
+                && map_array(cur, h.n_chars, chars)
+                && map_array(cur, h.n_tags, tags)
+                && map_array(cur, h.n_tags, lens)
+                && map_array(cur, h.n_inst, obs);
+            if (!ok) file.close();
+            return ok;
+        }
+
+        void use_image() {
+            std::memset(&h, 0, sizeof(h));
+            h.n_syms     = mem.sym_strs.size();
+            h.n_tag_strs = mem.tag_strs.size();
+            h.n_inst     = mem.obs.size();
+            h.n_words    = mem.word_chars.size() - 1;
+            h.n_chars    = mem.chars.size();
+            h.n_tags     = mem.tags.size();
+            sym_strs     = mem.sym_strs;
+            tag_strs     = mem.tag_strs;
+            inst_words   = mem.inst_words.data();
+            inst_tags    = mem.inst_tags.data();
+            word_chars   = mem.word_chars.data();
+            chars        = mem.chars.data();
+            tags         = mem.tags.data();
+            lens         = mem.lens.data();
+            obs          = mem.obs.data();
+        }
+
+        template<typename Corpus, typename Map>
+        void append_instance(Corpus& corpus, size_t n,
+                             const Map& sym_map, const Map& tag_map,
+                             instances& ret) const {
+            ret.emplace_back();
+            auto& sentence = ret.back();
+            sentence.chars.push_back(corpus.get_bos_key());
+            for (auto w = inst_words[n]; w < inst_words[n+1]; ++w) {
+                if (w > inst_words[n]) {
+                    sentence.chars.push_back(corpus.get_space_key());
+                }
+                syms word {corpus.get_bos_key()};
+                for (auto c = word_chars[w]; c < word_chars[w+1]; ++c) {
+                    word.push_back(sym_map[chars[c]]);
+                    sentence.chars.push_back(sym_map[chars[c]]);
+                }
+                word.push_back(corpus.get_eos_key());
+                sentence.words.push_back(word);
+            }
+            sentence.chars.push_back(corpus.get_eos_key());
+            sentence.words.push_back(corpus.get_eos_obs());
+            for (auto t = inst_tags[n]; t < inst_tags[n+1]; ++t) {
+                sentence.tags.push_back(tag_map[tags[t]]);
+                sentence.lens.push_back(lens[t]);
+            }
+            sentence.obs = static_cast<Annotation>(obs[n]);
+        }
+
+    public:
+        // Where the cache of a source file lives in the cache directory
+        static std::string cache_path(const std::string& cache_dir,
+                                      const std::string& path) {
+            namespace fs = boost::filesystem;
+            auto abs = fs::absolute(path).string();
+            std::ostringstream name;
+            name << fs::path(path).filename().string() << "."
+                 << std::hex << std::hash<std::string>()(abs) << ".cache";
+            return (fs::path(cache_dir) / name.str()).string();
+        }
+
+        // Opens the cache of the given file, (re)building it if it is
+        // missing, older than the file, cut short, or built with other
+        // tags. Without a cache directory, or if the cache can't be
+        // written, the file is parsed and the image is kept in memory.
+        corpus_cache(const std::string& path,
+                     const std::string& cache_dir,
+                     const std::string& other_tag,
+                     const std::string& unk_tag = "?") {
+            namespace fs = boost::filesystem;
+            if (!fs::exists(path)) {
+                LOG(FATAL) << "Error reading path: `" << path << "'";
+                throw std::system_error(EIO, std::generic_category());
+            }
+            if (cache_dir == "") {
+                mem = parse(path, other_tag, unk_tag);
+                use_image();
+                return;
+            }
+            uint64_t src_size  = fs::file_size(path);
+            int64_t  src_mtime = fs::last_write_time(path);
+            fs::create_directories(cache_dir);
+            auto cache_file = cache_path(cache_dir, path);
+            if (open(cache_file, src_size, src_mtime, other_tag, unk_tag)) {
+                LOG(INFO) << "Using corpus cache: " << cache_file;
+                return;
+            }
+            LOG(INFO) << "Building corpus cache: " << cache_file;
+            auto img = parse(path, other_tag, unk_tag);
+            if (!write(cache_file, img, src_size, src_mtime,
+                       other_tag, unk_tag) ||
+                !open(cache_file, src_size, src_mtime, other_tag, unk_tag)) {
+                // keep going on the parsed file
+                LOG(INFO) << "problem caching: " << cache_file;
+                mem = std::move(img);
+                use_image();
+            }
+        }
+
+        corpus_cache(corpus_cache const&)            = delete;
+        corpus_cache& operator=(corpus_cache const&) = delete;
+
+        // Number of instances; same as CoNLLCorpus::num_instances
+        // for a well-formed file
+        size_t size() const { return h.n_inst; }
+
+        // Same as corpus.read(path, include)
+        template<typename Corpus>
+        instances read(Corpus& corpus,
+                       const std::set<size_t>& include = std::set<size_t>()) const {
+            typedef decltype(corpus.get_bos_key()) k_type;
+
+            // As with the text reader, every symbol and tag in the
+            // file is seen, whether or not its instance is selected.
+            std::vector<k_type> sym_map;
+            sym_map.reserve(sym_strs.size());
+            size_t n_unk_syms {0};
+            for (const auto& c : sym_strs) {
+                auto s = corpus.get_symbol(c);
+                if (s == corpus.get_unk_key()) n_unk_syms ++;
+                sym_map.push_back(s);
+            }
+            std::vector<k_type> tag_map;
+            tag_map.reserve(tag_strs.size());
+            for (const auto& t : tag_strs) {
+                tag_map.push_back(corpus.tagtab.get_or_add_key(t));
+            }
+
+            const bool filter = (include.size() > 0);
+            instances ret;
+            ret.reserve(filter ? include.size() : size());
+            size_t tot_n_words {0};
+            for (size_t n = 0; n < size(); ++n) {
+                if (filter && include.count(n) == 0) continue;
+                append_instance(corpus, n, sym_map, tag_map, ret);
+                tot_n_words += inst_words[n+1] - inst_words[n];
+            }
+
+            LOG(INFO) << "n_unique_sym = " << sym_strs.size()
+                      << " (" << n_unk_syms << " unknown)";
+            LOG(INFO) << "n_instances = " << ret.size()
+                      << " n_words = " << tot_n_words;
+            return ret;
+        }
+
+        // Reads the given instances, in the given order, as if they
+        // were the whole file: only their symbols and tags are added
+        // to the corpus, in first-seen order. Safe to call
+        // concurrently for different corpora.
+        template<typename Corpus>
+        instances read_subset(Corpus& corpus,
+                              const std::vector<size_t>& order) const {
+            typedef decltype(corpus.get_bos_key()) k_type;
+            const k_type NONE = std::numeric_limits<k_type>::max();
+            std::vector<k_type> sym_map(sym_strs.size(), NONE);
+            std::vector<k_type> tag_map(tag_strs.size(), NONE);
+            instances ret;
+            ret.reserve(order.size());
+            for (auto n : order) {
+                CHECK(n < size()) << "no instance " << n;
+                for (auto c = word_chars[inst_words[n]];
+                     c < word_chars[inst_words[n+1]]; ++c) {
+                    auto& s = sym_map[chars[c]];
+                    if (s == NONE) s = corpus.get_symbol(sym_strs[chars[c]]);
+                }
+                for (auto t = inst_tags[n]; t < inst_tags[n+1]; ++t) {
+                    auto& k = tag_map[tags[t]];
+                    if (k == NONE) k = corpus.tagtab.get_or_add_key(tag_strs[tags[t]]);
+                }
+                append_instance(corpus, n, sym_map, tag_map, ret);
+            }
+            return ret;
+        }
+
+        // Same as corpus.read(path, train_idx, test_idx)
+        template<typename Corpus>
+        std::tuple<instances, instances> read(Corpus& corpus,
+                                              const std::set<size_t>& train_idx,
+                                              const std::set<size_t>& test_idx) const {
+            std::tuple<instances, instances> ret;
+            std::get<0>(ret) = read(corpus, train_idx);
+            corpus.symtab.freeze();
+            corpus.frozen = true;
+            std::get<1>(ret) = read(corpus, test_idx);
+            return ret;
+        }
+    };
+
+    constexpr uint64_t corpus_cache::MAGIC;
+    constexpr uint32_t corpus_cache::VERSION;
+}
+
+#endif
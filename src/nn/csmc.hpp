@@ -19,13 +19,45 @@
 #ifndef __NN_CSMC_HPP__
 #define __NN_CSMC_HPP__
 
+#include <nn/mu.hpp>
+#include <nn/rng.hpp>
 #include <nn/smc.hpp>
 
+// Conditional SMC, for particle Gibbs: particle 0 follows a fixed
+// reference trajectory. With ancestor sampling (settings::
+// ancestor_sampling), each time the particles are resampled after
+// observation t, the reference also picks a new history: particle m
+// with probability proportional to its weight times the density of
+// the rest of the reference given that history (continuation_p).
+// The reference then goes on as that history followed by its own
+// remaining states, so that it no longer has to be the same
+// trajectory from one sweep to the next. As the reference is moved
+// by score (incr_p) rather than sampled, splice_particle must leave
+// it in a state that the model can score from observation t+1 on.
+//
+// Ancestors are drawn only at the steps that resample. The
+// reference's ancestor is part of the same draw as those of the
+// others; at a step that doesn't resample, every particle keeps its
+// own history and so must the reference, or the sampler no longer
+// leaves the posterior invariant (see smc_test). To draw an ancestor
+// at every step, resample at every step (resample_threshold just
+// under 1).
 template<typename P, typename O>
 struct ConditionalFilter : public Filter<P,O> {
 
+    // Workspace for ancestor sampling
+    const std::vector<O>* ref_obs {nullptr};
+    std::vector<double> ancestor_log_weight;
+    P ancestor;
+    bool have_ancestor {false};
+
+    // Ancestor sampling draws, and those that changed the reference
+    size_t ancestor_draws {0};
+    size_t ancestor_moves {0};
+
     ConditionalFilter(typename Filter<P,O>::settings _config)
         : Filter<P,O>(_config) {
+        ancestor_log_weight.resize(_config.num_particles);
     }
 
     // take final particle src and use init
@@ -34,32 +66,92 @@ struct ConditionalFilter : public Filter<P,O> {
     // compute probability of state[t] and obs[t]
     virtual double incr_p(P& particle, const O& obs, size_t t) = 0;
 
+    // drop the states of the reference after observation t, so that
+    // a copy of it can be moved on like the other particles
+    virtual void truncate_particle(P& particle, size_t t) = 0;
+
+    // log density of the states of ref after observation t given the
+    // history of particle, up to a constant that is the same for all
+    // particles; -inf if ref can't continue it
+    virtual double continuation_p(const P& particle, const P& ref,
+                                  const std::vector<O>& obs, size_t t) = 0;
+
+    // the history of particle followed by the states of ref after
+    // observation t, into dst
+    virtual void splice_particle(P& dst, const P& particle, const P& ref,
+                                 size_t t) = 0;
+
+    // Draws the ancestor of the reference after observation t, by
+    // the weights before resampling; called by every thread of the
+    // team
+    void sample_ancestor(size_t t) {
+        auto& sys = this->sys;
+        const size_t N = this->config.num_particles;
+        const P& ref = sys.particle[0];
+        #pragma omp for schedule(static)
+        for (size_t m = 0; m < N; ++m) {
+            ancestor_log_weight[m] = sys.log_weight[m] +
+                continuation_p(sys.particle[m], ref, *ref_obs, t);
+        }
+        #pragma omp single
+        {
+            // the reference can't follow its own history where it is
+            // in the middle of a state that spans observations
+            have_ancestor = false;
+            if (ancestor_log_weight[0] != nn::NEG_INF) {
+                ancestor_draws ++;
+                auto a = nn::sample_unnormalized_lnpdf(ancestor_log_weight,
+                                                       nn::rng::get());
+                if (a != 0) {
+                    splice_particle(ancestor, sys.particle[a], ref, t);
+                    have_ancestor = true;
+                    ancestor_moves ++;
+                }
+            }
+        }
+    }
+
+    // The others are drawn from the particles before the reference
+    // takes its new history, which may be one of theirs. Until the
+    // last observation, their copies of the reference only keep its
+    // history.
+    void resample_step(size_t t, size_t start) override {
+        if (start == 0 || ref_obs == nullptr || t + 1 >= ref_obs->size()) {
+            this->resample(start);
+            return;
+        }
+        const bool as = this->config.ancestor_sampling;
+        if (as) sample_ancestor(t);
+        this->resample(start);
+        auto& sys = this->sys;
+        #pragma omp for schedule(static)
+        for (size_t m = start; m < this->config.num_particles; ++m) {
+            if (this->resample_indices[m] == 0) {
+                truncate_particle(sys.particle[m], t);
+            }
+        }
+        if (as) {
+            #pragma omp single
+            if (have_ancestor) std::swap(sys.particle[0], ancestor);
+        }
+    }
+
     // run conditional SMC over a vector of fixed length
     void csmc(const P& fixed, const std::vector<O>& obs) {
-        size_t start = 1;
-        size_t stop  = this->config.num_particles;
-
         // set up
         this->set_up(obs);
-
-        // initialize particles
-        this->init(start, stop);
+        ref_obs = &obs;
 
         // fix particle 0 and initialize its weight
         this->swap_complete_particle(this->sys.particle[0], fixed);
         this->sys.log_weight[0] = 0;
 
-        // run particle filter
-        size_t t = 0;
-        for(auto o : obs) {
-            // handle the fixed particle
+        // run particle filter, scoring the fixed particle as the
+        // others are moved
+        this->run(obs, 1, [this](const O& o, size_t t) {
             this->sys.log_weight[0] += incr_p(this->sys.particle[0], o, t);
-
-            // handle the rest
-            this->advance(o, start, stop);
-
-            t++;
-        }
+        });
+        ref_obs = nullptr;
     }
 };
 
@@ -120,7 +120,7 @@ namespace nn {
 
     template<typename IntVec>
     std::string get_string(
-        IntVec encoded,
+        const IntVec& encoded,
         const std::unordered_map<sym, std::string>& sym_map
         ) {
         std::string ret;
@@ -223,15 +223,15 @@ namespace nn {
 
 
     void write_tagging_conll(std::ofstream& of,
-                             phrase words,
-                             syms pred_tags,
-                             syms pred_lens, // how many words each of the pred tags spans
-                             syms gold_tags,
-                             syms gold_lens,
+                             const phrase& words,
+                             const syms& pred_tags,
+                             const syms& pred_lens, // how many words each of the pred tags spans
+                             const syms& gold_tags,
+                             const syms& gold_lens,
 //                             std::unordered_set<size_t> gaz_tags,
                              sym context_tag,
-                             std::unordered_map<size_t, std::string> sym_desc,
-                             std::unordered_map<size_t, std::string> tag_desc
+                             const std::unordered_map<size_t, std::string>& sym_desc,
+                             const std::unordered_map<size_t, std::string>& tag_desc
         ) {
         //LOG(INFO) << "[write tagging conll]";
         //LOG(INFO) << "tag_desc.size() = " << tag_desc.size();
@@ -248,9 +248,9 @@ namespace nn {
             auto str = get_string(words.at(i), sym_desc);
             of << str << " ";
             of << gold_tag_strs.at(i) << " ";
-            of << pred_tag_strs.at(i) << std::endl;
+            of << pred_tag_strs.at(i) << "\n";
         }
-        of << std::endl;
+        of << "\n";
     }
 
     std::vector<phrase> get_observations(sym _tag, const dictionary& dict, size_t max_instances) {
@@ -546,34 +546,6 @@ namespace nn {
         }
         return uni.size();
     }
-
-    template<typename P, typename I, typename C, typename M>
-    void write_state(std::vector<P> state,
-                     std::vector<I> instances,
-                     const C& corpus,
-                     const M& model,
-                     std::string path
-        ) {
-        CHECK(state.size() == instances.size()) << "size mismatch";
-        CHECK(state.size() > 0);
-        std::ofstream of (path);
-        CHECK(of.is_open()) << "problem opening path: " << path;
-        for(auto n = 0; n < state.size(); ++n) {
-            auto p = state.at(n);
-            auto i = instances.at(n);
-            auto tags = model.get_tags(p);
-            auto lens = model.get_lens(p);
-            CHECK(tags.size() > 0);
-            CHECK(lens.size() > 0);
-            write_tagging_conll(of, i.words,
-                                tags, lens,
-                                i.tags, i.lens,
-                                corpus.get_other_key(),
-                                corpus.symtab.get_map(),
-                                corpus.tagtab.get_map());
-        }
-        of.close();
-    }
 };
 
 #endif
@@ -95,8 +95,8 @@ namespace nn {
             return chunkStart;
         }
 
-        bool observe(Particle guess, Particle gold) {
-            auto tags = guess.tags;
+        bool observe(const Particle& guess, const Particle& gold) {
+            const auto& tags = guess.tags;
             CHECK(tags.size() == gold.tags.size()) << "size mismatch";
             bool inCorrect {false};
             size_t lastCorrect = context_tag;
@@ -167,29 +167,60 @@ namespace nn {
                 lastGuessedType = guessedType;
                 lastCorrectType = correctType;
             }
+
+            // The sentence boundary ends any open chunk (as in conlleval)
+            if (inCorrect) {
+                auto contextType = type(context_tag);
+                if(endOfChunk(lastCorrect,context_tag,lastCorrectType,contextType) &&
+                   endOfChunk(lastGuessed,context_tag,lastGuessedType,contextType) &&
+                   lastGuessedType == lastCorrectType) {
+                    correctChunk++;
+                    correctChunkMap[lastCorrectType]++;
+                }
+            }
             return true;
         }
 
+        // Adds the counts of other, e.g. over other sentences
+        void merge(const F1Result& other) {
+            correctChunk += other.correctChunk;
+            foundGuessed += other.foundGuessed;
+            foundCorrect += other.foundCorrect;
+            correctTags  += other.correctTags;
+            tokenCounter += other.tokenCounter;
+            for (auto kv : other.correctChunkMap) correctChunkMap[kv.first] += kv.second;
+            for (auto kv : other.foundGuessedMap) foundGuessedMap[kv.first] += kv.second;
+            for (auto kv : other.foundCorrectMap) foundCorrectMap[kv.first] += kv.second;
+        }
+
         double precision() const {
+            if (foundGuessed == 0) return 0.0;
             return 100.0*correctChunk/foundGuessed;
         }
 
         double recall() const {
+            if (foundCorrect == 0) return 0.0;
             return 100.0*correctChunk/foundCorrect;
         }
 
         double f1() const {
             double p = precision();
             double r = recall();
+            if (p + r == 0.0) return 0.0;
             return (2*p*r)/(p+r);
         }
 
+        double accuracy() const {
+            if (tokenCounter == 0) return 0.0;
+            return 100.0*correctTags/tokenCounter;
+        }
+
         template<typename Table>
         void log(const Table& tagtab) {
             double p = precision();
             double r = recall();
             double f = f1();
-            double a = 100.0*correctTags/tokenCounter;
+            double a = accuracy();
             LOG(INFO) << "Overall: precision: " << p
                       << "; recall: " << r
                       << "; F1: " << f
@@ -272,6 +303,138 @@ namespace nn {
             result.log(tagmap);
         }
     };
+
+    // Chunk F1 of segmentations given as span tags and lengths. Each
+    // word is labeled as in the CoNLL output: a span with tag t gives
+    // B-t followed by I-t, and context words keep the context tag.
+    class SegmentF1 {
+    public:
+        struct labels {
+            std::vector<size_t> tags;
+        };
+
+    private:
+        const size_t context_tag;
+        const size_t ntags;
+        F1Result<labels> result;
+        labels guess;
+        labels gold;
+
+        static std::set<size_t> make_begin_tags(size_t context_tag,
+                                                size_t ntags) {
+            std::set<size_t> ret;
+            for (size_t t = 0; t < ntags; ++t) {
+                if (t != context_tag) ret.insert(t);
+            }
+            return ret;
+        }
+
+        static std::set<size_t> make_extend_tags(size_t context_tag,
+                                                 size_t ntags) {
+            std::set<size_t> ret;
+            for (size_t t = 0; t < ntags; ++t) {
+                if (t != context_tag) ret.insert(ntags + t);
+            }
+            return ret;
+        }
+
+        static std::map<size_t, size_t> make_tag_type(size_t ntags) {
+            std::map<size_t, size_t> ret;
+            for (size_t t = 0; t < ntags; ++t) {
+                ret[t]         = t;
+                ret[ntags + t] = t;
+            }
+            return ret;
+        }
+
+        void expand(const syms& tags, const syms& lens, labels& out) const {
+            CHECK(tags.size() == lens.size()) << "size mismatch";
+            out.tags.clear();
+            for (size_t i = 0; i < tags.size(); ++i) {
+                CHECK(tags[i] < ntags) << "unexpected tag: " << tags[i];
+                for (size_t j = 0; j < lens[i]; ++j) {
+                    if (tags[i] == context_tag || j == 0) {
+                        out.tags.push_back(tags[i]);
+                    } else {
+                        out.tags.push_back(ntags + tags[i]);
+                    }
+                }
+            }
+        }
+
+    public:
+        SegmentF1(size_t _context_tag, size_t _ntags)
+            : context_tag(_context_tag),
+              ntags(_ntags),
+              result(_context_tag,
+                     make_begin_tags(_context_tag, _ntags),
+                     make_extend_tags(_context_tag, _ntags),
+                     make_tag_type(_ntags)) {
+            CHECK(context_tag < ntags) << "context tag out of range";
+        }
+
+        void observe(const syms& pred_tags, const syms& pred_lens,
+                     const syms& gold_tags, const syms& gold_lens) {
+            expand(pred_tags, pred_lens, guess);
+            expand(gold_tags, gold_lens, gold);
+            result.observe(guess, gold);
+        }
+
+        void merge(const SegmentF1& other) { result.merge(other.result); }
+
+        const F1Result<labels>& get_result() const { return result; }
+
+        double precision() const { return result.precision(); }
+        double recall()    const { return result.recall();    }
+        double f1()        const { return result.f1();        }
+        double accuracy()  const { return result.accuracy();  }
+
+        template<typename Table>
+        void log(const Table& tagtab) { result.log(tagtab); }
+    };
+
+    // Evaluation callback for particle_gibbs: scores the sampled
+    // state of the test sentences against their gold annotation, in
+    // parallel across sentences, and logs chunk P/R/F1 overall and
+    // per type.
+    template<typename Model>
+    class SegmentF1Evaluator {
+        const Model& model;
+        const instances& gold;
+
+        SegmentF1 make() const {
+            const auto& corpus = model.get_corpus();
+            return SegmentF1(corpus.get_other_key(), corpus.tagtab.size());
+        }
+
+    public:
+        SegmentF1Evaluator(const Model& _model, const instances& _gold)
+            : model(_model), gold(_gold) {}
+
+        template<typename Iterator>
+        SegmentF1 evaluate(Iterator begin, Iterator end) const {
+            CHECK(size_t(end - begin) == gold.size()) << "size mismatch";
+            SegmentF1 total = make();
+            #pragma omp parallel
+            {
+                SegmentF1 part = make();
+                #pragma omp for schedule(static) nowait
+                for (size_t i = 0; i < gold.size(); ++i) {
+                    const auto& p = *(begin + i);
+                    part.observe(model.get_tags(p), model.get_lens(p),
+                                 gold[i].tags, gold[i].lens);
+                }
+                #pragma omp critical
+                total.merge(part);
+            }
+            return total;
+        }
+
+        template<typename Iterator>
+        void operator()(Iterator begin, Iterator end) const {
+            evaluate(begin, end).log(model.get_corpus().tagtab);
+        }
+    };
 };
 
 #endif
@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+
+#include <nn/evaluation.hpp>
+
+// Tags: 0 = O, 1 = PER, 2 = LOC
+TEST(SegmentF1, ExactMatch) {
+    using namespace nn;
+    SegmentF1 eval(0, 3);
+    syms tags { 1, 0, 2 };
+    syms lens { 2, 1, 1 };
+    eval.observe(tags, lens, tags, lens);
+    ASSERT_EQ( eval.get_result().foundCorrect, 2 );
+    ASSERT_EQ( eval.get_result().correctChunk, 2 );
+    ASSERT_DOUBLE_EQ( eval.precision(), 100.0 );
+    ASSERT_DOUBLE_EQ( eval.recall(),    100.0 );
+    ASSERT_DOUBLE_EQ( eval.f1(),        100.0 );
+    ASSERT_DOUBLE_EQ( eval.accuracy(),  100.0 );
+}
+
+// Matches the counts conlleval gives for the same labels:
+//   gold: B-PER I-PER I-PER B-LOC | B-PER O
+//   pred: B-PER I-PER O     B-LOC | B-PER O
+TEST(SegmentF1, MatchesConlleval) {
+    using namespace nn;
+    SegmentF1 eval(0, 3);
+    eval.observe(syms { 1, 0, 2 }, syms { 2, 1, 1 },
+                 syms { 1, 2 },    syms { 3, 1 });
+    eval.observe(syms { 1, 0 },    syms { 1, 1 },
+                 syms { 1, 0 },    syms { 1, 1 });
+    const auto& r = eval.get_result();
+    ASSERT_EQ( r.foundGuessed, 3 );
+    ASSERT_EQ( r.foundCorrect, 3 );
+    ASSERT_EQ( r.correctChunk, 2 );
+    ASSERT_EQ( r.correctTags,  5 );
+    ASSERT_EQ( r.tokenCounter, 6 );
+    ASSERT_NEAR( eval.precision(), 66.666667, 1e-5 );
+    ASSERT_NEAR( eval.recall(),    66.666667, 1e-5 );
+    ASSERT_NEAR( eval.accuracy(),  83.333333, 1e-5 );
+}
+
+TEST(SegmentF1, NoEntities) {
+    using namespace nn;
+    SegmentF1 eval(0, 3);
+    eval.observe(syms { 0, 0 }, syms { 1, 1 }, syms { 0, 0 }, syms { 1, 1 });
+    ASSERT_DOUBLE_EQ( eval.f1(), 0.0 );
+    ASSERT_DOUBLE_EQ( eval.accuracy(), 100.0 );
+}
+
+TEST(SegmentF1, MergeMatchesOneEvaluator) {
+    using namespace nn;
+    SegmentF1 all(0, 3), first(0, 3), second(0, 3);
+    all.observe(syms { 1, 0, 2 }, syms { 2, 1, 1 }, syms { 1, 2 }, syms { 3, 1 });
+    all.observe(syms { 1, 0 }, syms { 1, 1 }, syms { 2, 0 }, syms { 1, 1 });
+    first.observe(syms { 1, 0, 2 }, syms { 2, 1, 1 }, syms { 1, 2 }, syms { 3, 1 });
+    second.observe(syms { 1, 0 }, syms { 1, 1 }, syms { 2, 0 }, syms { 1, 1 });
+    first.merge(second);
+    ASSERT_EQ( first.get_result().correctChunk, all.get_result().correctChunk );
+    ASSERT_EQ( first.get_result().foundGuessed, all.get_result().foundGuessed );
+    ASSERT_EQ( first.get_result().foundCorrect, all.get_result().foundCorrect );
+    ASSERT_EQ( first.get_result().correctTags,  all.get_result().correctTags );
+    ASSERT_EQ( first.get_result().foundGuessedMap, all.get_result().foundGuessedMap );
+    ASSERT_DOUBLE_EQ( first.f1(), all.f1() );
+}
+
+// Particles that are their own span tags and lengths
+struct SpanModel {
+    struct particle {
+        nn::syms tags;
+        nn::syms lens;
+    };
+    struct tag_table {
+        size_t size() const { return 3; }
+        std::string val(size_t t) const { return t == 1 ? "PER" : "LOC"; }
+    };
+    struct corpus_t {
+        tag_table tagtab;
+        size_t get_other_key() const { return 0; }
+    };
+    corpus_t corpus;
+    const corpus_t& get_corpus() const { return corpus; }
+    nn::syms get_tags(const particle& p) const { return p.tags; }
+    nn::syms get_lens(const particle& p) const { return p.lens; }
+};
+
+TEST(SegmentF1Evaluator, ScoresSampledState) {
+    using namespace nn;
+    instances gold(200);
+    std::vector<SpanModel::particle> state(200);
+    for (size_t i = 0; i < gold.size(); ++i) {
+        gold[i].tags = syms { 1, 0, 2 };
+        gold[i].lens = syms { 2, 1, 1 };
+        state[i].tags = gold[i].tags;
+        state[i].lens = gold[i].lens;
+        // every fourth sentence misses its PER span
+        if (i % 4 == 0) state[i].tags[0] = 0;
+    }
+    SpanModel model;
+    SegmentF1Evaluator<SpanModel> eval(model, gold);
+    auto result = eval.evaluate(state.cbegin(), state.cend());
+    ASSERT_EQ( result.get_result().foundCorrect, 400 );
+    ASSERT_EQ( result.get_result().foundGuessed, 350 );
+    ASSERT_EQ( result.get_result().correctChunk, 350 );
+    ASSERT_DOUBLE_EQ( result.precision(), 100.0 );
+    ASSERT_DOUBLE_EQ( result.recall(), 87.5 );
+    eval(state.cbegin(), state.cend());
+}
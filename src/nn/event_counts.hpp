@@ -0,0 +1,76 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_EVENT_COUNTS_HPP__
+#define __NN_EVENT_COUNTS_HPP__
+
+#include <vector>
+#include <utility>
+#include <unordered_map>
+
+#include <boost/functional/hash.hpp>
+#include <boost/iterator/indirect_iterator.hpp>
+
+namespace nn {
+
+    // Occurrences of identical events, e.g. (context, symbol) pairs
+    // to be observed by a model. Events are kept in the order they
+    // were first added, so that observing them in bulk seats
+    // customers in a deterministic order close to that of the data.
+    template<typename Event>
+    class event_counts {
+        // boost::hash covers the nested vectors and pairs that events
+        // are made of
+        typedef std::unordered_map<Event, size_t, boost::hash<Event>> map_t;
+        typedef typename map_t::value_type entry;
+
+        map_t counts;
+        std::vector<const entry*> order; // nodes of counts are stable
+        size_t total {0};
+
+    public:
+        typedef boost::indirect_iterator<
+            typename std::vector<const entry*>::const_iterator> const_iterator;
+
+        event_counts() {}
+        event_counts(event_counts&&)                 = default;
+        event_counts& operator=(event_counts&&)      = default;
+        event_counts(event_counts const&)            = delete;
+        event_counts& operator=(event_counts const&) = delete;
+
+        void add(Event e, size_t count = 1) {
+            auto it = counts.find(e);
+            if (it == counts.end()) {
+                it = counts.emplace(std::move(e), 0).first;
+                order.push_back(&*it);
+            }
+            it->second += count;
+            total += count;
+        }
+
+        // Number of distinct events
+        size_t size()      const { return order.size(); }
+        // Number of occurrences
+        size_t get_total() const { return total;        }
+
+        const_iterator begin() const { return order.begin(); }
+        const_iterator end()   const { return order.end();   }
+    };
+}
+
+#endif
@@ -0,0 +1,360 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_EXPERIMENT_HPP__
+#define __NN_EXPERIMENT_HPP__
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <omp.h>
+
+#include <nn/log.hpp>
+#include <nn/data.hpp>
+#include <nn/timing.hpp>
+#include <nn/corpus_cache.hpp>
+#include <nn/evaluation.hpp>
+#include <nn/generic_filter.hpp>
+
+#include <cereal/archives/json.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+namespace nn {
+
+    // Collects the distinct (tag, phrase) spans of labeled instances
+    // as gazetteer entries, in first-seen order, the way
+    // scripts/replications.py builds its gazetteer file. Entries are
+    // handed out as a single instance, like that file once read.
+    template<typename Corpus>
+    class gazetteer_builder {
+        const Corpus& corpus;
+        std::set<std::pair<sym, phrase>> seen;
+        instance pending;
+
+    public:
+        explicit gazetteer_builder(const Corpus& _corpus) : corpus(_corpus) {}
+
+        // Only fully labeled instances give complete spans
+        void add(const instance& i) {
+            if (i.obs != Annotation::FULL) return;
+            auto it = i.words.begin();
+            for (size_t k = 0; k < i.tags.size(); ++k) {
+                phrase entry(it, it + i.lens[k]);
+                it += i.lens[k];
+                if (!seen.emplace(i.tags[k], entry).second) continue;
+                for (const auto& w : entry) {
+                    pending.chars.push_back(pending.words.empty()
+                                            ? corpus.get_bos_key()
+                                            : corpus.get_space_key());
+                    pending.chars.insert(pending.chars.end(),
+                                         w.begin() + 1, w.end() - 1);
+                    pending.words.push_back(w);
+                }
+                pending.tags.push_back(i.tags[k]);
+                pending.lens.push_back(i.lens[k]);
+            }
+        }
+
+        // Number of distinct entries added so far
+        size_t size() const { return seen.size(); }
+
+        // Entries added since the last call; no tags if there are none
+        instance take() {
+            instance ret;
+            if (pending.tags.empty()) return ret;
+            std::swap(ret, pending);
+            ret.chars.push_back(corpus.get_eos_key());
+            ret.words.push_back(corpus.get_eos_obs());
+            ret.obs = Annotation::FULL;
+            return ret;
+        }
+    };
+
+    struct experiment_settings {
+        std::string train_path;
+        std::string valid_path;
+        std::string model;
+        size_t replications {5};
+        std::vector<size_t> train_sizes;     // nested prefixes
+        std::vector<size_t> gazetteer_sizes; // instances, not entries
+        size_t nvalid {250};
+        size_t nparticles {16};
+        size_t seed {42};
+
+        template<class Archive>
+        void serialize(Archive & archive) {
+            archive(CEREAL_NVP(train_path), CEREAL_NVP(valid_path),
+                    CEREAL_NVP(model), CEREAL_NVP(replications),
+                    CEREAL_NVP(train_sizes), CEREAL_NVP(gazetteer_sizes),
+                    CEREAL_NVP(nvalid), CEREAL_NVP(nparticles),
+                    CEREAL_NVP(seed));
+        }
+    };
+
+    struct type_score {
+        std::string tag;
+        double precision {0};
+        double recall {0};
+        double f1 {0};
+
+        template<class Archive>
+        void serialize(Archive & archive) {
+            archive(CEREAL_NVP(tag), CEREAL_NVP(precision),
+                    CEREAL_NVP(recall), CEREAL_NVP(f1));
+        }
+    };
+
+    struct experiment_result {
+        size_t replication {0};
+        size_t train_size {0};
+        size_t gazetteer_size {0};
+        size_t gazetteer_entries {0};
+        size_t valid_size {0};
+        double precision {0};
+        double recall {0};
+        double f1 {0};
+        double accuracy {0};
+        double train_ms {0}; // shared by all gazetteer sizes of a model
+        double test_ms {0};
+        std::vector<type_score> types;
+
+        template<class Archive>
+        void serialize(Archive & archive) {
+            archive(CEREAL_NVP(replication), CEREAL_NVP(train_size),
+                    CEREAL_NVP(gazetteer_size), CEREAL_NVP(gazetteer_entries),
+                    CEREAL_NVP(valid_size), CEREAL_NVP(precision),
+                    CEREAL_NVP(recall), CEREAL_NVP(f1),
+                    CEREAL_NVP(accuracy), CEREAL_NVP(train_ms),
+                    CEREAL_NVP(test_ms), CEREAL_NVP(types));
+        }
+    };
+
+    // Replications x training-set sizes x gazetteer sizes, following
+    // scripts/replications.py: each replication shuffles the training
+    // and validation pools; training sets are prefixes of the shuffled
+    // pool, the gazetteer is made from the instances right after the
+    // largest training set, and the first nvalid validation instances
+    // are tagged.
+    //
+    // Both files are parsed once and shared by all configurations. One
+    // model is trained per (replication, training size); gazetteer
+    // sizes are swept in increasing order on that model, observing
+    // only the entries each size adds. Models are run concurrently,
+    // one per thread.
+    template<typename Model, typename Corpus>
+    class experiment_runner {
+        typedef typename Model::particle Particle;
+        typedef generic_filter<Model, Particle> Filter;
+
+        struct job {
+            size_t replication;
+            size_t train_size;
+            const std::vector<size_t>* train_order;
+            const std::vector<size_t>* valid_order;
+        };
+
+        const experiment_settings config;
+        const Corpus& prototype; // empty corpus, copied for each model
+        corpus_cache train_data;
+        corpus_cache valid_data;
+
+        std::vector<experiment_result> run_job(const job& j) const {
+            const auto max_train = config.train_sizes.back();
+            const auto max_gaz   = config.gazetteer_sizes.back();
+            const auto& order    = *j.train_order;
+
+            std::vector<size_t> train_idx(order.begin(),
+                                          order.begin() + j.train_size);
+            std::vector<size_t> gaz_idx(order.begin() + max_train,
+                                        order.begin() + max_train + max_gaz);
+            std::vector<size_t> valid_idx(j.valid_order->begin(),
+                                          j.valid_order->begin() + config.nvalid);
+
+            // Symbols in the largest gazetteer are in the alphabet for
+            // every gazetteer size, so the sweep can share one model.
+            Corpus corpus(prototype);
+            auto train = train_data.read_subset(corpus, train_idx);
+            auto gaz   = train_data.read_subset(corpus, gaz_idx);
+            corpus.symtab.freeze();
+            corpus.frozen = true;
+            corpus.tagtab.freeze();
+            auto valid = valid_data.read_subset(corpus, valid_idx);
+
+            auto start = now();
+            auto m = std::make_unique<Model>(corpus);
+            for (const auto& ex : train) {
+                m->observe(ex.tags, ex.lens, ex.words);
+            }
+            double train_ms = elapsed_ms(start, now());
+
+            std::vector<experiment_result> ret;
+            gazetteer_builder<Corpus> builder(corpus);
+            size_t nadded {0};
+            for (auto size : config.gazetteer_sizes) {
+                start = now();
+                while (nadded < size) builder.add(gaz[nadded++]);
+                auto delta = builder.take();
+                if (delta.tags.size() > 0) {
+                    m->observe_gazetteer(delta.tags, delta.lens, delta.words);
+                }
+                train_ms += elapsed_ms(start, now());
+
+                start = now();
+                typename Filter::settings filter_config;
+                filter_config.num_particles = config.nparticles;
+                Filter filter(filter_config, *m);
+                SegmentF1 eval(corpus.get_other_key(), corpus.tagtab.size());
+                for (const auto& i : valid) {
+                    auto p = filter.sample(i.words);
+                    eval.observe(m->get_tags(p), m->get_lens(p),
+                                 i.tags, i.lens);
+                }
+
+                experiment_result r;
+                r.replication       = j.replication;
+                r.train_size        = j.train_size;
+                r.gazetteer_size    = size;
+                r.gazetteer_entries = builder.size();
+                r.valid_size        = valid.size();
+                r.precision         = eval.precision();
+                r.recall            = eval.recall();
+                r.f1                = eval.f1();
+                r.accuracy          = eval.accuracy();
+                r.train_ms          = train_ms;
+                r.test_ms           = elapsed_ms(start, now());
+                const auto& result  = eval.get_result();
+                for (const auto& kv : result.foundCorrectMap) {
+                    auto t = kv.first;
+                    auto count = [t](const std::map<size_t,size_t>& m) {
+                        auto it = m.find(t);
+                        return it == m.end() ? 0.0
+                                             : static_cast<double>(it->second);
+                    };
+                    type_score s;
+                    s.tag = corpus.tagtab.val(t);
+                    double nguessed = count(result.foundGuessedMap);
+                    double ncorrect = count(result.correctChunkMap);
+                    s.precision = nguessed > 0 ? 100.0*ncorrect/nguessed : 0.0;
+                    s.recall    = 100.0*ncorrect/kv.second;
+                    s.f1 = (s.precision + s.recall) > 0
+                        ? 2*s.precision*s.recall/(s.precision + s.recall)
+                        : 0.0;
+                    r.types.push_back(s);
+                }
+                ret.push_back(r);
+            }
+            return ret;
+        }
+
+    public:
+        experiment_runner(experiment_settings _config,
+                          const Corpus& _prototype,
+                          const std::string& cache_dir)
+            : config(_config),
+              prototype(_prototype),
+              train_data(config.train_path, cache_dir,
+                         prototype.get_other_val(), prototype.unk_tag),
+              valid_data(config.valid_path, cache_dir,
+                         prototype.get_other_val(), prototype.unk_tag) {
+            CHECK(config.train_sizes.size() > 0) << "no training sizes";
+            CHECK(config.gazetteer_sizes.size() > 0) << "no gazetteer sizes";
+            CHECK(std::is_sorted(config.train_sizes.begin(),
+                                 config.train_sizes.end()));
+            CHECK(std::is_sorted(config.gazetteer_sizes.begin(),
+                                 config.gazetteer_sizes.end()));
+        }
+
+        std::vector<experiment_result> run() const {
+            const auto ntrain = config.train_sizes.back()
+                + config.gazetteer_sizes.back();
+            if (train_data.size() < ntrain || valid_data.size() < config.nvalid) {
+                LOG(FATAL) << "insufficient data: need " << ntrain
+                           << " training and " << config.nvalid
+                           << " validation instances, have "
+                           << train_data.size() << " and "
+                           << valid_data.size();
+                return std::vector<experiment_result>();
+            }
+
+            // Splits are drawn up front, from their own generator, so
+            // they depend only on the seed.
+            std::mt19937 gen(config.seed);
+            std::vector<size_t> train_order(train_data.size());
+            std::vector<size_t> valid_order(valid_data.size());
+            std::iota(train_order.begin(), train_order.end(), 0);
+            std::iota(valid_order.begin(), valid_order.end(), 0);
+            std::vector<std::vector<size_t>> train_orders;
+            std::vector<std::vector<size_t>> valid_orders;
+            for (size_t r = 0; r < config.replications; ++r) {
+                std::shuffle(train_order.begin(), train_order.end(), gen);
+                std::shuffle(valid_order.begin(), valid_order.end(), gen);
+                train_orders.push_back(train_order);
+                valid_orders.push_back(valid_order);
+            }
+
+            std::vector<job> jobs;
+            for (size_t r = 0; r < config.replications; ++r) {
+                for (auto n : config.train_sizes) {
+                    jobs.push_back({r, n, &train_orders[r], &valid_orders[r]});
+                }
+            }
+            LOG(INFO) << jobs.size() << " models x "
+                      << config.gazetteer_sizes.size()
+                      << " gazetteer sizes on "
+                      << omp_get_max_threads() << " threads";
+
+            std::vector<std::vector<experiment_result>> results(jobs.size());
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t i = 0; i < jobs.size(); ++i) {
+                results[i] = run_job(jobs[i]);
+                LOG(INFO) << "replication " << jobs[i].replication
+                          << " train size " << jobs[i].train_size
+                          << ": F1 = " << results[i].back().f1
+                          << " at gazetteer size "
+                          << results[i].back().gazetteer_size;
+            }
+
+            std::vector<experiment_result> ret;
+            for (const auto& rs : results) {
+                ret.insert(ret.end(), rs.begin(), rs.end());
+            }
+            return ret;
+        }
+
+        const experiment_settings& get_settings() const { return config; }
+    };
+
+    void write_experiment_report(const std::string& path,
+                                 const experiment_settings& settings,
+                                 const std::vector<experiment_result>& results) {
+        std::ofstream os(path);
+        CHECK(os.is_open()) << "problem opening: " << path;
+        cereal::JSONOutputArchive archive(os);
+        archive(cereal::make_nvp("settings", settings),
+                cereal::make_nvp("results", results));
+    }
+}
+
+#endif
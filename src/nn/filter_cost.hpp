@@ -0,0 +1,129 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_FILTER_COST_HPP__
+#define __NN_FILTER_COST_HPP__
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+namespace nn {
+
+    // Cost model for spreading particle filters over threads. The
+    // particles of one sentence can be moved on a team of threads,
+    // which wait for each other a few times per step, or whole
+    // sentences can be filtered on threads of their own, which never
+    // wait but need as many sentences as threads and finish with the
+    // longest one. The cost of a particle step is learned from the
+    // filters' own runs; that of a barrier is measured once.
+    class filter_cost_model {
+        const double barriers_per_step {4.0}; // see Filter::advance
+
+        size_t threads;
+        double barrier_ns;
+        double step_ns {0}; // mean time of one particle step
+        size_t nruns {0};
+
+    public:
+        filter_cost_model()
+            : threads(omp_get_max_threads()),
+              barrier_ns(measure_barrier_ns()) {}
+
+        filter_cost_model(size_t _threads, double _barrier_ns)
+            : threads(_threads), barrier_ns(_barrier_ns) {}
+
+        // Mean time of a barrier on a team of all threads, including
+        // the start of the parallel region. Inside a parallel region,
+        // where no team can be started, it's a guess.
+        static double measure_barrier_ns() {
+            static const double ns = [] {
+                if (omp_in_parallel() || omp_get_max_threads() < 2) return 1000.0;
+                const size_t n = 256;
+                auto start = std::chrono::steady_clock::now();
+                #pragma omp parallel
+                {
+                    for (size_t i = 0; i < n; ++i) {
+                        #pragma omp barrier
+                    }
+                }
+                std::chrono::duration<double, std::nano> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                return elapsed.count() / n;
+            }();
+            return ns;
+        }
+
+        // Records a run over the given number of particles and steps
+        // on nt threads, which took ns in all
+        void observe(size_t particles, size_t steps, size_t nt, double ns) {
+            if (particles == 0 || steps == 0) return;
+            auto sync = nt > 1 ? steps * barriers_per_step * barrier_ns : 0.0;
+            auto per_thread = (particles + nt - 1) / nt;
+            auto x = std::max(ns - sync, 0.0) / (steps * per_thread);
+            nruns ++;
+            step_ns += (x - step_ns) / nruns;
+        }
+
+        bool calibrated() const { return nruns > 0; }
+
+        double get_step_ns() const { return step_ns; }
+        double get_barrier_ns() const { return barrier_ns; }
+        size_t get_threads() const { return threads; }
+
+        double serial_ns(size_t particles, size_t steps) const {
+            return steps * particles * step_ns;
+        }
+
+        double team_ns(size_t particles, size_t steps) const {
+            auto per_thread = (particles + threads - 1) / threads;
+            return steps * (per_thread * step_ns + barriers_per_step * barrier_ns);
+        }
+
+        // Should a sentence be filtered on a team of threads rather
+        // than on one? Until a run has been seen, teams are used.
+        bool prefer_team(size_t particles, size_t steps) const {
+            if (threads < 2 || particles < 2) return false;
+            if (!calibrated()) return true;
+            return team_ns(particles, steps) < serial_ns(particles, steps);
+        }
+
+        // Should sentences of the given lengths be filtered on threads
+        // of their own, rather than one after another, each on a team
+        // if that pays off?
+        bool prefer_sentences(size_t particles,
+                              const std::vector<size_t>& lengths) const {
+            if (threads < 2 || lengths.size() < 2 || !calibrated()) return false;
+            double one_by_one = 0;
+            double work = 0;
+            double longest = 0;
+            for (auto len : lengths) {
+                auto serial = serial_ns(particles, len + 1);
+                auto team   = team_ns(particles, len + 1);
+                one_by_one += prefer_team(particles, len + 1) ? team : serial;
+                work       += serial;
+                longest     = std::max(longest, serial);
+            }
+            auto width = std::min(threads, lengths.size());
+            return std::max(work / width, longest) < one_by_one;
+        }
+    };
+}
+
+#endif
@@ -20,6 +20,9 @@
 #define __NN_FIXED_DEPTH_HPYP_HPP__
 
 #include <type_traits>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 #include <memory>
 #include <iostream>
 #include <unordered_map>
@@ -33,6 +36,7 @@
 #include <nn/discrete_distribution.hpp>
 #include <nn/node.hpp>
 #include <nn/restaurants.hpp>
+#include <nn/profile.hpp>
 
 #include <cereal/types/memory.hpp>
 #include <cereal/types/vector.hpp>
@@ -40,6 +44,20 @@
 
 namespace nn {
 
+// Outcome of a pruning pass (see FixedDepthHPYP::prune)
+struct prune_stats {
+    size_t nodes_before     {0};
+    size_t nodes_after      {0};
+    size_t customers_folded {0}; // moved into parent restaurants
+
+    prune_stats& operator+=(const prune_stats& other) {
+        nodes_before     += other.nodes_before;
+        nodes_after      += other.nodes_after;
+        customers_folded += other.customers_folded;
+        return *this;
+    }
+};
+
 template<typename T,
          typename C,
          typename BaseMeasure,
@@ -53,6 +71,12 @@ struct FixedDepthHPYP {
     typedef std::vector<C> Context;
     typedef hash_node<C, Restaurant> Node;
 
+    // Nodes along a context path; index 1 is the root (see
+    // fill_node_array). Only the existing part of the path is stored.
+    typedef std::array<Node*, MAX_DEPTH+1> NodeChain;
+
+    static constexpr size_t max_depth {MAX_DEPTH};
+
     // Work storage
     // +1 for base distribution; note: 0 index is never used
     std::array<Node*, MAX_DEPTH+1> node_storage;
@@ -208,6 +232,7 @@ struct FixedDepthHPYP {
     void observe(typename Context::const_iterator start,
                  typename Context::const_iterator stop,
                  T obs) {
+        NN_PROFILE_SCOPE("hpyp.observe");
         fill_node_array(start, stop);
         fill_prob_array(obs);
         size_t depth = node_storage_size - 1;
@@ -230,6 +255,47 @@ struct FixedDepthHPYP {
         observe(prefix.begin(), prefix.end(), obs);
     }
 
+    // Seats count customers with the same context and observation,
+    // one after the other as count calls to observe would, but walks
+    // the context tree once. A customer changes the predictives of
+    // the restaurants it was seated in, so only those that are the
+    // base of a deeper restaurant are recomputed, and none when it
+    // joins a table of the deepest one.
+    void observe(typename Context::const_iterator start,
+                 typename Context::const_iterator stop,
+                 T obs, size_t count) {
+        if (count == 0) return;
+        NN_PROFILE_SCOPE("hpyp.observe_bulk");
+        NN_PROFILE_COUNT("customers", count);
+        fill_node_array(start, stop);
+        fill_prob_array(obs);
+        for (size_t n = 0; n < count; ++n) {
+            size_t depth = node_storage_size - 1;
+            bool new_table;
+            do {
+                new_table = restaurant.addCustomer(
+                                                   node_storage[depth]->get_payload(),
+                                                   obs,
+                                                   prob_storage[depth-1],
+                                                   discounts[depth],
+                                                   alphas[depth]
+                                                   );
+                if (new_table) total_n_tables ++;
+                depth --;
+            } while(depth > 0 && new_table);
+            total_n_customers ++;
+            for (size_t d = depth + 1; d + 1 < node_storage_size; ++d) {
+                prob_storage[d] = pred(node_storage[d], obs,
+                                       prob_storage[d-1],
+                                       discounts[d], alphas[d]);
+            }
+        }
+    }
+
+    void observe(const Context& prefix, T obs, size_t count) {
+        observe(prefix.begin(), prefix.end(), obs, count);
+    }
+
     void debug_print_restaurants(const Context& prefix, T obs) {
         debug_print_restaurants(prefix.begin(), prefix.end(), obs);
     }
@@ -237,6 +303,7 @@ struct FixedDepthHPYP {
     void remove(typename Context::const_iterator start,
                 typename Context::const_iterator stop,
                 T obs) {
+        NN_PROFILE_SCOPE("hpyp.remove");
         fill_node_array(start, stop);
         bool removed_table;
         size_t depth = node_storage_size - 1;
@@ -261,6 +328,7 @@ struct FixedDepthHPYP {
                 typename Context::const_iterator stop,
                 T obs)
         const {
+        NN_PROFILE_SCOPE("hpyp.prob");
         //LOG(INFO) << "getting base prob...";
         double p = H.prob(obs);
         //LOG(INFO) << "base prob: " << p;
@@ -295,6 +363,45 @@ struct FixedDepthHPYP {
         return p;
     }
 
+    // Look up (without creating) the nodes for the given context;
+    // returns the chain size. Nodes past the deepest existing context
+    // would contribute nothing to the predictive, so the walk stops
+    // there.
+    size_t find_node_chain(typename Context::const_iterator start,
+                           typename Context::const_iterator stop,
+                           NodeChain& chain) const {
+        size_t depth = 1;
+        Node* node = getRoot();
+        chain[depth++] = node;
+        if (start == stop) return depth;
+        auto riter = stop;
+        --riter;
+        while (true) {
+            node = node->get_or_null(*riter);
+            if (node == nullptr) break;
+            chain[depth++] = node;
+            if (depth == MAX_DEPTH || riter == start) break;
+            --riter;
+        }
+        return depth;
+    }
+
+    // Same as prob(start, stop, obs) but reuses a chain found with
+    // find_node_chain, so several symbols can be scored in the same
+    // context with a single walk of the tree.
+    double prob(const NodeChain& chain, size_t chain_size, T obs) const {
+        NN_PROFILE_SCOPE("hpyp.prob");
+        double p = H.prob(obs);
+        for (size_t depth = 1; depth < chain_size; ++depth) {
+            p = pred(chain[depth], obs, p, discounts.at(depth), alphas.at(depth));
+        }
+        return p;
+    }
+
+    double log_prob(const NodeChain& chain, size_t chain_size, T obs) const {
+        return log(prob(chain, chain_size, obs));
+    }
+
     double log_prob(typename Context::const_iterator start,
                     typename Context::const_iterator stop,
                     T obs)
@@ -324,6 +431,55 @@ struct FixedDepthHPYP {
         return log(prob(prefix, obs));
     }
 
+    // Adds the seating arrangements of a model trained on other data
+    // (e.g. another shard of a corpus) with the same configuration.
+    // Context symbols and dishes of other are translated with
+    // context_map and dish_map. The result is the state a single
+    // model would be in had it seen both data sets with the same
+    // table choices, so all counts stay consistent.
+    template<typename ContextMap, typename DishMap>
+    void merge(const FixedDepthHPYP& other,
+               const ContextMap& context_map,
+               const DishMap& dish_map) {
+        CHECK(discounts == other.discounts) << "discount mismatch";
+        CHECK(alphas == other.alphas)       << "concentration mismatch";
+        H.merge(other.H, dish_map);
+        root->merge(*other.root, context_map,
+                    [this, &dish_map](Node& dst, const Node& src) {
+                        restaurant.merge(dst.get_payload(),
+                                         src.get_payload(),
+                                         dish_map);
+                    });
+        total_n_customers += other.total_n_customers;
+        total_n_tables    += other.total_n_tables;
+    }
+
+    size_t num_nodes() const { return root->size(); }
+
+    // Removes leaf contexts that carry little information beyond
+    // their parent context, innermost first. A leaf is removed if
+    //
+    //   c * KL(P_leaf || P_parent) < threshold,
+    //
+    // where c is its number of customers and P the predictive
+    // distributions in the two contexts; its customers are folded
+    // into the parent restaurant, so the counts stay consistent and
+    // predictions in that context fall back to the parent. Nodes
+    // without customers are always removed, which doesn't change any
+    // prediction.
+    //
+    // Folded customers can no longer be removed, so a positive
+    // threshold is for trained models only; threshold = 0 just
+    // compacts the tree and is safe to use at any time.
+    prune_stats prune(double threshold) {
+        prune_stats stats;
+        stats.nodes_before = num_nodes();
+        std::vector<Node*> path { nullptr, root.get() }; // indexed by depth
+        prune(path, threshold, stats);
+        stats.nodes_after = num_nodes();
+        return stats;
+    }
+
     BaseMeasure get_base() const {
         return H;
     }
@@ -336,6 +492,60 @@ struct FixedDepthHPYP {
     void serialize(Archive & archive) {
         archive( discounts, alphas, H, root );
     }
+
+private:
+    // c * KL(P_node || P_parent) for the last node of path. Dishes
+    // without customers in the node get the parent's probability
+    // scaled by (a + d*t)/(a + c), so their terms are summed in
+    // closed form.
+    double weighted_divergence(const std::vector<Node*>& path) const {
+        size_t depth = path.size() - 1;
+        auto payload = path.back()->get_payload();
+        double c = restaurant.getC(payload);
+        double t = restaurant.getT(payload);
+        double d = discounts.at(depth);
+        double a = alphas.at(depth);
+        double kl = 0.0;
+        double seated = 0.0; // parent mass of the node's dishes
+        for (auto w : restaurant.getTypeVector(payload)) {
+            if (restaurant.getC(payload, w) == 0) continue;
+            double p = H.prob(w);
+            for (size_t k = 1; k < depth; ++k) {
+                p = pred(path[k], w, p, discounts.at(k), alphas.at(k));
+            }
+            double q = pred(path.back(), w, p, d, a);
+            kl += q * log(q / p);
+            seated += p;
+        }
+        double r = (a + d*t) / (a + c);
+        kl += r * std::max(0.0, 1.0 - seated) * log(r);
+        return c * kl;
+    }
+
+    void prune(std::vector<Node*>& path, double threshold, prune_stats& stats) {
+        Node* node = path.back();
+        std::vector<C> pruned;
+        for (const auto& kv : node->get_kids()) {
+            Node* kid = kv.second.get();
+            path.push_back(kid);
+            prune(path, threshold, stats);
+            bool empty = restaurant.getC(kid->get_payload()) == 0;
+            bool remove = kid->is_leaf() &&
+                (empty || (threshold > 0 && weighted_divergence(path) < threshold));
+            path.pop_back();
+            if (!remove) continue;
+            if (!empty) {
+                auto c = restaurant.getC(kid->get_payload());
+                auto t = restaurant.getT(kid->get_payload());
+                restaurant.fold(node->get_payload(), kid->get_payload());
+                stats.customers_folded += c - t;
+                total_n_tables -= t;
+            }
+            pruned.push_back(kv.first);
+        }
+        for (const auto& key : pruned) node->remove(key);
+        restaurant.compact(node->get_payload());
+    }
 };
 
 }
@@ -80,6 +80,127 @@ TEST(LogFixedDepthHPYP, CerealWorks) {
     }
 }
 
+TEST(FixedDepthHPYP, MergeAddsShards) {
+    using namespace nn;
+    typedef HashIntegralMeasure<size_t>        Base;
+    typedef FixedDepthHPYP<size_t,size_t,Base> Model;
+    rng::init();
+    Base H;
+    for(size_t i=0; i<5; ++i) H.add(i, 1.0);
+    auto identity = [](size_t x) { return x; };
+    auto reverse  = [](size_t x) { return 4 - x; };
+
+    std::vector<size_t> shard1 { 0, 1, 2, 2, 1, 3 };
+    std::vector<size_t> shard2 { 0, 1, 2, 3, 4, 4, 1 };
+    Model model1(H), model2(H);
+    for(auto it = shard1.begin()+1; it != shard1.end(); ++it) {
+        model1.observe(shard1.begin(), it, *it);
+    }
+    for(auto it = shard2.begin()+1; it != shard2.end(); ++it) {
+        model2.observe(shard2.begin(), it, *it);
+    }
+
+    // Merging into an empty model reproduces the shard exactly, also
+    // under a relabeling of the symbols
+    Model copy(H), reversed(H);
+    copy.merge(model2, identity, identity);
+    reversed.merge(model2, reverse, reverse);
+    std::vector<size_t> test { 0, 1, 2, 3, 4 };
+    std::vector<size_t> test_reversed { 4, 3, 2, 1, 0 };
+    for(size_t i = 1; i < test.size(); ++i) {
+        auto lp = model2.log_prob(test.begin(), test.begin()+i, test[i]);
+        ASSERT_EQ(lp, copy.log_prob(test.begin(), test.begin()+i, test[i]));
+        ASSERT_DOUBLE_EQ(lp, reversed.log_prob(test_reversed.begin(),
+                                               test_reversed.begin()+i,
+                                               test_reversed[i]));
+    }
+
+    auto root_c = model1.rootCustomers() + model2.rootCustomers();
+    auto root_t = model1.rootTables()    + model2.rootTables();
+    auto total_t = model1.totalTables()  + model2.totalTables();
+    model1.merge(model2, identity, identity);
+    ASSERT_EQ(model1.totalCustomers(), shard1.size() + shard2.size() - 2);
+    ASSERT_EQ(model1.totalTables(),    total_t);
+    ASSERT_EQ(model1.rootCustomers(),  root_c);
+    ASSERT_EQ(model1.rootTables(),     root_t);
+}
+
+TEST(FixedDepthHPYP, PruneKeepsCounts) {
+    using namespace nn;
+    typedef HashIntegralMeasure<size_t>        Base;
+    typedef FixedDepthHPYP<size_t,size_t,Base> Model;
+    rng::init();
+    Base H;
+    for(size_t i=0; i<5; ++i) H.add(i, 1.0);
+    Model model(H);
+    std::vector<size_t> obs { 0, 1, 2, 2, 1, 3, 0, 1, 2, 3, 4, 4, 0, 1, 2 };
+    for(auto it = obs.begin()+1; it != obs.end(); ++it) {
+        model.observe(obs.begin(), it, *it);
+    }
+
+    // Removing the last observation leaves empty contexts behind,
+    // which compaction drops without changing any prediction. (The
+    // removal needn't undo the seating exactly, so predictions are
+    // compared from after it.)
+    model.observe(obs.begin(), obs.end(), 3);
+    auto nodes = model.num_nodes();
+    model.remove(obs.begin(), obs.end(), 3);
+    std::vector<size_t> test { 0, 1, 2, 3, 4 };
+    std::vector<double> before;
+    for(auto it = test.begin()+1; it != test.end(); ++it) {
+        before.push_back(model.prob(test.begin(), it, *it));
+    }
+    auto stats = model.prune(0.0);
+    ASSERT_EQ(stats.nodes_before, nodes);
+    ASSERT_LT(stats.nodes_after, nodes);
+    ASSERT_EQ(stats.customers_folded, 0);
+    for(auto it = test.begin()+1; it != test.end(); ++it) {
+        ASSERT_DOUBLE_EQ(before[it - test.begin() - 1],
+                         model.prob(test.begin(), it, *it));
+    }
+
+    // Pruning everything folds all customers into the root
+    auto c = model.totalCustomers();
+    stats = model.prune(1e9);
+    ASSERT_EQ(stats.nodes_after, 1);
+    ASSERT_EQ(model.rootCustomers(), c);
+    ASSERT_TRUE(model.restaurant.checkConsistency(model.getRoot()->get_payload()));
+}
+
+TEST(FixedDepthHPYP, WeightedObserveMatchesSequential) {
+    using namespace nn;
+    typedef HashIntegralMeasure<size_t>        Base;
+    typedef FixedDepthHPYP<size_t,size_t,Base> Model;
+    rng::init();
+    Base H;
+    for(size_t i=0; i<5; ++i) H.add(i, 1.0);
+    Model model1(H);
+    Model model2(H);
+    std::vector<size_t> ctx1 { 0, 1, 2 };
+    std::vector<size_t> ctx2 { 3, 1, 2 };
+
+    // with the same draws, the customers are seated at the same tables
+    rng::engines[0] = rng::get_prng(7);
+    for(size_t n=0; n<50; ++n) model1.observe(ctx1, 4);
+    for(size_t n=0; n<20; ++n) model1.observe(ctx2, 4);
+    model1.observe(ctx2, 0);
+    rng::engines[0] = rng::get_prng(7);
+    model2.observe(ctx1, 4, 50);
+    model2.observe(ctx2, 4, 20);
+    model2.observe(ctx2, 0, 1);
+    model2.observe(ctx2, 1, 0);
+
+    ASSERT_EQ(model2.totalCustomers(), 71);
+    ASSERT_EQ(model1.totalTables(),    model2.totalTables());
+    ASSERT_EQ(model1.rootCustomers(),  model2.rootCustomers());
+    ASSERT_EQ(model1.rootTables(),     model2.rootTables());
+    for (const auto& ctx : { ctx1, ctx2 }) {
+        for(size_t i=0; i<5; ++i) {
+            ASSERT_DOUBLE_EQ(model1.prob(ctx, i), model2.prob(ctx, i));
+        }
+    }
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
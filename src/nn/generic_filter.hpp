@@ -21,6 +21,7 @@
 
 #include <nn/rng.hpp>
 #include <nn/csmc.hpp>
+#include <nn/tag_constraints.hpp>
 
 namespace nn {
     typedef std::vector<size_t>      Observation;
@@ -33,6 +34,22 @@ namespace nn {
         const Model& model;
         double zero_frac;
 
+        // Known labels of the sentence being sampled, if any
+        tag_constraints constraints;
+
+        // What the proposal precomputes for the sentence being
+        // sampled, e.g. to look ahead of the current observation
+        typename Model::sentence_info info;
+
+        void constrain(const std::vector<size_t>& tags,
+                       const std::vector<size_t>& lens) {
+            const auto& corpus = model.get_corpus();
+            auto unk = corpus.tagtab.has_key(corpus.unk_tag)
+                ? corpus.tagtab.key(corpus.unk_tag)
+                : tag_constraints::NO_TAG;
+            constraints = tag_constraints(tags, lens, unk);
+        }
+
     public:
         generic_filter(
             typename ConditionalFilter<Particle, Observation>::settings _config,
@@ -57,7 +74,25 @@ namespace nn {
         // Advance particle with the given observation, returning the
         // log incremental importance weight.
         double move_p(Particle& p, const Observation& obs) override {
-            return model.extend(p, obs);
+            return model.extend(p, obs, constraints, info);
+        }
+
+        // The particles of a group share the work of the proposal
+        // (see Model::extend_copies)
+        void move_group(const size_t* members, size_t n,
+                        const Observation& obs, size_t* same) override {
+            if (n == 1) {
+                auto m = members[0];
+                this->sys.log_weight[m] += move_p(this->sys.particle[m], obs);
+                same[0] = 0;
+                return;
+            }
+            std::vector<double> log_w(n);
+            model.extend_copies(this->sys.particle, members, n, obs,
+                                constraints, info, log_w.data(), same);
+            for (size_t k = 0; k < n; ++k) {
+                this->sys.log_weight[members[k]] += log_w[k];
+            }
         }
 
         void swap_complete_particle(Particle& dst,
@@ -74,11 +109,28 @@ namespace nn {
         double incr_p(Particle& p,
                       const Observation& obs,
                       size_t t) override {
-            return model.score(p, obs, t);
+            return model.score(p, obs, t, constraints, info);
+        }
+
+        void truncate_particle(Particle& p, size_t t) override {
+            model.truncate(p, t);
+        }
+
+        double continuation_p(const Particle& p, const Particle& ref,
+                              const std::vector<Observation>& obs,
+                              size_t t) override {
+            return model.log_continuation(p, ref, obs, t);
+        }
+
+        void splice_particle(Particle& dst, const Particle& p,
+                             const Particle& ref, size_t t) override {
+            model.splice(dst, p, ref, t);
         }
 
         // e.g., precompute some probabilities
-        void set_up(const std::vector<Observation>& obs) override {}
+        void set_up(const std::vector<Observation>& obs) override {
+            info = model.prepare(obs);
+        }
 
         Particle sample() {
             auto m = nn::sample_unnormalized_lnpdf(this->sys.log_weight,
@@ -95,7 +147,7 @@ namespace nn {
                 return model.make_particle(tags, lens);
             }
             case Annotation::SEMI: {
-                return sample(tags, obs);
+                return sample(tags, lens, obs);
             }
             case Annotation::NONE: {
                 return sample(obs);
@@ -106,13 +158,14 @@ namespace nn {
             }
         }
 
-        // some of the tags may be unk
+        // Some of the tags may be unk: samples a segmentation that
+        // agrees with the known ones
         Particle sample(const std::vector<size_t>& tags,
+                        const std::vector<size_t>& lens,
                         const Observations& obs) {
-
-            Particle p;
-            // TODO
-            CHECK(false) << "implement this (sample with some unks)";
+            constrain(tags, lens);
+            auto p = sample(obs);
+            constraints = tag_constraints();
             return p;
         }
 
@@ -145,17 +198,20 @@ namespace nn {
             return this->sys.particle[m];
         }
 
+        // The reference particle p must agree with the known tags
         Particle conditional_sample(const Particle &p,
                                     const std::vector<size_t>& tags,
+                                    const std::vector<size_t>& lens,
                                     const Observations& obs) {
-            CHECK(false) << "unimplemented";
-            auto m = nn::sample_unnormalized_lnpdf(this->sys.log_weight,
-                                                   nn::rng::get());
-            return this->sys.particle[m];
+            constrain(tags, lens);
+            auto ret = conditional_sample(p, obs);
+            constraints = tag_constraints();
+            return ret;
         }
 
         Particle conditional_sample(const Particle &p,
                                     const std::vector<size_t>& tags,
+                                    const std::vector<size_t>& lens,
                                     const Observations& obs,
                                     Annotation a) {
                 switch(a) {
@@ -163,7 +219,7 @@ namespace nn {
                     return p;
                 }
                 case Annotation::SEMI: {
-                    return conditional_sample(p, tags, obs);
+                    return conditional_sample(p, tags, lens, obs);
                 }
                 case Annotation::NONE: {
                     return conditional_sample(p, obs);
@@ -19,6 +19,7 @@
 #ifndef __NN_HIDDEN_SEQUENCE_MEMOIZER_HPP__
 #define __NN_HIDDEN_SEQUENCE_MEMOIZER_HPP__
 
+#include <map>
 #include <vector>
 
 #include <nn/data.hpp>
@@ -27,6 +28,8 @@
 #include <nn/mutable_symtab.hpp>
 #include <nn/adapted_seq_model.hpp>
 #include <nn/fixed_depth_hpyp.hpp>
+#include <nn/tag_constraints.hpp>
+#include <nn/event_counts.hpp>
 
 #include <cereal/archives/binary.hpp>
 
@@ -146,6 +149,8 @@ namespace nn {
             LOG(INFO) << "[HSM] context idx = " << context_idx;
 
             for(auto tag : tagtab.get_key_set()) {
+                // Words of unknown label are imputed by the filter
+                if (corpus.is_unk_tag(tag)) continue;
                 emit_param.alpha    = emit_adaptor_alpha.at(tag);
                 emit_param.discount = emit_adaptor_discount.at(tag);
                 add_emission_model(tag, emit_param);
@@ -156,6 +161,7 @@ namespace nn {
             // Prior
             base_type H;
             for(auto tag=0; tag < tagtab.size(); ++tag) {
+                if (!E.count(tag)) continue;
                 auto idx = tag_idx(tag, TType::START);
                 if(tag == context_tag) {
                     H.add(idx, 20.0);  // "other"
@@ -166,7 +172,7 @@ namespace nn {
                     H.add(idx, 2.5);
                 }
             }
-            CHECK(H.cardinality() == tagtab.size()*2);
+            CHECK(H.cardinality() == num_idx*2);
 
             auto tran_model = std::make_unique<tran_type>( H );
             add_transition_model( std::move(tran_model) );
@@ -179,7 +185,7 @@ namespace nn {
         auto get_eos_idx() -> decltype(eos_idx) const { return eos_idx;  }
         size_t num_emission_model()             const { return E.size(); }
 
-        data_type get_corpus() const {
+        const data_type& get_corpus() const {
             return corpus;
         }
 
@@ -441,6 +447,82 @@ namespace nn {
             ++n_transition_observed;
         }
 
+        // Events of many labeled sentences and gazetteer entries,
+        // counted so that each distinct event is observed once; see
+        // segmental_sequence_memoizer::observations
+        struct observations {
+            event_counts<std::pair<phrase, sym>> transitions;
+            std::map<sym, event_counts<syms>> words; // per tag
+            std::map<sym, typename emit_type::base_model::counts> gazetteer;
+        };
+
+        // Adds the events of a labeled sentence to obs; the input is
+        // the same as for observe
+        void count(const syms& tags, const syms& lens, const phrase& words,
+                   observations& obs) const {
+            particle p = make_particle(tags, lens);
+            CHECK(p.tags.size() == words.size()-1) << "size mismatch";
+            phrase context {BOS};
+            for(size_t i=0; i<p.tags.size(); ++i) {
+                auto idx  = p.tags.at(i);
+                auto word = words.at(i);
+                obs.transitions.add(std::make_pair(recent(context), idx));
+                update_context(context, idx, word);
+                obs.words[idx_tag(idx)].add(word);
+            }
+            obs.transitions.add(std::make_pair(recent(context), eos_idx));
+        }
+
+        // Adds the events of a gazetteer entry to obs, as
+        // observe_gazetteer would observe them
+        void count_gazetteer(const syms& tags, const syms& lens,
+                             const phrase& words, observations& obs) const {
+            auto it = words.begin();
+            for(size_t i=0; i<tags.size(); ++i) {
+                auto tag = tags.at(i);
+                auto len = lens.at(i);
+                auto start_idx = tag_idx(tag, TType::START);
+                for(size_t j=0; j<len; ++j) {
+                    get_emission_model(tag)->get_base()->count(*it,
+                                                               obs.gazetteer[tag]);
+                    it = std::next(it);
+                }
+                if (tag == context_tag) continue;
+                phrase context {start_idx};
+                auto extend_idx = tag_idx(tag, TType::EXTEND);
+                for(size_t j=1; j<len; ++j) {
+                    obs.transitions.add(std::make_pair(recent(context), extend_idx));
+                    syms tag_seq { extend_idx };
+                    context.push_back(tag_seq);
+                }
+                obs.transitions.add(std::make_pair(recent(context), context_idx));
+            }
+            CHECK(it == words.end()-1);
+        }
+
+        void observe(const observations& obs) {
+            for (const auto& kv : obs.gazetteer) {
+                get_emission_model(kv.first)->get_base()->observe(kv.second);
+            }
+            for (const auto& e : obs.transitions) {
+                T->observe(e.first.first, e.first.second, e.second);
+                n_transition_observed += e.second;
+            }
+            for (const auto& kv : obs.words) {
+                auto emit = get_emission_model(kv.first);
+                for (const auto& e : kv.second) {
+                    emit->observe(e.first, e.second);
+                    n_emission_observed += e.second;
+                }
+            }
+        }
+
+        // The part of a context the transition model conditions on
+        phrase recent(const phrase& context) const {
+            if (context.size() <= tran_type::max_depth) return context;
+            return phrase(context.end() - tran_type::max_depth, context.end());
+        }
+
         void log_stats() {
             LOG(INFO) << "n_transition_observed = " << n_transition_observed;
             LOG(INFO) << "n_emission_observed   = " << n_emission_observed;
@@ -474,6 +556,7 @@ namespace nn {
             unnormalized_discrete_distribution<size_t> ret;
             auto prev_tag = idx_tag(p.tags.back());
             for(auto tag : tagtab.get_key_set()) {
+                if (!E.count(tag)) continue; // the unknown tag
                 auto idx = tag_idx(tag, TType::START);
                 ret.push_back_log_prob(idx,
                                        T->log_prob(p.context, idx));
@@ -518,24 +601,41 @@ namespace nn {
             LOG(INFO) << tags;
         }
 
-        double baseline_extend(particle& p, const syms& obs) const {
-            if(obs == EOS) {
-                return T->log_prob(p.context, eos_idx);
-            }
+        // Is the transition to idx at word t allowed by the known labels?
+        bool allows(const tag_constraints& cons, size_t t, size_t idx) const {
+            if (!cons.allows(t, idx_tag(idx))) return false;
+            return idx % 2 == 0 ? cons.may_begin(t) : cons.may_continue(t);
+        }
+
+        // The proposal for the tag of obs, into Q; returns its
+        // normalizer, which is the incremental weight
+        double baseline_prop(particle& p, const syms& obs,
+                             const tag_constraints& cons,
+                             unnormalized_discrete_distribution<size_t>& Q) const {
+            auto t   = p.tags.size();
             auto p_t = tran_dist(p);
-            decltype(p_t) p_e;
-            decltype(p_t) Q;
             auto lnZ { -std::numeric_limits<double>::infinity() };
             for(auto i = 0; i < p_t.size(); ++i) {
                 auto idx = p_t.get_type(i);
+                if (!allows(cons, t, idx)) continue;
                 auto ltp = p_t.get_log_weight(i);
                 auto tag = idx_tag(idx);
                 auto lep = E.at(tag)->log_prob(obs);
-                p_e.push_back_log_prob(idx, lep);
                 auto lw = ltp + lep;
                 lnZ = log_add(lnZ, lw);
                 Q.push_back_log_prob(idx, lw);
             }
+            CHECK(Q.size() > 0) << "no tag allowed at word " << t;
+            return lnZ;
+        }
+
+        double baseline_extend(particle& p, const syms& obs,
+                               const tag_constraints& cons) const {
+            if(obs == EOS) {
+                return T->log_prob(p.context, eos_idx);
+            }
+            unnormalized_discrete_distribution<size_t> Q;
+            auto lnZ = baseline_prop(p, obs, cons, Q);
             auto i = Q.sample_index();
             auto idx = Q.get_type(i);
             update_context(p.context, idx, obs);
@@ -548,9 +648,18 @@ namespace nn {
 
         void log_stats() const {}
 
+        // Prunes the context trees of the transition and emission
+        // models; see FixedDepthHPYP::prune
+        prune_stats prune(double threshold) {
+            auto stats = T->prune(threshold);
+            for (auto& kv : E) stats += kv.second->prune(threshold);
+            return stats;
+        }
+
         double baseline_score(particle & p,
                               const syms& obs,
-                              size_t t) const {
+                              size_t t,
+                              const tag_constraints& cons) const {
             if(obs == EOS) {
                 return T->log_prob(p.context, eos_idx);
             }
@@ -558,6 +667,7 @@ namespace nn {
             auto lnZ { -std::numeric_limits<double>::infinity() };
             for(auto i = 0; i < p_t.size(); ++i) {
                 auto idx = p_t.get_type(i);
+                if (!allows(cons, t, idx)) continue;
                 auto tag = idx_tag(idx);
                 auto ltp = p_t.get_log_weight(i);
                 auto lep = E.at(tag)->log_prob(obs);
@@ -574,26 +684,127 @@ namespace nn {
             dst.tags = src.tags;
         }
 
-        double extend(particle& p, const syms& obs) const {
+        // Ancestor sampling (see ConditionalFilter): log probability
+        // of the tags of ref after word t given the history of p, up
+        // to the emissions and the transitions whose context doesn't
+        // reach back into p, which are the same for every p. -inf if
+        // the tag of word t+1 extends an entity that p doesn't have at
+        // word t. (The reference p has the tags of the whole sentence.)
+        double log_continuation(const particle& p, const particle& ref,
+                                const phrase& obs, size_t t) const {
+            auto k = t + 1;
+            if (k < ref.tags.size()) {
+                auto idx = ref.tags[k];
+                bool extends = idx % 2 == 1;
+                if (extends && idx_tag(p.tags.at(t)) != idx_tag(idx)) {
+                    return NEG_INF;
+                }
+            }
+            auto context = recent(p.context);
+            double ret = 0.0;
+            for (size_t n = 0; n < tran_type::max_depth; ++n, ++k) {
+                if (k == ref.tags.size()) {
+                    return ret + T->log_prob(context, eos_idx);
+                }
+                ret += T->log_prob(context, ref.tags[k]);
+                update_context(context, ref.tags[k], obs.at(k));
+            }
+            return ret;
+        }
+
+        // The reference p as it was after word t
+        void truncate(particle& p, size_t t) const {
+            p.tags.resize(t + 1);
+        }
+
+        // The history of p through word t, followed by the tags of ref
+        // after it
+        void splice(particle& dst, const particle& p, const particle& ref,
+                    size_t t) const {
+            dst = p;
+            dst.tags.insert(dst.tags.end(), ref.tags.begin() + t + 1,
+                            ref.tags.end());
+        }
+
+        double extend(particle& p, const syms& obs,
+                      const tag_constraints& cons) const {
             switch(prop) {
             case HSMProposal::BASELINE: {
-                return baseline_extend(p, obs);
+                return baseline_extend(p, obs, cons);
             }
             default: CHECK(false) << "unsupported proposal";
             };
             CHECK(false) << "sanity";
         }
 
-        double score(particle& p, const syms& obs, size_t t) const {
+        double extend(particle& p, const syms& obs) const {
+            return extend(p, obs, tag_constraints());
+        }
+
+        // The proposal doesn't look past obs, so there is nothing to
+        // precompute for a sentence
+        struct sentence_info {};
+
+        sentence_info prepare(const phrase&) const { return {}; }
+
+        // Extends the particles ps[members[0]], ..., ps[members[n-1]],
+        // which are in the same state, as extend() would each of them,
+        // drawing their tags from one proposal. same[k] is the first
+        // k' <= k whose particle drew the same tag as particle k.
+        void extend_copies(std::vector<particle>& ps, const size_t* members,
+                           size_t n, const syms& obs,
+                           const tag_constraints& cons,
+                           const sentence_info&,
+                           double* log_w, size_t* same) const {
+            CHECK(prop == HSMProposal::BASELINE) << "unsupported proposal";
+            auto& p = ps[members[0]];
+            if (obs == EOS) {
+                auto lw = T->log_prob(p.context, eos_idx);
+                for (size_t k = 0; k < n; ++k) { log_w[k] = lw; same[k] = 0; }
+                return;
+            }
+            unnormalized_discrete_distribution<size_t> Q;
+            auto lnZ = baseline_prop(p, obs, cons, Q);
+            std::vector<size_t> first(Q.size(), n);
+            for (size_t k = 0; k < n; ++k) {
+                auto& x = ps[members[k]];
+                auto i = Q.sample_index();
+                if (first[i] == n) first[i] = k;
+                auto idx = Q.get_type(i);
+                update_context(x.context, idx, obs);
+                x.add(idx);
+                log_w[k] = lnZ;
+                same[k] = first[i];
+            }
+        }
+
+        double extend(particle& p, const syms& obs,
+                      const tag_constraints& cons,
+                      const sentence_info&) const {
+            return extend(p, obs, cons);
+        }
+
+        double score(particle& p, const syms& obs, size_t t,
+                     const tag_constraints& cons) const {
             switch(prop) {
             case HSMProposal::BASELINE: {
-                return baseline_score(p, obs, t);
+                return baseline_score(p, obs, t, cons);
             }
             default: CHECK(false) << "unsupported proposal";
             };
             CHECK(false) << "sanity";
         }
 
+        double score(particle& p, const syms& obs, size_t t) const {
+            return score(p, obs, t, tag_constraints());
+        }
+
+        double score(particle& p, const syms& obs, size_t t,
+                     const tag_constraints& cons,
+                     const sentence_info&) const {
+            return score(p, obs, t, cons);
+        }
+
         template<class Archive>
         void serialize(Archive & archive) {
             archive(prop,
@@ -612,32 +823,6 @@ namespace nn {
                     corpus
                     );
         }
-
-        struct writer {
-            std::string prefix;
-            const instances& test;
-
-            sym context_tag;
-            const std::unordered_map<size_t, std::string>& sym_desc;
-            const std::unordered_map<size_t, std::string>& tag_desc;
-
-            writer(std::string _prefix,
-                   const instances& _test,
-                   sym _context_tag,
-                   const std::unordered_map<size_t, std::string>& _sym_desc,
-                   const std::unordered_map<size_t, std::string>& _tag_desc)
-                : prefix(_prefix),
-                  test(_test),
-                  context_tag(_context_tag),
-                  sym_desc(_sym_desc),
-                  tag_desc(_tag_desc) {}
-
-            void operator()(size_t iter,
-                            typename std::vector<particle>::const_iterator begin,
-                            typename std::vector<particle>::const_iterator end) {
-                CHECK(false) << "unimplemented";
-            }
-        };
     };
 }
 
@@ -3,7 +3,9 @@
 #include <string>
 #include <fstream>
 
+#include <nn/rng.hpp>
 #include <nn/reader.hpp>
+#include <nn/generic_filter.hpp>
 #include <nn/hidden_sequence_memoizer.hpp>
 
 #include <cereal/archives/binary.hpp>
@@ -29,3 +31,50 @@ TEST(HiddenSequenceMemoizer, CerealWorks) {
         iarchive( model );
     }
 }
+
+TEST(HiddenSequenceMemoizer, AncestorSamplingCrossesEntities) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    typedef hidden_sequence_memoizer<> Model;
+    typedef generic_filter<Model, Model::particle> Filter;
+    rng::init();
+    std::string fn {"/tmp/hsm_ancestor.conll"};
+    {
+        std::ofstream os(fn);
+        os << "Ann B-PER\nin O\nNew B-LOC\nYork I-LOC\n\n";
+        os << "in O\nYork B-LOC\nis O\n\n";
+        // the reference has an entity of two words, and doesn't end
+        // with it
+        os << "at O\nNew B-LOC\nYork I-LOC\nis O\n\n";
+    }
+    Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+    auto data = corpus.read(fn);
+    Model model(corpus);
+    for (size_t i = 0; i < 2; ++i) {
+        model.observe(data[i].tags, data[i].lens, data[i].words);
+    }
+
+    // Resampling at every word, the ancestor of the reference is
+    // drawn at every word but the last, also inside the entity
+    Filter::settings config;
+    config.num_particles = 16;
+    config.resample = rmethod::SMC_RESAMPLE_STRATIFIED;
+    config.resample_threshold = 1e9;
+    config.ancestor_sampling = true;
+    Filter filter(config, model);
+    const auto& ex = data.back();
+    auto p = model.make_particle(ex.tags, ex.lens);
+    const size_t nsweeps = 20;
+    for (size_t iter = 0; iter < nsweeps; ++iter) {
+        p = filter.conditional_sample(p, ex.words);
+        ASSERT_EQ(p.tags.size(), ex.words.size() - 1);
+        for (size_t t = 1; t < p.tags.size(); ++t) {
+            if (p.tags[t] % 2 == 1) {
+                ASSERT_EQ(model.idx_tag(p.tags[t]),
+                          model.idx_tag(p.tags[t-1]));
+            }
+        }
+    }
+    ASSERT_EQ(filter.ancestor_draws, nsweeps * (ex.words.size() - 1));
+    ASSERT_GT(filter.ancestor_moves, 0);
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_LIVE_MODEL_HPP__
+#define __NN_LIVE_MODEL_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+#include <nn/log.hpp>
+#include <nn/data.hpp>
+
+#include <cereal/types/memory.hpp>
+#include <cereal/archives/binary.hpp>
+
+namespace nn {
+
+    // A trained model that keeps learning while it is being used for
+    // decoding. Decoders hold a shared lock for the duration of a
+    // sentence; new annotations are observed under the exclusive lock,
+    // which is held only for the (incremental) observe call.
+    //
+    // Snapshots serialize the model into memory under the shared lock,
+    // so they never block decoders, and are written to disk without
+    // holding any lock.
+    template<typename Model>
+    class live_model {
+        std::unique_ptr<Model> model;
+        mutable std::shared_timed_mutex mutex;
+        std::atomic<size_t> generation {0}; // number of updates applied
+
+        // one snapshot at a time
+        std::mutex snapshot_mutex;
+        std::atomic<size_t> snapshot_generation {0};
+
+        // periodic snapshots
+        std::string snapshot_path;
+        std::thread snapshotter;
+        std::mutex stop_mutex;
+        std::condition_variable stop_cv;
+        bool stopping {false};
+
+        void snapshot_loop(std::chrono::seconds interval) {
+            std::unique_lock<std::mutex> lock(stop_mutex);
+            while (!stop_cv.wait_for(lock, interval, [this] { return stopping; })) {
+                lock.unlock();
+                if (generation != snapshot_generation) {
+                    snapshot(snapshot_path);
+                }
+                lock.lock();
+            }
+        }
+
+    public:
+        explicit live_model(std::unique_ptr<Model> _model)
+            : model(std::move(_model)) {
+            CHECK(model) << "no model";
+        }
+
+        live_model(live_model const&)            = delete;
+        live_model& operator=(live_model const&) = delete;
+
+        ~live_model() { stop_snapshots(); }
+
+        // Calls f(const Model&) under the shared lock
+        template<typename F>
+        auto read(F f) const -> decltype(f(std::declval<const Model&>())) {
+            std::shared_lock<std::shared_timed_mutex> lock(mutex);
+            return f(static_cast<const Model&>(*model));
+        }
+
+        void observe(const syms& tags, const syms& lens, const phrase& words) {
+            std::unique_lock<std::shared_timed_mutex> lock(mutex);
+            model->observe(tags, lens, words);
+            generation ++;
+        }
+
+        void observe_gazetteer(const syms& tags, const syms& lens,
+                               const phrase& words) {
+            std::unique_lock<std::shared_timed_mutex> lock(mutex);
+            model->observe_gazetteer(tags, lens, words);
+            generation ++;
+        }
+
+        size_t get_generation() const { return generation; }
+
+        // Writes the model in the format of train_model; the file is
+        // replaced atomically.
+        void snapshot(const std::string& path) {
+            std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex);
+            std::string bytes;
+            size_t gen;
+            {
+                std::ostringstream os(std::ios::binary);
+                std::shared_lock<std::shared_timed_mutex> lock(mutex);
+                gen = generation;
+                {
+                    cereal::BinaryOutputArchive oarchive(os);
+                    oarchive(model);
+                }
+                bytes = os.str();
+            }
+            std::string tmp = path + ".tmp" + std::to_string(::getpid());
+            {
+                std::ofstream of(tmp, std::ios::binary);
+                CHECK(of.is_open()) << "problem opening: " << tmp;
+                of.write(bytes.data(), bytes.size());
+                CHECK(of.good()) << "problem writing: " << tmp;
+            }
+            CHECK(std::rename(tmp.c_str(), path.c_str()) == 0)
+                << "problem renaming " << tmp << " to " << path;
+            snapshot_generation = gen;
+            LOG(INFO) << "Snapshot of update " << gen << " written to: "
+                      << path;
+        }
+
+        // Snapshots to path every interval, when there are new updates
+        void start_snapshots(const std::string& path,
+                             std::chrono::seconds interval) {
+            CHECK(!snapshotter.joinable()) << "snapshots already running";
+            snapshot_path = path;
+            stopping = false;
+            snapshotter = std::thread(&live_model::snapshot_loop, this,
+                                      interval);
+        }
+
+        // Stops periodic snapshots, writing a final one if needed
+        void stop_snapshots() {
+            if (!snapshotter.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(stop_mutex);
+                stopping = true;
+            }
+            stop_cv.notify_all();
+            snapshotter.join();
+            if (generation != snapshot_generation) snapshot(snapshot_path);
+        }
+    };
+}
+
+#endif
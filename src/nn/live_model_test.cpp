@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include <nn/live_model.hpp>
+
+struct counting_model {
+    size_t nobs {0};
+    size_t ngaz {0};
+
+    void observe(const nn::syms& tags, const nn::syms&,
+                 const nn::phrase&) { nobs += tags.size(); }
+
+    void observe_gazetteer(const nn::syms& tags, const nn::syms&,
+                           const nn::phrase&) { ngaz += tags.size(); }
+
+    template<class Archive>
+    void serialize(Archive & archive) {
+        archive(nobs, ngaz);
+    }
+};
+
+TEST(LiveModel, UpdatesWhileReading) {
+    using namespace nn;
+    live_model<counting_model> live(std::make_unique<counting_model>());
+    syms tags {0, 1};
+    syms lens {1, 1};
+    phrase words;
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r) {
+        readers.emplace_back([&live] {
+            size_t last {0};
+            for (int i = 0; i < 1000; ++i) {
+                auto n = live.read([](const counting_model& m) {
+                    return m.nobs;
+                });
+                ASSERT_TRUE(n >= last);
+                ASSERT_EQ(n % 2, 0);
+                last = n;
+            }
+        });
+    }
+    for (int i = 0; i < 1000; ++i) live.observe(tags, lens, words);
+    live.observe_gazetteer(tags, lens, words);
+    for (auto& t : readers) t.join();
+
+    ASSERT_EQ(live.get_generation(), 1001);
+    ASSERT_EQ(live.read([](const counting_model& m) { return m.nobs; }), 2000);
+}
+
+TEST(LiveModel, SnapshotLoads) {
+    using namespace nn;
+    std::string path {"/tmp/live_model_test.ser"};
+    {
+        live_model<counting_model> live(std::make_unique<counting_model>());
+        live.start_snapshots(path, std::chrono::seconds(60));
+        live.observe(syms {0}, syms {1}, phrase());
+        live.observe_gazetteer(syms {0, 1, 2}, syms {1, 1, 1}, phrase());
+        live.stop_snapshots(); // writes the pending updates
+    }
+    std::unique_ptr<counting_model> loaded;
+    {
+        std::ifstream is(path, std::ios::binary);
+        cereal::BinaryInputArchive iarchive(is);
+        iarchive(loaded);
+    }
+    ASSERT_EQ(loaded->nobs, 1);
+    ASSERT_EQ(loaded->ngaz, 3);
+}
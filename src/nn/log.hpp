@@ -26,6 +26,7 @@
 namespace logging = boost::log;
 
 #define INFO info
+#define WARNING warning
 #define FATAL fatal
 
 #define LOG(logger) \
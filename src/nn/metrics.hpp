@@ -0,0 +1,252 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_METRICS_HPP__
+#define __NN_METRICS_HPP__
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <condition_variable>
+#include <unistd.h>
+
+#include <nn/log.hpp>
+
+namespace nn {
+
+    // Live metrics of a long-running job, such as particle Gibbs
+    // sweeps or a decoder, for monitoring. Counters only go up, gauges
+    // hold the last value set, and histograms count observations into
+    // buckets. Updates take a lock, so they belong at the level of
+    // sentences rather than particles. text() renders the metrics in
+    // the Prometheus text format.
+    class metrics {
+        struct metric {
+            std::string type;
+            std::string help;
+            double value {0};
+            std::vector<double> bounds;   // histogram bucket upper bounds
+            std::vector<uint64_t> counts; // observations per bucket
+            uint64_t count {0};
+        };
+
+        mutable std::mutex mutex;
+        std::map<std::string, metric> items;
+
+        metric& get(const std::string& name, const char* type,
+                    const std::string& help) {
+            auto& m = items[name];
+            if (m.type.empty()) {
+                m.type = type;
+                m.help = help;
+            }
+            CHECK(m.type == type) << name << " is a " << m.type;
+            return m;
+        }
+
+        static void write_value(std::ostream& os, double v) {
+            os << std::setprecision(15) << v << "\n";
+        }
+
+    public:
+        // The metrics of the process
+        static metrics& global() {
+            static metrics m;
+            return m;
+        }
+
+        // Adds to a counter
+        void add(const std::string& name, double v,
+                 const std::string& help = "") {
+            std::lock_guard<std::mutex> lock(mutex);
+            get(name, "counter", help).value += v;
+        }
+
+        // Sets a counter kept elsewhere (e.g. by a filter) to its total
+        void set_total(const std::string& name, double v,
+                       const std::string& help = "") {
+            std::lock_guard<std::mutex> lock(mutex);
+            get(name, "counter", help).value = v;
+        }
+
+        void set(const std::string& name, double v,
+                 const std::string& help = "") {
+            std::lock_guard<std::mutex> lock(mutex);
+            get(name, "gauge", help).value = v;
+        }
+
+        // Counts v into the buckets with the given upper bounds, which
+        // are fixed by the first observation
+        void observe(const std::string& name, double v,
+                     const std::vector<double>& bounds,
+                     const std::string& help = "") {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto& m = get(name, "histogram", help);
+            if (m.counts.empty()) {
+                m.bounds = bounds;
+                m.counts.resize(bounds.size());
+            }
+            for (size_t i = 0; i < m.bounds.size(); ++i) {
+                if (v <= m.bounds[i]) m.counts[i] ++;
+            }
+            m.value += v;
+            m.count ++;
+        }
+
+        std::string text() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::ostringstream os;
+            for (const auto& kv : items) {
+                const auto& name = kv.first;
+                const auto& m = kv.second;
+                if (!m.help.empty()) os << "# HELP " << name << " " << m.help << "\n";
+                os << "# TYPE " << name << " " << m.type << "\n";
+                if (m.type != "histogram") {
+                    os << name << " ";
+                    write_value(os, m.value);
+                    continue;
+                }
+                for (size_t i = 0; i < m.bounds.size(); ++i) {
+                    os << name << "_bucket{le=\"" << m.bounds[i] << "\"} "
+                       << m.counts[i] << "\n";
+                }
+                os << name << "_bucket{le=\"+Inf\"} " << m.count << "\n";
+                os << name << "_sum ";
+                write_value(os, m.value);
+                os << name << "_count " << m.count << "\n";
+            }
+            return os.str();
+        }
+    };
+
+    // Resident set size of the process, in bytes (0 if unknown)
+    inline double resident_bytes() {
+        std::ifstream is("/proc/self/statm");
+        size_t size = 0, resident = 0;
+        if (!(is >> size >> resident)) return 0;
+        return static_cast<double>(resident) * ::sysconf(_SC_PAGESIZE);
+    }
+
+    // Records a sentence of nwords words that took the filter the
+    // given number of resampling steps
+    inline void record_filtered_sentence(metrics& m, size_t nwords,
+                                         size_t resamples) {
+        m.add("nname_sentences_total", 1, "sentences filtered");
+        m.add("nname_words_total", nwords, "words filtered");
+        m.add("nname_filter_resamples_total", resamples,
+              "resampling steps of the particle filter");
+    }
+
+    // Records the ESS of a filtered sentence, as a fraction of the
+    // particles (at most 1, but for rounding)
+    inline void record_filter_ess(metrics& m, double ess_ratio) {
+        static const std::vector<double> ess_buckets {
+            0.01, 0.05, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1.0
+        };
+        m.observe("nname_filter_ess_ratio", std::min(ess_ratio, 1.0),
+                  ess_buckets,
+                  "ESS of the final particles, as a fraction of the particles");
+    }
+
+    // Writes a snapshot of the metrics to a file every interval, on a
+    // thread of its own, and once more when closed. The file is
+    // replaced atomically, so it can be read at any time, e.g. by the
+    // textfile collector of the Prometheus node exporter.
+    class metrics_writer {
+        const std::string path;
+        const std::chrono::seconds interval;
+        metrics& source;
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool stopping {false};
+        std::thread writer;
+
+        void write() {
+            source.set("process_resident_memory_bytes", resident_bytes(),
+                       "resident set size in bytes");
+            std::string tmp = path + ".tmp" + std::to_string(::getpid());
+            bool written;
+            {
+                std::ofstream of(tmp);
+                CHECK(of.is_open()) << "problem opening: " << tmp;
+                of << source.text();
+                of.flush();
+                written = of.good();
+                CHECK(written) << "problem writing: " << tmp;
+            }
+            // a failed write keeps the last snapshot
+            if (!written) {
+                std::remove(tmp.c_str());
+                return;
+            }
+            CHECK(std::rename(tmp.c_str(), path.c_str()) == 0)
+                << "problem renaming " << tmp << " to " << path;
+        }
+
+        void write_loop() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                lock.unlock();
+                write();
+                lock.lock();
+                if (stopping) return;
+                cv.wait_for(lock, interval, [this] { return stopping; });
+            }
+        }
+
+    public:
+        metrics_writer(std::string _path, std::chrono::seconds _interval,
+                       metrics& _source = metrics::global())
+            : path(_path), interval(_interval), source(_source) {
+            CHECK(path != "") << "no metrics path";
+            CHECK(interval.count() > 0) << "bad metrics interval";
+            auto start = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            source.set("process_start_time_seconds", start,
+                       "start time of the process since the epoch");
+            writer = std::thread(&metrics_writer::write_loop, this);
+        }
+
+        metrics_writer(metrics_writer const&)            = delete;
+        metrics_writer& operator=(metrics_writer const&) = delete;
+
+        ~metrics_writer() { close(); }
+
+        // Writes the final metrics and stops the thread
+        void close() {
+            if (!writer.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            writer.join();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <csignal>
+#include <string>
+#include <thread>
+#include <fstream>
+#include <sstream>
+
+#include <sys/resource.h>
+
+#include <nn/metrics.hpp>
+
+using namespace nn;
+
+TEST(Metrics, TextFormat) {
+    metrics m;
+    m.add("jobs_total", 2, "jobs done");
+    m.add("jobs_total", 3);
+    m.set("queue_depth", 7);
+    m.set("queue_depth", 4);
+    for (double v : { 0.05, 0.5, 0.5, 2.0 }) {
+        m.observe("latency", v, { 0.1, 1.0 });
+    }
+    auto text = m.text();
+    ASSERT_NE(text.find("# HELP jobs_total jobs done\n"
+                        "# TYPE jobs_total counter\n"
+                        "jobs_total 5\n"), std::string::npos);
+    ASSERT_NE(text.find("# TYPE queue_depth gauge\n"
+                        "queue_depth 4\n"), std::string::npos);
+    ASSERT_NE(text.find("# TYPE latency histogram\n"
+                        "latency_bucket{le=\"0.1\"} 1\n"
+                        "latency_bucket{le=\"1\"} 3\n"
+                        "latency_bucket{le=\"+Inf\"} 4\n"
+                        "latency_sum 3.05\n"
+                        "latency_count 4\n"), std::string::npos);
+}
+
+TEST(Metrics, WriterKeepsFileCurrent) {
+    std::string fn {"/tmp/metrics_test.prom"};
+    std::remove(fn.c_str());
+    metrics m;
+    auto read = [&] {
+        std::ifstream is(fn);
+        std::stringstream ss;
+        ss << is.rdbuf();
+        return ss.str();
+    };
+    {
+        metrics_writer writer(fn, std::chrono::seconds(60), m);
+        record_filtered_sentence(m, 7, 2);
+        record_filter_ess(m, 0.25);
+        // the first write happens at once
+        for (size_t i = 0; i < 100 && read().empty(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT_NE(read().find("process_start_time_seconds"), std::string::npos);
+    }
+    // and the last when the writer is closed
+    auto text = read();
+    ASSERT_NE(text.find("nname_words_total 7\n"), std::string::npos);
+    ASSERT_NE(text.find("nname_filter_resamples_total 2\n"), std::string::npos);
+    ASSERT_NE(text.find("nname_filter_ess_ratio_bucket{le=\"0.3\"} 1\n"),
+              std::string::npos);
+    ASSERT_EQ(text.find("nname_filter_ess_ratio_bucket{le=\"0.2\"} 1\n"),
+              std::string::npos);
+    ASSERT_GT(resident_bytes(), 0);
+}
+
+TEST(Metrics, FailedWriteKeepsLastSnapshot) {
+    std::string fn {"/tmp/metrics_test_full.prom"};
+    std::remove(fn.c_str());
+    metrics m;
+    auto read = [&] {
+        std::ifstream is(fn);
+        std::stringstream ss;
+        ss << is.rdbuf();
+        return ss.str();
+    };
+    struct rlimit old_limit;
+    ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &old_limit), 0);
+    auto old_handler = signal(SIGXFSZ, SIG_IGN);
+    {
+        metrics_writer writer(fn, std::chrono::seconds(60), m);
+        for (size_t i = 0; i < 100 && read().empty(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT_FALSE(read().empty());
+        // a file size limit as on a full disk; the snapshot is small
+        // enough to sit in the stream buffer until the flush
+        struct rlimit limit = old_limit;
+        limit.rlim_cur = 16;
+        ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+        record_filtered_sentence(m, 7, 2);
+    }
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+    auto text = read();
+    ASSERT_NE(text.find("process_start_time_seconds"), std::string::npos);
+    ASSERT_EQ(text.find("nname_words_total 7\n"), std::string::npos);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
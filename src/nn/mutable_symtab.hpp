@@ -45,6 +45,8 @@ namespace nn {
 
     public:
         void freeze()              { frozen=true;                  }
+        void unfreeze()            { frozen=false;                 }
+        bool is_frozen() const     { return frozen;                }
         size_t size()   const      { return symtab.size();         }
         bool has(K key) const      { return symtab.count(key);     }
         bool hasValue(V val) const { return inv_symtab.count(val); }
@@ -85,8 +87,8 @@ namespace nn {
             return add_key(val);
         }
 
-        std::unordered_map<K, V> get_map()     const { return symtab;     }
-        std::unordered_map<V, K> get_inv_map() const { return inv_symtab; }
+        const std::unordered_map<K, V>& get_map()     const { return symtab;     }
+        const std::unordered_map<V, K>& get_inv_map() const { return inv_symtab; }
 
         const std::unordered_set<K>& get_key_set() const {
             return key_set;
@@ -125,7 +125,19 @@ namespace nn {
         hash_node(hash_node const&)            = delete;
         hash_node& operator=(hash_node const&) = delete;
 
-        void* get_payload() { return crp.get(); }
+        void* get_payload()       { return crp.get(); }
+        void* get_payload() const { return crp.get(); }
+
+        // Calls f(dst, src) for every node src of other's tree and
+        // the node dst at the same path in this tree, which is
+        // created if needed. Child keys are translated with key_map.
+        template<typename KeyMap, typename F>
+        void merge(const hash_node& other, const KeyMap& key_map, const F& f) {
+            f(*this, other);
+            for (const auto& kv : other.kids) {
+                get_or_make(key_map(kv.first))->merge(*kv.second, key_map, f);
+            }
+        }
 
         hash_node* get_or_null(T t) const {
             if(kids.count(t) > 0) {
@@ -154,6 +166,21 @@ namespace nn {
             return get(t);
         }
 
+        void remove(T t) { kids.erase(t); }
+
+        bool is_leaf() const { return kids.empty(); }
+
+        const std::unordered_map<T, std::unique_ptr<hash_node>>& get_kids() const {
+            return kids;
+        }
+
+        // Number of nodes in the subtree rooted here
+        size_t size() const {
+            size_t ret = 1;
+            for (const auto& kv : kids) ret += kv.second->size();
+            return ret;
+        }
+
         size_t getC()    const { return r.getC(crp.get());    };
         size_t getC(T t) const { return r.getC(crp.get(), t); };
         size_t getT()    const { return r.getT(crp.get());    };
@@ -24,6 +24,7 @@
 #include <nn/data.hpp>
 #include <nn/csmc.hpp>
 #include <nn/timing.hpp>
+#include <nn/metrics.hpp>
 
 namespace nn {
     template<typename P,     // particle
@@ -32,7 +33,10 @@ namespace nn {
              typename O      // observations (iterable type)
              >
     struct particle_gibbs {
-        struct settings { size_t num_iter {100}; };
+        struct settings {
+            size_t num_iter {100};
+            size_t prune_interval {0}; // sweeps between compactions (0 = never)
+        };
 
         settings config;
 
@@ -57,6 +61,10 @@ namespace nn {
         std::vector<P> state_test;
 
         bool initialized {false};
+        size_t first_sweep {1}; // later when resumed
+
+        // Filter resampling steps already recorded in the metrics
+        size_t recorded_resamples {0};
 
         // called between sampler iterations
         std::function<std::vector<P>(const O&)> initializer;
@@ -73,6 +81,12 @@ namespace nn {
                  typename std::vector<P>::const_iterator,
                  typename std::vector<P>::const_iterator)
         >> writers;
+        std::vector<std::function<
+            void(size_t,
+                 const std::vector<P>&,  // train
+                 const std::vector<P>&,  // unlabeled
+                 const std::vector<P>&)  // test
+        >> snapshotters;
 
         particle_gibbs(settings _config,
                        const O& _train,
@@ -157,7 +171,40 @@ namespace nn {
                 test_prog++;
             }
             LOG(INFO) << "...done in: " << nn::prettyprint(nn::toc());
+            initialized = true;
             write_test_state();
+            take_snapshots();
+        }
+
+        // Continues from the state after the given sweep instead of
+        // init(), e.g. from a checkpoint. The model observes the state
+        // in the order init() would.
+        void resume(size_t sweep,
+                    std::vector<P> _state_train,
+                    std::vector<P> _state_unlabeled,
+                    std::vector<P> _state_test) {
+            CHECK(!initialized) << "already initialized";
+            CHECK(_state_train.size() == train.size()) << "size mismatch!";
+            CHECK(_state_unlabeled.size() == unlabeled.size()) << "size mismatch!";
+            CHECK(_state_test.size() == test.size()) << "size mismatch!";
+            LOG(INFO) << "Resuming after sweep " << sweep << "...";
+            nn::tic();
+            state_train     = std::move(_state_train);
+            state_unlabeled = std::move(_state_unlabeled);
+            state_test      = std::move(_state_test);
+            for (size_t i = 0; i < train.size(); ++i) {
+                model->observe( state_train[i], train[i].words );
+            }
+            for (size_t i = 0; i < unlabeled.size(); ++i) {
+                model->observe( state_unlabeled[i], unlabeled[i].words );
+            }
+            for (size_t i = 0; i < test.size(); ++i) {
+                model->observe( state_test[i], test[i].words );
+            }
+            LOG(INFO) << "...done in: " << nn::prettyprint(nn::toc());
+            epoch_iter  = sweep;
+            first_sweep = sweep + 1;
+            initialized = true;
         }
 
         void pre_run_callbacks() const {
@@ -180,11 +227,38 @@ namespace nn {
             }
         }
 
+        void take_snapshots() const {
+            for(const auto& s : snapshotters) {
+                s(epoch_iter, state_train, state_unlabeled, state_test);
+            }
+        }
+
         void pre_sweep_callbacks() const { run_eval(); }
 
+        // Records the filtering of a sentence in the live metrics
+        void record_sentence(const typename O::value_type& instance) {
+            auto& m = metrics::global();
+            record_filtered_sentence(m, instance.words.size() - 1,
+                                     filter->num_resamples - recorded_resamples);
+            recorded_resamples = filter->num_resamples;
+            record_filter_ess(m, filter->get_ess() / filter->config.num_particles);
+        }
+
+        void record_sweep(double mean_ESS, size_t n_changed) const {
+            auto& m = metrics::global();
+            m.set("nname_sweep", epoch_iter, "last particle Gibbs sweep done");
+            m.set("nname_sweep_mean_ess", mean_ESS, "mean ESS of the last sweep");
+            m.set("nname_sweep_test_changed", n_changed,
+                  "test labelings changed by the last sweep");
+            m.set_total("nname_ancestor_draws_total", filter->ancestor_draws,
+                        "ancestor sampling draws");
+            m.set_total("nname_ancestor_moves_total", filter->ancestor_moves,
+                        "ancestor sampling draws that moved the reference");
+        }
+
         void run(size_t status_interval) {
             // initialize sampler state
-            init();
+            if (!initialized) init();
 
             LOG(INFO) << "Resampling parameters...";
             model->resample_hyperparameters();
@@ -197,11 +271,12 @@ namespace nn {
             nn::progress_bar prog(n_total_instance * config.num_iter,
                                   status_interval);
             nn::tic();
-            for (epoch_iter = 1; epoch_iter < config.num_iter; ++epoch_iter) {
+            for (epoch_iter = first_sweep; epoch_iter < config.num_iter; ++epoch_iter) {
                 pre_sweep_callbacks();
                 LOG(INFO) << "[epoch " << epoch_iter << " of " << config.num_iter
                           << "] running Gibbs sweep...";
                 mean_ESS = 0.0;
+                n_instance_sampled = 0;
                 LOG(INFO) << "Resampling train data...";
                 for (j=0; j<train.size(); ++j) {
                     const auto& instance = train.at(j);
@@ -209,11 +284,13 @@ namespace nn {
                     model->remove(particle, instance.words);
                     state_train[j] = filter->conditional_sample(particle,
                                                                 instance.tags,
+                                                                instance.lens,
                                                                 instance.words,
                                                                 instance.obs);
                     if (train[j].obs != Annotation::FULL) {
                         mean_ESS += filter->get_ess();
                         n_instance_sampled ++;
+                        record_sentence(instance);
                     }
                     model->observe(state_train[j], instance.words);
                     prog++;
@@ -227,6 +304,7 @@ namespace nn {
                                                                         unlabeled[j].words);
                         mean_ESS += filter->get_ess();
                         n_instance_sampled ++;
+                        record_sentence(unlabeled[j]);
                         const auto& particle = state_unlabeled.at(j);
                         model->observe(particle, unlabeled[j].words);
                         prog++;
@@ -234,19 +312,41 @@ namespace nn {
                 }
 
                 LOG(INFO) << "Resampling test data...";
+                size_t n_changed = 0; // a measure of mixing
                 for (j=0; j<test.size(); ++j) {
                     model->remove(state_test[j], test[j].words);
-                    state_test[j] = filter->conditional_sample(state_test[j],
-                                                               test[j].words);
+                    auto next = filter->conditional_sample(state_test[j],
+                                                           test[j].words);
+                    if (model->get_tags(next) != model->get_tags(state_test[j]) ||
+                        model->get_lens(next) != model->get_lens(state_test[j])) {
+                        n_changed ++;
+                    }
+                    state_test[j] = std::move(next);
                     mean_ESS += filter->get_ess();
                     n_instance_sampled ++;
+                    record_sentence(test[j]);
                     const auto& particle = state_test.at(j);
                     model->observe(particle, test[j].words);
                     prog++;
                 }
                 mean_ESS /= n_instance_sampled;
                 LOG(INFO) << "[mean ESS = " << mean_ESS << "]";
+                LOG(INFO) << "[test labelings changed = " << n_changed
+                          << " of " << test.size() << "; ancestor moves = "
+                          << filter->ancestor_moves << " of "
+                          << filter->ancestor_draws << " draws so far]";
+                record_sweep(mean_ESS, n_changed);
                 write_test_state();
+                take_snapshots();
+                if (config.prune_interval > 0 &&
+                    epoch_iter % config.prune_interval == 0) {
+                    // Only empty contexts: the sampler still has to
+                    // remove the customers of every instance
+                    auto stats = model->prune(0.0);
+                    LOG(INFO) << "Compacted context trees: "
+                              << stats.nodes_before << " -> "
+                              << stats.nodes_after << " nodes";
+                }
             }
             LOG(INFO) << "Final evaluation:";
             run_eval();
@@ -268,6 +368,13 @@ namespace nn {
             writers.push_back( std::forward<Writer>(writer) );
         }
 
+        // Called with the whole sampler state after initialization
+        // and after each sweep
+        template<typename Snapshotter>
+        void add_snapshot_callback(Snapshotter&& snapshotter) {
+            snapshotters.push_back( std::forward<Snapshotter>(snapshotter) );
+        }
+
         template<typename Initializer>
         void set_initializer(Initializer&& init) {
             initializer = std::forward<Initializer>( init );
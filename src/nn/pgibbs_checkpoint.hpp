@@ -0,0 +1,169 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_PGIBBS_CHECKPOINT_HPP__
+#define __NN_PGIBBS_CHECKPOINT_HPP__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <unistd.h>
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/vector.hpp>
+#include <cereal/types/string.hpp>
+
+#include <nn/log.hpp>
+#include <nn/rng.hpp>
+#include <nn/data.hpp>
+#include <nn/state_snapshots.hpp>
+
+namespace nn {
+
+    // Checkpoint of a particle Gibbs run after a sweep: the taggings
+    // of the sampler state and the states of the random engines. The
+    // model is not stored; it is rebuilt by observing the taggings
+    // (see particle_gibbs::resume), which only re-draws the seating
+    // arrangements of its restaurants. That takes about as long as a
+    // sweep without filtering, and keeps checkpoints small.
+    struct pgibbs_checkpoint {
+        size_t format {1};
+        size_t sweep {0};
+        std::vector<tagging> train;
+        std::vector<tagging> unlabeled;
+        std::vector<tagging> test;
+        std::vector<std::string> engines;
+
+        template<class Archive>
+        void serialize(Archive & archive) {
+            archive( format, sweep, train, unlabeled, test, engines );
+        }
+
+        template<typename Model, typename P>
+        void capture(size_t _sweep, const Model& model,
+                     const std::vector<P>& train_state,
+                     const std::vector<P>& unlabeled_state,
+                     const std::vector<P>& test_state) {
+            sweep = _sweep;
+            copy_taggings(model, train_state, train);
+            copy_taggings(model, unlabeled_state, unlabeled);
+            copy_taggings(model, test_state, test);
+            engines.resize(rng::get_num_engines());
+            for (size_t i = 0; i < engines.size(); ++i) {
+                std::ostringstream os;
+                os << rng::engines[i];
+                engines[i] = os.str();
+            }
+        }
+
+        template<typename Model>
+        static auto particles(const Model& model, const std::vector<tagging>& state)
+            -> std::vector<typename Model::particle> {
+            std::vector<typename Model::particle> ret;
+            for (const auto& t : state) {
+                ret.push_back( model.make_particle(t.tags, t.lens) );
+            }
+            return ret;
+        }
+
+        // Restores the engines that both runs have; a run on more
+        // threads keeps the fresh engines of the others
+        void restore_engines() const {
+            auto n = std::min(engines.size(), rng::get_num_engines());
+            if (n < engines.size() || n < rng::get_num_engines()) {
+                LOG(INFO) << "Checkpoint has " << engines.size()
+                          << " random engines; restoring " << n;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                std::istringstream is(engines[i]);
+                is >> rng::engines[i];
+            }
+        }
+
+        // Does the checkpoint tag the given data?
+        bool matches(const instances& _train,
+                     const instances& _unlabeled,
+                     const instances& _test) const {
+            auto same = [](const std::vector<tagging>& state,
+                           const instances& data) {
+                if (state.size() != data.size()) return false;
+                for (size_t i = 0; i < state.size(); ++i) {
+                    size_t len = 0;
+                    for (auto l : state[i].lens) len += l;
+                    // the last word is the <EOS> sentinel
+                    if (len + 1 != data[i].words.size()) return false;
+                }
+                return true;
+            };
+            return same(train, _train) && same(unlabeled, _unlabeled) &&
+                same(test, _test);
+        }
+
+        // Writes the checkpoint; the file is replaced atomically, and
+        // only once it has all been written, so that a failed write
+        // (e.g. a full disk) keeps the last checkpoint. False if the
+        // checkpoint couldn't be written.
+        bool save(const std::string& path) const {
+            std::string tmp = path + ".tmp" + std::to_string(::getpid());
+            bool written = false;
+            {
+                std::ofstream of(tmp, std::ios::binary);
+                CHECK(of.is_open()) << "problem opening: " << tmp;
+                // cereal throws on the writes it sees fail; those that
+                // were buffered fail on the flush
+                try {
+                    cereal::BinaryOutputArchive oarchive(of);
+                    oarchive(*this);
+                    of.flush();
+                    written = of.good();
+                } catch (const cereal::Exception& e) {
+                    LOG(INFO) << e.what();
+                }
+                CHECK(written) << "problem writing: " << tmp;
+            }
+            if (!written) {
+                std::remove(tmp.c_str());
+                return false;
+            }
+            if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+                LOG(WARNING) << "problem renaming " << tmp << " to " << path;
+                std::remove(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // Reads the checkpoint at path; false if there is none, or it
+        // is in a format this version doesn't know
+        bool load(const std::string& path) {
+            std::ifstream is(path, std::ios::binary);
+            if (!is.is_open()) return false;
+            cereal::BinaryInputArchive iarchive(is);
+            iarchive(*this);
+            if (format != 1) {
+                LOG(WARNING) << "unknown checkpoint format: " << format;
+                return false;
+            }
+            return true;
+        }
+    };
+}
+
+#endif
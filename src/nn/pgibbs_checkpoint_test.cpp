@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <csignal>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <boost/filesystem.hpp>
+
+#include <nn/rng.hpp>
+#include <nn/pgibbs_checkpoint.hpp>
+
+// Particles are their taggings
+struct TaggingModel {
+    typedef nn::tagging particle;
+    nn::syms get_tags(const particle& p) const { return p.tags; }
+    nn::syms get_lens(const particle& p) const { return p.lens; }
+    particle make_particle(const nn::syms& tags, const nn::syms& lens) const {
+        return particle { tags, lens };
+    }
+};
+
+TEST(PGibbsCheckpoint, RoundTrip) {
+    using namespace nn;
+    rng::init();
+    std::string path {"/tmp/pgibbs_checkpoint_test.ckpt"};
+    TaggingModel model;
+    std::vector<tagging> train { { {1, 0}, {2, 1} } };
+    std::vector<tagging> none;
+    std::vector<tagging> test { { {0}, {1} }, { {1}, {2} } };
+
+    pgibbs_checkpoint saved;
+    saved.capture(7, model, train, none, test);
+    saved.save(path);
+    std::vector<size_t> draws;
+    for (size_t i = 0; i < 5; ++i) draws.push_back(rng::get()());
+
+    pgibbs_checkpoint loaded;
+    ASSERT_TRUE(loaded.load(path));
+    ASSERT_EQ(loaded.sweep, 7);
+    auto particles = loaded.particles(model, loaded.test);
+    ASSERT_EQ(particles.size(), 2);
+    ASSERT_EQ(particles[1].tags, syms { 1 });
+    ASSERT_EQ(particles[1].lens, syms { 2 });
+    ASSERT_EQ(loaded.train[0].lens, (syms { 2, 1 }));
+
+    // the engines go on from where they were
+    loaded.restore_engines();
+    for (size_t i = 0; i < 5; ++i) ASSERT_EQ(rng::get()(), draws[i]);
+
+    // the last word of a sentence is the <EOS> sentinel
+    auto sentence = [](size_t nwords) {
+        instance i;
+        i.words = phrase(nwords + 1);
+        return i;
+    };
+    ASSERT_TRUE(loaded.matches({ sentence(3) }, {}, { sentence(1), sentence(2) }));
+    ASSERT_FALSE(loaded.matches({ sentence(3) }, {}, { sentence(1) }));
+    ASSERT_FALSE(loaded.matches({ sentence(2) }, {}, { sentence(1), sentence(2) }));
+}
+
+TEST(PGibbsCheckpoint, FailedSaveKeepsLastCheckpoint) {
+    using namespace nn;
+    rng::init();
+    std::string path {"/tmp/pgibbs_checkpoint_test_full.ckpt"};
+    TaggingModel model;
+    std::vector<tagging> none;
+    std::vector<tagging> small { { {0}, {1} } };
+    std::vector<tagging> big(1000, tagging { {0, 1, 0}, {1, 2, 1} });
+    pgibbs_checkpoint next;
+    next.capture(2, model, big, none, none);
+    ASSERT_TRUE(next.save(path));
+    struct stat st;
+    ASSERT_EQ(stat(path.c_str(), &st), 0);
+
+    // file size limits as on a full disk, failing the write at its
+    // end and near its start
+    for (rlim_t max_size : { rlim_t(st.st_size - 1), rlim_t(4096) }) {
+        pgibbs_checkpoint saved;
+        saved.capture(1, model, small, none, none);
+        ASSERT_TRUE(saved.save(path));
+
+        struct rlimit old_limit;
+        ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &old_limit), 0);
+        auto old_handler = signal(SIGXFSZ, SIG_IGN);
+        struct rlimit limit = old_limit;
+        limit.rlim_cur = max_size;
+        ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+        bool written = next.save(path);
+        setrlimit(RLIMIT_FSIZE, &old_limit);
+        signal(SIGXFSZ, old_handler);
+        ASSERT_FALSE(written);
+
+        pgibbs_checkpoint loaded;
+        ASSERT_TRUE(loaded.load(path));
+        ASSERT_EQ(loaded.sweep, 1);
+        ASSERT_EQ(loaded.train.size(), 1);
+    }
+}
+
+TEST(PGibbsCheckpoint, FailedRenameIsReported) {
+    using namespace nn;
+    rng::init();
+    // a directory that is in the way of the checkpoint
+    std::string path {"/tmp/pgibbs_checkpoint_test_dir"};
+    boost::filesystem::remove_all(path);
+    boost::filesystem::create_directories(path + "/sub");
+    TaggingModel model;
+    std::vector<tagging> none;
+    pgibbs_checkpoint saved;
+    saved.capture(1, model, none, none, none);
+    ASSERT_FALSE(saved.save(path));
+    ASSERT_TRUE(boost::filesystem::is_directory(path));
+    for (auto it = boost::filesystem::directory_iterator("/tmp");
+         it != boost::filesystem::directory_iterator(); ++it) {
+        auto name = it->path().filename().string();
+        ASSERT_NE(name.find("pgibbs_checkpoint_test_dir.tmp"), 0);
+    }
+}
+
+TEST(PGibbsCheckpoint, UnknownFormat) {
+    using namespace nn;
+    rng::init();
+    std::string path {"/tmp/pgibbs_checkpoint_test_format.ckpt"};
+    TaggingModel model;
+    std::vector<tagging> none;
+    pgibbs_checkpoint saved;
+    saved.capture(1, model, none, none, none);
+    saved.format = 2;
+    ASSERT_TRUE(saved.save(path));
+    pgibbs_checkpoint loaded;
+    ASSERT_FALSE(loaded.load(path));
+}
+
+TEST(PGibbsCheckpoint, MissingFile) {
+    nn::pgibbs_checkpoint checkpoint;
+    ASSERT_FALSE(checkpoint.load("/tmp/no/such/checkpoint"));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_PIPELINE_HPP__
+#define __NN_PIPELINE_HPP__
+
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <omp.h>
+
+#include <nn/log.hpp>
+
+namespace nn {
+
+    // FIFO queue of at most capacity items: push blocks while it is
+    // full, and pop while it is empty, until the queue is closed.
+    template<typename T>
+    class bounded_queue {
+        std::deque<T> items;
+        size_t capacity;
+        bool closed {false};
+        std::mutex mutex;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+
+    public:
+        explicit bounded_queue(size_t _capacity) : capacity(_capacity) {
+            CHECK(capacity > 0) << "empty queue";
+        }
+
+        void push(T item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_full.wait(lock, [this] { return items.size() < capacity; });
+            items.push_back(std::move(item));
+            not_empty.notify_one();
+        }
+
+        // Returns false once the queue is closed and empty
+        bool pop(T& item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] { return closed || !items.empty(); });
+            if (items.empty()) return false;
+            item = std::move(items.front());
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        // No more items will be pushed
+        void close() {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            not_empty.notify_all();
+        }
+    };
+
+    // Runs the stages read -> decode -> write over a stream of items,
+    // connected by bounded queues:
+    //
+    //   read(in)           fills in the next input, or returns false
+    //   make_decoder()     makes the decoder d of one thread, which
+    //                      is called as d(in, out)
+    //   write(in, out)     is called for the items in input order
+    //
+    // Reading and writing each have a thread of their own. Decoding
+    // runs on a team of ndecoders OpenMP threads, so that each decoder
+    // draws from its own nn::rng engine; a single decoder can run its
+    // own team. At most window items are between read and write, which
+    // bounds the memory of the queues and of reordering.
+    template<typename In, typename Out,
+             typename Read, typename MakeDecoder, typename Write>
+    void ordered_pipeline(size_t ndecoders, size_t window,
+                          Read read, MakeDecoder make_decoder, Write write) {
+        struct item {
+            size_t seq;
+            In in;
+            Out out;
+        };
+        CHECK(ndecoders > 0) << "no decoders";
+        window = std::max(window, ndecoders);
+        bounded_queue<item> decode_queue(window);
+        bounded_queue<item> write_queue(window);
+
+        // Items read but not yet written
+        std::mutex flight_mutex;
+        std::condition_variable flight_cv;
+        size_t nread {0};
+        size_t nwritten {0};
+
+        std::thread reader([&] {
+            item x;
+            while (read(x.in)) {
+                {
+                    std::unique_lock<std::mutex> lock(flight_mutex);
+                    flight_cv.wait(lock, [&] { return nread - nwritten < window; });
+                    x.seq = nread ++;
+                }
+                decode_queue.push(std::move(x));
+                x = item();
+            }
+            decode_queue.close();
+        });
+
+        std::thread writer([&] {
+            std::map<size_t, item> pending;
+            size_t next {0};
+            item x;
+            while (write_queue.pop(x)) {
+                auto seq = x.seq;
+                pending.emplace(seq, std::move(x));
+                for (auto it = pending.find(next); it != pending.end();
+                     it = pending.find(next)) {
+                    write(it->second.in, it->second.out);
+                    pending.erase(it);
+                    ++ next;
+                    std::lock_guard<std::mutex> lock(flight_mutex);
+                    nwritten = next;
+                    flight_cv.notify_one();
+                }
+            }
+            CHECK(pending.empty()) << pending.size() << " items never written";
+        });
+
+        #pragma omp parallel num_threads(ndecoders)
+        {
+            auto decode = make_decoder();
+            item x;
+            while (decode_queue.pop(x)) {
+                decode(x.in, x.out);
+                write_queue.push(std::move(x));
+            }
+        }
+        write_queue.close();
+
+        reader.join();
+        writer.join();
+    }
+}
+
+#endif
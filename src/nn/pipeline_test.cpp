@@ -0,0 +1,50 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <omp.h>
+
+#include <nn/pipeline.hpp>
+
+TEST(Pipeline, WritesInInputOrder) {
+    const size_t n = 1000;
+    for (size_t ndecoders : { 1, 4 }) {
+        size_t next = 0;
+        auto read = [&](size_t& x) {
+            if (next == n) return false;
+            x = next ++;
+            return true;
+        };
+        auto make_decoder = [] {
+            return [](const size_t& x, size_t& y) {
+                // later items are done sooner, to shuffle them
+                volatile size_t spin = (n - x) % 97 * 100;
+                while (spin > 0) spin = spin - 1;
+                y = x * x;
+            };
+        };
+        std::vector<size_t> written;
+        auto write = [&](const size_t& x, const size_t& y) {
+            ASSERT_EQ(y, x * x);
+            written.push_back(x);
+        };
+        nn::ordered_pipeline<size_t, size_t>(ndecoders, 8, read,
+                                             make_decoder, write);
+        ASSERT_EQ(written.size(), n);
+        for (size_t i = 0; i < n; ++i) ASSERT_EQ(written[i], i);
+    }
+}
+
+TEST(Pipeline, EmptyInput) {
+    size_t nwritten = 0;
+    nn::ordered_pipeline<int, int>(
+        2, 4,
+        [](int&) { return false; },
+        [] { return [](const int&, int&) {}; },
+        [&](const int&, const int&) { nwritten ++; });
+    ASSERT_EQ(nwritten, 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
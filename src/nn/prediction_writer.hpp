@@ -0,0 +1,282 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_PREDICTION_WRITER_HPP__
+#define __NN_PREDICTION_WRITER_HPP__
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+
+#include <nn/log.hpp>
+#include <nn/data.hpp>
+
+namespace nn {
+
+    enum class OutputFormat {
+        CONLL, // word, gold tag, predicted tag; one word per line
+        TSV    // sentence, first word, length, tag; one entity per line
+    };
+
+    OutputFormat output_format_from_string(const std::string& name) {
+        if (name == "conll") return OutputFormat::CONLL;
+        if (name == "tsv")   return OutputFormat::TSV;
+        CHECK(false) << "unrecognized output format: " << name;
+        return OutputFormat::CONLL;
+    }
+
+    // Dense id -> string tables for everything that is written out,
+    // built once from the corpus symbol and tag tables so that
+    // writing a sentence needs no hashing or map copies.
+    class output_vocab {
+        std::vector<bool> sym_present; // ids may have gaps
+        std::vector<bool> tag_present;
+        std::vector<std::string> sym_strs;
+        std::vector<std::string> tag_strs;   // context tag and bare names
+        std::vector<std::string> begin_strs; // B-<tag>
+        std::vector<std::string> inside_strs; // I-<tag>
+        sym context_tag;
+
+        static std::vector<std::string> densify(
+            const std::unordered_map<size_t, std::string>& desc,
+            std::vector<bool>& present) {
+            size_t n = 0;
+            for (const auto& kv : desc) n = std::max(n, kv.first + 1);
+            std::vector<std::string> ret(n);
+            present.assign(n, false);
+            for (const auto& kv : desc) {
+                ret[kv.first] = kv.second;
+                present[kv.first] = true;
+            }
+            return ret;
+        }
+
+    public:
+        output_vocab(sym _context_tag,
+                     const std::unordered_map<size_t, std::string>& sym_desc,
+                     const std::unordered_map<size_t, std::string>& tag_desc)
+            : sym_strs(densify(sym_desc, sym_present)),
+              tag_strs(densify(tag_desc, tag_present)),
+              context_tag(_context_tag) {
+            CHECK(sym_strs.size() > 0);
+            CHECK(tag_strs.size() > 0);
+            for (const auto& t : tag_strs) {
+                begin_strs.push_back("B-" + t);
+                inside_strs.push_back("I-" + t);
+            }
+        }
+
+        template<typename Corpus>
+        explicit output_vocab(const Corpus& corpus)
+            : output_vocab(corpus.get_other_key(),
+                           corpus.symtab.get_map(),
+                           corpus.tagtab.get_map()) {}
+
+        sym get_context_tag() const { return context_tag; }
+
+        bool has_sym(sym s) const {
+            return s < sym_present.size() && sym_present[s];
+        }
+
+        bool has_tag(sym t) const {
+            return t < tag_present.size() && tag_present[t];
+        }
+
+        const std::string& tag(sym t) const {
+            CHECK(has_tag(t)) << "missing tag: " << t;
+            return tag_strs[t];
+        }
+
+        // CoNLL label of the j'th word of a span with tag t
+        const std::string& label(sym t, size_t j) const {
+            CHECK(has_tag(t)) << "missing tag: " << t;
+            if (t == context_tag) return tag_strs[t];
+            return j == 0 ? begin_strs[t] : inside_strs[t];
+        }
+
+        // Append the surface form of a BOS/EOS-wrapped word
+        void append_word(std::string& out, const syms& word) const {
+            for (size_t i = 1; i + 1 < word.size(); ++i) {
+                CHECK(has_sym(word[i])) << "missing symbol: " << word[i];
+                out.append(sym_strs[word[i]]);
+            }
+        }
+    };
+
+    // Buffered writer for predicted taggings. Output is formatted into
+    // an in-memory buffer and handed to the stream in large chunks.
+    class prediction_writer {
+        static constexpr size_t BUFFER_SIZE {1 << 20};
+
+        const output_vocab& vocab;
+        OutputFormat format;
+        std::ofstream of;
+        std::ostream* os; // of, or a stream of the caller's
+        std::string buf;
+        size_t nsent {0};
+        bool ok {true};
+
+        // per-word labels; reused across sentences
+        std::vector<const std::string*> pred_labels;
+        std::vector<const std::string*> gold_labels;
+
+        void expand(const syms& tags, const syms& lens,
+                    std::vector<const std::string*>& labels) const {
+            CHECK(tags.size() == lens.size()) << "unexpected size";
+            labels.clear();
+            for (size_t i = 0; i < tags.size(); ++i) {
+                CHECK(lens[i] > 0) << "lens must be > 0";
+                CHECK(tags[i] != vocab.get_context_tag() || lens[i] == 1);
+                for (size_t j = 0; j < lens[i]; ++j) {
+                    labels.push_back(&vocab.label(tags[i], j));
+                }
+            }
+        }
+
+        void write_conll(const phrase& words,
+                         const syms& pred_tags, const syms& pred_lens,
+                         const syms& gold_tags, const syms& gold_lens) {
+            expand(pred_tags, pred_lens, pred_labels);
+            expand(gold_tags, gold_lens, gold_labels);
+            CHECK(pred_labels.size() == gold_labels.size());
+            CHECK(gold_labels.size() == words.size()-1);
+            for (size_t i = 0; i < words.size()-1; ++i) {
+                vocab.append_word(buf, words[i]);
+                buf += ' ';
+                buf += *gold_labels[i];
+                buf += ' ';
+                buf += *pred_labels[i];
+                buf += '\n';
+            }
+            buf += '\n';
+        }
+
+        void write_tsv(const phrase& words,
+                       const syms& pred_tags, const syms& pred_lens) {
+            CHECK(pred_tags.size() == pred_lens.size()) << "unexpected size";
+            size_t start = 0;
+            for (size_t i = 0; i < pred_tags.size(); ++i) {
+                auto len = pred_lens[i];
+                CHECK(start + len < words.size()) << "span out of range";
+                if (pred_tags[i] != vocab.get_context_tag()) {
+                    buf += std::to_string(nsent);
+                    buf += '\t';
+                    buf += std::to_string(start);
+                    buf += '\t';
+                    buf += std::to_string(len);
+                    buf += '\t';
+                    buf += vocab.tag(pred_tags[i]);
+                    buf += '\t';
+                    for (size_t j = start; j < start + len; ++j) {
+                        if (j > start) buf += ' ';
+                        vocab.append_word(buf, words[j]);
+                    }
+                    buf += '\n';
+                }
+                start += len;
+            }
+        }
+
+    public:
+        prediction_writer(const std::string& path,
+                          const output_vocab& _vocab,
+                          OutputFormat _format = OutputFormat::CONLL)
+            : vocab(_vocab), format(_format), of(path), os(&of) {
+            CHECK(of.is_open()) << "problem opening: " << path;
+            buf.reserve(BUFFER_SIZE + 4096);
+        }
+
+        // Writes to out, which is flushed but not closed by close()
+        prediction_writer(std::ostream& out,
+                          const output_vocab& _vocab,
+                          OutputFormat _format = OutputFormat::CONLL)
+            : vocab(_vocab), format(_format), os(&out) {
+            buf.reserve(BUFFER_SIZE + 4096);
+        }
+
+        prediction_writer(prediction_writer const&)            = delete;
+        prediction_writer& operator=(prediction_writer const&) = delete;
+
+        ~prediction_writer() { close(); }
+
+        // The final word of each sentence is a sentinel and is not
+        // written (see CoNLLCorpus).
+        void write(const phrase& words,
+                   const syms& pred_tags, const syms& pred_lens,
+                   const syms& gold_tags, const syms& gold_lens) {
+            switch (format) {
+            case OutputFormat::CONLL:
+                write_conll(words, pred_tags, pred_lens, gold_tags, gold_lens);
+                break;
+            case OutputFormat::TSV:
+                write_tsv(words, pred_tags, pred_lens);
+                break;
+            }
+            nsent ++;
+            if (buf.size() >= BUFFER_SIZE) flush();
+        }
+
+        void flush() {
+            if (buf.empty()) return;
+            os->write(buf.data(), buf.size());
+            CHECK(os->good()) << "problem writing predictions";
+            buf.clear();
+        }
+
+        // Returns false if any of the predictions couldn't be written
+        bool close() {
+            if (!os) return ok;
+            flush();
+            if (of.is_open()) of.close();
+            else os->flush();
+            ok = os->good();
+            CHECK(ok) << "problem writing predictions";
+            os = nullptr;
+            return ok;
+        }
+    };
+
+    // Returns false if the state couldn't be written to path
+    template<typename P, typename I, typename C, typename M>
+    bool write_state(const std::vector<P>& state,
+                     const std::vector<I>& instances,
+                     const C& corpus,
+                     const M& model,
+                     std::string path,
+                     OutputFormat format = OutputFormat::CONLL
+        ) {
+        CHECK(state.size() == instances.size()) << "size mismatch";
+        CHECK(state.size() > 0);
+        output_vocab vocab(corpus);
+        prediction_writer out(path, vocab, format);
+        for(size_t n = 0; n < state.size(); ++n) {
+            const auto& p = state[n];
+            const auto& i = instances[n];
+            auto tags = model.get_tags(p);
+            auto lens = model.get_lens(p);
+            CHECK(tags.size() > 0);
+            CHECK(lens.size() > 0);
+            out.write(i.words, tags, lens, i.tags, i.lens);
+        }
+        return out.close();
+    }
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <unordered_map>
+
+#include <nn/prediction_writer.hpp>
+
+typedef std::unordered_map<size_t, std::string> desc_t;
+
+std::string read_file(std::string path) {
+    std::ifstream is(path);
+    std::stringstream ss;
+    ss << is.rdbuf();
+    return ss.str();
+}
+
+struct PredictionWriterTest : public ::testing::Test {
+    desc_t sym_desc { {0, "<bos>"}, {1, "<eos>"}, {2, "a"}, {3, "b"} };
+    desc_t tag_desc { {0, "O"}, {1, "PER"}, {2, "LOC"} };
+    nn::sym context_tag {0};
+
+    // "ab b a ba" plus the sentinel word
+    nn::phrase words { {0, 2, 3, 1}, {0, 3, 1}, {0, 2, 1}, {0, 3, 2, 1},
+                       {0, 1} };
+    nn::syms pred_tags { 1, 0, 2 };
+    nn::syms pred_lens { 2, 1, 1 };
+    nn::syms gold_tags { 1, 2 };
+    nn::syms gold_lens { 3, 1 };
+};
+
+TEST_F(PredictionWriterTest, ConllMatchesWriteTaggingConll) {
+    using namespace nn;
+    std::string expected_path {"/tmp/prediction_writer_expected.conll"};
+    std::string path {"/tmp/prediction_writer.conll"};
+    {
+        std::ofstream of(expected_path);
+        for (size_t i = 0; i < 2; ++i) {
+            write_tagging_conll(of, words, pred_tags, pred_lens,
+                                gold_tags, gold_lens, context_tag,
+                                sym_desc, tag_desc);
+        }
+    }
+    {
+        output_vocab vocab(context_tag, sym_desc, tag_desc);
+        prediction_writer out(path, vocab);
+        for (size_t i = 0; i < 2; ++i) {
+            out.write(words, pred_tags, pred_lens, gold_tags, gold_lens);
+        }
+    }
+    ASSERT_EQ( read_file(path), read_file(expected_path) );
+}
+
+TEST_F(PredictionWriterTest, TsvListsEntitySpans) {
+    using namespace nn;
+    std::string path {"/tmp/prediction_writer.tsv"};
+    {
+        output_vocab vocab(context_tag, sym_desc, tag_desc);
+        prediction_writer out(path, vocab, OutputFormat::TSV);
+        for (size_t i = 0; i < 2; ++i) {
+            out.write(words, pred_tags, pred_lens, gold_tags, gold_lens);
+        }
+    }
+    std::string expected {
+        "0\t0\t2\tPER\tab b\n"
+        "0\t3\t1\tLOC\tba\n"
+        "1\t0\t2\tPER\tab b\n"
+        "1\t3\t1\tLOC\tba\n"
+    };
+    ASSERT_EQ( read_file(path), expected );
+}
+
+TEST_F(PredictionWriterTest, CloseReportsFailedWrites) {
+    using namespace nn;
+    output_vocab vocab(context_tag, sym_desc, tag_desc);
+    {
+        prediction_writer out("/tmp/prediction_writer.conll", vocab);
+        out.write(words, pred_tags, pred_lens, gold_tags, gold_lens);
+        ASSERT_TRUE(out.close());
+        ASSERT_TRUE(out.close());
+    }
+    {
+        // every write to /dev/full fails with ENOSPC
+        prediction_writer out("/dev/full", vocab);
+        out.write(words, pred_tags, pred_lens, gold_tags, gold_lens);
+        ASSERT_FALSE(out.close());
+        ASSERT_FALSE(out.close());
+    }
+    {
+        std::ostringstream os;
+        os.setstate(std::ios::badbit);
+        prediction_writer out(os, vocab, OutputFormat::TSV);
+        out.write(words, pred_tags, pred_lens, gold_tags, gold_lens);
+        ASSERT_FALSE(out.close());
+    }
+}
+
+TEST_F(PredictionWriterTest, VocabKnowsWhichIdsAreMissing) {
+    using namespace nn;
+    desc_t gappy_tags { {0, "O"}, {2, "LOC"} };
+    output_vocab vocab(context_tag, sym_desc, gappy_tags);
+    ASSERT_TRUE(vocab.has_tag(0));
+    ASSERT_FALSE(vocab.has_tag(1));
+    ASSERT_TRUE(vocab.has_tag(2));
+    ASSERT_FALSE(vocab.has_tag(3));
+    ASSERT_EQ(vocab.label(2, 1), "I-LOC");
+    ASSERT_TRUE(vocab.has_sym(3));
+    ASSERT_FALSE(vocab.has_sym(4));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_PROFILE_HPP__
+#define __NN_PROFILE_HPP__
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <nn/log.hpp>
+
+// Hot path profiling. Built with NN_PROFILE defined (cmake
+// -DNN_PROFILE=ON),
+//
+//   NN_PROFILE_SCOPE("name")     times the rest of the enclosing block
+//   NN_PROFILE_COUNT("name", n)  adds n to a counter
+//
+// Scopes nest: what is timed or counted inside the scope "a" is
+// reported as "a/name". Each thread records into a tree of its own,
+// without locks, and the trees are merged by path when reported, so
+// times are summed over threads. As there are no locks, the totals
+// may only be collected, reported or reset while no other thread
+// records, e.g. after the parallel regions have joined. Names must be
+// string literals. Without NN_PROFILE the macros expand to nothing.
+#ifdef NN_PROFILE
+#define NN_PROFILE_CAT2(a, b) a ## b
+#define NN_PROFILE_CAT(a, b) NN_PROFILE_CAT2(a, b)
+#define NN_PROFILE_SCOPE(name) \
+    nn::profile::scope NN_PROFILE_CAT(nn_profile_scope_, __LINE__)(name)
+#define NN_PROFILE_COUNT(name, n) nn::profile::local().count(name, n)
+#else
+#define NN_PROFILE_SCOPE(name) do {} while (0)
+#define NN_PROFILE_COUNT(name, n) do {} while (0)
+#endif
+
+namespace nn {
+namespace profile {
+
+    struct totals {
+        uint64_t calls {0}; // scopes entered
+        uint64_t ns    {0}; // time spent in them
+        uint64_t count {0}; // counter increments
+    };
+
+    // The scopes and counters of one thread; node 0 is the root
+    class thread_tree {
+        struct node {
+            const char* name;
+            size_t parent;
+            totals t;
+            std::vector<size_t> children;
+        };
+        std::vector<node> nodes;
+        size_t current {0};
+
+        size_t child(const char* name) {
+            for (auto c : nodes[current].children) {
+                if (nodes[c].name == name) return c;
+            }
+            nodes.push_back(node { name, current, totals(), {} });
+            nodes[current].children.push_back(nodes.size() - 1);
+            return nodes.size() - 1;
+        }
+
+    public:
+        thread_tree() { nodes.push_back(node { "", 0, totals(), {} }); }
+
+        size_t enter(const char* name) { return current = child(name); }
+
+        void leave(size_t n, uint64_t ns) {
+            nodes[n].t.calls ++;
+            nodes[n].t.ns += ns;
+            current = nodes[n].parent;
+        }
+
+        void count(const char* name, uint64_t n) {
+            nodes[child(name)].t.count += n;
+        }
+
+        // Adds the totals of each node to out, by path; parents come
+        // before their children
+        void collect(std::map<std::string, totals>& out) const {
+            std::vector<std::string> paths(nodes.size());
+            for (size_t i = 1; i < nodes.size(); ++i) {
+                const auto& parent = paths[nodes[i].parent];
+                paths[i] = parent.empty() ? nodes[i].name
+                    : parent + "/" + nodes[i].name;
+                auto& x = out[paths[i]];
+                x.calls += nodes[i].t.calls;
+                x.ns    += nodes[i].t.ns;
+                x.count += nodes[i].t.count;
+            }
+        }
+
+        void reset() {
+            for (auto& x : nodes) x.t = totals();
+        }
+    };
+
+    // The trees of all threads that have recorded anything. They
+    // outlive their threads, so that a report at exit sees them all.
+    class registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<thread_tree>> trees;
+
+    public:
+        static registry& get() {
+            static registry r;
+            return r;
+        }
+
+        thread_tree* add() {
+            std::lock_guard<std::mutex> lock(mutex);
+            trees.emplace_back(new thread_tree());
+            return trees.back().get();
+        }
+
+        // The totals of all threads by path. No other thread may be
+        // recording: its tree may grow, and move, as it is read.
+        std::map<std::string, totals> collect() {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<std::string, totals> ret;
+            for (const auto& t : trees) t->collect(ret);
+            return ret;
+        }
+
+        // As collect(), only while no other thread records
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& t : trees) t->reset();
+        }
+    };
+
+    inline thread_tree& local() {
+        static thread_local thread_tree* tree = registry::get().add();
+        return *tree;
+    }
+
+    class scope {
+        thread_tree& tree;
+        size_t node;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        explicit scope(const char* name)
+            : tree(local()),
+              node(tree.enter(name)),
+              start(std::chrono::steady_clock::now()) {}
+
+        scope(scope const&)            = delete;
+        scope& operator=(scope const&) = delete;
+
+        ~scope() {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            tree.leave(node, ns);
+        }
+    };
+
+    inline std::string to_json(const std::map<std::string, totals>& stats) {
+        std::ostringstream os;
+        os << "{\n  \"profile\": [";
+        bool first = true;
+        for (const auto& kv : stats) {
+            os << (first ? "\n" : ",\n")
+               << "    { \"path\": \"" << kv.first << "\""
+               << ", \"calls\": "   << kv.second.calls
+               << ", \"seconds\": " << kv.second.ns / 1e9
+               << ", \"count\": "   << kv.second.count << " }";
+            first = false;
+        }
+        os << "\n  ]\n}\n";
+        return os.str();
+    }
+
+    // Logs a table of the totals so far, and writes them as JSON to
+    // json_path unless it is empty. Call it once the other threads
+    // are done recording (see registry::collect).
+    inline void report(const std::string& json_path = "") {
+#ifndef NN_PROFILE
+        if (json_path != "") {
+            LOG(INFO) << "Not writing " << json_path
+                      << ": built without NN_PROFILE";
+        }
+        return;
+#endif
+        auto stats = registry::get().collect();
+        LOG(INFO) << "Profile (times summed over threads):";
+        LOG(INFO) << std::left << std::setw(56) << "path"
+                  << std::right << std::setw(12) << "calls"
+                  << std::setw(12) << "ms"
+                  << std::setw(12) << "us/call"
+                  << std::setw(14) << "count";
+        for (const auto& kv : stats) {
+            const auto& x = kv.second;
+            auto ms = x.ns / 1e6;
+            std::ostringstream row;
+            row << std::left << std::setw(56) << kv.first << std::right
+                << std::setw(12) << x.calls
+                << std::setw(12) << std::fixed << std::setprecision(1) << ms
+                << std::setw(12) << std::setprecision(3)
+                << (x.calls > 0 ? 1000 * ms / x.calls : 0.0)
+                << std::setw(14) << x.count;
+            LOG(INFO) << row.str();
+        }
+        if (json_path == "") return;
+        std::ofstream of(json_path);
+        CHECK(of.is_open()) << "problem opening: " << json_path;
+        of << to_json(stats);
+        LOG(INFO) << "Profile written to: " << json_path;
+    }
+}
+}
+
+#endif
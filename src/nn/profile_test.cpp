@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+// profile every header included below
+#ifndef NN_PROFILE
+#define NN_PROFILE
+#endif
+
+#include <nn/profile.hpp>
+#include <nn/timing.hpp>
+#include <nn/uniform.hpp>
+#include <nn/fixed_depth_hpyp.hpp>
+
+using namespace nn;
+
+TEST(Profile, ScopesNestByPath) {
+    profile::registry::get().reset();
+    {
+        NN_PROFILE_SCOPE("outer");
+        for (size_t i = 0; i < 3; ++i) {
+            NN_PROFILE_SCOPE("inner");
+            NN_PROFILE_COUNT("hits", 2);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        NN_PROFILE_COUNT("hits", 1);
+    }
+    auto stats = profile::registry::get().collect();
+    ASSERT_EQ(stats.at("outer").calls, 1);
+    ASSERT_EQ(stats.at("outer/inner").calls, 3);
+    ASSERT_EQ(stats.at("outer/inner/hits").count, 6);
+    ASSERT_EQ(stats.at("outer/hits").count, 1);
+    ASSERT_GE(stats.at("outer/inner").ns, 3000000);
+    ASSERT_GE(stats.at("outer").ns, stats.at("outer/inner").ns);
+
+    auto json = profile::to_json(stats);
+    ASSERT_NE(json.find("\"path\": \"outer/inner/hits\""), std::string::npos);
+}
+
+TEST(Profile, ThreadsAreMerged) {
+    profile::registry::get().reset();
+    const size_t n = 1000;
+    #pragma omp parallel num_threads(4)
+    {
+        NN_PROFILE_SCOPE("team");
+        #pragma omp for
+        for (size_t i = 0; i < n; ++i) {
+            NN_PROFILE_COUNT("items", 1);
+        }
+    }
+    std::thread other([] { NN_PROFILE_COUNT("items", 1); });
+    other.join();
+    auto stats = profile::registry::get().collect();
+    ASSERT_EQ(stats.at("team/items").count, n);
+    ASSERT_EQ(stats.at("items").count, 1);
+}
+
+TEST(Profile, CountsRestaurantTables) {
+    typedef HashIntegralMeasure<size_t>        Base;
+    typedef FixedDepthHPYP<size_t,size_t,Base> Model;
+    rng::init();
+    profile::registry::get().reset();
+    Base H;
+    for (size_t i = 0; i < 5; ++i) H.add(i, 1.0);
+    Model model(H);
+    std::vector<size_t> obs { 0, 1, 2, 2, 1, 3, 0, 1, 2, 3, 4 };
+    for (auto it = obs.begin()+1; it != obs.end(); ++it) {
+        model.observe(obs.begin(), it, *it);
+        model.log_prob(obs.begin(), it, *it);
+    }
+    auto stats = profile::registry::get().collect();
+    ASSERT_EQ(stats.at("hpyp.observe").calls, obs.size() - 1);
+    ASSERT_EQ(stats.at("hpyp.prob").calls, obs.size() - 1);
+    ASSERT_EQ(stats.at("hpyp.observe/restaurant.new_tables").count,
+              model.total_n_tables);
+    ASSERT_GE(stats.at("hpyp.observe/restaurant.customers").count,
+              model.total_n_customers);
+}
+
+TEST(Profile, CountsBulkObservations) {
+    typedef HashIntegralMeasure<size_t>        Base;
+    typedef FixedDepthHPYP<size_t,size_t,Base> Model;
+    rng::init();
+    profile::registry::get().reset();
+    Base H;
+    for (size_t i = 0; i < 5; ++i) H.add(i, 1.0);
+    Model model(H);
+    std::vector<size_t> ctx { 0, 1 };
+    model.observe(ctx, 2, 7);
+    model.observe(ctx, 3, 1);
+    model.observe(ctx, 4, 0);
+    auto stats = profile::registry::get().collect();
+    ASSERT_EQ(stats.at("hpyp.observe_bulk").calls, 2);
+    ASSERT_EQ(stats.at("hpyp.observe_bulk/customers").count, 8);
+    ASSERT_GE(stats.at("hpyp.observe_bulk/restaurant.customers").count, 8);
+    ASSERT_EQ(stats.at("hpyp.observe_bulk/restaurant.new_tables").count,
+              model.total_n_tables);
+    ASSERT_EQ(stats["hpyp.observe"].calls, 0);
+}
+
+TEST(Timing, TicTocNest) {
+    tic();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    tic();
+    auto inner = toc();
+    auto outer = toc();
+    ASSERT_LT(inner.count(), outer.count());
+    ASSERT_GE(std::chrono::duration_cast<std::chrono::milliseconds>(outer).count(), 20);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -19,11 +19,16 @@
 #ifndef __NN_READER_HPP__
 #define __NN_READER_HPP__
 
+#include <cstring>
 #include <iomanip>
+#include <iterator>
+#include <limits>
 #include <system_error>
+#include <unordered_map>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/join.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include <nn/log.hpp>
 #include <nn/utf8.hpp>
@@ -70,6 +75,68 @@ namespace nn {
         return ret;
     }
 
+    // Split a line into fields at any of the delimiters without
+    // copying; like boost::split, adjacent delimiters yield empty
+    // fields.
+    void split_fields(boost::string_ref line,
+                      const char* delims,
+                      std::vector<boost::string_ref>& fields) {
+        fields.clear();
+        size_t start = 0;
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (strchr(delims, line[i]) != nullptr) {
+                fields.push_back(line.substr(start, i - start));
+                start = i + 1;
+            }
+        }
+        fields.push_back(line.substr(start));
+    }
+
+    // Maps Unicode codepoints to symbol ids: a dense table over the
+    // basic multilingual plane, grown up to the largest codepoint
+    // seen, and a hash map for the remaining planes.
+    template<typename k_type = size_t>
+    class codepoint_index {
+        static constexpr uint32_t BMP_SIZE {0x10000};
+        static constexpr k_type NONE {std::numeric_limits<k_type>::max()};
+
+        std::vector<k_type> dense;
+        std::unordered_map<uint32_t, k_type> sparse;
+
+    public:
+        bool find(uint32_t cp, k_type& key) const {
+            if (cp < BMP_SIZE) {
+                if (cp >= dense.size() || dense[cp] == NONE) return false;
+                key = dense[cp];
+                return true;
+            }
+            auto it = sparse.find(cp);
+            if (it == sparse.end()) return false;
+            key = it->second;
+            return true;
+        }
+
+        void put(uint32_t cp, k_type key) {
+            if (cp < BMP_SIZE) {
+                if (cp >= dense.size()) dense.resize(cp + 1, NONE);
+                dense[cp] = key;
+            } else {
+                sparse[cp] = key;
+            }
+        }
+
+        void clear() {
+            dense.clear();
+            sparse.clear();
+        }
+    };
+
+    template<typename k_type>
+    constexpr uint32_t codepoint_index<k_type>::BMP_SIZE;
+
+    template<typename k_type>
+    constexpr k_type codepoint_index<k_type>::NONE;
+
     std::vector<std::string> split_tag(std::string tag, std::string other_tag) {
         size_t found = tag.find("-");
         if(found != std::string::npos) {
@@ -101,9 +168,48 @@ namespace nn {
 
         std::string unk_tag {"?"}; // string value for unknown (latent) tags
 
+    private:
+        // Symbols which are single codepoints, by codepoint. This is
+        // derived from symtab and is rebuilt rather than serialized.
+        codepoint_index<k_type> cpindex;
+
+        void index_symbol(k_type key, const s_type& val) {
+            const char* it  = val.data();
+            const char* end = it + val.size();
+            if (it == end) return;
+            uint32_t cp = utf8::next(it, end);
+            if (it == end) cpindex.put(cp, key);
+        }
+
+        void index_symbols() {
+            cpindex.clear();
+            for (const auto& kv : symtab.get_map()) {
+                index_symbol(kv.first, kv.second);
+            }
+        }
+
+        // Symbol for a codepoint, adding it to the symbol table if
+        // needed; only valid before the corpus is frozen.
+        k_type get_or_add_key(uint32_t cp) {
+            k_type s;
+            if (cpindex.find(cp, s)) return s;
+            std::string c;
+            utf8::append(cp, std::back_inserter(c));
+            s = symtab.get_or_add_key(c);
+            cpindex.put(cp, s);
+            return s;
+        }
+
+        // Symbol for a codepoint, or unk if it hasn't been seen
+        k_type key_or_unk(uint32_t cp) const {
+            k_type s;
+            if (cpindex.find(cp, s)) return s;
+            return unk;
+        }
+
     public:
         template<class Archive>
-        void serialize(Archive & archive) {
+        void save(Archive & archive) const {
             archive( symtab,
                      tagtab,
                      bos,
@@ -115,6 +221,20 @@ namespace nn {
                      unk_tag);
         }
 
+        template<class Archive>
+        void load(Archive & archive) {
+            archive( symtab,
+                     tagtab,
+                     bos,
+                     eos,
+                     space,
+                     unk,
+                     other_tag,
+                     frozen,
+                     unk_tag);
+            index_symbols();
+        }
+
       CoNLLCorpus() {}
       CoNLLCorpus(s_type _bos,   // beginning of sequence
                   s_type _eos,   // end of sequence
@@ -127,6 +247,7 @@ namespace nn {
         space     = symtab.add_key(_space);
         unk       = symtab.add_key(_unk);
         other_tag = tagtab.add_key(_other);
+        index_symbols();
       }
 
       const s_type& get_bos_val()   const { return symtab.val(bos);       }
@@ -141,6 +262,12 @@ namespace nn {
       k_type get_unk_key()   const { return unk;       }
       k_type get_other_key() const { return other_tag; }
 
+      // Is tag the label of words whose tag is latent? Such tags only
+      // appear in partially annotated (SEMI) data.
+      bool is_unk_tag(k_type tag) const {
+        return tagtab.has_key(unk_tag) && tagtab.key(unk_tag) == tag;
+      }
+
         syms get_eos_obs() const {
             syms EOS { 0, eos, 0 };
             return EOS;
@@ -160,9 +287,9 @@ namespace nn {
             }
             size_t result = 0;
             std::string line;
+            std::vector<boost::string_ref> toks;
             while (std::getline(infile, line)) {
-                std::vector<std::string> toks;
-                boost::split(toks, line, boost::is_any_of(" \n\t"));
+                split_fields(line, " \n\t", toks);
                 if(toks.size() != 2) { // end of sentence
                     result ++;
                 }
@@ -171,6 +298,17 @@ namespace nn {
             return result;
         }
 
+        // Symbol for a character (the UTF-8 encoding of a single
+        // codepoint). Once the corpus is frozen, unseen characters
+        // map to unk; before that they are added to the symbol table.
+        k_type get_symbol(const std::string& c) {
+            const char* it  = c.data();
+            const char* end = it + c.size();
+            uint32_t cp = utf8::next(it, end);
+            CHECK(it == end) << "not a single character: " << c;
+            return frozen ? key_or_unk(cp) : get_or_add_key(cp);
+        }
+
       std::string get_tagging_string(std::vector<size_t> tags,
                                      std::vector<size_t> lens) const {
         std::vector<std::string> tagging;
@@ -192,23 +330,20 @@ namespace nn {
         return boost::algorithm::join(tagging, " ");
       }
 
-      instance line_to_instance(std::string line) const {
+      instance line_to_instance(boost::string_ref line) const {
         CHECK(frozen) << "this should be used after training a model";
         instance sentence;
-        std::vector<std::string> tokens;
-        boost::split(tokens, line, boost::is_any_of(" \t"));
+        std::vector<boost::string_ref> tokens;
+        split_fields(line, " \t", tokens);
         sentence.chars.push_back(bos);
         for (auto token : tokens) {
-          auto chars = split_utf8_word(token);
-          auto i = 0;
           std::vector<size_t> word {bos};
-          for (auto c : chars) {
-            k_type s;
-            if(symtab.has_key(c)) {
-              s = symtab.key(c);
-            } else {
-              s = unk;
-            }
+          const char* it  = token.data();
+          const char* end = it + token.size();
+          while (it < end) {
+            uint32_t cp = utf8::next(it, end);
+            if (cp == 0) continue;
+            k_type s = key_or_unk(cp);
             word.push_back(s);
             sentence.chars.push_back(s);
           }
@@ -221,6 +356,43 @@ namespace nn {
         return sentence;
       }
 
+      // Parses a sentence together with its labels (in the format of
+      // get_tagging_string). Returns false, leaving the sentence
+      // unspecified, if the labels don't match the words or use an
+      // unknown tag.
+      bool line_to_instance(boost::string_ref line,
+                            boost::string_ref labels,
+                            instance& sentence) const {
+        sentence = line_to_instance(line);
+        std::vector<boost::string_ref> toks;
+        split_fields(labels, " \t", toks);
+        if (toks.size() != sentence.words.size() - 1) return false;
+        const auto& other_tag_str = tagtab.val(other_tag);
+        for (auto tok : toks) {
+          std::string raw_tag(tok);
+          if (raw_tag == other_tag_str) {
+            sentence.tags.push_back(other_tag);
+            sentence.lens.push_back(1);
+            continue;
+          }
+          if (raw_tag.size() < 3 || raw_tag[1] != '-') return false;
+          std::string tag(raw_tag.substr(2));
+          if (!tagtab.has_key(tag)) return false;
+          auto key = tagtab.key(tag);
+          if (raw_tag[0] == 'B') {
+            sentence.tags.push_back(key);
+            sentence.lens.push_back(1);
+          } else if (raw_tag[0] == 'I' && sentence.tags.size() > 0 &&
+                     sentence.tags.back() == key) {
+            sentence.lens.back() ++;
+          } else {
+            return false;
+          }
+        }
+        sentence.obs = Annotation::FULL;
+        return true;
+      }
+
         std::tuple<instances, instances>
         read(std::string path,
              std::set<size_t> train_idx,
@@ -256,172 +428,186 @@ namespace nn {
         return ret;
       }
 
-        std::vector<instance>
-        read(std::string path,
-             std::set<size_t> include = std::set<size_t>()) {
-            std::vector<instance> ret;
-            std::string line;
-            std::ifstream infile;
-
-            bool filter = (include.size() > 0);
-            LOG(INFO) << "filter? " << filter
-                      << " include.size() = " << include.size();
-
-            infile.open(path);
-            if(!infile) {
-                LOG(FATAL) << "Error reading path: `" << path << "'";
-                throw std::system_error(EIO, std::generic_category());
-            }
-
-            std::set<size_t> unique_syms;
-
+        // Running state of a read of a file, one sentence at a time
+        // (see read_next): counts over the sentences read so far, and
+        // those of the last one
+        struct read_state {
             instance sentence;
-            size_t nwords { 0 };
-            size_t ntags  { 0 };
-            sentence.chars.push_back(bos);
-
-            size_t tot_n_words {0};
-            size_t tot_n_tags  {0};
-
+            int line_idx {-1};
+            size_t nwords {0};
+            size_t ntags  {0};
             size_t n_full {0};
             size_t n_semi {0};
             size_t n_none {0};
-
             size_t n_unk  {0};
+            std::set<size_t> unique_syms;
+        };
 
-            size_t idx {0};
-            int line_idx {-1};
+        // Reads the next sentence of infile into sentence. Returns
+        // false at the end of the file, where a sentence that isn't
+        // followed by a blank line is dropped.
+        bool read_next(std::istream& infile, read_state& st, instance& sentence) {
+            std::string line;
+            std::vector<boost::string_ref> toks;
+
+            st.nwords = 0;
+            st.ntags  = 0;
+            st.sentence.clear();
+            st.sentence.chars.push_back(bos);
 
             while (std::getline(infile, line)) {
-                ++line_idx;
-                std::vector<std::string> toks;
-                boost::split(toks, line, boost::is_any_of(" \n\t"));
+                ++st.line_idx;
+                split_fields(line, " \n\t", toks);
                 if(toks.size() != 2) { // end of sentence
-                    if(sentence.tags.size() < 1) {
+                    if(st.sentence.tags.size() < 1) {
                         throw std::runtime_error("pushing empty sentence");
                     }
-                    sentence.chars.push_back(eos);
+                    st.sentence.chars.push_back(eos);
 
                     // Add an EOS word:
-                    sentence.words.push_back( get_eos_obs() );
+                    st.sentence.words.push_back( get_eos_obs() );
 
                     // Make sure total len makes sense:
                     size_t tot_len = 0;
-                    for (auto l : sentence.lens) {
+                    for (auto l : st.sentence.lens) {
                         CHECK(l > 0) << "bad len";
                         tot_len += l;
                     }
-                    CHECK(tot_len == nwords) << nwords << " != " << tot_len
-                                             << "; line = " << line_idx;
+                    CHECK(tot_len == st.nwords) << st.nwords << " != " << tot_len
+                                                << "; line = " << st.line_idx;
 
                     // Check last word isn't empty
-                    CHECK(sentence.words.back().size() > 2) << "empty last word";
-                    auto last_word = sentence.words.back();
-
-                    if(nwords == ntags) {
-                        sentence.obs = Annotation::FULL;
-                        ++ n_full;
-                    } else if(ntags > 0) {
-                        sentence.obs = Annotation::SEMI;
-                        ++ n_semi;
+                    CHECK(st.sentence.words.back().size() > 2) << "empty last word";
+
+                    if(st.nwords == st.ntags) {
+                        st.sentence.obs = Annotation::FULL;
+                        ++ st.n_full;
+                    } else if(st.ntags > 0) {
+                        st.sentence.obs = Annotation::SEMI;
+                        ++ st.n_semi;
                     } else {
-                        sentence.obs = Annotation::NONE;
-                        ++ n_none;
+                        st.sentence.obs = Annotation::NONE;
+                        ++ st.n_none;
                     }
 
-                    if((filter && include.count(idx) > 0) || (!filter)) {
-                        ret.push_back(sentence); // push back a copy
-                        tot_n_words += nwords;
-                        tot_n_tags += ntags;
-                    }
-
-                    nwords = 0;
-                    ntags = 0;
-                    sentence.clear();
-                    sentence.chars.push_back(bos);
-
-                    // Increment sentence index
-                    ++ idx;
-
-                    continue;
+                    sentence = std::move(st.sentence);
+                    return true;
                 }
                 else if (toks.size() == 2) {
-                    ++ nwords;
+                    ++ st.nwords;
 
-                    std::string obs(toks[0]);
+                    boost::string_ref obs(toks[0]);
                     std::string raw_tag(toks[1]);
 
                     if (!(raw_tag == unk_tag)) {
-                        ++ ntags;
+                        ++ st.ntags;
                     }
 
-                    CHECK(obs != "") << "empty observation for line: " << line;
+                    CHECK(!obs.empty()) << "empty observation for line: " << line;
 
-                    // split tag into parts (takes strings)
-                    auto other_tag_str = tagtab.val(other_tag);
-                    auto parts         = split_tag(raw_tag, other_tag_str);
+                    // split tag into parts (takes strings); a word of
+                    // unknown label is a segment of its own
+                    const auto& other_tag_str = tagtab.val(other_tag);
+                    auto parts = raw_tag == unk_tag
+                        ? std::vector<std::string> { "B", unk_tag }
+                        : split_tag(raw_tag, other_tag_str);
 
                     std::string tag_type(parts[0]);
                     std::string tag(parts[1]);
 
-                    std::vector<std::string> chars = split_utf8_word(obs);
-
                     // the "other" tag will be of this type
                     if(tag_type == "B") {
-                        if(sentence.words.size() > 0) {
-                            sentence.chars.push_back( space );
+                        if(st.sentence.words.size() > 0) {
+                            st.sentence.chars.push_back( space );
                         }
-                        sentence.lens.push_back( 1 );
-                        sentence.tags.push_back( tagtab.get_or_add_key(tag) );
+                        st.sentence.lens.push_back( 1 );
+                        st.sentence.tags.push_back( tagtab.get_or_add_key(tag) );
                     }
 
                     std::vector<k_type> w { bos }; // start every word seq with <bos>
-                    sentence.words.push_back( w );
+                    st.sentence.words.push_back( w );
 
                     // current word and its length
-                    std::vector<k_type>& word = sentence.words.back();
-                    size_t& len               = sentence.lens.back();
+                    std::vector<k_type>& word = st.sentence.words.back();
+                    size_t& len               = st.sentence.lens.back();
 
                     // if continuing a phrase, increment the sequence length
                     if(tag_type == "I") {
                         ++len;
-                        sentence.chars.push_back( space );
+                        st.sentence.chars.push_back( space );
                     }
 
-                    size_t i = 0;
-                    for (std::string c : chars) {
-                        k_type s;
+                    // decode the codepoints of the observation in place
+                    const char* it  = obs.data();
+                    const char* end = it + obs.size();
+                    while (it < end) {
+                        uint32_t cp = utf8::next(it, end);
+                        if (cp == 0) continue;
 
+                        k_type s;
                         if(frozen) {
-                            if(symtab.has_key(c)) {
-                                s = symtab.key(c);
-                            } else {
-                                n_unk++;
-                                s = unk;
-                            }
+                            s = key_or_unk(cp);
+                            if (s == unk) st.n_unk++;
                         } else {
-                            s = symtab.get_or_add_key(c);
+                            s = get_or_add_key(cp);
                         }
 
-                        unique_syms.insert(s);
+                        st.unique_syms.insert(s);
                         word.push_back(s);
-                        sentence.chars.push_back(s);
+                        st.sentence.chars.push_back(s);
                     }
                     word.push_back(eos);
                 } else {
                     throw std::runtime_error("unrecognized data format");
                 }
             }
+            return false;
+        }
+
+        std::vector<instance>
+        read(std::string path,
+             std::set<size_t> include = std::set<size_t>()) {
+            std::vector<instance> ret;
+            std::ifstream infile;
+
+            bool filter = (include.size() > 0);
+            LOG(INFO) << "filter? " << filter
+                      << " include.size() = " << include.size();
+
+            infile.open(path);
+            if(!infile) {
+                LOG(FATAL) << "Error reading path: `" << path << "'";
+                throw std::system_error(EIO, std::generic_category());
+            }
+
+            read_state st;
+            instance sentence;
+
+            size_t tot_n_words {0};
+            size_t tot_n_tags  {0};
+
+            size_t idx {0};
+
+            while (read_next(infile, st, sentence)) {
+                if((filter && include.count(idx) > 0) || (!filter)) {
+                    ret.push_back(std::move(sentence));
+                    tot_n_words += st.nwords;
+                    tot_n_tags += st.ntags;
+                }
+
+                // Increment sentence index
+                ++ idx;
+            }
 
             infile.close();
 
             //CHECK(tot_n_words > 0);
             //CHECK(tot_n_tags > 0);
 
-            LOG(INFO) << "n_unique_sym = " << unique_syms.size();
+            LOG(INFO) << "n_unique_sym = " << st.unique_syms.size();
             LOG(INFO) << "n_words = " << tot_n_words << " n_tags = " << tot_n_tags;
-            LOG(INFO) << "n_full = " << n_full << " n_semi = " << n_semi
-                      << " n_none = " << n_none;
+            LOG(INFO) << "n_full = " << st.n_full << " n_semi = " << st.n_semi
+                      << " n_none = " << st.n_none;
 
             return ret;
         }
@@ -432,6 +618,19 @@ namespace nn {
             frozen = true;
         }
 
+        // Symbol for val, adding it even if the corpus is frozen. This
+        // is for merging models trained on other corpora, whose
+        // symbols need to be known to this one.
+        k_type merge_symbol(const s_type& val) {
+            if (symtab.has_key(val)) return symtab.key(val);
+            bool was_frozen = symtab.is_frozen();
+            symtab.unfreeze();
+            auto key = symtab.add_key(val);
+            if (was_frozen) symtab.freeze();
+            index_symbol(key, val);
+            return key;
+        }
+
         void log_instance(const instance& i) {
             LOG(INFO) << i.words.size() << " words";
             LOG(INFO) << i.lens.size()  << " lens";
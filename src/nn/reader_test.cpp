@@ -1,9 +1,14 @@
 #include <gtest/gtest.h>
 
+#include <memory>
 #include <string>
+#include <csignal>
 #include <fstream>
 
+#include <sys/resource.h>
+
 #include <nn/reader.hpp>
+#include <nn/corpus_cache.hpp>
 
 #include <cereal/archives/binary.hpp>
 
@@ -33,3 +38,209 @@ TEST(Reader, CerealWorks) {
         ASSERT_EQ(corpus1.other_tag, corpus2.other_tag);
     }
 }
+
+TEST(Reader, CodepointsMapToSymbols) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+    std::string fn {"/tmp/reader_test.conll"};
+    {
+        // two-, three- and four-byte sequences
+        std::ofstream os(fn);
+        os << "Zo\xc3\xab B-PER\n";
+        os << "\xe6\x97\xa5\xf0\x9d\x84\x9e O\n";
+        os << "\n";
+    }
+    auto train = corpus.read(fn);
+    ASSERT_EQ(train.size(), 1);
+    const auto& words = train[0].words;
+    ASSERT_EQ(words.size(), 3);
+    ASSERT_EQ(words[0].size(), 5);
+    ASSERT_EQ(words[1].size(), 4);
+    ASSERT_EQ(corpus.symtab.val(words[0][3]), "\xc3\xab");
+    ASSERT_EQ(corpus.symtab.val(words[1][2]), "\xf0\x9d\x84\x9e");
+
+    corpus.freeze();
+    auto i = corpus.line_to_instance("\xc3\xab\xf0\x9d\x84\x9e Zq");
+    ASSERT_EQ(i.words.size(), 3);
+    ASSERT_EQ(i.words[0][1], words[0][3]);
+    ASSERT_EQ(i.words[0][2], words[1][2]);
+    ASSERT_EQ(i.words[1][1], words[0][1]);
+    ASSERT_EQ(i.words[1][2], corpus.unk);
+
+    // the index is rebuilt when a corpus is loaded
+    std::string cfn {"/tmp/reader_codepoints.cereal"};
+    {
+        std::ofstream os(cfn, std::ios::binary);
+        cereal::BinaryOutputArchive oarchive(os);
+        oarchive( corpus );
+    }
+    Corpus loaded;
+    {
+        std::ifstream is(cfn, std::ios::binary);
+        cereal::BinaryInputArchive iarchive(is);
+        iarchive( loaded );
+    }
+    auto j = loaded.line_to_instance("\xc3\xab\xf0\x9d\x84\x9e Zq");
+    ASSERT_EQ(i.words, j.words);
+    ASSERT_EQ(i.chars, j.chars);
+}
+
+void expect_same(const nn::instances& a, const nn::instances& b) {
+    ASSERT_EQ(a.size(), b.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        ASSERT_EQ(a[i].words, b[i].words);
+        ASSERT_EQ(a[i].chars, b[i].chars);
+        ASSERT_EQ(a[i].tags,  b[i].tags);
+        ASSERT_EQ(a[i].lens,  b[i].lens);
+        ASSERT_TRUE(a[i].obs == b[i].obs);
+    }
+}
+
+TEST(Reader, CorpusCacheMatchesText) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    std::string fn {"/tmp/reader_cache_test.conll"};
+    std::string dir {"/tmp/reader_cache_test"};
+    {
+        std::ofstream os(fn);
+        os << "New B-LOC\nYork I-LOC\nis O\n\n";
+        os << "Z\xc3\xbcrich B-LOC\nrocks ?\n\n";
+        os << "x ?\ny ?\n\n";
+        os << "Qq B-PER\n\n";
+        os << "dangling O\n"; // unterminated; dropped by the reader
+    }
+    boost::filesystem::remove_all(dir);
+
+    std::set<size_t> train_idx {0, 2};
+    std::set<size_t> test_idx {1, 3};
+    for (int pass = 0; pass < 2; ++pass) { // build, then reuse
+        corpus_cache cache(fn, dir, "O");
+        ASSERT_EQ(cache.size(), Corpus::num_instances(fn));
+
+        Corpus text("<bos>", "<eos>", "<s>", "<unk>", "O");
+        Corpus cached("<bos>", "<eos>", "<s>", "<unk>", "O");
+        expect_same(text.read(fn), cache.read(cached));
+
+        Corpus text2("<bos>", "<eos>", "<s>", "<unk>", "O");
+        Corpus cached2("<bos>", "<eos>", "<s>", "<unk>", "O");
+        auto a = text2.read(fn, train_idx, test_idx);
+        auto b = cache.read(cached2, train_idx, test_idx);
+        expect_same(std::get<0>(a), std::get<0>(b));
+        expect_same(std::get<1>(a), std::get<1>(b));
+        ASSERT_EQ(text2.symtab.get_map(), cached2.symtab.get_map());
+        ASSERT_EQ(text2.tagtab.get_map(), cached2.tagtab.get_map());
+    }
+}
+
+TEST(Reader, CorpusCacheRebuildsForOtherTags) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    std::string fn {"/tmp/reader_cache_tags_test.conll"};
+    std::string dir {"/tmp/reader_cache_tags_test"};
+    {
+        std::ofstream os(fn);
+        os << "New B-U\nYork B-V\n\n";
+    }
+    boost::filesystem::remove_all(dir);
+
+    // the same file read with a different unknown tag, from the same
+    // cache directory
+    for (std::string unk : { "?", "B-U", "?" }) {
+        corpus_cache cache(fn, dir, "O", unk);
+        Corpus text("<bos>", "<eos>", "<s>", "<unk>", "O");
+        Corpus cached("<bos>", "<eos>", "<s>", "<unk>", "O");
+        text.unk_tag = unk;
+        cached.unk_tag = unk;
+        auto a = text.read(fn);
+        auto b = cache.read(cached);
+        expect_same(a, b);
+        ASSERT_TRUE(b[0].obs == (unk == "?" ? Annotation::FULL
+                                            : Annotation::SEMI));
+        ASSERT_EQ(text.tagtab.get_map(), cached.tagtab.get_map());
+    }
+}
+
+TEST(Reader, CorpusCacheRebuildsWhenCutShort) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    std::string fn {"/tmp/reader_cache_short_test.conll"};
+    std::string dir {"/tmp/reader_cache_short_test"};
+    {
+        std::ofstream os(fn);
+        os << "New B-LOC\nYork I-LOC\nis O\n\n";
+        os << "Z\xc3\xbcrich B-LOC\nrocks ?\n\n";
+    }
+    boost::filesystem::remove_all(dir);
+    auto cache_file = corpus_cache::cache_path(dir, fn);
+    { corpus_cache cache(fn, dir, "O"); }
+    auto size = boost::filesystem::file_size(cache_file);
+
+    // cut in the tags it was built with, the symbol strings and the
+    // arrays
+    for (size_t cut : { size_t(84), size_t(100), size / 2, size - 1 }) {
+        boost::filesystem::resize_file(cache_file, cut);
+        corpus_cache cache(fn, dir, "O");
+        Corpus text("<bos>", "<eos>", "<s>", "<unk>", "O");
+        Corpus cached("<bos>", "<eos>", "<s>", "<unk>", "O");
+        expect_same(text.read(fn), cache.read(cached));
+        ASSERT_EQ(boost::filesystem::file_size(cache_file), size);
+    }
+}
+
+TEST(Reader, CorpusCacheKeepsGoingWhenWriteFails) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    std::string fn {"/tmp/reader_cache_full_test.conll"};
+    std::string dir {"/tmp/reader_cache_full_test"};
+    {
+        std::ofstream os(fn);
+        for (size_t i = 0; i < 1000; ++i) os << "New B-LOC\nYork I-LOC\n\n";
+    }
+    boost::filesystem::remove_all(dir);
+    boost::filesystem::create_directories(dir);
+
+    // a file size limit as on a full disk
+    struct rlimit old_limit;
+    ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &old_limit), 0);
+    auto old_handler = signal(SIGXFSZ, SIG_IGN);
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = 4096;
+    ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+    std::unique_ptr<corpus_cache> cache(new corpus_cache(fn, dir, "O"));
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+
+    ASSERT_FALSE(boost::filesystem::exists(corpus_cache::cache_path(dir, fn)));
+    ASSERT_TRUE(boost::filesystem::is_empty(dir));
+    Corpus text("<bos>", "<eos>", "<s>", "<unk>", "O");
+    Corpus cached("<bos>", "<eos>", "<s>", "<unk>", "O");
+    expect_same(text.read(fn), cache->read(cached));
+}
+
+TEST(Reader, CorpusCacheSubsetMatchesText) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    std::string fn {"/tmp/reader_subset_test.conll"};
+    std::string sub {"/tmp/reader_subset_test_sub.conll"};
+    {
+        std::ofstream os(fn);
+        os << "New B-LOC\nYork I-LOC\nis O\n\n";
+        os << "Z\xc3\xbcrich B-LOC\nrocks ?\n\n";
+        os << "Qq B-PER\n\n";
+    }
+    {
+        // instances 2 and 0, in that order
+        std::ofstream os(sub);
+        os << "Qq B-PER\n\n";
+        os << "New B-LOC\nYork I-LOC\nis O\n\n";
+    }
+    corpus_cache cache(fn, "", "O"); // in memory
+    ASSERT_EQ(cache.size(), 3);
+
+    Corpus text("<bos>", "<eos>", "<s>", "<unk>", "O");
+    Corpus cached("<bos>", "<eos>", "<s>", "<unk>", "O");
+    expect_same(text.read(sub), cache.read_subset(cached, {2, 0}));
+    ASSERT_EQ(text.symtab.get_map(), cached.symtab.get_map());
+    ASSERT_EQ(text.tagtab.get_map(), cached.tagtab.get_map());
+}
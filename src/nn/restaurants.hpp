@@ -21,6 +21,7 @@
 #define __NN_RESTAURANTS_HPP__
 
 #include <map>
+#include <algorithm>
 #include <boost/multi_array.hpp>
 
 #include <nn/rng.hpp>
@@ -28,6 +29,7 @@
 #include <nn/mu.hpp>
 #include <nn/utils.hpp>
 #include <nn/restaurant_interface.hpp>
+#include <nn/profile.hpp>
 
 #include <cereal/types/utility.hpp>
 #include <cereal/types/vector.hpp>
@@ -162,6 +164,54 @@ namespace nn {
 
         bool checkConsistency(void* payloadPtr) const;
 
+        // Seats the tables of src in dst, translating dishes with
+        // dish_map. Tables are kept as they are, so table counts add
+        // up and every table still accounts for one customer in the
+        // parent restaurant.
+        template<typename DishMap>
+        void merge(void* dstPtr, void* srcPtr, const DishMap& dish_map) const {
+            Payload& dst = *((Payload*)dstPtr);
+            const Payload& src = *((Payload*)srcPtr);
+            for (const auto& kv : src.tableMap) {
+                auto& arrangement = dst.tableMap[dish_map(kv.first)];
+                arrangement.first += kv.second.first;
+                arrangement.second.insert(arrangement.second.end(),
+                                          kv.second.second.begin(),
+                                          kv.second.second.end());
+            }
+            dst.sumCustomers += src.sumCustomers;
+            dst.sumTables    += src.sumTables;
+        }
+
+        // Moves the customers of a child restaurant into its parent,
+        // so the child can be dropped. Each table of the child already
+        // is a customer in the parent; the other customers join the
+        // parent's largest table of the same dish, so the parent's
+        // table counts (and everything above it) are unchanged.
+        void fold(void* parentPtr, void* childPtr) const {
+            Payload& parent = *((Payload*)parentPtr);
+            const Payload& child = *((Payload*)childPtr);
+            for (const auto& kv : child.tableMap) {
+                auto extra = kv.second.first - kv.second.second.size();
+                if (extra == 0) continue;
+                auto& arrangement = parent.tableMap[kv.first];
+                auto& tables = arrangement.second;
+                CHECK(tables.size() > 0) << "child table without parent customer";
+                *std::max_element(tables.begin(), tables.end()) += extra;
+                arrangement.first   += extra;
+                parent.sumCustomers += extra;
+            }
+        }
+
+        // Drops dishes without customers
+        void compact(void* payloadPtr) const {
+            Payload& payload = *((Payload*)payloadPtr);
+            for (auto it = payload.tableMap.begin(); it != payload.tableMap.end(); ) {
+                if (it->second.first == 0) it = payload.tableMap.erase(it);
+                else ++it;
+            }
+        }
+
         struct Payload {
             Payload() : tableMap(), sumCustomers(0), sumTables(0) {}
 
@@ -226,6 +276,51 @@ namespace nn {
 
         bool checkConsistency(void* payloadPtr) const;
 
+        // Same as SimpleFullRestaurant::merge
+        template<typename DishMap>
+        void merge(void* dstPtr, void* srcPtr, const DishMap& dish_map) const {
+            Payload& dst = *((Payload*)dstPtr);
+            const Payload& src = *((Payload*)srcPtr);
+            for (const auto& kv : src.tableMap) {
+                auto& arrangement = dst.tableMap[dish_map(kv.first)];
+                arrangement.cw += kv.second.cw;
+                arrangement.tw += kv.second.tw;
+                for (const auto& bucket : kv.second.histogram) {
+                    arrangement.histogram[bucket.first] += bucket.second;
+                }
+            }
+            dst.sumCustomers += src.sumCustomers;
+            dst.sumTables    += src.sumTables;
+        }
+
+        // Same as SimpleFullRestaurant::fold
+        void fold(void* parentPtr, void* childPtr) const {
+            Payload& parent = *((Payload*)parentPtr);
+            const Payload& child = *((Payload*)childPtr);
+            for (const auto& kv : child.tableMap) {
+                auto extra = kv.second.cw - kv.second.tw;
+                if (extra == 0) continue;
+                auto& arrangement = parent.tableMap[kv.first];
+                auto& histogram = arrangement.histogram;
+                CHECK(histogram.size() > 0) << "child table without parent customer";
+                auto largest = std::prev(histogram.end());
+                auto size = largest->first;
+                if (--largest->second == 0) histogram.erase(largest);
+                histogram[size + extra] += 1;
+                arrangement.cw      += extra;
+                parent.sumCustomers += extra;
+            }
+        }
+
+        // Same as SimpleFullRestaurant::compact
+        void compact(void* payloadPtr) const {
+            Payload& payload = *((Payload*)payloadPtr);
+            for (auto it = payload.tableMap.begin(); it != payload.tableMap.end(); ) {
+                if (it->second.cw == 0) it = payload.tableMap.erase(it);
+                else ++it;
+            }
+        }
+
         class Payload {
         public:
             typedef std::map<l_type, l_type> Histogram;
@@ -401,10 +496,12 @@ namespace nn {
 
         ++payload.sumCustomers; // c
         ++arrangement.first;    // cw
+        NN_PROFILE_COUNT("restaurant.customers", 1);
 
         if (arrangement.first == 1) { // first customer sits at first table
             tables.push_back(1);
             ++payload.sumTables;
+            NN_PROFILE_COUNT("restaurant.new_tables", 1);
             return true;
         }
 
@@ -445,6 +542,7 @@ namespace nn {
             // sit at new table
             tables.push_back(1);
             ++payload.sumTables;
+            NN_PROFILE_COUNT("restaurant.new_tables", 1);
             return true;
         } else {
             // existing table
@@ -534,6 +632,7 @@ namespace nn {
         if (tables[table] == 0) { // if table became empty
             tables.erase(tables.begin() + table); // drop from table list
             --payload.sumTables;
+            NN_PROFILE_COUNT("restaurant.removed_tables", 1);
             return true;
         } else {
             return false;
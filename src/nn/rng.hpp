@@ -21,6 +21,8 @@
 
 #include <random>
 #include <array>
+#include <deque>
+#include <mutex>
 #include <functional>
 #include <unordered_map>
 #include <omp.h>
@@ -33,7 +35,10 @@ typedef std::mt19937 RandomEngine;
 namespace nn {
 
   struct rng {
-    static std::vector<RandomEngine> engines;
+    // Engines of the threads that have drawn, in a deque so that
+    // adding one for a new thread leaves those in use in place
+    static std::deque<RandomEngine> engines;
+    static size_t nclaimed;
 
     static RandomEngine get_prng() {
       std::random_device r;
@@ -46,24 +51,46 @@ namespace nn {
     }
 
     static void init() {
-      for(auto i = 0; i < omp_get_max_threads(); ++i) {
-        engines.push_back( get_prng() );
+      {
+        std::lock_guard<std::mutex> lock(claim_mutex());
+        for(auto i = 0; i < omp_get_max_threads(); ++i) {
+          engines.push_back( get_prng() );
+        }
       }
+      get(); // the calling thread takes the first engine
       LOG(INFO) << engines.size() << " threads.";
     }
 
+    // Engine of the calling thread. Each thread is given an engine of
+    // its own the first time it draws and keeps it, so no two threads
+    // share one however their teams are nested (e.g. the particle
+    // filters of concurrent folds), and a draw costs no OpenMP calls.
     static RandomEngine & get() {
-      return engines.at( omp_get_thread_num() );
+      static thread_local RandomEngine* engine = claim();
+      return *engine;
     }
 
     static size_t get_num_engines() {
       return engines.size();
     }
+
+  private:
+    static std::mutex& claim_mutex() {
+      static std::mutex m;
+      return m;
+    }
+
+    static RandomEngine* claim() {
+      std::lock_guard<std::mutex> lock(claim_mutex());
+      if (nclaimed == engines.size()) engines.push_back( get_prng() );
+      return &engines[nclaimed++];
+    }
   };
 
-  // define the static member
+  // define the static members
   //std::unordered_map<std::thread::id, RandomEngine> rng::engines;
-  std::vector<RandomEngine> rng::engines;
+  std::deque<RandomEngine> rng::engines;
+  size_t rng::nclaimed {0};
 
   template<typename RNG>
   double uni(RNG& rng) {
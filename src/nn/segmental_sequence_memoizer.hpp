@@ -19,8 +19,10 @@
 #ifndef __NN_SEGMENTAL_SEQUENCE_MEMOIZER_HPP__
 #define __NN_SEGMENTAL_SEQUENCE_MEMOIZER_HPP__
 
+#include <map>
 #include <vector>
 #include <memory>
+#include <numeric>
 #include <unordered_map>
 #include <sstream>
 
@@ -33,6 +35,9 @@
 #include <nn/seq_model.hpp>
 #include <nn/simple_seq_model.hpp>
 #include <nn/adapted_seq_model_prefix.hpp>
+#include <nn/tag_constraints.hpp>
+#include <nn/span_trie.hpp>
+#include <nn/event_counts.hpp>
 
 #include <cereal/types/memory.hpp>
 #include <cereal/types/unordered_map.hpp>
@@ -84,7 +89,11 @@ namespace nn {
         return ret;
     }
 
-    enum class FilterProposal { CHUNK, BASELINE, HYBRID, PROP1 };
+    // GAZETTEER is HYBRID guided by the known entity spans (see
+    // segmental_sequence_memoizer::index_spans); LOOKAHEAD is HYBRID
+    // guided by the next few words of the sentence
+    enum class FilterProposal { CHUNK, BASELINE, HYBRID, PROP1, GAZETTEER,
+                                LOOKAHEAD };
 
     template<typename data_t = CoNLLCorpus<>,
              typename base_t = HashIntegralMeasure<sym>,
@@ -110,6 +119,19 @@ namespace nn {
 
         const double STOP_PROB {0.9};
 
+        // Gazetteer proposal: weight of the span trie in the proposal
+        // for a new segment, and pseudo-count of STOP_PROB when
+        // deciding where a matching span ends
+        const double SPAN_MIX   {0.5};
+        const double SPAN_PRIOR {1.0};
+        span_trie spans;
+
+        // Lookahead proposal: number of upcoming words scored, and
+        // weight of HYBRID in the mixture, which bounds the weights
+        // when the lookahead is wrong
+        size_t lookahead {1};
+        const double LOOKAHEAD_MIX {0.1};
+
         uint_str_table symtab;
         uint_str_table tagtab;
 
@@ -135,7 +157,9 @@ namespace nn {
                      prop,
                      symtab,
                      tagtab,
-                     corpus
+                     corpus,
+                     spans,
+                     lookahead
                 );
         }
 
@@ -174,6 +198,8 @@ namespace nn {
                   std::set<size_t> tags;
                   for(auto k : tagtab.get_key_set()) {
                       tags.insert(k);
+                      // Words of unknown label are imputed by the filter
+                      if (corpus.is_unk_tag(k)) continue;
                       auto emit_model = std::make_unique<emit_t>(emit_param);
                       add_emission_model( k, std::move(emit_model) );
                       if (k == context_tag) {
@@ -195,7 +221,9 @@ namespace nn {
                   auto tran_model = std::make_unique<tran_t>( H );
                   add_transition_model( std::move(tran_model) );
                   LOG(INFO) << "Num emission models: " << num_emission_model();
-                  CHECK(num_emission_model() == corpus.tagtab.size()) << "tag size mismatch";
+                  auto num_unk = corpus.tagtab.has_key(corpus.unk_tag) ? 1 : 0;
+                  CHECK(num_emission_model() + num_unk == corpus.tagtab.size())
+                      << "tag size mismatch";
                   freeze(); // don't add any emission models past this point
               }
 
@@ -221,13 +249,63 @@ namespace nn {
             tagtab = tagtab_;
         }
 
+        // Adds the sufficient statistics of a model trained on another
+        // shard of the data. Symbols are matched by their strings and
+        // those this model hasn't seen are added to its corpus; the tags
+        // of other must all be known to this model. Counts are summed,
+        // so the result is the same as one model that has observed both
+        // shards with the same seating choices.
+        void merge(const segmental_sequence_memoizer& other) {
+            std::vector<sym> sym_map(other.corpus.symtab.size());
+            for (const auto& kv : other.corpus.symtab.get_map()) {
+                sym_map.at(kv.first) = corpus.merge_symbol(kv.second);
+            }
+            symtab = corpus.symtab;
+            CHECK(sym_map.at(other.corpus.get_bos_key()) == corpus.get_bos_key())
+                << "BOS mismatch";
+            CHECK(sym_map.at(other.corpus.get_eos_key()) == corpus.get_eos_key())
+                << "EOS mismatch";
+
+            std::vector<sym> tag_map(other.eos_tag + 1);
+            for (const auto& kv : other.tagtab.get_map()) {
+                if (other.corpus.is_unk_tag(kv.first)) continue;
+                CHECK(tagtab.has_key(kv.second)) << "unknown tag: " << kv.second;
+                tag_map.at(kv.first) = tagtab.key(kv.second);
+            }
+            tag_map.at(other.eos_tag) = eos_tag;
+            CHECK(tag_map.at(other.context_tag) == context_tag)
+                << "context tag mismatch";
+
+            auto map_sym = [&sym_map](sym s) { return sym_map.at(s); };
+            auto map_tag = [&tag_map](sym t) { return tag_map.at(t); };
+
+            // Context elements are words, or {0, tag, 0} for phrases
+            // (see update_context; BOS is the context tag's)
+            auto map_context = [&](const syms& elem) {
+                if (elem.size() == 3 && elem.front() == 0 && elem.back() == 0) {
+                    return syms { 0, map_tag(elem[1]), 0 };
+                }
+                syms ret(elem.size());
+                std::transform(elem.begin(), elem.end(), ret.begin(), map_sym);
+                return ret;
+            };
+
+            T->merge(*other.T, map_context, map_tag);
+            for (const auto& kv : other.E) {
+                E.at(map_tag(kv.first))->merge(*kv.second, map_sym);
+            }
+            spans.merge(other.spans, map_sym, map_tag);
+        }
+
         struct particle {
-            std::vector<syms> words;    // words in the current phrase
+            typename emit_t::scorer words; // words in the current phrase
 
             bool in_phrase {false};     // if we're extending a phrase
+            size_t span {span_trie::NONE}; // current phrase in the span trie
             bool done      {false};     // reached EOS
             syms tags;                  // predicted tags
             std::vector<size_t> lens;   // span (# of words) for each tag
+            size_t pos {0};             // words consumed; the sum of lens
 
             std::vector<syms> context;  // all previous words, used for predictions
             sym context_tag;
@@ -282,13 +360,26 @@ namespace nn {
                 return lens.at(idx);
             }
 
-            void start(size_t tag, syms w) {
+            void start(size_t tag, syms w, typename emit_t::scorer s) {
+                in_phrase = true;
+
+                tags.push_back(tag);
+                lens.push_back(1);
+                pos++;
+
+                words = std::move(s);
+                words.extend(w);
+            }
+
+            // start a segment whose scorer already has its first word
+            void start(size_t tag, typename emit_t::scorer s) {
                 in_phrase = true;
 
                 tags.push_back(tag);
                 lens.push_back(1);
+                pos++;
 
-                words.push_back(w);
+                words = std::move(s);
             }
 
             void add(size_t tag, syms w) {
@@ -296,30 +387,32 @@ namespace nn {
 
                 tags.push_back(tag);
                 lens.push_back(1);
+                pos++;
             }
 
             void stop(syms w) {
                 in_phrase = false;
                 lens.back()++;
-                words.clear();
+                pos++;
+                words = typename emit_t::scorer();
             }
 
             // start a segment then change our mind
             void emergencyStop(syms w) {
                 in_phrase = false;
-                words.clear();
+                words = typename emit_t::scorer();
             }
 
             void stopEOS(syms w) {
                 done = true;
                 in_phrase = false;
-                words.clear();
+                words = typename emit_t::scorer();
             }
 
             void cont(syms w) {
                 CHECK(in_phrase) << "cont while not in phrase";
                 lens.back()++;
-                words.push_back(w);
+                pos++;
             }
         };
 
@@ -330,6 +423,7 @@ namespace nn {
             particle p;
             p.tags = i.tags;
             p.lens = i.lens;
+            p.pos  = std::accumulate(p.lens.begin(), p.lens.end(), size_t(0));
             return p;
         }
 
@@ -338,6 +432,7 @@ namespace nn {
             particle p;
             p.tags = tags;
             p.lens = lens;
+            p.pos  = std::accumulate(p.lens.begin(), p.lens.end(), size_t(0));
             return p;
         }
 
@@ -349,11 +444,14 @@ namespace nn {
 
         void init(particle& p) const {
             p.in_phrase = false;
+            p.done = false;
             p.tags.clear();
             p.tags.reserve(128);
             p.lens.clear();
             p.lens.reserve(128);
-            p.words.clear();
+            p.pos = 0;
+            p.words = typename emit_t::scorer();
+            p.span = span_trie::NONE;
             p.context.clear();
             p.context.reserve(128);
             p.context.push_back(BOS);
@@ -387,6 +485,14 @@ namespace nn {
 
         size_t num_emission_model() { return E.size(); }
 
+        // Prunes the context trees of the transition and emission
+        // models; see FixedDepthHPYP::prune
+        prune_stats prune(double threshold) {
+            auto stats = T->prune(threshold);
+            for (auto& kv : E) stats += kv.second->prune(threshold);
+            return stats;
+        }
+
         emit_t* get_emission_model( sym tag ) const {
             // if (!has_emission_model(tag)) {
             //     if (frozen) { LOG(FATAL) << "unknown tag: " << tag; }
@@ -433,22 +539,40 @@ namespace nn {
             CHECK(tags.size() == lens.size()) << "size mismatch! tags.len = "
                                               << tags.size() << " lens.len = "
                                               << lens.size();
+            // emit_param isn't serialized, so take the symbols from the
+            // corpus, which is (a loaded model may observe more entries)
             phrase::const_iterator it = words.begin();
             for (auto i=0; i<tags.size(); ++i) {
                 auto tag = tags.at(i);
                 auto len = lens.at(i);
                 auto segment = nn::join(it,
                                         it+len,
-                                        emit_param.BOS,
-                                        emit_param.SPACE,
-                                        emit_param.EOS);
+                                        corpus.get_bos_key(),
+                                        corpus.get_space_key(),
+                                        corpus.get_eos_key());
                 auto emit_base = get_emission_model(tag)->get_base();
                 emit_base->observe(segment);
                 std::advance(it, len);
             }
             CHECK(it == words.end()-1);
+            index_spans(tags, lens, words);
+        }
+
+        // Adds the entity spans of a labeled sentence to the span trie
+        // of the gazetteer proposal. Entries of the gazetteer are
+        // added as they are observed; the trie is only consulted, and
+        // so doesn't have to be kept in sync with the sampler state.
+        void index_spans(const syms& tags, const syms& lens,
+                         const phrase& words) {
+            auto it = words.begin();
+            for (size_t i = 0; i < tags.size(); ++i) {
+                if (tags[i] != context_tag) spans.add(it, it+lens[i], tags[i]);
+                std::advance(it, lens[i]);
+            }
         }
 
+        const span_trie& get_spans() const { return spans; }
+
         void observe(const particle& p, const phrase& words) {
             observe(p.tags, p.lens, words);
         }
@@ -498,6 +622,131 @@ namespace nn {
             T->observe(context, eos_tag);
         }
 
+        // Events of many labeled sentences and gazetteer entries,
+        // counted so that each distinct event is observed once, with
+        // its count. The restaurants end up with the same customers as
+        // if the data were observed one sentence at a time, though
+        // seated in a different order.
+        struct observations {
+            event_counts<std::pair<Context, sym>> transitions;
+            std::map<sym, event_counts<phrase>> segments; // per tag
+            std::map<sym, typename emit_t::base_model::counts> gazetteer;
+        };
+
+        // Adds the events of a labeled sentence to obs; the input is
+        // the same as for observe
+        void count(const syms& tags, const syms& lens, const phrase& words,
+                   observations& obs) const {
+            CHECK(tags.size() > 0) << "no tags";
+            CHECK(tags.size() == lens.size()) << "size mismatch! tags.len = " << tags.size() << " lens.len = " << lens.size();
+            phrase context {BOS};
+            auto it = words.begin();
+            for (size_t i = 0; i < tags.size(); ++i) {
+                auto tag = tags[i];
+                auto len = lens[i];
+                obs.transitions.add(std::make_pair(recent(context), tag));
+                update_context(tag, *it, context);
+                obs.segments[tag].add(phrase(it, it+len));
+                std::advance(it, len);
+            }
+            CHECK(it == words.end()-1) << "bad particle; len mismatch";
+            obs.transitions.add(std::make_pair(recent(context), eos_tag));
+        }
+
+        // Adds the events of a gazetteer entry to obs; see
+        // observe_gazetteer, which also indexes the spans
+        void count_gazetteer(const syms& tags, const syms& lens,
+                             const phrase& words, observations& obs) const {
+            CHECK(tags.size() == lens.size()) << "size mismatch! tags.len = "
+                                              << tags.size() << " lens.len = "
+                                              << lens.size();
+            auto it = words.begin();
+            for (size_t i = 0; i < tags.size(); ++i) {
+                auto tag = tags[i];
+                auto len = lens[i];
+                auto segment = nn::join(it,
+                                        it+len,
+                                        corpus.get_bos_key(),
+                                        corpus.get_space_key(),
+                                        corpus.get_eos_key());
+                get_emission_model(tag)->get_base()->count(segment,
+                                                           obs.gazetteer[tag]);
+                std::advance(it, len);
+            }
+            CHECK(it == words.end()-1);
+        }
+
+        void observe(const observations& obs) {
+            for (const auto& kv : obs.gazetteer) {
+                get_emission_model(kv.first)->get_base()->observe(kv.second);
+            }
+            for (const auto& e : obs.transitions) {
+                T->observe(e.first.first, e.first.second, e.second);
+            }
+            for (const auto& kv : obs.segments) {
+                auto emit = get_emission_model(kv.first);
+                for (const auto& e : kv.second) {
+                    emit->observe(e.first.begin(), e.first.end(), e.second);
+                }
+            }
+        }
+
+        // Log probability of a labeled sentence; the input is the same
+        // as for observe
+        double log_prob(const syms& tags, const syms& lens,
+                        const phrase& words) const {
+            double ret = 0.0;
+            phrase context {BOS};
+            auto it = words.begin();
+            for (size_t i = 0; i < tags.size(); ++i) {
+                auto tag = tags[i];
+                auto len = lens[i];
+                ret += T->log_prob(context, tag);
+                ret += E.at(tag)->log_prob(it, it+len);
+                update_context(tag, *it, context);
+                std::advance(it, len);
+            }
+            return ret + T->log_prob(context, eos_tag);
+        }
+
+        // Queries of the exact decoder (see semi_markov.hpp)
+        Context initial_context() const { return Context {BOS}; }
+        sym get_eos_tag() const { return eos_tag; }
+
+        double log_transition(const Context& context, sym tag) const {
+            return T->log_prob(context, tag);
+        }
+
+        // Log probability of every segment of up to max_len words that
+        // the model allows, by tag: ret[t][tag][k] is that of words
+        // t..t+k. Context words are segments of their own, and the
+        // unknown tag has no segments.
+        std::vector<std::unordered_map<sym, std::vector<double>>>
+        segment_log_probs(const phrase& words, size_t max_len) const {
+            auto n = words.size() - 1; // words.back() is EOS
+            std::vector<std::unordered_map<sym, std::vector<double>>> ret(n);
+            for (size_t t = 0; t < n; ++t) {
+                for (const auto& kv : E) {
+                    if (!kv.second) continue;
+                    auto len = kv.first == context_tag ? 1 : max_len;
+                    auto last = std::min(t + len, n);
+                    auto& lps = ret[t][kv.first];
+                    auto s = kv.second->get_scorer();
+                    for (auto i = t; i < last; ++i) {
+                        s.extend(words[i]);
+                        lps.push_back(s.log_prob());
+                    }
+                }
+            }
+            return ret;
+        }
+
+        // The part of a context the transition model conditions on
+        Context recent(const Context& context) const {
+            if (context.size() <= tran_t::max_depth) return context;
+            return Context(context.end() - tran_t::max_depth, context.end());
+        }
+
         void update_context(size_t tag, const syms& word,
                             phrase& context) const {
             if (tag == context_tag) {
@@ -566,16 +815,21 @@ namespace nn {
         get_transition_dist(const phrase& context) const {
             unnormalized_discrete_distribution<size_t> ret;
             for(auto tag : tagtab.get_key_set()) {
+                if (!E.count(tag)) continue; // the unknown tag
                 ret.push_back_prob( tag,
                                     T->prob(context, tag) );
             }
             return ret;
         }
 
+        // Proposal for the segment starting at word t, restricted to
+        // the events the known labels allow
         discrete_distribution<std::pair<sym,bool>>
         get_between_prop(const unnormalized_discrete_distribution<size_t>& Q_trans,
                          const phrase& context,
-                         const syms& obs) const {
+                         const syms& obs,
+                         const tag_constraints& cons = tag_constraints(),
+                         size_t t = 0) const {
             typedef std::pair<sym,bool> Event;
             Event e;
             discrete_distribution<Event> Q;
@@ -583,14 +837,17 @@ namespace nn {
                 double tlp = Q_trans.get_log_weight(i);
                 auto tag = Q_trans.get_type(i);
                 e.first  = tag;
+                if (!cons.allows(t, tag)) continue;
 
                 // E-Y -- start and immediately stop
-                double q1 = tlp + E.at(tag)->log_prob(obs);
-                e.second = false;
-                Q.push_back_log_prob( e, q1 );
+                if (cons.may_end(t)) {
+                    double q1 = tlp + E.at(tag)->log_prob(obs);
+                    e.second = false;
+                    Q.push_back_log_prob( e, q1 );
+                }
 
                 // I-Y -- start a phrase and stop later
-                if(e.first != context_tag) {
+                if(e.first != context_tag && cons.may_continue(t+1, tag)) {
                     syms prefix(obs.begin(), obs.end()-1);
                     double q2 = tlp + E.at(tag)->log_prefix_prob(prefix);
                     e.second = true;
@@ -601,15 +858,218 @@ namespace nn {
             return Q;
         }
 
+        // (1-w) Q + w G, for G given by unnormalized log weights lg
+        // over the events of Q
+        template<typename Event>
+        discrete_distribution<Event>
+        mix_prop(const discrete_distribution<Event>& Q,
+                 const std::vector<double>& lg, double w) const {
+            auto lZ = log_add(lg);
+            if (lZ == -std::numeric_limits<double>::infinity()) return Q;
+            discrete_distribution<Event> ret;
+            for (size_t i = 0; i < Q.size(); ++i) {
+                ret.push_back_prob(Q.get_type(i),
+                                   (1.0-w)*Q.get_prob(i) + w*exp(lg[i]-lZ));
+            }
+            return ret;
+        }
+
+        // Mixes the proposal for a new segment with the entries of the
+        // span trie that start with its first word: a Y entry that is
+        // the one word supports E-Y, a longer one I-Y
+        discrete_distribution<std::pair<sym,bool>>
+        guide_between_prop(const discrete_distribution<std::pair<sym,bool>>& Q,
+                           const syms& obs) const {
+            auto n = spans.child(span_trie::ROOT, obs);
+            if (n == span_trie::NONE) return Q;
+            std::vector<double> lg(Q.size());
+            for (size_t i = 0; i < Q.size(); ++i) {
+                auto e = Q.get_type(i);
+                lg[i] = log(e.second ? spans.longer(n, e.first)
+                                     : spans.ends(n, e.first));
+            }
+            return mix_prop(Q, lg, SPAN_MIX);
+        }
+
+        // What the proposals need to know about the sentence being
+        // sampled, beyond the current word. For the lookahead
+        // proposal, this is the log probability of every phrase of up
+        // to lookahead+1 words, by tag, which doesn't depend on the
+        // particle: phrases[t][tag][k] is that of words t..t+k, and
+        // the last entry the prefix probability of the longest one
+        // (-inf if it would run into EOS).
+        struct sentence_info {
+            const phrase* words {nullptr};
+            std::vector<std::unordered_map<sym, std::vector<double>>> phrases;
+        };
+
+        sentence_info prepare(const phrase& words) const {
+            sentence_info info;
+            info.words = &words;
+            if (prop != FilterProposal::LOOKAHEAD) return info;
+            auto n = words.size() - 1; // words.back() is EOS
+            info.phrases.resize(n);
+            for (size_t t = 0; t < n; ++t) {
+                auto last = std::min(t + lookahead, n - 1);
+                for (const auto& kv : E) {
+                    if (!kv.second) continue;
+                    auto& lps = info.phrases[t][kv.first];
+                    auto s = kv.second->get_scorer();
+                    for (auto i = t; i <= last; ++i) {
+                        s.extend(words[i]);
+                        lps.push_back(s.log_prob());
+                    }
+                    lps.push_back(last + 1 < n ? s.log_prefix_prob()
+                                  : -std::numeric_limits<double>::infinity());
+                }
+            }
+            return info;
+        }
+
+        // Log weight of word i of the sentence as a segment of its
+        // own, of any tag
+        double log_single_prob(const unnormalized_discrete_distribution<size_t>& Q_trans,
+                               const sentence_info& info, size_t i) const {
+            auto ret = -std::numeric_limits<double>::infinity();
+            for (size_t j = 0; j < Q_trans.size(); ++j) {
+                auto tag = Q_trans.get_type(j);
+                ret = log_add(ret, Q_trans.get_log_weight(j) +
+                              info.phrases[i].at(tag)[0]);
+            }
+            return ret;
+        }
+
+        // Log weights of the words after word t, up to t+lookahead, as
+        // segments of their own: rest[k] covers the words past t+k
+        std::vector<double>
+        lookahead_rest(const unnormalized_discrete_distribution<size_t>& Q_trans,
+                       const sentence_info& info, size_t t) const {
+            auto last = std::min(t + lookahead, info.phrases.size() - 1);
+            std::vector<double> rest(last - t + 1, 0.0);
+            for (auto i = last; i > t; --i) {
+                rest[i-t-1] = rest[i-t] + log_single_prob(Q_trans, info, i);
+            }
+            return rest;
+        }
+
+        // Scores the ends of a phrase whose words so far, in s, end
+        // with word t of the sentence, by the words up to t+lookahead:
+        // the phrase emissions, and the words past a candidate end
+        // as segments of their own (see lookahead_rest). Returns the
+        // log weights of ending at t and of going on.
+        std::pair<double,double>
+        lookahead_scores(typename emit_t::scorer s,
+                         const std::vector<double>& rest,
+                         const sentence_info& info, size_t t) const {
+            auto last = t + rest.size() - 1;
+            auto stop = s.log_prob() + rest[0];
+            auto cont = -std::numeric_limits<double>::infinity();
+            for (auto i = t+1; i <= last; ++i) {
+                s.extend((*info.words)[i]);
+                cont = log_add(cont, s.log_prob() + rest[i-t]);
+            }
+            if (last + 1 < info.phrases.size()) {
+                cont = log_add(cont, s.log_prefix_prob());
+            }
+            return std::make_pair(stop, cont);
+        }
+
+        // Mixes the proposal for a new segment with the lookahead
+        // scores of E-Y and I-Y, which for a phrase starting at word t
+        // only need the cached phrase probabilities
+        discrete_distribution<std::pair<sym,bool>>
+        lookahead_between_prop(const discrete_distribution<std::pair<sym,bool>>& Q,
+                               const unnormalized_discrete_distribution<size_t>& Q_trans,
+                               const sentence_info& info, size_t t) const {
+            auto rest = lookahead_rest(Q_trans, info, t);
+            std::vector<double> lg(Q.size());
+            for (size_t i = 0; i < Q.size(); ++i) {
+                auto e   = Q.get_type(i);
+                auto ltp = Q_trans.get_log_weight(Q_trans.get_index(e.first));
+                const auto& lps = info.phrases[t].at(e.first);
+                if (!e.second) {
+                    lg[i] = ltp + lps[0] + rest[0];
+                    continue;
+                }
+                auto cont = lps.back();
+                for (size_t k = 1; k < rest.size(); ++k) {
+                    cont = log_add(cont, lps[k] + rest[k]);
+                }
+                lg[i] = ltp + cont;
+            }
+            return mix_prop(Q, lg, 1.0-LOOKAHEAD_MIX);
+        }
+
+        // Proposal for the segment starting at word t
+        discrete_distribution<std::pair<sym,bool>>
+        between_prop(const unnormalized_discrete_distribution<size_t>& Q_trans,
+                     const particle& p, const syms& obs,
+                     const tag_constraints& cons,
+                     const sentence_info& info, size_t t) const {
+            auto Q = get_between_prop(Q_trans, p.context, obs, cons, t);
+            CHECK(Q.size() > 0) << "no segment allowed at word " << t;
+            switch (prop) {
+            case FilterProposal::GAZETTEER:
+                return guide_between_prop(Q, obs);
+            case FilterProposal::LOOKAHEAD:
+                if (t >= info.phrases.size()) return Q;
+                return lookahead_between_prop(Q, Q_trans, info, t);
+            default:
+                return Q;
+            }
+        }
+
+        // Probability of ending the current phrase after obs, word t of
+        // the sentence. For the gazetteer proposal, this moves the
+        // phrase along the span trie: outside the trie it is
+        // STOP_PROB; inside, it is shrunk toward the fraction of
+        // matching entries that end here.
+        double stop_prob(particle& p, const syms& obs, sym tag,
+                         const sentence_info& info, size_t t) const {
+            switch (prop) {
+            case FilterProposal::GAZETTEER: {
+                p.span = spans.child(p.span, obs);
+                double ends   = spans.ends(p.span, tag);
+                double longer = spans.longer(p.span, tag);
+                return (ends + SPAN_PRIOR*STOP_PROB) / (ends + longer + SPAN_PRIOR);
+            }
+            case FilterProposal::LOOKAHEAD: {
+                if (t >= info.phrases.size()) return STOP_PROB;
+                auto rest = lookahead_rest(get_transition_dist(p.context),
+                                           info, t);
+                auto sc = lookahead_scores(p.words, rest, info, t);
+                auto q = exp(sc.first - log_add(sc.first, sc.second));
+                return (1.0-LOOKAHEAD_MIX)*q + LOOKAHEAD_MIX*STOP_PROB;
+            }
+            default:
+                return STOP_PROB;
+            }
+        }
+
+        // Does the proposal need the position of the next word?
+        bool needs_position(const tag_constraints& cons) const {
+            return !cons.empty() || prop == FilterProposal::LOOKAHEAD;
+        }
+
         // The previous tag is E-X
         // We must now pick the next tag, which may be E-Y or I-Y
-        double between_extend(particle& p, const syms& obs) const {
+        double between_extend(particle& p, const syms& obs,
+                              const tag_constraints& cons,
+                              const sentence_info& info) const {
             if (obs == EOS) {
                 return T->log_prob(p.context, eos_tag);
             }
+            auto t       = needs_position(cons) ? position(p) : 0;
             auto Q_trans = get_transition_dist(p.context);
-            auto Q       = get_between_prop(Q_trans, p.context, obs);
-            auto j       = Q.sample_index();
+            auto Q       = between_prop(Q_trans, p, obs, cons, info, t);
+            return between_take(p, obs, Q_trans, Q, Q.sample_index());
+        }
+
+        // Makes choice j of the between proposal Q
+        template<typename Dist>
+        double between_take(particle& p, const syms& obs,
+                            const unnormalized_discrete_distribution<size_t>& Q_trans,
+                            const Dist& Q, size_t j) const {
             auto e       = Q.get_type(j);
             auto tag     = e.first;
             auto start   = e.second;
@@ -617,7 +1077,8 @@ namespace nn {
             auto i       = Q_trans.get_index(tag);
 
             if (start) {
-                p.start(tag, obs);
+                p.start(tag, obs, E.at(tag)->get_scorer());
+                p.span = spans.child(span_trie::ROOT, obs);
                 return Q_trans.get_log_weight(i)-lp;
             } else {
                 p.add(tag, obs);
@@ -629,80 +1090,282 @@ namespace nn {
             return 0.0;
         }
 
+        // Extends the particles ps[members[0]], ..., ps[members[n-1]],
+        // which are in the same state, as extend() would each of them:
+        // the proposal is computed once and drawn from n times, and
+        // the particles that draw the same choice share its scores.
+        // same[k] is the first k' <= k whose particle made the same
+        // choice as particle k, i.e. is still in the same state.
+        void extend_copies(std::vector<particle>& ps, const size_t* members,
+                           size_t n, const syms& obs,
+                           const tag_constraints& cons,
+                           const sentence_info& info,
+                           double* log_w, size_t* same) const {
+            auto& p = ps[members[0]];
+            if (n == 1) {
+                log_w[0] = extend(p, obs, cons, info);
+                same[0] = 0;
+            } else if (p.in_phrase) {
+                inside_extend_copies(ps, members, n, obs, cons, info, log_w, same);
+            } else {
+                between_extend_copies(ps, members, n, obs, cons, info, log_w, same);
+            }
+        }
+
+        void between_extend_copies(std::vector<particle>& ps,
+                                   const size_t* members, size_t n,
+                                   const syms& obs,
+                                   const tag_constraints& cons,
+                                   const sentence_info& info,
+                                   double* log_w, size_t* same) const {
+            auto& p = ps[members[0]];
+            if (obs == EOS) {
+                auto lw = T->log_prob(p.context, eos_tag);
+                for (size_t k = 0; k < n; ++k) { log_w[k] = lw; same[k] = 0; }
+                return;
+            }
+            auto t       = needs_position(cons) ? position(p) : 0;
+            auto Q_trans = get_transition_dist(p.context);
+            auto Q       = between_prop(Q_trans, p, obs, cons, info, t);
+            std::vector<size_t> first(Q.size(), n);
+            std::vector<double> lw(Q.size());
+            for (size_t k = 0; k < n; ++k) {
+                auto& x = ps[members[k]];
+                auto j  = Q.sample_index();
+                if (first[j] == n) {
+                    first[j] = k;
+                    lw[j] = between_take(x, obs, Q_trans, Q, j);
+                } else {
+                    // the move of the first particle to draw j
+                    const auto& y = ps[members[first[j]]];
+                    auto tag = y.tags.back();
+                    if (y.in_phrase) {
+                        x.start(tag, y.words);
+                        x.span = y.span;
+                    } else {
+                        x.add(tag, obs);
+                        update_context(tag, obs, x.context);
+                    }
+                }
+                log_w[k] = lw[j];
+                same[k] = first[j];
+            }
+        }
+
+        void inside_extend_copies(std::vector<particle>& ps,
+                                  const size_t* members, size_t n,
+                                  const syms& obs,
+                                  const tag_constraints& cons,
+                                  const sentence_info& info,
+                                  double* log_w, size_t* same) const {
+            // the leader p goes last, as the others start from its
+            // scorer with obs
+            auto& p = ps[members[0]];
+            auto tag = p.tags.back();
+            p.words.extend(obs);
+            if (obs == EOS) {
+                auto lep = p.words.log_prob();
+                update_context(tag, obs, p.context);
+                auto lw = T->log_prob(p.context, eos_tag) + lep;
+                p.stopEOS(obs);
+                for (size_t k = 0; k < n; ++k) {
+                    if (k > 0) {
+                        auto& x = ps[members[k]];
+                        update_context(tag, obs, x.context);
+                        x.stopEOS(obs);
+                    }
+                    log_w[k] = lw;
+                    same[k] = 0;
+                }
+                return;
+            }
+            auto t   = needs_position(cons) ? position(p) : 0;
+            auto q   = stop_prob(p, obs, tag, info, t);
+            bool may_stop = cons.may_end(t);
+            bool may_cont = cons.may_continue(t+1, tag);
+            CHECK(may_stop || may_cont) << "segment stuck at word " << t;
+            std::bernoulli_distribution d(q);
+            auto& eng = nn::rng::get();
+            const bool proposed = may_stop && may_cont;
+            bool any_stop = false;
+            for (size_t k = 0; k < n; ++k) {
+                bool b = proposed ? d(eng) : may_stop;
+                same[k] = b ? 1 : 0; // for now, the choice
+                any_stop = any_stop || b;
+            }
+            auto lep = any_stop ? p.words.log_prob() : 0.0;
+            size_t first[2] { n, n };
+            for (size_t k = n; k-- > 0; ) {
+                bool b = same[k] == 1;
+                double lq = proposed ? log(b ? q : 1.0-q) : 0.0;
+                auto& x = ps[members[k]];
+                if (k > 0) x.span = p.span;
+                if (b) { // emit E-X: stop
+                    x.stop(obs);
+                    update_context(tag, obs, x.context);
+                    log_w[k] = lep - lq;
+                } else { // emit I-X: continue
+                    if (k > 0) x.words = p.words;
+                    x.cont(obs);
+                    log_w[k] = -lq;
+                }
+                first[b] = k;
+            }
+            for (size_t k = 0; k < n; ++k) {
+                same[k] = first[same[k]];
+            }
+        }
+
         void swap(particle& dst, const particle& src) const {
             init(dst);
             dst.tags = src.tags;
             dst.lens = src.lens;
+            dst.pos  = src.pos;
+        }
+
+        // Ancestor sampling (see ConditionalFilter): log probability
+        // of the segments of the reference ref after word t given the
+        // history of p, which is between segments. The emissions of
+        // these segments don't depend on p, nor do the transitions
+        // whose context no longer reaches back into it, so only the
+        // first transitions are scored. -inf unless both p and ref
+        // end a segment at word t.
+        double log_continuation(const particle& p, const particle& ref,
+                                const phrase& obs, size_t t) const {
+            if (p.in_phrase || p.done || !ref.end_at_pos(t)) return NEG_INF;
+            auto k   = ref.pos_idx(t) + 1; // first segment after word t
+            auto pos = t + 1;
+            auto context = recent(p.context);
+            double ret = 0.0;
+            for (size_t n = 0; n < tran_t::max_depth; ++n, ++k) {
+                if (k == ref.tags.size()) {
+                    return ret + T->log_prob(context, eos_tag);
+                }
+                auto tag = ref.tags[k];
+                ret += T->log_prob(context, tag);
+                update_context(tag, obs.at(pos), context);
+                pos += ref.lens[k];
+            }
+            return ret;
+        }
+
+        // The reference p as it was after word t: its last segment is
+        // cut to the words up to t, which its state is in the middle of
+        // if it doesn't end there
+        void truncate(particle& p, size_t t) const {
+            auto k = p.pos_idx(t);
+            size_t begin = 0;
+            for (size_t i = 0; i < k; ++i) begin += p.lens[i];
+            p.tags.resize(k + 1);
+            p.lens.resize(k + 1);
+            p.lens[k] = t + 1 - begin;
+            p.pos = t + 1;
+        }
+
+        // The history of p through word t, followed by the segments of
+        // ref after it, to be scored from word t+1 on
+        void splice(particle& dst, const particle& p, const particle& ref,
+                    size_t t) const {
+            auto k = ref.pos_idx(t) + 1;
+            dst = p;
+            dst.tags.insert(dst.tags.end(), ref.tags.begin() + k, ref.tags.end());
+            dst.lens.insert(dst.lens.end(), ref.lens.begin() + k, ref.lens.end());
+            dst.pos = ref.pos;
         }
 
-        double baseline_inside_extend(particle& p, const syms& obs) const {
+        double baseline_inside_extend(particle& p, const syms& obs,
+                                      const tag_constraints& cons,
+                                      const sentence_info& info) const {
+            p.words.extend(obs);
             if(obs == EOS) {
                 auto tag = p.tags.back();
-                auto lep = E.at(tag)->log_prob(p.words, obs); // pay emission
+                auto lep = p.words.log_prob();                // pay emission
                 update_context(tag, obs, p.context);
                 auto ltp = T->log_prob(p.context, eos_tag);   // pay transition
                 p.stopEOS(obs);
                 return ltp + lep;
             }
-            std::bernoulli_distribution d(STOP_PROB);
-            auto b = d( nn::rng::get() );
+            auto tag = p.tags.back();
+            auto t   = needs_position(cons) ? position(p) : 0;
+            auto q   = stop_prob(p, obs, tag, info, t);
+            bool may_stop = cons.may_end(t);
+            bool may_cont = cons.may_continue(t+1, tag);
+            CHECK(may_stop || may_cont) << "segment stuck at word " << t;
+            // A forced choice isn't proposed, so it has no proposal term
+            bool b;
+            double lq;
+            if (may_stop && may_cont) {
+                std::bernoulli_distribution d(q);
+                b  = d( nn::rng::get() );
+                lq = log(b ? q : 1.0-q);
+            } else {
+                b  = may_stop;
+                lq = 0.0;
+            }
             if(b) { // emit E-X: stop
-                auto tag = p.tags.back();
-                auto log_emit_prob = E.at(tag)->log_prob(p.words, obs);
+                auto log_emit_prob = p.words.log_prob();
                 p.stop(obs);
                 update_context(tag, obs, p.context);
-                return log_emit_prob - log(STOP_PROB);
+                return log_emit_prob - lq;
             } else { // emit I-X: continue
                 p.cont(obs);
-                return -log(1.0-STOP_PROB);
+                return -lq;
             }
         }
 
         double baseline_inside_extend(particle& p,
                                       const syms& obs,
-                                      size_t t // position in the observation
-                                      ) const {
+                                      size_t t, // position in the observation
+                                      const tag_constraints& cons,
+                                      const sentence_info& info) const {
             //LOG(INFO) << "[inside extend score]";
 
+            p.words.extend(obs);
             if(obs == EOS) {
                 auto tag = p.tags.back();
-                auto lep = E.at(tag)->log_prob(p.words, obs); // pay emission
+                auto lep = p.words.log_prob();                // pay emission
                 update_context(tag, obs, p.context);
                 auto ltp = T->log_prob(p.context, eos_tag);   // pay transition
                 p.stopEOS(obs);
                 return ltp + lep;
             }
 
-            auto b = p.end_at_pos(t);
+            auto b   = p.end_at_pos(t);
+            auto tag = p.tag_at_pos(t);
+            auto q   = stop_prob(p, obs, tag, info, t);
+            double lq = 0.0;
+            if (cons.may_end(t) && cons.may_continue(t+1, tag)) {
+                lq = log(b ? q : 1.0-q);
+            }
 
             if(b) { // emit E-X: stop
                 //LOG(INFO) << "E-X";
-                auto tag = p.tag_at_pos(t);
-                auto log_emit_prob = E.at(tag)->log_prob(p.words, obs);
-                p.words.clear();
+                auto log_emit_prob = p.words.log_prob();
+                p.words = typename emit_t::scorer();
                 p.in_phrase = false;
                 update_context(tag, obs, p.context);
-                return log_emit_prob - log(STOP_PROB);
+                return log_emit_prob - lq;
             } else { // emit I-X: continue
                 //LOG(INFO) << "I-X";
                 p.in_phrase = true;
-                p.words.push_back(obs);
-                return -log(STOP_PROB);
+                return -lq;
             }
         }
 
         double between_extend(particle& p,
                               const syms& obs,
-                              size_t t) const {
+                              size_t t,
+                              const tag_constraints& cons,
+                              const sentence_info& info) const {
             //LOG(INFO) << "[between extend score]";
-            CHECK(p.words.size() == 0) << "logic";
+            CHECK(p.words.empty()) << "logic";
 
             if (obs == EOS) {
                 return T->log_prob(p.context, eos_tag);
             }
 
             auto Q_trans = get_transition_dist(p.context);
-            auto Q       = get_between_prop(Q_trans, p.context, obs);
+            auto Q       = between_prop(Q_trans, p, obs, cons, info, t);
 
             std::pair<sym,bool> e;
             auto tag = p.tag_at_pos(t);
@@ -722,7 +1385,9 @@ namespace nn {
 
             if ( cont ) {
                 //LOG(INFO) << "[between] cont";
-                p.words.push_back(obs);
+                p.words = E.at(tag)->get_scorer();
+                p.words.extend(obs);
+                p.span = spans.child(span_trie::ROOT, obs);
                 p.in_phrase = true;
                 update_context(tag, obs, p.context);
                 return Q_trans.get_log_weight(tran_idx) - lp;
@@ -739,85 +1404,73 @@ namespace nn {
 
         void log_stats() const {}
 
-        double score(particle& p, const syms& obs, size_t t) const {
+        // Number of words the particle has consumed, i.e. the position
+        // of the next observation
+        size_t position(const particle& p) const {
+            return p.pos;
+        }
+
+        double score(particle& p, const syms& obs, size_t t,
+                     const tag_constraints& cons,
+                     const sentence_info& info) const {
             if (t==0) CHECK(p.context.size() == 1);
 
             //LOG(INFO) << "[score]";
 
             switch(prop) {
-            case FilterProposal::HYBRID: {
-                if (p.in_phrase) return baseline_inside_extend(p, obs, t);
-                else             return between_extend(p, obs, t);
+            case FilterProposal::HYBRID:
+            case FilterProposal::GAZETTEER:
+            case FilterProposal::LOOKAHEAD: {
+                if (p.in_phrase) return baseline_inside_extend(p, obs, t, cons, info);
+                else             return between_extend(p, obs, t, cons, info);
             }
             default: CHECK(false) << "logic error";
             }
             CHECK(false) << "sanity";
         }
 
-        double extend(particle& p, const syms& obs) const {
+        double score(particle& p, const syms& obs, size_t t,
+                     const tag_constraints& cons) const {
+            return score(p, obs, t, cons, sentence_info());
+        }
+
+        double score(particle& p, const syms& obs, size_t t) const {
+            return score(p, obs, t, tag_constraints());
+        }
+
+        // Extends the particle with a segmentation consistent with the
+        // known labels of the sentence (see tag_constraints). The
+        // lookahead proposal also reads the words of the sentence
+        // past obs; without them, it is HYBRID.
+        double extend(particle& p, const syms& obs,
+                      const tag_constraints& cons,
+                      const sentence_info& info) const {
             switch(prop) {
-            case FilterProposal::HYBRID: {
-                if (p.in_phrase) return baseline_inside_extend(p, obs);
-                else             return between_extend(p, obs);
+            case FilterProposal::HYBRID:
+            case FilterProposal::GAZETTEER:
+            case FilterProposal::LOOKAHEAD: {
+                if (p.in_phrase) return baseline_inside_extend(p, obs, cons, info);
+                else             return between_extend(p, obs, cons, info);
             }
             default: CHECK(false) << "unsupported proposal";
             };
             CHECK(false) << "sanity";
         }
 
-      data_t get_corpus() const {
-        return corpus;
-      }
+        double extend(particle& p, const syms& obs,
+                      const tag_constraints& cons) const {
+            return extend(p, obs, cons, sentence_info());
+        }
 
-        struct writer {
-            std::string prefix;
-            instances test;
+        double extend(particle& p, const syms& obs) const {
+            return extend(p, obs, tag_constraints());
+        }
 
-            sym context_tag;
-            std::unordered_map<size_t, std::string> sym_desc;
-            std::unordered_map<size_t, std::string> tag_desc;
-
-            writer(std::string _prefix,
-                   instances _test,
-                   sym _context_tag,
-                   std::unordered_map<size_t, std::string> _sym_desc,
-                   std::unordered_map<size_t, std::string> _tag_desc)
-                : prefix(_prefix),
-                  test(_test),
-                  context_tag(_context_tag),
-                  sym_desc(_sym_desc),
-                  tag_desc(_tag_desc) {
-                LOG(INFO) << "Context tag = " << context_tag;
-                CHECK(tag_desc.size() > 0);
-                CHECK(sym_desc.size() > 0);
-            }
-
-            void operator()(size_t iter,
-                            typename std::vector<particle>::const_iterator begin,
-                            typename std::vector<particle>::const_iterator end) {
-                auto instance = test.begin();
-                std::string path(prefix+"_"+std::to_string(iter)+".conll");
-                std::ofstream of (path);
-                CHECK(of.is_open()) << "Problem opening: "     << path;
-                LOG(INFO)           << "Writing predictions: " << path;
-                CHECK(sym_desc.size() > 0);
-                CHECK(tag_desc.size() > 0);
-                for(auto particle = begin; particle != end; ++particle) {
-                    write_tagging_conll(of,
-                                        instance->words,
-                                        particle->tags,
-                                        particle->lens,
-                                        instance->tags,
-                                        instance->lens,
-                                        context_tag,
-                                        sym_desc,
-                                        tag_desc);
-                    instance ++;
-                }
-                CHECK(instance == test.end());
-                of.close();
-            }
-        };
+        void set_lookahead(size_t k) { lookahead = k; }
+
+      const data_t& get_corpus() const {
+        return corpus;
+      }
     };
 }
 
@@ -1,9 +1,11 @@
 #include <gtest/gtest.h>
 
+#include <memory>
 #include <string>
 #include <fstream>
 
 #include <nn/reader.hpp>
+#include <nn/generic_filter.hpp>
 #include <nn/segmental_sequence_memoizer.hpp>
 
 #include <cereal/archives/binary.hpp>
@@ -29,3 +31,325 @@ TEST(SegmentalSequenceMemoizer, CerealWorks) {
         iarchive( model );
     }
 }
+
+TEST(SegmentalSequenceMemoizer, MergeAddsShards) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    typedef segmental_sequence_memoizer<> Model;
+    rng::init();
+    std::string fn1 {"/tmp/ssm_merge_shard1.conll"};
+    std::string fn2 {"/tmp/ssm_merge_shard2.conll"};
+    std::string gaz1 {"/tmp/ssm_merge_gaz1.conll"};
+    std::string gaz2 {"/tmp/ssm_merge_gaz2.conll"};
+    {
+        std::ofstream os(gaz1);
+        os << "New B-LOC\nYork I-LOC\n\n";
+        os << "York B-LOC\n\n";
+    }
+    {
+        std::ofstream os(gaz2);
+        os << "Zurich B-LOC\n\n";
+        os << "Qq B-PER\n\n";
+        os << "York B-LOC\n\n";
+    }
+    {
+        std::ofstream os(fn1);
+        os << "Ann B-PER\nin O\nNew B-LOC\nYork I-LOC\n\n";
+        os << "in O\nYork B-LOC\n\n";
+    }
+    {
+        std::ofstream os(fn2); // tags in another order, new characters
+        os << "Zurich B-LOC\nis O\n\n";
+        os << "Qq B-PER\nin O\nYork B-LOC\n\n";
+    }
+    auto train = [](const std::string& fn, const std::string& gaz_fn) {
+        Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+        auto data = corpus.read(fn);
+        auto gaz = corpus.read(gaz_fn);
+        auto model = std::make_unique<Model>(corpus);
+        for (const auto& ex : data) model->observe(ex.tags, ex.lens, ex.words);
+        for (const auto& ex : gaz) {
+            model->observe_gazetteer(ex.tags, ex.lens, ex.words);
+        }
+        return model;
+    };
+    auto m1 = train(fn1, gaz1);
+    auto m2 = train(fn2, gaz2);
+    auto customers = [](const Model& m, const std::string& tag) {
+        auto key = m.get_corpus().tagtab.key(tag);
+        return m.get_emission_model(key)->get_num_customers();
+    };
+
+    auto ntrans = m1->get_transition_model()->totalCustomers()
+        + m2->get_transition_model()->totalCustomers();
+    auto nloc = customers(*m1, "LOC") + customers(*m2, "LOC");
+    auto nper = customers(*m1, "PER") + customers(*m2, "PER");
+    m1->merge(*m2);
+    ASSERT_EQ(m1->get_transition_model()->totalCustomers(), ntrans);
+    ASSERT_EQ(customers(*m1, "LOC"), nloc);
+    ASSERT_EQ(customers(*m1, "PER"), nper);
+    ASSERT_TRUE(m1->get_corpus().symtab.has_key("Q"));
+    ASSERT_TRUE(m1->get_corpus().symtab.has_key("Z"));
+
+    // the gazetteer spans of both shards guide the proposals
+    auto corpus = m1->get_corpus();
+    auto g1 = corpus.read(gaz1);
+    auto g2 = corpus.read(gaz2);
+    const auto& spans = m1->get_spans();
+    auto loc = corpus.tagtab.key("LOC");
+    auto per = corpus.tagtab.key("PER");
+    auto root   = span_trie::ROOT;
+    auto New    = spans.child(root, g1[0].words[0]);
+    auto zurich = spans.child(root, g2[0].words[0]);
+    auto qq     = spans.child(root, g2[1].words[0]);
+    auto york   = spans.child(root, g2[2].words[0]);
+    ASSERT_EQ(spans.ends(zurich, loc), 1);
+    ASSERT_EQ(spans.ends(qq, per), 1);
+    ASSERT_EQ(spans.ends(qq, loc), 0);
+    ASSERT_EQ(spans.ends(york, loc), 2);
+    ASSERT_EQ(spans.longer(New, loc), 1);
+    ASSERT_EQ(spans.ends(spans.child(New, g1[0].words[1]), loc), 1);
+}
+
+TEST(SegmentalSequenceMemoizer, BulkObserveSeatsAllCustomers) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    typedef segmental_sequence_memoizer<> Model;
+    rng::init();
+    std::string fn {"/tmp/ssm_bulk.conll"};
+    {
+        std::ofstream os(fn);
+        for (auto i = 0; i < 3; ++i) {
+            os << "Ann B-PER\nin O\nNew B-LOC\nYork I-LOC\n\n";
+            os << "in O\nYork B-LOC\n\n";
+            os << "the O\nend O\n\n";
+        }
+    }
+    Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+    auto data = corpus.read(fn);
+    Model m1(corpus);
+    Model m2(corpus);
+    Model::observations obs;
+    for (const auto& ex : data) {
+        m1.observe(ex.tags, ex.lens, ex.words);
+        m2.count(ex.tags, ex.lens, ex.words, obs);
+    }
+    // the repeated sentences add no new events, and the second and
+    // third both start with an O after <bos>
+    ASSERT_EQ(obs.transitions.get_total(), 3 * (4 + 3 + 3));
+    ASSERT_EQ(obs.transitions.size(), 4 + 3 + 3 - 1);
+    m2.observe(obs);
+
+    auto customers = [&](const Model& m, const std::string& tag) {
+        auto key = corpus.tagtab.key(tag);
+        return m.get_emission_model(key)->get_num_customers();
+    };
+    ASSERT_EQ(m1.get_transition_model()->totalCustomers(),
+              m2.get_transition_model()->totalCustomers());
+    for (std::string tag : { "O", "PER", "LOC" }) {
+        ASSERT_EQ(customers(m1, tag), customers(m2, tag));
+    }
+
+    // gazetteer entries go to the bases of the emission models, which
+    // already hold a customer for each table of the adaptors
+    auto base_customers = [&](const Model& m, const std::string& tag) {
+        auto key = corpus.tagtab.key(tag);
+        return m.get_emission_model(key)->get_base()->get_model()->totalCustomers();
+    };
+    std::vector<size_t> before1, before2;
+    for (std::string tag : { "O", "PER", "LOC" }) {
+        before1.push_back(base_customers(m1, tag));
+        before2.push_back(base_customers(m2, tag));
+    }
+    Model::observations gaz;
+    for (const auto& ex : data) {
+        m1.observe_gazetteer(ex.tags, ex.lens, ex.words);
+        m2.count_gazetteer(ex.tags, ex.lens, ex.words, gaz);
+    }
+    m2.observe(gaz);
+    size_t i = 0;
+    for (std::string tag : { "O", "PER", "LOC" }) {
+        ASSERT_EQ(base_customers(m1, tag) - before1[i],
+                  base_customers(m2, tag) - before2[i]);
+        ++ i;
+    }
+}
+
+TEST(SegmentalSequenceMemoizer, ConstraintsTakeAnyTag) {
+    using namespace nn;
+    // B-3, B-100 I-100, then a word of unknown label
+    const sym unk {7};
+    tag_constraints cons({ 3, 100, unk }, { 1, 2, 1 }, unk);
+    ASSERT_EQ(cons.size(), 4);
+    ASSERT_TRUE(cons.allows(0, 3));
+    ASSERT_FALSE(cons.allows(0, 100));
+    ASSERT_TRUE(cons.allows(1, 100));
+    ASSERT_TRUE(cons.allows(2, 100));
+    ASSERT_FALSE(cons.allows(2, 3));
+    ASSERT_FALSE(cons.allows(2, 1000));
+    ASSERT_TRUE(cons.allows(3, 1000));
+    ASSERT_TRUE(cons.allows(4, 1000)); // past the end
+    ASSERT_TRUE(cons.may_begin(1));
+    ASSERT_FALSE(cons.may_begin(2));
+    ASSERT_FALSE(cons.may_continue(1));
+    ASSERT_TRUE(cons.may_continue(2, 100));
+    ASSERT_FALSE(cons.may_continue(2, 3));
+}
+
+TEST(SegmentalSequenceMemoizer, ConstrainedSampleKeepsKnownTags) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    typedef segmental_sequence_memoizer<> Model;
+    typedef generic_filter<Model, Model::particle> Filter;
+    rng::init();
+    std::string fn {"/tmp/ssm_constrained.conll"};
+    {
+        std::ofstream os(fn);
+        os << "Ann B-PER\nin O\nNew B-LOC\nYork I-LOC\n\n";
+        os << "in O\nYork B-LOC\nis O\n\n";
+        // Only some labels known: "New" must be the start of the LOC
+        // that goes on to "York"
+        os << "Ann ?\nin O\nNew ?\nYork I-LOC\nis ?\n\n";
+    }
+    Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+    auto data = corpus.read(fn);
+    ASSERT_EQ(data.back().obs, Annotation::SEMI);
+    Model model(corpus);
+    ASSERT_EQ(model.num_tags(), 3); // no emission model for "?"
+    for (size_t i = 0; i < 2; ++i) {
+        model.observe(data[i].tags, data[i].lens, data[i].words);
+    }
+
+    const auto& ex = data.back();
+    tag_constraints cons(ex.tags, ex.lens, corpus.tagtab.key(corpus.unk_tag));
+    auto loc = corpus.tagtab.key("LOC");
+    auto other = corpus.get_other_key();
+    auto respects = [&](const Model::particle& p) {
+        size_t t = 0;
+        for (size_t i = 0; i < p.tags.size(); ++i) {
+            if (!cons.may_begin(t)) return false;
+            for (size_t j = 0; j < p.lens[i]; ++j, ++t) {
+                if (!cons.allows(t, p.tags[i])) return false;
+                if (j > 0 && !cons.may_continue(t)) return false;
+            }
+        }
+        return t == ex.words.size() - 1 && p.tags[1] == other
+            && p.tags[2] == loc && p.lens[2] >= 2;
+    };
+
+    for (bool collapse : { false, true }) {
+        Filter::settings config;
+        config.num_particles = 8;
+        config.collapse = collapse;
+        Filter filter(config, model);
+        auto p = filter.sample(ex.tags, ex.lens, ex.words, ex.obs);
+        ASSERT_TRUE(respects(p));
+        for (size_t iter = 0; iter < 20; ++iter) {
+            p = filter.conditional_sample(p, ex.tags, ex.lens, ex.words, ex.obs);
+            ASSERT_TRUE(respects(p));
+            ASSERT_GT(filter.get_ess(), 0.0);
+        }
+    }
+}
+
+TEST(SegmentalSequenceMemoizer, GazetteerProposalKeepsEvidence) {
+    using namespace nn;
+    typedef CoNLLCorpus<> Corpus;
+    typedef segmental_sequence_memoizer<> Model;
+    typedef generic_filter<Model, Model::particle> Filter;
+    rng::init();
+    std::string fn {"/tmp/ssm_gazetteer.conll"};
+    {
+        std::ofstream os(fn);
+        os << "Ann B-PER\nin O\nNew B-LOC\nYork I-LOC\nCity I-LOC\n\n";
+        os << "in O\nYork B-LOC\nis O\n\n";
+        os << "at O\nNew B-LOC\nYork I-LOC\nCity I-LOC\n\n";
+    }
+    Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+    auto data = corpus.read(fn);
+    Model model(corpus);
+    for (size_t i = 0; i < 2; ++i) {
+        model.observe(data[i].tags, data[i].lens, data[i].words);
+        model.index_spans(data[i].tags, data[i].lens, data[i].words);
+    }
+    ASSERT_EQ(model.get_spans().size(), 6); // LOC: New York City, York
+
+    // Both proposals estimate the same marginal likelihood; the
+    // estimates are averaged over enough runs for the tolerance
+    Filter::settings config;
+    config.num_particles = 4096;
+    Filter filter(config, model);
+    const auto& words = data.back().words;
+    auto log_z = [&]() {
+        double ret {0};
+        for (size_t i = 0; i < 32; ++i) ret += filter.estimate_log_partition(words);
+        return ret / 32;
+    };
+    auto hybrid = log_z();
+    model.set_proposal(FilterProposal::GAZETTEER);
+    auto guided = log_z();
+    ASSERT_NEAR(hybrid, guided, 0.05);
+}
+
+// Model and sentence for the proposals that look past the current
+// word: the entity is followed by another word
+struct ProposalEvidence : public ::testing::Test {
+    typedef nn::CoNLLCorpus<> Corpus;
+    typedef nn::segmental_sequence_memoizer<> Model;
+    typedef nn::generic_filter<Model, Model::particle> Filter;
+
+    std::string fn {"/tmp/ssm_proposals.conll"};
+    Corpus corpus {"<bos>", "<eos>", "<s>", "<unk>", "O"};
+    nn::instances data;
+    std::unique_ptr<Model> model;
+
+    ProposalEvidence() {
+        nn::rng::init();
+        {
+            std::ofstream os(fn);
+            os << "Ann B-PER\nin O\nNew B-LOC\nYork I-LOC\nCity I-LOC\n\n";
+            os << "in O\nYork B-LOC\nis O\n\n";
+            os << "at O\nNew B-LOC\nYork I-LOC\nCity I-LOC\nis O\n\n";
+        }
+        data = corpus.read(fn);
+        model.reset(new Model(corpus));
+        for (size_t i = 0; i < 2; ++i) {
+            model->observe(data[i].tags, data[i].lens, data[i].words);
+            model->index_spans(data[i].tags, data[i].lens, data[i].words);
+        }
+    }
+
+    double log_z(Filter& f, nn::FilterProposal prop) {
+        model->set_proposal(prop);
+        double ret {0};
+        for (size_t i = 0; i < 32; ++i) {
+            ret += f.estimate_log_partition(data.back().words);
+        }
+        return ret / 32;
+    }
+};
+
+TEST_F(ProposalEvidence, LookaheadProposalKeepsEvidence) {
+    using namespace nn;
+    Filter::settings config;
+    config.num_particles = 4096;
+    Filter filter(config, *model);
+    auto hybrid = log_z(filter, FilterProposal::HYBRID);
+    ASSERT_NEAR(hybrid, log_z(filter, FilterProposal::LOOKAHEAD), 0.05);
+}
+
+// The particles in the same state are moved together
+TEST_F(ProposalEvidence, CollapsedProposalsKeepEvidence) {
+    using namespace nn;
+    Filter::settings config;
+    config.num_particles = 4096;
+    Filter filter(config, *model);
+    config.collapse = true;
+    Filter collapsed(config, *model);
+    auto hybrid = log_z(filter, FilterProposal::HYBRID);
+    for (auto prop : { FilterProposal::HYBRID,
+                       FilterProposal::GAZETTEER,
+                       FilterProposal::LOOKAHEAD }) {
+        ASSERT_NEAR(hybrid, log_z(collapsed, prop), 0.1);
+    }
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_SEMI_MARKOV_HPP__
+#define __NN_SEMI_MARKOV_HPP__
+
+#include <map>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include <nn/log.hpp>
+#include <nn/mu.hpp>
+#include <nn/rng.hpp>
+#include <nn/data.hpp>
+
+namespace nn {
+
+    // Exact inference over the segmentations of a sentence, for
+    // segmental models whose transitions condition on a bounded number
+    // of previous segments: the log partition function (forward
+    // filtering), posterior samples (backward sampling) and the most
+    // probable segmentation (Viterbi). The model provides
+    //
+    //   tag_set()                    the tags of segments
+    //   initial_context()            context at the start of a sentence
+    //   update_context(tag, w, c)    c after a segment that starts at w
+    //   log_transition(c, tag)       log p(tag | c); get_eos_tag() ends
+    //   segment_log_probs(words, L)  segment emissions (see the SSM)
+    //   make_particle(tags, lens)
+    //
+    // The transitions see only the last settings::order elements of
+    // the context, and segments have at most settings::max_len words;
+    // within these bounds the results are exact. The states of the
+    // dynamic program are the distinct truncated contexts at each
+    // segment boundary. Emissions are computed once per segment, and
+    // transitions once per state.
+    template<typename Model>
+    class semi_markov_decoder {
+    public:
+        struct settings {
+            size_t order   {2}; // context elements seen by transitions
+            size_t max_len {8}; // words in a segment
+        };
+
+        typedef typename Model::particle particle;
+
+    private:
+        typedef phrase Context;
+
+        static constexpr size_t NONE {std::numeric_limits<size_t>::max()};
+
+        const Model& model;
+        const settings config;
+        std::vector<sym> tags; // segment tags, in order
+        sym eos_tag;
+
+        // Context elements and states of the current sentence
+        std::map<syms, size_t> element_ids;
+        std::vector<const syms*> elements;
+        struct state {
+            std::vector<size_t> key;       // element ids, oldest first
+            std::vector<double> log_trans; // by tag index; EOS last
+            std::unordered_map<size_t, size_t> next; // by element id
+        };
+        std::map<std::vector<size_t>, size_t> state_ids;
+        std::vector<state> states;
+
+        // A segment of tag index tag from position begin, whose
+        // segmentations so far end in chart[begin][from]
+        struct edge {
+            size_t begin;
+            size_t from;
+            size_t tag;
+            double log_w;
+        };
+
+        // The segmentations of the words up to a position that end in
+        // a state: log_alpha sums them, log_best is the best of them,
+        // which ends with in[best]
+        struct cell {
+            size_t state;
+            double log_alpha;
+            double log_best;
+            size_t best;
+            std::vector<edge> in;
+        };
+
+        const phrase* words {nullptr};
+        std::vector<std::vector<cell>> chart;                    // by position
+        std::vector<std::unordered_map<size_t, size_t>> cell_of; // by position
+        std::vector<double> final_log_w;                         // chart.back()
+        double log_z {0};
+
+        size_t element_id(const syms& element) {
+            auto it = element_ids.find(element);
+            if (it != element_ids.end()) return it->second;
+            it = element_ids.emplace(element, elements.size()).first;
+            elements.push_back(&it->first);
+            return it->second;
+        }
+
+        size_t state_id(const std::vector<size_t>& key) {
+            auto it = state_ids.find(key);
+            if (it != state_ids.end()) return it->second;
+            state s;
+            s.key = key;
+            Context context;
+            for (auto e : key) context.push_back(*elements[e]);
+            for (auto tag : tags) {
+                s.log_trans.push_back(model.log_transition(context, tag));
+            }
+            s.log_trans.push_back(model.log_transition(context, eos_tag));
+            states.push_back(std::move(s));
+            state_ids.emplace(key, states.size() - 1);
+            return states.size() - 1;
+        }
+
+        // The state after a segment of element e (see update_context)
+        size_t successor(size_t s, size_t e) {
+            auto it = states[s].next.find(e);
+            if (it != states[s].next.end()) return it->second;
+            auto key = states[s].key;
+            key.push_back(e);
+            if (key.size() > config.order) key.erase(key.begin());
+            auto ret = state_id(key);
+            states[s].next.emplace(e, ret);
+            return ret;
+        }
+
+        size_t cell_at(size_t pos, size_t s) {
+            auto it = cell_of[pos].find(s);
+            if (it != cell_of[pos].end()) return it->second;
+            auto neg_inf = -std::numeric_limits<double>::infinity();
+            chart[pos].push_back(cell { s, neg_inf, neg_inf, NONE, {} });
+            cell_of[pos].emplace(s, chart[pos].size() - 1);
+            return chart[pos].size() - 1;
+        }
+
+        // Follows edges back from cell c of the last position: by
+        // weight, or the best ones
+        particle trace(size_t c, bool best) const {
+            syms tag_seq, len_seq;
+            auto& eng = rng::get();
+            auto pos = chart.size() - 1;
+            while (pos > 0) {
+                const auto& x = chart[pos][c];
+                size_t k = x.best;
+                if (!best) {
+                    std::vector<double> lw(x.in.size());
+                    for (size_t i = 0; i < lw.size(); ++i) lw[i] = x.in[i].log_w;
+                    k = sample_unnormalized_lnpdf(lw, eng);
+                }
+                const auto& e = x.in.at(k);
+                tag_seq.push_back(tags[e.tag]);
+                len_seq.push_back(pos - e.begin);
+                pos = e.begin;
+                c = e.from;
+            }
+            std::reverse(tag_seq.begin(), tag_seq.end());
+            std::reverse(len_seq.begin(), len_seq.end());
+            return model.make_particle(tag_seq, len_seq);
+        }
+
+    public:
+        semi_markov_decoder(settings _config, const Model& _model)
+            : model(_model), config(_config) {
+            CHECK(config.order > 0) << "order must be positive";
+            CHECK(config.max_len > 0) << "max_len must be positive";
+            auto ts = model.tag_set();
+            tags.assign(ts.begin(), ts.end());
+            std::sort(tags.begin(), tags.end());
+            eos_tag = model.get_eos_tag();
+        }
+
+        semi_markov_decoder(semi_markov_decoder const&)            = delete;
+        semi_markov_decoder& operator=(semi_markov_decoder const&) = delete;
+
+        // Fills the chart of the given sentence, whose last word is
+        // EOS, and returns its log partition function
+        double forward(const phrase& _words) {
+            CHECK(_words.size() > 0) << "no EOS";
+            words = &_words;
+            element_ids.clear();
+            elements.clear();
+            state_ids.clear();
+            states.clear();
+
+            auto n = _words.size() - 1;
+            auto lps = model.segment_log_probs(_words, config.max_len);
+            chart.assign(n + 1, std::vector<cell>());
+            cell_of.assign(n + 1, std::unordered_map<size_t, size_t>());
+
+            std::vector<size_t> key;
+            for (const auto& e : model.initial_context()) {
+                key.push_back(element_id(e));
+            }
+            if (key.size() > config.order) {
+                key.erase(key.begin(), key.end() - config.order);
+            }
+            auto c0 = cell_at(0, state_id(key));
+            chart[0][c0].log_alpha = 0;
+            chart[0][c0].log_best  = 0;
+
+            // The element of a segment of each tag starting at word i
+            std::vector<size_t> elem(tags.size());
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t k = 0; k < tags.size(); ++k) {
+                    Context c;
+                    model.update_context(tags[k], _words[i], c);
+                    elem[k] = element_id(c.back());
+                }
+                for (size_t c = 0; c < chart[i].size(); ++c) {
+                    auto s     = chart[i][c].state;
+                    auto alpha = chart[i][c].log_alpha;
+                    auto best  = chart[i][c].log_best;
+                    for (size_t k = 0; k < tags.size(); ++k) {
+                        auto it = lps[i].find(tags[k]);
+                        if (it == lps[i].end()) continue;
+                        auto next = successor(s, elem[k]);
+                        auto lt   = states[s].log_trans[k];
+                        for (size_t len = 1; len <= it->second.size(); ++len) {
+                            auto lw = lt + it->second[len-1];
+                            auto& x = chart[i+len][cell_at(i+len, next)];
+                            x.in.push_back(edge { i, c, k, alpha + lw });
+                            x.log_alpha = log_add(x.log_alpha, alpha + lw);
+                            if (best + lw > x.log_best) {
+                                x.log_best = best + lw;
+                                x.best = x.in.size() - 1;
+                            }
+                        }
+                    }
+                }
+            }
+
+            log_z = -std::numeric_limits<double>::infinity();
+            final_log_w.clear();
+            for (const auto& x : chart[n]) {
+                auto lw = states[x.state].log_trans.back();
+                final_log_w.push_back(x.log_alpha + lw);
+                log_z = log_add(log_z, x.log_alpha + lw);
+            }
+            return log_z;
+        }
+
+        double get_log_partition() const { return log_z; }
+        size_t num_states() const { return states.size(); }
+
+        // A segmentation of the sentence of the last forward pass,
+        // drawn from the posterior
+        particle sample() const {
+            CHECK(words != nullptr) << "sample before forward";
+            auto c = sample_unnormalized_lnpdf(final_log_w, rng::get());
+            return trace(c, false);
+        }
+
+        // The most probable segmentation of the given sentence
+        particle viterbi(const phrase& _words) {
+            forward(_words);
+            const auto& last = chart.back();
+            size_t c = 0;
+            double best = -std::numeric_limits<double>::infinity();
+            for (size_t i = 0; i < last.size(); ++i) {
+                auto lw = last[i].log_best + states[last[i].state].log_trans.back();
+                if (lw > best) {
+                    best = lw;
+                    c = i;
+                }
+            }
+            return trace(c, true);
+        }
+
+        // A segmentation of the given sentence drawn from the posterior
+        particle sample(const phrase& _words) {
+            forward(_words);
+            return sample();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,159 @@
+#include <gtest/gtest.h>
+
+#include <map>
+#include <string>
+#include <fstream>
+#include <functional>
+
+#include <nn/reader.hpp>
+#include <nn/segmental_sequence_memoizer.hpp>
+#include <nn/semi_markov.hpp>
+
+using namespace nn;
+
+typedef CoNLLCorpus<> Corpus;
+typedef segmental_sequence_memoizer<> Model;
+typedef semi_markov_decoder<Model> Decoder;
+
+struct segmentation {
+    syms tags;
+    syms lens;
+    double log_p;
+};
+
+// Every segmentation the decoder considers, with its log probability
+// when transitions see the last order elements of the context
+std::vector<segmentation> enumerate(const Model& model, const phrase& words,
+                                    size_t order, size_t max_len) {
+    std::vector<segmentation> ret;
+    auto n = words.size() - 1;
+    auto tag_set = model.tag_set();
+    auto other = model.get_corpus().get_other_key();
+    auto log_trans = [&](const phrase& context, sym tag) {
+        auto begin = context.size() > order ? context.end() - order
+            : context.begin();
+        return model.log_transition(phrase(begin, context.end()), tag);
+    };
+    segmentation x;
+    std::function<void(size_t, phrase, double)> extend =
+        [&](size_t t, phrase context, double lp) {
+        if (t == n) {
+            x.log_p = lp + log_trans(context, model.get_eos_tag());
+            ret.push_back(x);
+            return;
+        }
+        for (auto tag : tag_set) {
+            auto longest = tag == other ? 1 : std::min(max_len, n - t);
+            for (size_t len = 1; len <= longest; ++len) {
+                auto it = words.begin() + t;
+                auto lw = log_trans(context, tag) +
+                    model.get_emission_model(tag)->log_prob(it, it+len);
+                auto next = context;
+                model.update_context(tag, *it, next);
+                x.tags.push_back(tag);
+                x.lens.push_back(len);
+                extend(t + len, next, lp + lw);
+                x.tags.pop_back();
+                x.lens.pop_back();
+            }
+        }
+    };
+    extend(0, model.initial_context(), 0.0);
+    return ret;
+}
+
+std::unique_ptr<Model> train(Corpus& corpus, instances& data) {
+    rng::init();
+    std::string fn {"/tmp/semi_markov.conll"};
+    {
+        std::ofstream os(fn);
+        os << "Ann B-PER\nin O\nNew B-LOC\nYork I-LOC\n\n";
+        os << "in O\nYork B-LOC\nis O\n\n";
+        os << "Ann B-PER\nLee I-PER\nis O\nin O\n\n";
+        os << "Lee O\nin O\nNew O\nYork O\n\n";
+    }
+    data = corpus.read(fn);
+    auto model = std::make_unique<Model>(corpus);
+    for (size_t i = 0; i + 1 < data.size(); ++i) {
+        model->observe(data[i].tags, data[i].lens, data[i].words);
+    }
+    return model;
+}
+
+TEST(SemiMarkovDecoder, ForwardMatchesEnumeration) {
+    Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+    instances data;
+    auto model = train(corpus, data);
+    const auto& words = data.back().words;
+    for (size_t order : { 1, 2, 10 }) {
+        for (size_t max_len : { 1, 2, 4 }) {
+            Decoder::settings config;
+            config.order   = order;
+            config.max_len = max_len;
+            Decoder decoder(config, *model);
+            auto segs = enumerate(*model, words, order, max_len);
+            auto log_z = -std::numeric_limits<double>::infinity();
+            for (const auto& s : segs) log_z = log_add(log_z, s.log_p);
+            ASSERT_NEAR(decoder.forward(words), log_z, 1e-9);
+        }
+    }
+    // With the whole context the log probabilities are the model's
+    for (const auto& s : enumerate(*model, words, 10, 4)) {
+        ASSERT_NEAR(s.log_p, model->log_prob(s.tags, s.lens, words), 1e-9);
+    }
+}
+
+TEST(SemiMarkovDecoder, ViterbiFindsBestSegmentation) {
+    Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+    instances data;
+    auto model = train(corpus, data);
+    for (const auto& ex : data) {
+        for (size_t order : { 1, 3 }) {
+            Decoder::settings config;
+            config.order   = order;
+            config.max_len = 3;
+            Decoder decoder(config, *model);
+            auto segs = enumerate(*model, ex.words, order, config.max_len);
+            auto best = std::max_element(segs.begin(), segs.end(),
+                                         [](const segmentation& a,
+                                            const segmentation& b) {
+                                             return a.log_p < b.log_p;
+                                         });
+            auto p = decoder.viterbi(ex.words);
+            ASSERT_EQ(p.tags, best->tags);
+            ASSERT_EQ(p.lens, best->lens);
+        }
+    }
+}
+
+TEST(SemiMarkovDecoder, SamplesFollowPosterior) {
+    Corpus corpus("<bos>", "<eos>", "<s>", "<unk>", "O");
+    instances data;
+    auto model = train(corpus, data);
+    const auto& words = data.back().words;
+    Decoder::settings config;
+    config.order   = 2;
+    config.max_len = 4;
+    Decoder decoder(config, *model);
+    auto log_z = decoder.forward(words);
+    std::map<std::pair<syms, syms>, double> posterior;
+    for (const auto& s : enumerate(*model, words, config.order, config.max_len)) {
+        posterior[std::make_pair(s.tags, s.lens)] = exp(s.log_p - log_z);
+    }
+    const size_t nsamples = 20000;
+    std::map<std::pair<syms, syms>, double> freq;
+    for (size_t i = 0; i < nsamples; ++i) {
+        auto p = decoder.sample();
+        auto key = std::make_pair(p.tags, p.lens);
+        ASSERT_TRUE(posterior.count(key));
+        freq[key] += 1.0 / nsamples;
+    }
+    for (const auto& kv : posterior) {
+        ASSERT_NEAR(freq[kv.first], kv.second, 0.015);
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
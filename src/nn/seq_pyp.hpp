@@ -19,26 +19,38 @@
 #ifndef __NN_SEQ_PYP_HPP__
 #define __NN_SEQ_PYP_HPP__
 
+#include <algorithm>
 #include <vector>
 #include <memory>
+#include <type_traits>
 
 #include <nn/log.hpp>
 #include <nn/restaurants.hpp>
+#include <nn/string_table.hpp>
 
 #include <cereal/types/vector.hpp>
 #include <cereal/types/memory.hpp>
 
 namespace nn {
 
+// Sequences are interned on their way in and the restaurant seats
+// customers by the resulting ids, so each distinct dish is stored
+// once and table lookups compare integers rather than sequences.
 template <typename S,
           typename T = std::vector<S>,
-          typename Restaurant = SimpleFullRestaurant<T>
+          typename Restaurant = SimpleFullRestaurant<typename string_table<S>::id_t>
           >
 class seq_pyp : public restaurant_interface<T> {
+    static_assert(std::is_same<T, std::vector<S>>::value,
+                  "dishes must be symbol vectors");
+
+    string_table<S> strings;
     Restaurant restaurant;
     std::unique_ptr<typename Restaurant::Payload> crp;
 
 public:
+    typedef typename string_table<S>::id_t id_t;
+
     seq_pyp() {}
     seq_pyp(S _BOS, S _EOS, S _SPACE)
         : crp(std::make_unique<typename Restaurant::Payload>()) {
@@ -48,7 +60,7 @@ public:
     seq_pyp& operator=(seq_pyp const&) = delete;
 
     size_t get_c(const T& obs) const override {
-        return restaurant.getC( crp.get(), obs );
+        return restaurant.getC( crp.get(), strings.find(obs) );
     }
 
     size_t get_c() const override {
@@ -56,7 +68,7 @@ public:
     }
 
     size_t get_t(const T& obs) const override {
-        return restaurant.getT( crp.get(), obs );
+        return restaurant.getT( crp.get(), strings.find(obs) );
     }
 
     size_t get_t() const override {
@@ -64,15 +76,19 @@ public:
     }
 
     double prob(const T& obs, double p0, double d, double a) const override {
-        return restaurant.computeProbability( crp.get(), obs, p0, d, a );
+        return restaurant.computeProbability( crp.get(), strings.find(obs), p0, d, a );
     }
 
     double log_prob(const T& obs, double ln_p0, double d, double a) const override {
-        return restaurant.computeLogProbability( crp.get(), obs, ln_p0, d, a );
+        return restaurant.computeLogProbability( crp.get(), strings.find(obs), ln_p0, d, a );
     }
 
     double log_cache_prob(const T& obs, double d, double a) const override {
-        return restaurant.computeLogCacheProb( crp.get(), obs, d, a );
+        return log_cache_prob( strings.find(obs), d, a );
+    }
+
+    double log_cache_prob(id_t id, double d, double a) const {
+        return restaurant.computeLogCacheProb( crp.get(), id, d, a );
     }
 
     double log_new_prob(double ln_p0, double d, double a) const override {
@@ -80,17 +96,43 @@ public:
     }
 
     bool add(const T& obs, double ln_p0, double d, double a) override {
-        return restaurant.logAddCustomer( crp.get(), obs, ln_p0, d, a );
+        return restaurant.logAddCustomer( crp.get(), strings.intern(obs), ln_p0, d, a );
     }
 
     bool remove(const T& obs, double d, double a) override {
-        auto removed_table = restaurant.removeCustomer(crp.get(), obs, d);
+        auto id = strings.find(obs);
+        if (id == string_table<S>::npos) {
+            LOG(FATAL) << "removing unseen sequence";
+            return false;
+        }
+        auto removed_table = restaurant.removeCustomer(crp.get(), id, d);
         return removed_table;
     }
 
+    // Interned sequences; this includes every sequence ever added,
+    // even those with no remaining customers.
+    const string_table<S>& get_strings() const { return strings; }
+
+    // Adds the tables of other, whose sequences are translated
+    // symbol by symbol with sym_map
+    template<typename SymMap>
+    void merge(const seq_pyp& other, const SymMap& sym_map) {
+        std::vector<id_t> ids;
+        ids.reserve(other.strings.size());
+        T seq;
+        for (id_t id = 0; id < other.strings.size(); ++id) {
+            const auto& src = other.strings.get(id);
+            seq.resize(src.size());
+            std::transform(src.begin(), src.end(), seq.begin(), sym_map);
+            ids.push_back(strings.intern(seq));
+        }
+        restaurant.merge(crp.get(), other.crp.get(),
+                         [&ids](id_t id) { return ids[id]; });
+    }
+
     template<class Archive>
     void serialize(Archive & archive) {
-        archive( crp );
+        archive( strings, crp );
     }
 };
 
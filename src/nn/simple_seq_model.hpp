@@ -25,6 +25,7 @@
 #include <nn/uniform.hpp>
 #include <nn/fixed_depth_hpyp.hpp>
 #include <nn/mutable_symtab.hpp>
+#include <nn/event_counts.hpp>
 
 namespace nn {
 
@@ -78,6 +79,8 @@ namespace nn {
         H get_base()   { return model->get_base(); }
         M* get_model() { return model.get();      }
 
+        prune_stats prune(double threshold) { return model->prune(threshold); }
+
         double log_prob(const seq_t& seq) const {
             CHECK(seq.front() == BOS) << "seq doesn't start with BOS";
             double ret = 0.0;
@@ -88,6 +91,55 @@ namespace nn {
             return ret;
         }
 
+        // Left-to-right scorer for a growing sequence. It keeps the
+        // running log probability and the node chain of the current
+        // context, so each extension costs one walk of at most
+        // MAX_DEPTH nodes regardless of how long the sequence is, and
+        // any number of symbols can be peeked at in that context.
+        class scorer {
+            const M* model {nullptr};
+            seq_t context;
+            typename M::NodeChain chain {};
+            size_t chain_size {0};
+            double lp {0.0};
+
+            void refresh() {
+                // keep a bounded window of the context
+                if (context.size() > 2*M::max_depth) {
+                    context.erase(context.begin(),
+                                  context.end() - M::max_depth);
+                }
+                chain_size = model->find_node_chain(context.begin(),
+                                                    context.end(),
+                                                    chain);
+            }
+
+        public:
+            scorer() {}
+            scorer(const M* _model, T BOS) : model(_model), context {BOS} {
+                refresh();
+            }
+
+            // log p(obs | sequence so far); does not extend
+            double log_prob(T obs) const {
+                return model->log_prob(chain, chain_size, obs);
+            }
+
+            // extend the sequence with obs, returning its log probability
+            double extend(T obs) {
+                auto ret = log_prob(obs);
+                lp += ret;
+                context.push_back(obs);
+                refresh();
+                return ret;
+            }
+
+            // total log probability of the sequence so far (after BOS)
+            double log_prob() const { return lp; }
+        };
+
+        scorer get_scorer() const { return scorer(model.get(), BOS); }
+
         double prob(const seq_t& seq, T obs) const {
             return model->prob(seq, obs);
         }
@@ -113,6 +165,34 @@ namespace nn {
             }
         }
 
+        // (context, symbol) events of sequences to be observed in bulk;
+        // contexts are cut to the longest the model conditions on, so
+        // that the same symbol after the same recent history is
+        // counted as one event
+        typedef event_counts<std::pair<seq_t, T>> counts;
+
+        // Adds the events of n observations of seq to c
+        void count(const seq_t& seq, counts& c, size_t n = 1) const {
+            CHECK(seq.front() == BOS) << "seq doesn't start with BOS";
+            CHECK(seq.back() == EOS) << "seq doesn't stop with EOS";
+            auto start = seq.begin();
+            for(auto iter = std::next(start); iter != seq.end(); iter++) {
+                auto first = start;
+                if (static_cast<size_t>(iter - start) > M::max_depth) {
+                    first = iter - M::max_depth;
+                }
+                c.add(std::make_pair(seq_t(first, iter), *iter), n);
+            }
+        }
+
+        // Observes counted events; each is seated in one operation
+        // (see FixedDepthHPYP::observe)
+        void observe(const counts& c) {
+            for (const auto& e : c) {
+                model->observe(e.first.first, e.first.second, e.second);
+            }
+        }
+
         void remove(const seq_t& seq) {
             CHECK(seq.front() == BOS) << "seq doesn't start with BOS";
             CHECK(seq.back() == EOS) << "seq doesn't stop with EOS";
@@ -156,6 +236,16 @@ namespace nn {
         //     }
         // }
 
+        // See FixedDepthHPYP::merge; sym_map translates the symbols
+        // of other
+        template<typename SymMap>
+        void merge(const simple_seq_model& other, const SymMap& sym_map) {
+            CHECK(sym_map(other.BOS) == BOS) << "BOS mismatch";
+            CHECK(sym_map(other.EOS) == EOS) << "EOS mismatch";
+            base.merge(other.base, sym_map);
+            model->merge(*other.model, sym_map, sym_map);
+        }
+
         template<class Archive>
         void serialize(Archive & archive) {
             archive( BOS, EOS, base, model );
@@ -36,3 +36,18 @@ TEST(SimpleSequenceModel, CerealWorks) {
         ASSERT_EQ(lp, lp2);
     }
 }
+
+TEST(SimpleSequenceModel, ScorerMatchesLogProb) {
+    using namespace nn;
+    rng::init();
+    simple_seq_model<> model(5, 0, 4);
+    syms seq1 { 0, 1, 1, 2, 3, 1, 1, 2, 3, 1, 1, 2, 4 };
+    model.observe(seq1);
+    model.observe(seq1);
+    syms seq2 { 0, 1, 1, 2, 3, 1, 1, 2, 3, 3, 2, 1, 4 };
+    auto scorer = model.get_scorer();
+    for(auto it = seq2.begin()+1; it != seq2.end(); ++it) {
+        scorer.extend(*it);
+    }
+    ASSERT_EQ(model.log_prob(seq2), scorer.log_prob());
+}
@@ -23,10 +23,16 @@
 #include <random>
 #include <utility>
 #include <map>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <chrono>
 #include <omp.h>
 
 #include <nn/log.hpp>
 #include <nn/rng.hpp>
+#include <nn/filter_cost.hpp>
+#include <nn/profile.hpp>
 
 enum class rmethod {
     SMC_RESAMPLE_MULTINOMIAL,
@@ -36,6 +42,13 @@ enum class rmethod {
     SMC_RESAMPLE_NONE
 };
 
+// The particles of a sentence are moved on one team of threads for
+// the whole sentence (see run). Each thread owns the same block of
+// particles at every step, as all loops over particles share the
+// static schedule, and the threads wait for each other only to pool
+// their partial results. The methods below that work on the particle
+// system are called by every thread of the team, or by one thread
+// outside a parallel region, where they run serially.
 template<typename P, typename O>
 struct Filter {
 
@@ -46,6 +59,17 @@ struct Filter {
         size_t num_particles { 100 };
         double resample_threshold { 0.5 };
         rmethod resample { rmethod::SMC_RESAMPLE_NONE };
+        // Use a team of threads for a sentence when the cost model
+        // expects it to pay off
+        bool parallel { true };
+        // Conditional SMC: resample the ancestor of the reference
+        // particle whenever the others are resampled (see
+        // ConditionalFilter)
+        bool ancestor_sampling { false };
+        // Move the particles that are in the same state together,
+        // e.g. the copies made by resampling (see move_group); init_p
+        // must put every particle in the same state
+        bool collapse { false };
     };
 
     struct particle_system {
@@ -59,10 +83,37 @@ struct Filter {
     particle_system sys;
     settings config;
 
+    // Learned from the runs of this filter
+    nn::filter_cost_model cost;
+
+    // Resampling steps so far, over all runs
+    size_t num_resamples {0};
+
     // Temporary work buffers for resampling
     std::vector<size_t> resample_counts;
     std::vector<size_t> resample_indices;
     std::vector<double> resample_weights;
+    std::vector<double> resample_positions;
+    std::vector<size_t> resample_extra;
+    std::vector<size_t> resample_free;
+    std::vector<size_t> resample_slots;
+    double resample_offset;
+
+    // Particles in the same state form groups, with collapse: the
+    // leader of a particle is the first particle of its group. At each
+    // step, the members of group g are listed in group_members, from
+    // group_offset[g] to group_offset[g+1].
+    std::vector<size_t> group_leader;
+    std::vector<size_t> group_offset;
+    std::vector<size_t> group_members;
+    std::vector<size_t> group_same;
+    size_t num_groups {0};
+
+    // Partial results of the threads of a team, for reductions (two
+    // buffers, used in turn) and prefix sums
+    std::vector<double> team_partial[2];
+    std::vector<double> block_partial;
+    std::vector<size_t> block_counts;
 
     Filter(settings _config) : config(_config) {
         DLOG(INFO) << config.num_particles << " particles";
@@ -75,6 +126,21 @@ struct Filter {
         resample_counts.resize(config.num_particles);
         resample_indices.resize(config.num_particles);
         resample_weights.resize(config.num_particles);
+        resample_positions.resize(config.num_particles + 1);
+        resample_extra.resize(config.num_particles);
+        resample_free.resize(config.num_particles);
+        resample_slots.resize(config.num_particles);
+
+        group_leader.resize(config.num_particles);
+        group_offset.resize(config.num_particles + 1);
+        group_members.resize(config.num_particles);
+        group_same.resize(config.num_particles);
+
+        auto nt = std::max(omp_get_max_threads(), omp_get_num_procs()) + 1;
+        team_partial[0].resize(nt);
+        team_partial[1].resize(nt);
+        block_partial.resize(nt, 0.0);
+        block_counts.resize(nt, 0);
     }
 
     // initialize particle, returning incremental importance weight
@@ -83,6 +149,19 @@ struct Filter {
     // advance particle with the given observation, returning inremental importance weight
     virtual double move_p(P& particle, const O& obs) = 0;
 
+    // Advances the particles members[0..n), which are in the same
+    // state, with the given observation, adding to their weights.
+    // same[k] is the first k' <= k whose particle is still in the same
+    // state as particle members[k]. By default, the particles are
+    // moved one at a time, and each goes its own way.
+    virtual void move_group(const size_t* members, size_t n, const O& obs,
+                            size_t* same) {
+        for (size_t k = 0; k < n; ++k) {
+            sys.log_weight[members[k]] += move_p(sys.particle[members[k]], obs);
+            same[k] = k;
+        }
+    }
+
     // setup work (e.g. precompute probabilities)
     // (Optional override)
     virtual void set_up(const std::vector<O>& obs) {}
@@ -105,34 +184,151 @@ struct Filter {
         return 1.0/sum;
     }
 
-    // compute expected sample size and normalizing constant
-    void update() {
-        sys.log_Z = nn::log_add(sys.log_weight);
-        for(size_t m = 0; m < config.num_particles; ++m) {
-            sys.log_prob[m] = sys.log_weight[m] - sys.log_Z;
+    // Total of the threads' partial sums x, returned to each
+    double team_sum(double x, size_t buffer) {
+        auto& part = team_partial[buffer];
+        const size_t nt = omp_get_num_threads();
+        part[omp_get_thread_num()] = x;
+        #pragma omp barrier
+        double ret = 0;
+        for(size_t i = 0; i < nt; ++i) ret += part[i];
+        return ret;
+    }
+
+    double team_max(double x, size_t buffer) {
+        auto& part = team_partial[buffer];
+        const size_t nt = omp_get_num_threads();
+        part[omp_get_thread_num()] = x;
+        #pragma omp barrier
+        double ret = part[0];
+        for(size_t i = 1; i < nt; ++i) ret = std::max(ret, part[i]);
+        return ret;
+    }
+
+    // compute expected sample size and normalizing constant, which
+    // are returned to every thread; sys is only up to date after the
+    // next barrier
+    double update() {
+        const size_t N = config.num_particles;
+        const double ninf = -std::numeric_limits<double>::infinity();
+        double max_lw = ninf;
+        #pragma omp for schedule(static) nowait
+        for(size_t m = 0; m < N; ++m) {
+            max_lw = std::max(max_lw, sys.log_weight[m]);
         }
-        sys.ess = calc_ess();
+        max_lw = team_max(max_lw, 0);
+        if(max_lw == ninf) {
+            // all particles are dead
+            #pragma omp for schedule(static)
+            for(size_t m = 0; m < N; ++m) {
+                sys.log_prob[m] = ninf;
+            }
+            #pragma omp master
+            {
+                sys.log_Z = ninf;
+                sys.ess = 0;
+            }
+            return 0;
+        }
+        double sum = 0;
+        #pragma omp for schedule(static) nowait
+        for(size_t m = 0; m < N; ++m) {
+            sum += exp( sys.log_weight[m] - max_lw );
+        }
+        const double log_Z = max_lw + log( team_sum(sum, 1) );
+        double sum_sq = 0;
+        #pragma omp for schedule(static) nowait
+        for(size_t m = 0; m < N; ++m) {
+            sys.log_prob[m] = sys.log_weight[m] - log_Z;
+            auto p = exp( sys.log_prob[m] );
+            sum_sq += p*p;
+        }
+        const double ess = 1.0 / team_sum(sum_sq, 0);
+        #pragma omp master
+        {
+            sys.log_Z = log_Z;
+            sys.ess = ess;
+        }
+        return ess;
     }
 
     // initialize particle system
     void init(size_t start, size_t stop) {
 
-        #pragma omp parallel for
+        #pragma omp for schedule(static)
         for(size_t m=start; m<stop; ++m) {
             sys.log_weight[m] = init_p(sys.particle[m]); // NOTE: = not +=
         }
+        if (config.collapse) {
+            #pragma omp for schedule(static)
+            for(size_t m=start; m<stop; ++m) {
+                group_leader[m] = start;
+            }
+        }
 
         update();
     }
 
-    // advance particle system over given observation
-    void advance(const O& obs, size_t start, size_t stop) {
-        #pragma omp parallel for
-        for (size_t m=start; m<stop; ++m) {
-             sys.log_weight[m] += move_p(sys.particle[m], obs);
+    // Resamples the particles from start on, after the given observation
+    virtual void resample_step(size_t, size_t start) {
+        resample(start);
+    }
+
+    // Moves each group of particles in the same state at once
+    void move_groups(const O& obs, size_t start, size_t stop) {
+        #pragma omp single
+        {
+            // Number the groups in the order of their leaders, into
+            // group_same for now, and list their members by counting
+            // sort
+            num_groups = 0;
+            for(size_t m = start; m < stop; ++m) {
+                auto leader = group_leader[m];
+                group_same[m] = leader == m ? num_groups++ : group_same[leader];
+            }
+            std::fill(group_offset.begin(), group_offset.begin() + num_groups + 1, 0);
+            for(size_t m = start; m < stop; ++m) {
+                group_offset[group_same[m] + 1] ++;
+            }
+            for(size_t g = 0; g < num_groups; ++g) {
+                group_offset[g + 1] += group_offset[g];
+            }
+            for(size_t m = start; m < stop; ++m) {
+                group_members[ group_offset[group_same[m]] ++ ] = m;
+            }
+            for(size_t g = num_groups; g > 0; --g) {
+                group_offset[g] = group_offset[g - 1];
+            }
+            group_offset[0] = 0;
+        }
+
+        // Groups that go their own ways split
+        #pragma omp for schedule(dynamic)
+        for(size_t g = 0; g < num_groups; ++g) {
+            const auto b = group_offset[g];
+            const auto n = group_offset[g + 1] - b;
+            move_group(&group_members[b], n, obs, &group_same[b]);
+            for(size_t k = 0; k < n; ++k) {
+                group_leader[ group_members[b + k] ] =
+                    group_members[b + group_same[b + k]];
+            }
+        }
+    }
+
+    // advance particle system over observation t
+    void advance(const O& obs, size_t t, size_t start, size_t stop) {
+        NN_PROFILE_SCOPE("filter.advance");
+        if(config.collapse) {
+            move_groups(obs, start, stop);
+        } else {
+            #pragma omp for schedule(static)
+            for (size_t m=start; m<stop; ++m) {
+                 sys.log_weight[m] += move_p(sys.particle[m], obs);
+            }
         }
 
-        update(); // update weights and calculate ESS
+        // update weights and calculate ESS
+        const double ess = update();
 
         if(config.resample == rmethod::SMC_RESAMPLE_NONE) {
             return;
@@ -140,144 +336,284 @@ struct Filter {
 
         // if ESS drops below a threshold, resample
         if(config.resample_threshold < 1) {
-            auto f = sys.ess / (double)config.num_particles;
+            auto f = ess / (double)config.num_particles;
             if( f < config.resample_threshold ) {
-                resample();
+                resample_step(t, start);
             }
         } else {
-            if( sys.ess < config.resample_threshold )  {
-                resample();
+            if( ess < config.resample_threshold )  {
+                resample_step(t, start);
             }
         }
     }
 
+    // Runs the filter over obs for the particles from start on, on a
+    // team of threads if the cost model expects that to pay off and
+    // another level of teams may be started here (e.g. inside the
+    // threads of concurrent folds). reference(o, t) is called on one
+    // thread before the others are moved to o, for the particles
+    // before start.
+    template<typename F>
+    void run(const std::vector<O>& obs, size_t start, F reference) {
+        const size_t stop = config.num_particles;
+        const bool team = config.parallel &&
+            omp_get_active_level() < omp_get_max_active_levels() &&
+            cost.prefer_team(stop - start, obs.size() + 1);
+        size_t nthreads = 1;
+        auto start_time = std::chrono::steady_clock::now();
+
+        #pragma omp parallel if(team) num_threads(cost.get_threads())
+        {
+            #pragma omp master
+            nthreads = omp_get_num_threads();
+
+            // initialize particles
+            init(start, stop);
+
+            // run particle filter
+            for(size_t t = 0; t < obs.size(); ++t) {
+                #pragma omp single nowait
+                reference(obs[t], t);
+                advance(obs[t], t, start, stop);
+            }
+        }
+
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start_time;
+        cost.observe(stop - start, obs.size() + 1, nthreads, elapsed.count());
+    }
+
     // run SMC over a vector of fixed length
     void smc(const std::vector<O>& obs) {
-        size_t start = 0;
-        size_t stop = config.num_particles;
-
         // setup work (e.g. precompute distributions)
         set_up(obs);
 
-        // initialize particles
-        init(start, stop);
+        run(obs, 0, [](const O&, size_t) {});
+    }
 
-        // run particle filter
-        for(auto o : obs) {
-            advance(o, start, stop);
+    std::vector<double>& block_sums(double) { return block_partial; }
+    std::vector<size_t>& block_sums(size_t) { return block_counts; }
+
+    // Inclusive prefix sums of x[0..n), in place: each thread sums
+    // its own block, then adds the totals of the blocks before it
+    template<typename T>
+    void prefix_sum(std::vector<T>& x, size_t n) {
+        auto& block_sum = block_sums(T());
+        const size_t nt = omp_get_num_threads();
+        const size_t id = omp_get_thread_num();
+        const size_t lo = n * id / nt;
+        const size_t hi = n * (id + 1) / nt;
+        T sum = 0;
+        for(size_t i = lo; i < hi; ++i) {
+            sum += x[i];
+            x[i] = sum;
         }
+        block_sum[id + 1] = sum;
+        #pragma omp barrier
+        T offset = 0;
+        for(size_t i = 0; i <= id; ++i) offset += block_sum[i];
+        for(size_t i = lo; i < hi; ++i) x[i] += offset;
+        #pragma omp barrier
     }
 
-    // resample particle system
-    void resample() {
-
-        //Resampling is done in place.
-        double dWeightSum = 0;
-        size_t uMultinomialCount;
-
-        std::fill(resample_counts.begin(), resample_counts.end(), 0);
-        std::fill(resample_indices.begin(), resample_indices.end(), 0);
-
-        //First obtain a count of the number of children each particle has.
-        switch( config.resample ) {
+    // Draw n sorted points in [0, total), one per offspring, in
+    // resample_positions
+    void draw_positions(rmethod method, size_t n, double total) {
+        auto& u = resample_positions;
+        switch( method ) {
         case rmethod::SMC_RESAMPLE_MULTINOMIAL:
-        {
-            //Sample from a suitable multinomial vector
-            for(size_t m = 0; m < config.num_particles; ++m) {
-                resample_weights[m] = exp( sys.log_prob[m] );
-            }
-            nn::multinomial( nn::rng::get(), resample_weights, resample_counts, config.num_particles );
-            break;
-        }
         case rmethod::SMC_RESAMPLE_RESIDUAL:
         {
-            //Sample from a suitable multinomial vector and add the integer replicate
-            //counts afterwards.
-
-            for(size_t m = 0; m < config.num_particles; ++m) {
-                resample_weights[m] = exp( sys.log_prob[m] );
-                dWeightSum += resample_weights[m];
+            // Sorted uniforms, as normalized sums of exponential spacings
+            auto& eng = nn::rng::get();
+            std::exponential_distribution<double> d;
+            #pragma omp for schedule(static)
+            for(size_t j = 0; j <= n; ++j) {
+                u[j] = d(eng);
             }
-
-            uMultinomialCount = config.num_particles;
-            for(size_t m = 0; m < config.num_particles; ++m) {
-                resample_weights[m] = config.num_particles * resample_weights[m] / dWeightSum;
-                resample_indices[m] = size_t(floor(resample_weights[m]));
-                resample_weights[m] = (resample_weights[m] - resample_indices[m]);
-                uMultinomialCount -= resample_indices[m];
+            prefix_sum(u, n + 1);
+            const double scale = total / u[n];
+            #pragma omp for schedule(static)
+            for(size_t j = 0; j < n; ++j) {
+                u[j] *= scale;
             }
-
-            nn::multinomial( nn::rng::get(), resample_weights, resample_counts, uMultinomialCount );
-
             break;
         }
         case rmethod::SMC_RESAMPLE_STRATIFIED:
         default:
         {
-            dWeightSum = 0;
-            double dWeightCumulative = 0;
-            for(size_t m = 0; m < config.num_particles; ++m) {
-                dWeightSum += exp( sys.log_prob[m] );
+            // One uniform point in each of n equal strata
+            auto& eng = nn::rng::get();
+            #pragma omp for schedule(static)
+            for(size_t j = 0; j < n; ++j) {
+                u[j] = (j + nn::uni_range(eng, 0.0, 1.0)) * total / n;
             }
-
-            //Generate a random number between 0 and 1/N times the sum of the weights
-            double dRand = nn::uni_range(nn::rng::get(), 0.0, 1.0/(double)config.num_particles);
-
-            size_t j = 0, k = 0;
-            dWeightCumulative = exp( sys.log_prob[0] ) / dWeightSum;
-            while(j < config.num_particles) {
-                while((dWeightCumulative - dRand) > ((double)j)/((double)config.num_particles) && j < config.num_particles) {
-                    resample_counts[k]++;
-                    j++;
-                    dRand = nn::uni_range(nn::rng::get(), 0.0, 1.0 / ((double)config.num_particles));
-                }
-                k++;
-                dWeightCumulative += exp( sys.log_prob[k] ) / dWeightSum;
-            }
-
             break;
         }
         case rmethod::SMC_RESAMPLE_SYSTEMATIC:
         {
-            // Procedure for stratified sampling but with a common RV for each stratum
-            dWeightSum = 1.0;
-            double dWeightCumulative = 0;
-
-            //Generate a random number between 0 and 1/N times the sum of the weights
-            double dRand = nn::uni_range(nn::rng::get(), 0.0, 1.0 / ((double)config.num_particles));
-            dWeightCumulative = exp( sys.log_prob[0] );
-
-            size_t j = 0, k = 0;
-            while(j < config.num_particles) {
-                while((dWeightCumulative - dRand) > ((double)j)/((double)config.num_particles) && j < config.num_particles) {
-                    resample_counts[k]++;
-                    j++;
-                }
-                k++;
-                dWeightCumulative += exp( sys.log_prob[k] );
+            // Stratified, but with a common offset in every stratum
+            #pragma omp single
+            resample_offset = nn::uni_range(nn::rng::get(), 0.0, 1.0);
+            #pragma omp for schedule(static)
+            for(size_t j = 0; j < n; ++j) {
+                u[j] = (j + resample_offset) * total / n;
             }
-
             break;
         }
         }
+    }
 
-        for(size_t i=0, j=0; i<config.num_particles; ++i) {
-            if(resample_counts[i] > 0) {
-                resample_indices[i] = i;
-                while( resample_counts[i] > 1 ) {
-                    while( resample_counts[j] > 0 ) ++j; // find next free spot
-                    resample_indices[j++] = i;
-                    --resample_counts[i];
+    // Add to the count of each particle m the number of the n
+    // positions that fall in [cdf[m-1], cdf[m]). Each thread finds
+    // where its block of particles starts by bisection, and walks the
+    // positions from there. Those past the end because of rounding go
+    // to the heaviest particle, which can't have zero weight.
+    void count_offspring(const dvec& cdf, size_t n) {
+        const auto& u = resample_positions;
+        const size_t N = config.num_particles;
+        const size_t nt = omp_get_num_threads();
+        const size_t id = omp_get_thread_num();
+        const size_t lo = N * id / nt;
+        const size_t hi = N * (id + 1) / nt;
+        size_t j = lo == 0 ? 0
+            : std::lower_bound(u.begin(), u.begin() + n, cdf[lo-1]) - u.begin();
+        for(size_t m = lo; m < hi; ++m) {
+            const size_t first = j;
+            while(j < n && u[j] < cdf[m]) ++j;
+            resample_counts[m] += j - first;
+        }
+        #pragma omp barrier
+        #pragma omp single
+        {
+            auto end = std::lower_bound(u.begin(), u.begin() + n, cdf[N-1]);
+            const size_t rest = u.begin() + n - end;
+            if(rest > 0) {
+                auto weight = [&cdf](size_t m) {
+                    return cdf[m] - (m > 0 ? cdf[m-1] : 0.0);
+                };
+                size_t best = 0;
+                for(size_t m = 1; m < N; ++m) {
+                    if(weight(m) > weight(best)) best = m;
                 }
+                resample_counts[best] += rest;
             }
         }
+    }
 
-        for(size_t m = 0; m < config.num_particles; ++m) {
+    // resample particle system. The particles before start are kept
+    // as they are (e.g. the reference particle of conditional SMC);
+    // the others are drawn from all particles, by weight.
+    void resample(size_t start = 0) {
+        const size_t N = config.num_particles;
+        const size_t n = N - start; // number of offspring
+        #pragma omp barrier
+        if(n == 0 || sys.log_Z == -std::numeric_limits<double>::infinity()) {
+            return;
+        }
+        NN_PROFILE_SCOPE("filter.resample");
+        #pragma omp master
+        {
+            ++ num_resamples;
+            NN_PROFILE_COUNT("filter.resamples", 1);
+        }
+
+        // First obtain a count of the number of children each
+        // particle has, by cutting the cumulative weights at n sorted
+        // positions
+        auto& w = resample_weights;
+        double total = 0;
+        #pragma omp for schedule(static) nowait
+        for(size_t m = 0; m < N; ++m) {
+            w[m] = exp( sys.log_prob[m] );
+            total += w[m];
+            resample_counts[m] = 0;
+        }
+        total = team_sum(total, 1);
+
+        size_t ndraws = n;
+        if(config.resample == rmethod::SMC_RESAMPLE_RESIDUAL) {
+            // floor(n w) children each, and the rest drawn from the
+            // residual weights
+            #pragma omp for schedule(static)
+            for(size_t m = 0; m < N; ++m) {
+                auto x = n * w[m] / total;
+                resample_counts[m] = size_t( floor(x) );
+                resample_extra[m] = resample_counts[m];
+                w[m] = x - resample_counts[m];
+            }
+            prefix_sum(resample_extra, N);
+            CHECK(resample_extra[N-1] <= n) << "too many residual children";
+            ndraws = n - resample_extra[N-1];
+        }
+        if(ndraws > 0) {
+            prefix_sum(w, N);
+            draw_positions(config.resample, ndraws, w[N-1]);
+            count_offspring(w, ndraws);
+        }
+
+        // Survivors from start on stay where they are. Their other
+        // copies, and all copies of particles before start, go to
+        // the slots of those that died: extra and free count these by
+        // prefix sums, which number the copies and the free slots.
+        auto& extra = resample_extra;
+        auto& free  = resample_free;
+        #pragma omp for schedule(static)
+        for(size_t m = 0; m < N; ++m) {
+            bool stays = m >= start && resample_counts[m] > 0;
+            extra[m] = resample_counts[m] - (stays ? 1 : 0);
+            free[m]  = (m >= start && resample_counts[m] == 0) ? 1 : 0;
+            resample_indices[m] = m;
+        }
+        prefix_sum(extra, N);
+        prefix_sum(free, N);
+        CHECK(extra[N-1] == free[N-1]) << "bad offspring counts";
+
+        #pragma omp for schedule(static)
+        for(size_t m = start; m < N; ++m) {
+            if(resample_counts[m] == 0) resample_slots[free[m] - 1] = m;
+        }
+        #pragma omp for schedule(static)
+        for(size_t m = 0; m < N; ++m) {
+            auto first = m == 0 ? 0 : extra[m-1];
+            for(auto k = first; k < extra[m]; ++k) {
+                resample_indices[ resample_slots[k] ] = m;
+            }
+        }
+
+        // Sources never die, so the copies are independent, and each
+        // thread writes the particles it goes on to move
+        const double log_uniform = log(1.0 / (double)N);
+        #pragma omp for schedule(static) nowait
+        for(size_t m = start; m < N; ++m) {
             if(resample_indices[m] != m) {
-                sys.particle[m] = sys.particle[resample_indices[m]];
+                sys.particle[m] = sys.particle[ resample_indices[m] ];
             }
+        }
+        #pragma omp for schedule(static)
+        for(size_t m = 0; m < N; ++m) {
             sys.log_weight[m] = 0;
-            sys.log_prob[m] = log(1.0 / (double)config.num_particles);
+            sys.log_prob[m] = log_uniform;
+        }
+
+        // Copies of particles in the same state are in the same
+        // state: each joins the group of the first copy of its
+        // source's group. The particles before start lead their own.
+        if(config.collapse) {
+            #pragma omp single
+            {
+                auto& source_group = group_same;
+                auto& first_copy = group_offset;
+                for(size_t m = 0; m < N; ++m) {
+                    source_group[m] = m < start ? m : group_leader[m];
+                    first_copy[m] = N;
+                }
+                for(size_t m = start; m < N; ++m) {
+                    auto g = source_group[ resample_indices[m] ];
+                    if(first_copy[g] == N) first_copy[g] = m;
+                    group_leader[m] = first_copy[g];
+                }
+            }
         }
     }
 
@@ -0,0 +1,454 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <nn/mu.hpp>
+#include <nn/rng.hpp>
+#include <nn/smc.hpp>
+#include <nn/csmc.hpp>
+#include <nn/filter_cost.hpp>
+
+// Particles are their own index, so offspring can be counted after
+// resampling
+struct IndexFilter : public Filter<size_t, size_t> {
+    IndexFilter(settings config) : Filter<size_t, size_t>(config) {}
+
+    double init_p(size_t&) override { return 0.0; }
+    double move_p(size_t&, const size_t&) override { return 0.0; }
+
+    void set_weights(const std::vector<double>& w) {
+        for (size_t m = 0; m < w.size(); ++m) {
+            sys.particle[m]   = m;
+            sys.log_weight[m] = log(w[m]);
+        }
+        update();
+    }
+
+    std::vector<size_t> counts() const {
+        std::vector<size_t> ret(sys.particle.size(), 0);
+        for (auto p : sys.particle) ret[p] ++;
+        return ret;
+    }
+};
+
+std::vector<double> test_weights(size_t N) {
+    std::vector<double> w(N);
+    for (size_t m = 0; m < N; ++m) w[m] = (m % 7 == 0) ? 0.0 : 1.0 + (m % 5);
+    return w;
+}
+
+TEST(Filter, ResamplingIsUnbiased) {
+    nn::rng::init();
+    const size_t N = 50;
+    const size_t nrep = 4000;
+    auto w = test_weights(N);
+    double total = 0;
+    for (auto x : w) total += x;
+
+    for (auto method : { rmethod::SMC_RESAMPLE_MULTINOMIAL,
+                         rmethod::SMC_RESAMPLE_RESIDUAL,
+                         rmethod::SMC_RESAMPLE_STRATIFIED,
+                         rmethod::SMC_RESAMPLE_SYSTEMATIC }) {
+        IndexFilter::settings config;
+        config.num_particles = N;
+        config.resample = method;
+        IndexFilter filter(config);
+        std::vector<double> mean(N, 0.0);
+        for (size_t r = 0; r < nrep; ++r) {
+            filter.set_weights(w);
+            filter.resample();
+            auto c = filter.counts();
+            size_t sum = 0;
+            for (size_t m = 0; m < N; ++m) {
+                sum += c[m];
+                mean[m] += c[m] / (double) nrep;
+                if (w[m] == 0) {
+                    ASSERT_EQ(c[m], 0);
+                }
+                // the particles that survive stay where they were
+                if (c[m] > 0) {
+                    ASSERT_EQ(filter.sys.particle[m], m);
+                }
+            }
+            ASSERT_EQ(sum, N);
+        }
+        for (size_t m = 0; m < N; ++m) {
+            ASSERT_NEAR(mean[m], N * w[m] / total, 0.12);
+        }
+    }
+}
+
+TEST(Filter, RoundingRemainderGoesToHeaviestParticle) {
+    IndexFilter::settings config;
+    config.num_particles = 4;
+    IndexFilter filter(config);
+    // weights 1, 3, 2, 0; the last two positions are past the end,
+    // as rounding can leave them
+    std::vector<double> cdf { 1.0, 4.0, 6.0, 6.0 };
+    filter.resample_positions = { 0.5, 2.0, 5.0, 6.0, 6.0 + 1e-12 };
+    std::fill(filter.resample_counts.begin(), filter.resample_counts.end(), 0);
+    filter.count_offspring(cdf, 5);
+    std::vector<size_t> expected { 1, 3, 1, 0 };
+    ASSERT_EQ(std::vector<size_t>(filter.resample_counts.begin(),
+                                  filter.resample_counts.begin() + 4),
+              expected);
+}
+
+TEST(Filter, ParallelResamplingKeepsReference) {
+    omp_set_num_threads(4);
+    nn::rng::init();
+    const size_t N = 20000;
+    auto w = test_weights(N);
+    w[0] = 1e-300; // the reference particle would never be drawn
+    double total = 0;
+    for (auto x : w) total += x;
+
+    for (auto method : { rmethod::SMC_RESAMPLE_RESIDUAL,
+                         rmethod::SMC_RESAMPLE_SYSTEMATIC }) {
+        IndexFilter::settings config;
+        config.num_particles = N;
+        config.resample = method;
+        IndexFilter filter(config);
+        filter.set_weights(w);
+        // on a team of threads, as in Filter::run
+        #pragma omp parallel
+        filter.resample(1);
+        auto c = filter.counts();
+        ASSERT_EQ(filter.sys.particle[0], 0);
+        ASSERT_EQ(c[0], 1);
+        // N-1 offspring, at least the integer part of the expected
+        // number of each, and at most one more for systematic
+        for (size_t m = 1; m < N; ++m) {
+            double expected = (N - 1) * w[m] / total;
+            ASSERT_GE(c[m], floor(expected - 1e-6));
+            if (method == rmethod::SMC_RESAMPLE_SYSTEMATIC) {
+                ASSERT_LE(c[m], ceil(expected + 1e-6));
+            }
+        }
+    }
+}
+
+// Records the widest team its particles are moved on
+struct TeamFilter : public Filter<size_t, size_t> {
+    std::mutex mutex;
+    size_t widest {0};
+
+    TeamFilter(settings config) : Filter<size_t, size_t>(config) {}
+
+    double init_p(size_t&) override { return 0.0; }
+    double move_p(size_t&, const size_t&) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        widest = std::max<size_t>(widest, omp_get_num_threads());
+        return 0.0;
+    }
+};
+
+TEST(Filter, RunsOnTeamsNestedInThreads) {
+    nn::rng::init();
+    omp_set_max_active_levels(2);
+    std::vector<std::unique_ptr<TeamFilter>> filters(2);
+    // as the folds of cross-validation
+    #pragma omp parallel num_threads(2)
+    {
+        omp_set_num_threads(2);
+        TeamFilter::settings config;
+        config.num_particles = 64;
+        auto& f = filters[omp_get_thread_num()];
+        f.reset(new TeamFilter(config));
+        f->smc(std::vector<size_t>(10, 0));
+    }
+    omp_set_max_active_levels(1);
+    for (const auto& f : filters) {
+        ASSERT_EQ(f->widest, 2);
+    }
+}
+
+TEST(Filter, NestedTeamsDrawFromOwnEngines) {
+    nn::rng::init();
+    omp_set_max_active_levels(2);
+    std::mutex mutex;
+    std::set<RandomEngine*> engines;
+    std::atomic<size_t> arrived {0};
+    #pragma omp parallel num_threads(2)
+    {
+        // teams of different sizes, as when folds split the threads
+        // unevenly
+        #pragma omp parallel num_threads(omp_get_thread_num() == 0 ? 3 : 2)
+        {
+            auto e = &nn::rng::get();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                engines.insert(e);
+            }
+            // all five threads run at once
+            arrived ++;
+            while (arrived < 5) std::this_thread::yield();
+        }
+    }
+    omp_set_max_active_levels(1);
+    ASSERT_EQ(engines.size(), 5);
+}
+
+TEST(Filter, CostModelPrefersSentencesWhenShort) {
+    nn::filter_cost_model cost(8, 2000.0);
+    ASSERT_TRUE(cost.prefer_team(16, 20)); // until calibrated
+    ASSERT_FALSE(cost.prefer_sentences(16, { 20, 20 }));
+
+    // 500ns per particle step
+    cost.observe(100, 10, 1, 100 * 10 * 500.0);
+    ASSERT_DOUBLE_EQ(cost.get_step_ns(), 500.0);
+    ASSERT_FALSE(cost.prefer_team(16, 20));
+    ASSERT_TRUE(cost.prefer_team(4096, 20));
+
+    std::vector<size_t> lengths(100, 20);
+    ASSERT_TRUE(cost.prefer_sentences(16, lengths));
+    ASSERT_FALSE(cost.prefer_sentences(4096, { 20 }));
+    // a long sentence on its own thread holds up the others
+    ASSERT_FALSE(cost.prefer_sentences(4096, { 2000, 20 }));
+}
+
+// Particles are their paths so far, each step a uniform draw from
+// {0, 1, 2}. Groups share a proposal, which is counted.
+struct PathFilter : public Filter<std::vector<size_t>, size_t> {
+    typedef std::vector<size_t> path;
+    size_t proposals {0};
+
+    PathFilter(settings config) : Filter<path, size_t>(config) {}
+
+    double init_p(path& p) override { p.clear(); return 0.0; }
+
+    double move_p(path& p, const size_t& obs) override {
+        proposals ++;
+        std::uniform_int_distribution<size_t> d(0, 2);
+        p.push_back(d(nn::rng::get()));
+        return p.back() == obs ? 0.0 : -1.0;
+    }
+
+    void move_group(const size_t* members, size_t n, const size_t& obs,
+                    size_t* same) override {
+        proposals ++;
+        std::uniform_int_distribution<size_t> d(0, 2);
+        size_t first[3] { n, n, n };
+        for (size_t k = 0; k < n; ++k) {
+            auto x = d(nn::rng::get());
+            if (first[x] == n) first[x] = k;
+            sys.particle[members[k]].push_back(x);
+            sys.log_weight[members[k]] += x == obs ? 0.0 : -1.0;
+            same[k] = first[x];
+        }
+    }
+};
+
+TEST(Filter, CollapsedGroupsAreDistinctStates) {
+    nn::rng::init();
+    const size_t N = 200;
+    PathFilter::settings config;
+    config.num_particles = N;
+    config.resample = rmethod::SMC_RESAMPLE_SYSTEMATIC;
+    config.resample_threshold = 0.9; // at about every step
+    config.collapse = true;
+    config.parallel = false;
+    PathFilter filter(config);
+    std::vector<size_t> obs { 0, 1, 2, 2, 1, 0, 0, 1 };
+
+    // Before each move, the groups are the distinct states
+    size_t ndistinct = 0;
+    filter.run(obs, 0, [&](const size_t&, size_t) {
+        std::set<PathFilter::path> leaders;
+        for (size_t m = 0; m < N; ++m) {
+            auto leader = filter.group_leader[m];
+            ASSERT_LE(leader, m);
+            ASSERT_EQ(filter.sys.particle[m], filter.sys.particle[leader]);
+            if (leader == m) {
+                ASSERT_TRUE(leaders.insert(filter.sys.particle[m]).second);
+            }
+        }
+        ndistinct += leaders.size();
+    });
+    ASSERT_EQ(filter.proposals, ndistinct);
+    ASSERT_LT(filter.proposals, N * obs.size() / 2);
+    for (const auto& p : filter.sys.particle) ASSERT_EQ(p.size(), obs.size());
+}
+
+// Two-state HMM; particles are the states so far (the reference has
+// all of them), proposed from the transitions
+struct ChainFilter : public ConditionalFilter<std::vector<size_t>, size_t> {
+    typedef std::vector<size_t> path;
+    double init[2]     { 0.6, 0.4 };
+    double trans[2][2] { { 0.8, 0.2 }, { 0.3, 0.7 } };
+    double emit[2][2]  { { 0.9, 0.1 }, { 0.2, 0.8 } };
+
+    ChainFilter(settings config)
+        : ConditionalFilter<path, size_t>(config) {}
+
+    double init_p(path& p) override { p.clear(); return 0.0; }
+
+    double move_p(path& p, const size_t& obs) override {
+        double q = p.empty() ? init[1] : trans[p.back()][1];
+        std::bernoulli_distribution d(q);
+        p.push_back(d(nn::rng::get()) ? 1 : 0);
+        return log(emit[p.back()][obs]);
+    }
+
+    void swap_complete_particle(path& dst, const path& src) override {
+        dst = src;
+    }
+
+    double incr_p(path& p, const size_t& obs, size_t t) override {
+        return log(emit[p[t]][obs]);
+    }
+
+    void truncate_particle(path& p, size_t t) override {
+        p.resize(t + 1);
+    }
+
+    double continuation_p(const path& p, const path& ref,
+                          const std::vector<size_t>&, size_t t) override {
+        return log(trans[p[t]][ref[t+1]]);
+    }
+
+    void splice_particle(path& dst, const path& p, const path& ref,
+                         size_t t) override {
+        dst.assign(p.begin(), p.begin() + t + 1);
+        dst.insert(dst.end(), ref.begin() + t + 1, ref.end());
+    }
+
+    double log_joint(const path& x, const std::vector<size_t>& obs) const {
+        double ret = log(init[x[0]]) + log(emit[x[0]][obs[0]]);
+        for (size_t t = 1; t < x.size(); ++t) {
+            ret += log(trans[x[t-1]][x[t]]) + log(emit[x[t]][obs[t]]);
+        }
+        return ret;
+    }
+};
+
+// Runs niter sweeps of particle Gibbs on obs and returns the
+// frequency of each path, indexed by its states as bits
+std::vector<double> path_frequencies(ChainFilter& filter,
+                                     const std::vector<size_t>& obs,
+                                     size_t niter) {
+    std::vector<double> freq(1 << obs.size(), 0.0);
+    ChainFilter::path x(obs.size(), 0);
+    for (size_t i = 0; i < niter; ++i) {
+        filter.csmc(x, obs);
+        auto m = nn::sample_unnormalized_lnpdf(filter.sys.log_weight,
+                                               nn::rng::get());
+        x = filter.sys.particle[m];
+        EXPECT_EQ(x.size(), obs.size());
+        size_t k = 0;
+        for (size_t t = 0; t < x.size(); ++t) k |= x[t] << t;
+        freq[k] += 1.0 / niter;
+    }
+    return freq;
+}
+
+// Exact posterior over the paths of obs, indexed as above
+std::vector<double> path_posterior(const ChainFilter& filter,
+                                   const std::vector<size_t>& obs) {
+    std::vector<double> ret(1 << obs.size());
+    double total = 0;
+    for (size_t k = 0; k < ret.size(); ++k) {
+        ChainFilter::path x(obs.size());
+        for (size_t t = 0; t < obs.size(); ++t) x[t] = (k >> t) & 1;
+        ret[k] = exp(filter.log_joint(x, obs));
+        total += ret[k];
+    }
+    for (auto& p : ret) p /= total;
+    return ret;
+}
+
+TEST(ConditionalFilter, AncestorSamplingKeepsPosterior) {
+    omp_set_num_threads(1);
+    nn::rng::init();
+    ChainFilter::settings config;
+    config.num_particles = 3;
+    config.resample = rmethod::SMC_RESAMPLE_MULTINOMIAL;
+    config.resample_threshold = 0.999; // at every step
+    config.ancestor_sampling = true;
+    config.parallel = false;
+    ChainFilter filter(config);
+    std::vector<size_t> obs { 0, 1, 1, 0 };
+
+    // particle Gibbs: each sample is the reference of the next
+    auto exact = path_posterior(filter, obs);
+    auto freq = path_frequencies(filter, obs, 40000);
+    for (size_t k = 0; k < exact.size(); ++k) {
+        ASSERT_NEAR(freq[k], exact[k], 0.01);
+    }
+    ASSERT_GT(filter.ancestor_moves, 0);
+    ASSERT_LE(filter.ancestor_moves, filter.ancestor_draws);
+}
+
+// Ancestors are only drawn at the steps that resample; at the others
+// the reference keeps its history, as every other particle does
+TEST(ConditionalFilter, AncestorSamplingKeepsPosteriorWhenResamplingAdaptively) {
+    omp_set_num_threads(1);
+    nn::rng::init();
+    ChainFilter::settings config;
+    config.num_particles = 3;
+    config.resample = rmethod::SMC_RESAMPLE_MULTINOMIAL;
+    config.resample_threshold = 0.8;
+    config.ancestor_sampling = true;
+    config.parallel = false;
+    ChainFilter filter(config);
+    std::vector<size_t> obs { 0, 1, 1, 0 };
+
+    auto exact = path_posterior(filter, obs);
+    auto freq = path_frequencies(filter, obs, 40000);
+    for (size_t k = 0; k < exact.size(); ++k) {
+        ASSERT_NEAR(freq[k], exact[k], 0.01);
+    }
+    // some steps resample and some don't
+    ASSERT_GT(filter.ancestor_draws, 0);
+    ASSERT_LT(filter.num_resamples, 40000 * (obs.size() - 1));
+}
+
+// On a long sentence the particles of plain conditional SMC all
+// descend from the reference at the start, which then rarely
+// changes from one sweep to the next; ancestor sampling lets it
+TEST(ConditionalFilter, AncestorSamplingMixesFaster) {
+    omp_set_num_threads(1);
+    nn::rng::init();
+    std::vector<size_t> obs;
+    for (size_t t = 0; t < 50; ++t) obs.push_back((t / 5) % 2);
+    const size_t niter = 1000;
+    const size_t head = 10; // states scored
+    auto change_rate = [&](bool ancestor_sampling) {
+        ChainFilter::settings config;
+        config.num_particles = 5;
+        config.resample = rmethod::SMC_RESAMPLE_MULTINOMIAL;
+        config.resample_threshold = 0.999; // at every step
+        config.ancestor_sampling = ancestor_sampling;
+        config.parallel = false;
+        ChainFilter filter(config);
+        ChainFilter::path x(obs.size(), 0);
+        size_t changed = 0;
+        for (size_t i = 0; i < niter; ++i) {
+            filter.csmc(x, obs);
+            auto m = nn::sample_unnormalized_lnpdf(filter.sys.log_weight,
+                                                   nn::rng::get());
+            const auto& y = filter.sys.particle[m];
+            for (size_t t = 0; t < head; ++t) changed += y[t] != x[t];
+            x = y;
+        }
+        return changed / double(niter * head);
+    };
+    auto plain = change_rate(false);
+    auto as    = change_rate(true);
+    LOG(INFO) << "First " << head << " states changed per sweep: "
+              << plain << " without ancestor sampling, "
+              << as << " with";
+    ASSERT_GT(as, 0.02);
+    ASSERT_GT(as, 4 * plain);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_SPAN_TRIE_HPP__
+#define __NN_SPAN_TRIE_HPP__
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <nn/data.hpp>
+
+#include <cereal/types/map.hpp>
+#include <cereal/types/vector.hpp>
+
+namespace nn {
+
+    // Word-level trie of tagged multi-word spans (e.g. gazetteer
+    // entries). Each node is a span prefix and counts, by tag, the
+    // entries that end there and those that go on.
+    class span_trie {
+    public:
+        static constexpr size_t ROOT {0};
+        static constexpr size_t NONE {~size_t(0)};
+
+    private:
+        struct node {
+            std::map<syms, size_t> kids;
+            std::map<sym, size_t> ends;
+            std::map<sym, size_t> longer;
+
+            template<class Archive>
+            void serialize(Archive & archive) {
+                archive(kids, ends, longer);
+            }
+        };
+
+        std::vector<node> nodes;
+
+        static size_t count(const std::map<sym, size_t>& counts, sym tag) {
+            auto it = counts.find(tag);
+            return it == counts.end() ? 0 : it->second;
+        }
+
+    public:
+        span_trie() : nodes(1) {}
+
+        template<class Archive>
+        void serialize(Archive & archive) {
+            archive(nodes);
+        }
+
+        void add(phrase::const_iterator begin,
+                 phrase::const_iterator end,
+                 sym tag) {
+            size_t n = ROOT;
+            for (auto it = begin; it != end; ++it) {
+                if (it != begin) nodes[n].longer[tag] ++;
+                auto kid = nodes[n].kids.find(*it);
+                if (kid == nodes[n].kids.end()) {
+                    nodes[n].kids.emplace(*it, nodes.size());
+                    n = nodes.size();
+                    nodes.emplace_back();
+                } else {
+                    n = kid->second;
+                }
+            }
+            nodes[n].ends[tag] ++;
+        }
+
+        // Adds the entries of another trie, whose word symbols and
+        // tags are mapped to those of this one by map_sym and map_tag
+        template<typename SymMap, typename TagMap>
+        void merge(const span_trie& other,
+                   const SymMap& map_sym,
+                   const TagMap& map_tag) {
+            // pairs of the same span prefix: (node of other, node here)
+            std::vector<std::pair<size_t, size_t>> stack { { ROOT, ROOT } };
+            while (!stack.empty()) {
+                auto src = stack.back().first;
+                auto dst = stack.back().second;
+                stack.pop_back();
+                const auto& x = other.nodes[src];
+                for (const auto& kv : x.ends) {
+                    nodes[dst].ends[map_tag(kv.first)] += kv.second;
+                }
+                for (const auto& kv : x.longer) {
+                    nodes[dst].longer[map_tag(kv.first)] += kv.second;
+                }
+                for (const auto& kv : x.kids) {
+                    syms w(kv.first.size());
+                    std::transform(kv.first.begin(), kv.first.end(),
+                                   w.begin(), map_sym);
+                    auto kid = nodes[dst].kids.find(w);
+                    size_t n;
+                    if (kid == nodes[dst].kids.end()) {
+                        n = nodes.size();
+                        nodes[dst].kids.emplace(w, n);
+                        nodes.emplace_back();
+                    } else {
+                        n = kid->second;
+                    }
+                    stack.emplace_back(kv.second, n);
+                }
+            }
+        }
+
+        // The span prefix n extended with word w, or NONE if no entry
+        // starts that way
+        size_t child(size_t n, const syms& w) const {
+            if (n == NONE) return NONE;
+            auto it = nodes[n].kids.find(w);
+            return it == nodes[n].kids.end() ? NONE : it->second;
+        }
+
+        // Number of entries with the given tag that are the span n
+        size_t ends(size_t n, sym tag) const {
+            return n == NONE ? 0 : count(nodes[n].ends, tag);
+        }
+
+        // Number of entries with the given tag that extend the span n
+        size_t longer(size_t n, sym tag) const {
+            return n == NONE ? 0 : count(nodes[n].longer, tag);
+        }
+
+        size_t size() const { return nodes.size(); }
+    };
+}
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_STATE_SNAPSHOTS_HPP__
+#define __NN_STATE_SNAPSHOTS_HPP__
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unistd.h>
+
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+#include <nn/log.hpp>
+#include <nn/data.hpp>
+#include <nn/prediction_writer.hpp>
+
+namespace nn {
+
+    // Labels of one sentence, as spans
+    struct tagging {
+        syms tags;
+        syms lens;
+
+        template<class Archive>
+        void serialize(Archive & archive) {
+            archive( tags, lens );
+        }
+    };
+
+    // The taggings of a sampler state, into out; its vectors are
+    // reused from one call to the next
+    template<typename Model, typename P>
+    void copy_taggings(const Model& model, const std::vector<P>& state,
+                       std::vector<tagging>& out) {
+        out.resize(state.size());
+        for (size_t i = 0; i < state.size(); ++i) {
+            out[i].tags = model.get_tags(state[i]);
+            out[i].lens = model.get_lens(state[i]);
+        }
+    }
+
+    // The state of a sampler at the end of a sweep
+    struct state_snapshot {
+        size_t sweep {0};
+        std::vector<tagging> train;
+        std::vector<tagging> unlabeled;
+        std::vector<tagging> test;
+    };
+
+    // Writes snapshots of a particle Gibbs state on a thread of its
+    // own. capture() copies the taggings into one of two buffers and
+    // returns, while the other may still be being written; it only
+    // waits if both are taken, i.e. if the thread is a whole snapshot
+    // behind. Each part of a snapshot is written as CoNLL predictions
+    // to <prefix>_<sweep>.<part>.conll, or .conll.gz, under a
+    // temporary name which is then renamed.
+    class state_snapshot_writer {
+    public:
+        struct settings {
+            std::string prefix;
+            size_t interval {1};    // sweeps between snapshots
+            size_t keep {0};        // snapshots kept on disk (0 = all)
+            bool compress {false};  // gzip
+            bool train {false};     // also the train and unlabeled state
+        };
+
+    private:
+        enum class slot { FREE, FILLING, READY, WRITING };
+
+        const settings config;
+        const output_vocab vocab;
+        const instances& train;
+        const instances& unlabeled;
+        const instances& test;
+
+        state_snapshot buffers[2];
+        slot status[2] { slot::FREE, slot::FREE };
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool stopping {false};
+        std::thread writer;
+
+        std::deque<std::vector<std::string>> written; // paths, oldest first
+
+        // Returns false, leaving nothing at path, if the part couldn't
+        // be written
+        bool write_part(const std::string& path,
+                        const std::vector<tagging>& state,
+                        const instances& data) const {
+            CHECK(state.size() == data.size()) << "size mismatch";
+            std::string tmp = path + ".tmp" + std::to_string(::getpid());
+            bool ok;
+            {
+                std::ofstream of(tmp, std::ios::binary);
+                CHECK(of.is_open()) << "problem opening: " << tmp;
+                boost::iostreams::filtering_ostream os;
+                if (config.compress) {
+                    os.push(boost::iostreams::gzip_compressor());
+                }
+                os.push(of);
+                prediction_writer out(os, vocab);
+                for (size_t i = 0; i < state.size(); ++i) {
+                    out.write(data[i].words, state[i].tags, state[i].lens,
+                              data[i].tags, data[i].lens);
+                }
+                ok = out.close();
+                os.reset();
+                of.close();
+                ok = ok && !of.fail();
+            }
+            if (!ok ||
+                std::rename(tmp.c_str(), path.c_str()) != 0) {
+                LOG(WARNING) << "problem writing: " << path;
+                std::remove(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        void write(const state_snapshot& s) {
+            std::string base = config.prefix + "_" + std::to_string(s.sweep);
+            std::string ext = config.compress ? ".conll.gz" : ".conll";
+            std::vector<std::string> paths;
+            paths.push_back(base + ".test" + ext);
+            bool ok = write_part(paths.back(), s.test, test);
+            if (ok && config.train) {
+                paths.push_back(base + ".train" + ext);
+                ok = write_part(paths.back(), s.train, train);
+                if (ok && unlabeled.size() > 0) {
+                    paths.push_back(base + ".unlabeled" + ext);
+                    ok = write_part(paths.back(), s.unlabeled, unlabeled);
+                }
+            }
+            if (!ok) {
+                // a partial snapshot is of no use; the older ones are kept
+                for (const auto& path : paths) std::remove(path.c_str());
+                LOG(WARNING) << "Snapshot of sweep " << s.sweep
+                             << " couldn't be written to: " << paths.front();
+                return;
+            }
+            LOG(INFO) << "Snapshot of sweep " << s.sweep << " written to: "
+                      << paths.front();
+
+            written.push_back(paths);
+            while (config.keep > 0 && written.size() > config.keep) {
+                for (const auto& path : written.front()) {
+                    std::remove(path.c_str());
+                }
+                written.pop_front();
+            }
+        }
+
+        // Writes ready buffers, oldest first, until stopped
+        void write_loop() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                int next = -1;
+                for (int b = 0; b < 2; ++b) {
+                    if (status[b] != slot::READY) continue;
+                    if (next < 0 || buffers[b].sweep < buffers[next].sweep) {
+                        next = b;
+                    }
+                }
+                if (next < 0) {
+                    if (stopping) return;
+                    cv.wait(lock);
+                    continue;
+                }
+                status[next] = slot::WRITING;
+                lock.unlock();
+                write(buffers[next]);
+                lock.lock();
+                status[next] = slot::FREE;
+                cv.notify_all();
+            }
+        }
+
+    public:
+        state_snapshot_writer(settings _config,
+                              const output_vocab& _vocab,
+                              const instances& _train,
+                              const instances& _unlabeled,
+                              const instances& _test)
+            : config(_config),
+              vocab(_vocab),
+              train(_train),
+              unlabeled(_unlabeled),
+              test(_test) {
+            CHECK(config.prefix != "") << "no snapshot prefix";
+            CHECK(config.interval > 0) << "bad snapshot interval";
+            writer = std::thread(&state_snapshot_writer::write_loop, this);
+        }
+
+        state_snapshot_writer(state_snapshot_writer const&)            = delete;
+        state_snapshot_writer& operator=(state_snapshot_writer const&) = delete;
+
+        ~state_snapshot_writer() { close(); }
+
+        // Hands a snapshot of the given state to the writer, every
+        // interval sweeps
+        template<typename Model, typename P>
+        void capture(size_t sweep, const Model& model,
+                     const std::vector<P>& train_state,
+                     const std::vector<P>& unlabeled_state,
+                     const std::vector<P>& test_state) {
+            if (sweep % config.interval != 0) return;
+            int b;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                CHECK(!stopping) << "snapshot writer closed";
+                cv.wait(lock, [this] {
+                    return status[0] == slot::FREE || status[1] == slot::FREE;
+                });
+                b = status[0] == slot::FREE ? 0 : 1;
+                status[b] = slot::FILLING;
+            }
+            auto& s = buffers[b];
+            s.sweep = sweep;
+            copy_taggings(model, test_state, s.test);
+            if (config.train) {
+                copy_taggings(model, train_state, s.train);
+                copy_taggings(model, unlabeled_state, s.unlabeled);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                status[b] = slot::READY;
+            }
+            cv.notify_all();
+        }
+
+        // Writes the snapshots still pending and stops the thread
+        void close() {
+            if (!writer.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            writer.join();
+        }
+    };
+}
+
+#endif
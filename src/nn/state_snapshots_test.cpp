@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <unordered_map>
+
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+#include <nn/state_snapshots.hpp>
+
+typedef std::unordered_map<size_t, std::string> desc_t;
+
+// Particles are their taggings
+struct TaggingModel {
+    nn::syms get_tags(const nn::tagging& p) const { return p.tags; }
+    nn::syms get_lens(const nn::tagging& p) const { return p.lens; }
+};
+
+std::string read_file(std::string path, bool gzip = false) {
+    std::ifstream is(path, std::ios::binary);
+    boost::iostreams::filtering_istream in;
+    if (gzip) in.push(boost::iostreams::gzip_decompressor());
+    in.push(is);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+bool exists(std::string path) { return std::ifstream(path).good(); }
+
+struct StateSnapshotTest : public ::testing::Test {
+    desc_t sym_desc { {0, "<bos>"}, {1, "<eos>"}, {2, "a"}, {3, "b"} };
+    desc_t tag_desc { {0, "O"}, {1, "PER"} };
+    nn::output_vocab vocab { 0, sym_desc, tag_desc };
+    nn::instances test;
+    nn::instances none;
+
+    StateSnapshotTest() {
+        nn::instance i;
+        i.words = { {0, 2, 1}, {0, 3, 1}, {0, 1} }; // "a b"
+        i.tags  = { 1 };
+        i.lens  = { 2 };
+        test.push_back(i);
+    }
+
+    // The state at sweep t: the gold PER span when t is a multiple
+    // of 4, otherwise all context
+    std::vector<nn::tagging> state(size_t t) const {
+        if (t % 4 == 0) return { { {1}, {2} } };
+        return { { {0, 0}, {1, 1} } };
+    }
+};
+
+const std::string all_found { "a B-PER B-PER\nb I-PER I-PER\n\n" };
+const std::string none_found { "a B-PER O\nb I-PER O\n\n" };
+
+TEST_F(StateSnapshotTest, WritesEveryIntervalAndKeepsTheLast) {
+    using namespace nn;
+    std::string prefix {"/tmp/state_snapshots_test"};
+    state_snapshot_writer::settings config;
+    config.prefix   = prefix;
+    config.interval = 2;
+    config.keep     = 2;
+    TaggingModel model;
+    std::vector<tagging> empty;
+    {
+        state_snapshot_writer snapshots(config, vocab, none, none, test);
+        std::vector<tagging> s;
+        for (size_t t = 0; t < 8; ++t) {
+            s = state(t);
+            snapshots.capture(t, model, empty, empty, s);
+        }
+    }
+    for (size_t t : { 0, 1, 2, 3, 5, 7 }) {
+        ASSERT_FALSE(exists(prefix + "_" + std::to_string(t) + ".test.conll"));
+    }
+    ASSERT_EQ(read_file(prefix + "_4.test.conll"), all_found);
+    ASSERT_EQ(read_file(prefix + "_6.test.conll"), none_found);
+}
+
+TEST_F(StateSnapshotTest, Gzip) {
+    using namespace nn;
+    std::string prefix {"/tmp/state_snapshots_test_gz"};
+    state_snapshot_writer::settings config;
+    config.prefix   = prefix;
+    config.compress = true;
+    config.train    = true;
+    TaggingModel model;
+    state_snapshot_writer snapshots(config, vocab, test, none, test);
+    auto s = state(0);
+    snapshots.capture(3, model, s, std::vector<tagging>(), s);
+    snapshots.close();
+    ASSERT_EQ(read_file(prefix + "_3.test.conll.gz", true), all_found);
+    ASSERT_EQ(read_file(prefix + "_3.train.conll.gz", true), all_found);
+    ASSERT_FALSE(exists(prefix + "_3.unlabeled.conll.gz"));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
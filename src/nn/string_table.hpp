@@ -0,0 +1,172 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_STRING_TABLE_HPP__
+#define __NN_STRING_TABLE_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+#include <nn/log.hpp>
+
+#include <cereal/types/vector.hpp>
+
+namespace nn {
+
+    // Hash-consing table for symbol sequences. Every distinct
+    // sequence is stored exactly once and named by a dense 32-bit id;
+    // ids are never recycled, so they stay valid for the lifetime of
+    // the table and may be used as restaurant dishes.
+    //
+    // Both indices hold views into the canonical copies rather than
+    // copies of their own. The sorted index supports enumerating all
+    // entries that extend a given prefix.
+    template<typename T>
+    class string_table {
+    public:
+        typedef uint32_t id_t;
+        typedef std::vector<T> seq_t;
+
+        static constexpr id_t npos {std::numeric_limits<id_t>::max()};
+
+        // Non-owning view of a sequence
+        struct view {
+            const T* ptr;
+            size_t len;
+
+            view() : ptr(nullptr), len(0) {}
+            view(const seq_t& s) : ptr(s.data()), len(s.size()) {}
+
+            const T* begin()             const { return ptr;       }
+            const T* end()               const { return ptr + len; }
+            size_t size()                const { return len;       }
+            const T& operator[](size_t i) const { return ptr[i];    }
+        };
+
+    private:
+        struct view_hash {
+            size_t operator()(const view& v) const {
+                return boost::hash_range(v.begin(), v.end());
+            }
+        };
+
+        struct view_equal {
+            bool operator()(const view& lhs, const view& rhs) const {
+                return lhs.size() == rhs.size() &&
+                    std::equal(lhs.begin(), lhs.end(), rhs.begin());
+            }
+        };
+
+        struct view_less {
+            bool operator()(const view& lhs, const view& rhs) const {
+                return std::lexicographical_compare(lhs.begin(), lhs.end(),
+                                                    rhs.begin(), rhs.end());
+            }
+        };
+
+        typedef std::unordered_map<view, id_t, view_hash, view_equal> index_t;
+        typedef std::map<view, id_t, view_less> sorted_t;
+
+        // The buffer of each sequence is owned by its vector, so views
+        // survive reallocation of the outer vector.
+        std::vector<seq_t> strings;
+        index_t index;
+        sorted_t sorted;
+
+        void insert_views(id_t id) {
+            view v(strings[id]);
+            index.emplace(v, id);
+            sorted.emplace(v, id);
+        }
+
+    public:
+        typedef typename sorted_t::const_iterator const_iterator;
+        typedef std::pair<const_iterator, const_iterator> range_t;
+
+        string_table() {}
+
+        // Views point into this table's storage
+        string_table(string_table const&)            = delete;
+        string_table& operator=(string_table const&) = delete;
+
+        size_t size() const { return strings.size(); }
+
+        const seq_t& get(id_t id) const { return strings.at(id); }
+
+        // Returns npos if the sequence has not been interned
+        id_t find(const seq_t& s) const {
+            auto it = index.find(view(s));
+            if (it == index.end()) return npos;
+            return it->second;
+        }
+
+        id_t intern(const seq_t& s) {
+            auto it = index.find(view(s));
+            if (it != index.end()) return it->second;
+            CHECK(strings.size() < npos) << "string table is full";
+            id_t id = static_cast<id_t>(strings.size());
+            strings.push_back(s);
+            insert_views(id);
+            return id;
+        }
+
+        // All entries which have the given prefix, in lexicographic
+        // order
+        range_t match_prefix(const seq_t& prefix) const {
+            auto start = sorted.lower_bound(view(prefix));
+            auto it = start;
+            while (it != sorted.end()) {
+                const auto& key = it->first;
+                if (key.size() < prefix.size() ||
+                    !std::equal(prefix.begin(), prefix.end(), key.begin())) {
+                    break;
+                }
+                ++it;
+            }
+            return range_t(start, it);
+        }
+
+        template<class Archive>
+        void save(Archive & archive) const {
+            archive( strings );
+        }
+
+        template<class Archive>
+        void load(Archive & archive) {
+            archive( strings );
+            index.clear();
+            sorted.clear();
+            index.reserve(strings.size());
+            for (id_t id = 0; id < strings.size(); ++id) {
+                insert_views(id);
+            }
+        }
+    };
+
+    template<typename T>
+    constexpr typename string_table<T>::id_t string_table<T>::npos;
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <string>
+#include <fstream>
+#include <vector>
+
+#include <nn/seq_pyp.hpp>
+#include <nn/string_table.hpp>
+
+#include <cereal/archives/binary.hpp>
+
+typedef std::vector<size_t> syms;
+
+TEST(StringTable, InternIsStable) {
+    using namespace nn;
+    string_table<size_t> table;
+    syms a {0, 1, 2};
+    syms b {0, 1};
+    auto id_a = table.intern(a);
+    auto id_b = table.intern(b);
+    for (size_t i = 0; i < 1000; ++i) {
+        table.intern(syms {i, i+1});
+    }
+    ASSERT_NE( id_a, id_b );
+    ASSERT_EQ( table.intern(a), id_a );
+    ASSERT_EQ( table.find(b), id_b );
+    ASSERT_EQ( table.get(id_a), a );
+    ASSERT_EQ( table.find(syms {7}), string_table<size_t>::npos );
+}
+
+TEST(StringTable, MatchPrefix) {
+    using namespace nn;
+    string_table<size_t> table;
+    table.intern(syms {0, 1, 3});
+    table.intern(syms {0, 2});
+    table.intern(syms {0, 1, 2, 4});
+    table.intern(syms {1});
+    table.intern(syms {0, 1});
+    auto range = table.match_prefix(syms {0, 1});
+    std::vector<syms> matches;
+    for (auto it = range.first; it != range.second; ++it) {
+        matches.push_back(table.get(it->second));
+    }
+    std::vector<syms> expected { {0, 1}, {0, 1, 2, 4}, {0, 1, 3} };
+    ASSERT_EQ( matches, expected );
+}
+
+TEST(StringTable, CerealWorks) {
+    using namespace nn;
+    std::string fn {"/tmp/string_table.cereal"};
+    {
+        string_table<size_t> table;
+        table.intern(syms {3, 4});
+        table.intern(syms {1, 2, 3});
+        std::ofstream os(fn, std::ios::binary);
+        cereal::BinaryOutputArchive oarchive(os);
+        oarchive( table );
+    }
+    {
+        string_table<size_t> table;
+        std::ifstream is(fn, std::ios::binary);
+        cereal::BinaryInputArchive iarchive(is);
+        iarchive( table );
+        ASSERT_EQ( table.size(), 2 );
+        ASSERT_EQ( table.find(syms {1, 2, 3}), 1 );
+        ASSERT_EQ( table.match_prefix(syms {3}).first->second, 0 );
+    }
+}
+
+TEST(StringTable, SeqPYPRemovesOnlySeenSequences) {
+    using namespace nn;
+    seq_pyp<size_t> pyp(0, 1, 2);
+    pyp.add(syms {3, 4}, log(0.1), 0.5, 1.0);
+    ASSERT_FALSE(pyp.remove(syms {5}, 0.5, 1.0));
+    ASSERT_EQ(pyp.get_c(), 1);
+    ASSERT_EQ(pyp.get_t(), 1);
+    ASSERT_TRUE(pyp.remove(syms {3, 4}, 0.5, 1.0));
+    ASSERT_EQ(pyp.get_c(), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
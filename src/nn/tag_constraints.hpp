@@ -0,0 +1,114 @@
+/*
+ * Copyright 2015-2016 Nicholas Andrews
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef __NN_TAG_CONSTRAINTS_HPP__
+#define __NN_TAG_CONSTRAINTS_HPP__
+
+#include <cstdint>
+#include <vector>
+
+#include <nn/log.hpp>
+#include <nn/data.hpp>
+
+namespace nn {
+
+    // Known labels of a partially annotated sentence, by word: the
+    // tag the segment containing the word must have, if it is known,
+    // and whether a segment must (B-X) or can't (I-X) start there.
+    // A word allows every tag, one tag, or (if its labels contradict
+    // each other) none, so there is no limit on the number of tags.
+    // Positions past the end, and default constructed constraints,
+    // allow everything.
+    class tag_constraints {
+    public:
+        enum class boundary : uint8_t { FREE, BEGIN, INSIDE };
+
+        static constexpr sym NO_TAG {(sym) - 1};
+
+    private:
+        static constexpr sym ANY  {(sym) - 1};
+        static constexpr sym NONE {(sym) - 2};
+
+        std::vector<sym> allowed; // ANY, NONE or the one tag allowed
+        std::vector<boundary> bounds;
+
+        static sym meet(sym a, sym b) {
+            if (a == ANY) return b;
+            if (b == ANY) return a;
+            return a == b ? a : NONE;
+        }
+
+    public:
+        tag_constraints() {}
+
+        // From the segments of a sentence as read by CoNLLCorpus, where
+        // the words of unknown label are single segments tagged
+        // unk_tag
+        tag_constraints(const syms& tags, const syms& lens, sym unk_tag) {
+            CHECK(tags.size() == lens.size()) << "size mismatch";
+            for (size_t i = 0; i < tags.size(); ++i) {
+                auto tag = tags[i];
+                bool known = tag != unk_tag;
+                const sym allow = known ? tag : sym(ANY);
+                for (size_t j = 0; j < lens[i]; ++j) {
+                    allowed.push_back(allow);
+                    bounds.push_back(!known ? boundary::FREE
+                                     : j == 0 ? boundary::BEGIN
+                                     : boundary::INSIDE);
+                }
+            }
+            // A word inside a segment decides the tag of the word
+            // before it, so a segment never starts that can't go on
+            for (size_t t = allowed.size(); t-- > 1; ) {
+                if (bounds[t] == boundary::INSIDE) {
+                    allowed[t-1] = meet(allowed[t-1], allowed[t]);
+                }
+            }
+        }
+
+        bool empty() const { return allowed.empty(); }
+        size_t size() const { return allowed.size(); }
+
+        // Can the segment containing word t have the given tag?
+        bool allows(size_t t, sym tag) const {
+            if (t >= allowed.size()) return true;
+            return allowed[t] == ANY || allowed[t] == tag;
+        }
+
+        // Can a segment start at word t?
+        bool may_begin(size_t t) const {
+            return t >= bounds.size() || bounds[t] != boundary::INSIDE;
+        }
+
+        // Can the segment containing word t-1 go on to word t?
+        bool may_continue(size_t t) const {
+            return t >= bounds.size() || bounds[t] != boundary::BEGIN;
+        }
+
+        // Can a segment with the given tag that covers word t-1 go
+        // on to word t?
+        bool may_continue(size_t t, sym tag) const {
+            return may_continue(t) && allows(t, tag);
+        }
+
+        // Can a segment end at word t?
+        bool may_end(size_t t) const { return may_begin(t+1); }
+    };
+}
+
+#endif
@@ -20,6 +20,7 @@
 #define __NN_TIMING_HPP__
 
 #include <chrono>
+#include <vector>
 #include <nn/log.hpp>
 
 namespace nn {
@@ -39,12 +40,20 @@ namespace nn {
         return duration_cast<milliseconds>(end_time - start_time).count();
     }
 
-    static std::chrono::steady_clock::time_point global_start_time;
+    // Start times of the tic()s not yet matched by a toc(), innermost
+    // last; per thread, so that concurrent jobs can each time
+    // themselves, and stacked, so that a job can time its parts
+    static thread_local std::vector<std::chrono::steady_clock::time_point> start_times;
 
-    void tic() { global_start_time = now(); }
+    void tic() { start_times.push_back(now()); }
 
+    // Time since the innermost tic(), which it closes
     std::chrono::duration<float, std::chrono::steady_clock::period> toc() {
-        return now() - global_start_time;
+        CHECK(!start_times.empty()) << "toc() without tic()";
+        if (start_times.empty()) return {};
+        auto ret = now() - start_times.back();
+        start_times.pop_back();
+        return ret;
     }
 
     std::string prettyprint(std::chrono::duration<float, std::chrono::steady_clock::period> t) {
@@ -77,6 +77,17 @@ namespace nn {
 
         void observe(T t) {}
         size_t cardinality() const { return weight.size(); }
+
+        // Adds the outcomes of other (translated with key_map) which
+        // this measure doesn't have yet
+        template<typename KeyMap>
+        void merge(const HashIntegralMeasure& other, const KeyMap& key_map) {
+            for (const auto& kv : other.weight) {
+                auto t = key_map(kv.first);
+                if (weight.count(t) == 0) add(t, kv.second);
+            }
+        }
+
         double partition()   const { return Z;             }
 
         template<class Archive>